@@ -88,6 +88,70 @@ int main(int argc, char* argv[])
 		{
 			options.IntegratorName = argv[++i];
 		}
+		else if (!strncmp(argv[i], "-tileorder", 10))
+		{
+			options.TileOrder = argv[++i];
+		}
+		else if (!strncmp(argv[i], "-benchtraversal", 15))
+		{
+			options.benchmarkTraversal = true;
+		}
+		else if (!strncmp(argv[i], "-benchaccel", 11))
+		{
+			options.benchmarkAccelerators = argv[++i];
+		}
+		else if (!strncmp(argv[i], "-baketriangles", 14))
+		{
+			options.bakeTriangles = true;
+		}
+		else if (!strncmp(argv[i], "-trianglegroups", 15))
+		{
+			options.triangleGroupWidth = atoi(argv[++i]);
+		}
+		else if (!strncmp(argv[i], "-triangletest", 13))
+		{
+			options.triangleTest = argv[++i];
+		}
+		else if (!strncmp(argv[i], "-benchtriangles", 15))
+		{
+			options.benchmarkTriangles = true;
+		}
+		else if (!strncmp(argv[i], "-benchsampling", 14))
+		{
+			options.benchmarkSampling = true;
+		}
+		else if (!strncmp(argv[i], "-benchparallel", 14))
+		{
+			options.benchmarkParallel = true;
+		}
+		else if (!strncmp(argv[i], "-scheduler", 10))
+		{
+			options.parallelScheduler = argv[++i];
+		}
+		else if (!strncmp(argv[i], "-bvhcache", 9))
+		{
+			options.bvhCacheDir = argv[++i];
+		}
+		else if (!strncmp(argv[i], "-sbvhbudget", 11))
+		{
+			options.spatialSplitBudget = atof(argv[++i]);
+		}
+		else if (!strncmp(argv[i], "-raypackets", 11))
+		{
+			options.rayPacketSize = atoi(argv[++i]);
+		}
+		else if (!strncmp(argv[i], "-interleave", 11))
+		{
+			options.interleaveTraversal = true;
+		}
+		else if (!strncmp(argv[i], "-traversalcost", 14))
+		{
+			options.traversalCostImages = true;
+		}
+		else if (!strncmp(argv[i], "-lightsample", 12))
+		{
+			options.lightSampleStrategy = argv[++i];
+		}
 		else if (!strncmp(argv[i], "-spp", 4))
 		{
 			options.samplePerPixel = atoi(argv[++i]);
@@ -110,6 +174,9 @@ int main(int argc, char* argv[])
 
 	Log::Info("integrator:{}", options.IntegratorName);
 	Log::Info("sampler:{}", options.SamplerName);
+	Log::Info("tile order:{}", options.TileOrder);
+	Log::Info("scheduler:{}", options.parallelScheduler);
+	Log::Info("light sampling:{}", options.lightSampleStrategy);
 	Log::Info("xspp:{}", options.xSpp);
 	Log::Info("yspp:{}", options.ySpp);
 	Log::Info("image size:{},{}", options.filmWidth, options.filmHeight);
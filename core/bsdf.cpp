@@ -169,7 +169,7 @@ Spectrum BSDF::rho_hd(const Vector3f &woWorld, int nSamples, const Point2f *samp
 	return ret;
 }
 
-inline int BSDF::NumComponents(BxDFType flags) const 
+int BSDF::NumComponents(BxDFType flags) const 
 {
 	int num = 0;
 	for (int i = 0; i < nBxDFs; ++i)
@@ -2,6 +2,7 @@
 #include "film.h"
 #include "sampling.h"
 #include "medium.h"
+#include "light.h"
 
 namespace AIR
 {
@@ -31,6 +32,7 @@ namespace AIR
 			Matrix4f::Perspective(fov, aspect, 1e-2f, 1000.f);
 
 		RasterToCamera = Matrix4f::Inverse(CameraToScreen) * RasterToScreen;
+		CameraToRaster = ScreenToRaster * CameraToScreen;
 		
 
 		dxCamera = (MultiplyPoint(RasterToCamera, Point3f(1, 0, 0)) - MultiplyPoint(RasterToCamera, Point3f(0, 0, 0)));
@@ -44,6 +46,7 @@ namespace AIR
 			Point3f pMax = MultiplyPoint(RasterToCamera, Point3f(res.x, res.y, 0));
 			pMin /= pMin.z;
 			pMax /= pMax.z;
+			A = std::abs((pMax.x - pMin.x) * (pMax.y - pMin.y));
 		}
 		
 	}
@@ -152,4 +155,75 @@ namespace AIR
 		ray->hasDifferentials = true;
 		return 1;
 	}
+
+	Spectrum Camera::We(const Ray& ray, Point2f* pRaster2) const
+	{
+		if (orthogonal)
+			return Spectrum(0.f);
+
+		//the camera looks down +z, the ray leaves the pinhole at the origin
+		Vector3f d = Vector3f::Normalize(mTransform.WorldToObjectVector(ray.d));
+		Float cosTheta = d.z;
+		if (cosTheta <= 0)
+			return Spectrum(0.f);
+
+		//project the point where the ray crosses z = 1 to the film
+		Point3f pRaster = MultiplyPoint(CameraToRaster, d / cosTheta);
+		if (pRaster2)
+			*pRaster2 = Point2f(pRaster.x, pRaster.y);
+		Bounds2i sampleBounds = film->GetOutputSampleBounds();
+		if (pRaster.x < sampleBounds.pMin.x || pRaster.x >= sampleBounds.pMax.x ||
+			pRaster.y < sampleBounds.pMin.y || pRaster.y >= sampleBounds.pMax.y)
+			return Spectrum(0.f);
+
+		//an image plane area dA at z = 1 subtends dA cos^3 of solid angle,
+		//one more cos turns the radiance measurement into flux
+		Float cos2Theta = cosTheta * cosTheta;
+		return Spectrum(1 / (A * cos2Theta * cos2Theta));
+	}
+
+	void Camera::Pdf_We(const Ray& ray, Float* pdfPos, Float* pdfDir) const
+	{
+		*pdfPos = *pdfDir = 0;
+		if (orthogonal)
+			return;
+
+		Vector3f d = Vector3f::Normalize(mTransform.WorldToObjectVector(ray.d));
+		Float cosTheta = d.z;
+		if (cosTheta <= 0)
+			return;
+
+		Point3f pRaster = MultiplyPoint(CameraToRaster, d / cosTheta);
+		Bounds2i sampleBounds = film->GetOutputSampleBounds();
+		if (pRaster.x < sampleBounds.pMin.x || pRaster.x >= sampleBounds.pMax.x ||
+			pRaster.y < sampleBounds.pMin.y || pRaster.y >= sampleBounds.pMax.y)
+			return;
+
+		//the pinhole is a delta in position
+		*pdfPos = 1;
+		*pdfDir = 1 / (A * cosTheta * cosTheta * cosTheta);
+	}
+
+	Spectrum Camera::Sample_Wi(const Interaction& ref, const Point2f& u, Vector3f* wi,
+		Float* pdf, Point2f* pRaster, VisibilityTester* vis) const
+	{
+		*pdf = 0;
+		if (orthogonal)
+			return Spectrum(0.f);
+
+		Interaction lensIntr(mTransform.ObjectToWorldPoint(Point3f(0, 0, 0)), ref.time,
+			MediumInterface(medium));
+		lensIntr.normal = Vector3f::Normalize(mTransform.ObjectToWorldVector(Vector3f(0, 0, 1)));
+
+		*wi = lensIntr.interactPoint - ref.interactPoint;
+		Float dist = wi->Length();
+		if (dist == 0)
+			return Spectrum(0.f);
+		*wi /= dist;
+
+		//the lens area is 1, converted to solid angle at ref
+		*pdf = (dist * dist) / Vector3f::AbsDot(lensIntr.normal, *wi);
+		*vis = VisibilityTester(ref, lensIntr);
+		return We(lensIntr.SpawnRay(-*wi), pRaster);
+	}
 }
@@ -3,6 +3,7 @@
 //#include "robject.h"
 #include "geometry.h"
 #include "transform.h"
+#include "spectrum.h"
 
 namespace AIR
 {
@@ -15,6 +16,8 @@ namespace AIR
 	};
 	class Film;
 	class Medium;
+	struct Interaction;
+	class VisibilityTester;
 
 	//默认就是一个perspective camera
 	class Camera
@@ -38,6 +41,22 @@ namespace AIR
 
 		Float GenerateRayDifferential(const CameraSample& sample, RayDifferential* ray) const;
 
+		//importance the camera emits along ray, zero when the ray misses
+		//the film. pRaster receives the film position the ray goes through.
+		//The camera is a pinhole, We is normalized to integrate to 1 over the
+		//image plane at z = 1 and is zero for orthogonal cameras.
+		Spectrum We(const Ray& ray, Point2f* pRaster = nullptr) const;
+
+		//area density of the ray origin on the lens, solid angle density
+		//of its direction
+		void Pdf_We(const Ray& ray, Float* pdfPos, Float* pdfDir) const;
+
+		//connects ref straight to the lens, used by the light subpaths.
+		//wi points from ref to the lens, pdf is its solid angle density at ref
+		//and pRaster the film position the connection lands on
+		Spectrum Sample_Wi(const Interaction& ref, const Point2f& u, Vector3f* wi,
+			Float* pdf, Point2f* pRaster, VisibilityTester* vis) const;
+
 		static Camera* CreateCamera(const Transform& cameraToWorld, const Bounds2f& screenWindow,
 			Film* film, Float fov, bool orthogonal, const Medium* medium);
 
@@ -52,6 +71,9 @@ namespace AIR
 		//y=[-1,1],z=[0,1]的box上
 		Matrix4f CameraToScreen, RasterToCamera;
 		Matrix4f ScreenToRaster, RasterToScreen;
+		Matrix4f CameraToRaster;
+		//area of the image plane at z = 1
+		Float A = 0;
 
 		Vector3f dxCamera, dyCamera;
 		const bool orthogonal = false;
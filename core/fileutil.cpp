@@ -1,5 +1,13 @@
 #include "fileutil.h"
 #include "../RayTracing.h"
+#ifdef IS_WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace AIR
 {
@@ -50,6 +58,47 @@ namespace AIR
 		return filename;
 	}
 
+	bool MappedFile::Open(const std::string &filename) {
+		Close();
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+			nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			CloseHandle(file);
+			return false;
+		}
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+		if (mapping == nullptr) {
+			CloseHandle(file);
+			return false;
+		}
+		void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		if (view == nullptr) {
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+		fileHandle = file;
+		mappingHandle = mapping;
+		data = (uint8_t*)view;
+		size = (size_t)fileSize.QuadPart;
+		return true;
+	}
+
+	void MappedFile::Close() {
+		if (data)
+			UnmapViewOfFile(data);
+		if (mappingHandle)
+			CloseHandle(mappingHandle);
+		if (fileHandle)
+			CloseHandle(fileHandle);
+		data = nullptr;
+		size = 0;
+		fileHandle = mappingHandle = nullptr;
+	}
+
 #else
 
 	bool IsAbsolutePath(const std::string &filename) {
@@ -82,6 +131,33 @@ namespace AIR
 		return result;
 	}
 
+	bool MappedFile::Open(const std::string &filename) {
+		Close();
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		void* view = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		// the mapping keeps its own reference to the file
+		close(fd);
+		if (view == MAP_FAILED)
+			return false;
+		data = (uint8_t*)view;
+		size = (size_t)st.st_size;
+		return true;
+	}
+
+	void MappedFile::Close() {
+		if (data)
+			munmap(data, size);
+		data = nullptr;
+		size = 0;
+	}
+
 #endif
 
 	void SetSearchDirectory(const std::string &dirname) {
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <cctype>
+#include <cstdint>
 #include <string.h>
 
 namespace AIR
@@ -12,6 +13,32 @@ namespace AIR
 	std::string DirectoryContaining(const std::string &filename);
 	void SetSearchDirectory(const std::string &dirname);
 
+	// A whole file mapped into memory, pages are read on first access.
+	// The mapping is private copy-on-write, writes through Data() never
+	// reach the file.
+	class MappedFile
+	{
+	public:
+		MappedFile() {}
+		~MappedFile() { Close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const std::string &filename);
+		void Close();
+
+		uint8_t* Data() const { return data; }
+		size_t Size() const { return size; }
+
+	private:
+		uint8_t* data = nullptr;
+		size_t size = 0;
+#ifdef _WIN32
+		void* fileHandle = nullptr;
+		void* mappingHandle = nullptr;
+#endif
+	};
+
 	inline bool HasExtension(const std::string &value, const std::string &ending) 
 	{
 		if (ending.size() > value.size()) 
@@ -66,6 +66,20 @@ namespace AIR
 		}
 	}
 
+	void Film::AddSplat(const Point2f& p, Spectrum v)
+	{
+		if (v.HasNaNs() || std::isinf(v.y()))
+			return;
+		Point2i pi = (Point2i)Point2f::Floor(p);
+		if (!InsideExclusive(pi, croppedPixelBounds))
+			return;
+		Float xyz[3];
+		v.ToXYZ(xyz);
+		Pixel& pixel = GetPixel(pi);
+		for (int i = 0; i < 3; ++i)
+			pixel.splatXYZ[i].Add(xyz[i]);
+	}
+
 	void Film::WriteImage(Float splatScale)
 	{
 		std::unique_ptr<Float[]> rgb(new Float[3 * croppedPixelBounds.Area()]);
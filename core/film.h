@@ -41,6 +41,11 @@ namespace AIR
 		//merge the filmtile into the final image
 		//executing in threads
 		void MergeFilmTile(std::unique_ptr<FilmTile> tile);
+
+		//adds v at the film position p without filtering, for samples that
+		//can land anywhere on the film like the light subpaths of bdpt.
+		//Safe to call from any thread, WriteImage scales the sum by splatScale.
+		void AddSplat(const Point2f& p, Spectrum v);
 		void Clear();
 
 		void WriteImage(Float splatScale = 1);
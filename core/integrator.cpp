@@ -6,6 +6,13 @@
 #include "film.h"
 #include "parallelism.h"
 #include "robject.h"
+#include "log.h"
+#include "stat.h"
+#include "imageio.h"
+#include "lightdistribution.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 namespace AIR
 {
@@ -82,6 +89,29 @@ Spectrum UniformSampleOneLight(const Interaction& it, const Scene& scene,
 	return L;
 }
 
+//The light selection probability only scales the estimate: EstimateDirect
+//counts a BSDF sample only when it hits the chosen light, so its MIS
+//weights are the ones of that light alone and stay correct for any pick.
+Spectrum UniformSampleOneLight(const Interaction& it, const Scene& scene,
+	MemoryArena& arena, Sampler& sampler, bool handleMedia,
+	const LightDistribution& lightDistribution)
+{
+	if (scene.lights.empty())
+		return Spectrum(0.f);
+
+	Float lightPdf;
+	int lightIndex = lightDistribution.Sample(it, sampler.Get1D(), &lightPdf);
+	//the 2D samples are drawn anyway so the sampler dimensions stay aligned
+	Point2f uLight = sampler.Get2D();
+	Point2f uScattering = sampler.Get2D();
+	if (lightIndex < 0 || lightPdf == 0)
+		return Spectrum(0.f);
+
+	const std::shared_ptr<Light>& light = scene.lights[lightIndex];
+	return EstimateDirect(it, uScattering, *light, uLight,
+		scene, sampler, arena, handleMedia) / lightPdf;
+}
+
 //MISĹʽ
 //                f(Xi)g(Xi)wf(Xi)                    f(Xj)g(Xj)wg(Xj)
 // 1/Nf[i=1, Nf]----------------  +  1/Ng[j=1, Ng]----------------
@@ -135,7 +165,7 @@ Spectrum EstimateDirect(const Interaction& it,
 		{
 			if (handleMedia)
 				Li *= visibility.Tr(scene, sampler);
-			else if (!visibility.Unoccluded(scene))
+			else if (!visibility.Unoccluded(scene, light))
 				Li = Spectrum(0.f);
 
 
@@ -252,6 +282,171 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
 		new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
+//distance of (x, y) along a Hilbert curve filling an n x n grid, n is a power of 2
+static int64_t HilbertIndex(int n, int x, int y)
+{
+	int64_t d = 0;
+	for (int s = n / 2; s > 0; s /= 2)
+	{
+		int rx = (x & s) > 0;
+		int ry = (y & s) > 0;
+		d += (int64_t)s * s * ((3 * rx) ^ ry);
+		//rotate the quadrant so the curve stays continuous
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+std::vector<RenderTile> GenerateRenderTiles(const Bounds2i& sampleBounds,
+	int tileSize, const std::string& order)
+{
+	Vector2i sampleExtent = sampleBounds.Diagonal();
+	Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+		(sampleExtent.y + tileSize - 1) / tileSize);
+
+	std::vector<RenderTile> tiles;
+	//sort keys, tiles are generated in scanline order
+	std::vector<int64_t> keys;
+	std::vector<Float> angles;
+	int hilbertSize = 1;
+	while (hilbertSize < std::max(nTiles.x, nTiles.y))
+		hilbertSize *= 2;
+	for (int y = 0; y < nTiles.y; ++y)
+	{
+		for (int x = 0; x < nTiles.x; ++x)
+		{
+			int x0 = sampleBounds.pMin.x + x * tileSize;
+			int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+			int y0 = sampleBounds.pMin.y + y * tileSize;
+			int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+
+			RenderTile tile;
+			tile.bounds = Bounds2i(Point2i(x0, y0), Point2i(x1, y1));
+			//the seed only depends on the tile position, so every order
+			//produces the same image
+			tile.seed = y * nTiles.x + x;
+			tile.cost = 0;
+			tiles.push_back(tile);
+
+			if (order == "hilbert")
+				keys.push_back(HilbertIndex(hilbertSize, x, y));
+			else if (order == "spiral")
+			{
+				//ring around the center tile first, then the angle in the ring
+				Float dx = x - (nTiles.x - 1) * 0.5f, dy = y - (nTiles.y - 1) * 0.5f;
+				keys.push_back((int64_t)std::max(std::abs(dx), std::abs(dy)));
+				angles.push_back(std::atan2(dy, dx));
+			}
+		}
+	}
+
+	if (keys.empty())
+		return tiles;
+
+	std::vector<int> indices(tiles.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+		indices[i] = (int)i;
+	std::sort(indices.begin(), indices.end(), [&](int a, int b) {
+		if (keys[a] != keys[b])
+			return keys[a] < keys[b];
+		return !angles.empty() && angles[a] < angles[b];
+	});
+
+	std::vector<RenderTile> sortedTiles;
+	sortedTiles.reserve(tiles.size());
+	for (int i : indices)
+		sortedTiles.push_back(tiles[i]);
+	return sortedTiles;
+}
+
+//radiance that is NaN, negative or infinite is dropped
+Spectrum ValidRadiance(Spectrum L)
+{
+	if (L.HasNaNs()) {
+		//Error("Not-a-number radiance value returned "
+		//	"for image sample.  Setting to black.");
+		L = Spectrum(0.f);
+	}
+	else if (L.y() < -1e-5) {
+		//Error("Negative luminance value, %f, returned "
+		//	"for image sample.  Setting to black.", L.y());
+		L = Spectrum(0.f);
+	}
+	else if (std::isinf(L.y())) {
+		//Error("Infinite luminance value returned "
+		//	"for image sample.  Setting to black.");
+		L = Spectrum(0.f);
+	}
+	return L;
+}
+
+//writes the per pixel means of the sums over spp camera samples as a
+//blue-green-red ramp. Red is the 99th percentile, so a few very expensive
+//pixels don't wash out the rest.
+static void WriteFalseColorImage(const std::string& name, const std::vector<int64_t>& sums,
+	int64_t spp, const Bounds2i& bounds, const Point2i& fullResolution, const char* what)
+{
+	std::vector<int64_t> sorted = sums;
+	size_t percentile = sorted.size() * 99 / 100;
+	std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+	const Float maxMean = std::max<Float>(1, (Float)sorted[percentile] / spp);
+	double totalMean = 0;
+
+	std::unique_ptr<Float[]> rgb(new Float[3 * sums.size()]);
+	for (size_t i = 0; i < sums.size(); ++i)
+	{
+		const Float mean = (Float)sums[i] / spp;
+		totalMean += mean;
+		//blue, cyan, green, yellow, red
+		static const Float ramp[5][3] = { { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } };
+		Float x = std::min<Float>(mean / maxMean, 1) * 4;
+		int segment = std::min((int)x, 3);
+		Float t = x - segment;
+		for (int c = 0; c < 3; ++c)
+		{
+			//the image is gamma corrected when written
+			Float value = ramp[segment][c] * (1 - t) + ramp[segment + 1][c] * t;
+			rgb[3 * i + c] = InverseGammaCorrect(value);
+		}
+	}
+	ImageIO::WriteImage(name, &rgb[0], bounds, fullResolution);
+	Log::Info("{} per camera sample written to {}, pixel mean {:.1f}, red at {:.1f}",
+		what, name, sums.empty() ? 0.0 : totalMean / sums.size(), maxMean);
+}
+
+void SamplerIntegrator::WriteTraversalCostImages(int64_t spp) const
+{
+	//render.png gets render_nodes.png and render_prims.png
+	const std::string& filename = camera->film->filename;
+	size_t dot = filename.find_last_of('.');
+	std::string base = dot == std::string::npos ? filename : filename.substr(0, dot);
+	WriteFalseColorImage(base + "_nodes.png", pixelNodesVisited, spp, pixelBounds,
+		camera->film->fullResolution, "Nodes visited");
+	WriteFalseColorImage(base + "_prims.png", pixelPrimitivesTested, spp, pixelBounds,
+		camera->film->fullResolution, "Primitives tested");
+}
+
+//sequence of the sampler at pixel when pixelSequences is set. The strata
+//are drawn from the same sequence in both passes of the cost order, so
+//the sample of the first pass and the ones of the second form one
+//stratified set. The samples of the second pass then continue on the
+//next sequence instead of replaying the random numbers of the first.
+static uint64_t PixelSequence(const Point2i& pixel, const Bounds2i& pixelBounds,
+	bool firstPass)
+{
+	uint64_t index = (uint64_t)(pixel.y - pixelBounds.pMin.y) *
+		(pixelBounds.pMax.x - pixelBounds.pMin.x) + (pixel.x - pixelBounds.pMin.x);
+	return 2 * index + (firstPass ? 0 : 1);
+}
+
 void SamplerIntegrator::Render(const Scene& scene)
 {
 	Preprocess(scene, *sampler);
@@ -261,80 +456,278 @@ void SamplerIntegrator::Render(const Scene& scene)
 	//Ϊͼһfilm(0, 0)ʼ
 	//sampleBoundsfilmɫ
 	Bounds2i sampleBounds = camera->film->GetOutputSampleBounds();
-	//imageĴС
-	Vector2i sampleExtent = sampleBounds.Diagonal();
 	const int tileSize = 16;
+	const std::string& tileOrder = g_globalOptions.TileOrder;
+	const int64_t spp = sampler->samplesPerPixel;
+	rayPacketSize = g_globalOptions.rayPacketSize;
+	if (rayPacketSize != 0 && rayPacketSize != 4 && rayPacketSize != 8 && rayPacketSize != 16)
+	{
+		Log::Warn("Ray packets of {} rays aren't supported, use 4, 8 or 16", rayPacketSize);
+		rayPacketSize = 0;
+	}
+	interleaveTraversal = g_globalOptions.interleaveTraversal;
+	if (g_globalOptions.traversalCostImages)
+	{
+		//a packet mixes the rays of several pixels, its traversal can't be
+		//charged to one of them
+		if (rayPacketSize > 0)
+			Log::Warn("Traversal cost images trace the camera rays one by one");
+		rayPacketSize = 0;
+		pixelNodesVisited.assign(pixelBounds.Area(), 0);
+		pixelPrimitivesTested.assign(pixelBounds.Area(), 0);
+	}
+	g_countTraversal = !pixelNodesVisited.empty();
 
-	//nTilesĶά
-	//ͼСܱ16x = 50, y = 50
-	//(int)x/16 = 3Ȼ
-	//(int)(x + tileSize - 1)/16 = 4
-	Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-		(sampleExtent.y + tileSize - 1) / tileSize);
+	pixelSequences = tileOrder == "cost" && spp > 1;
+	if (!pixelSequences)
+	{
+		std::vector<RenderTile> tiles = GenerateRenderTiles(sampleBounds, tileSize, tileOrder);
+		RenderTiles(scene, tiles, 0, spp);
+	}
+	else
+	{
+		//first pass: one sample per pixel in hilbert order, which also
+		//measures how expensive every tile is
+		std::vector<RenderTile> tiles = GenerateRenderTiles(sampleBounds, tileSize, "hilbert");
+		RenderTiles(scene, tiles, 0, 1);
+
+		//split the tiles that alone would take more than a quarter of a
+		//thread's share, so that no single tile ends up as the long tail
+		double totalCost = 0;
+		for (const RenderTile& tile : tiles)
+			totalCost += tile.cost;
+		const double maxTileCost = totalCost / (4 * MaxThreadIndex());
+		const int minTileSize = 4;
+		//the seeds of the split tiles follow the ones of the grid
+		const int nGridTiles = (int)tiles.size();
+		const int sampleWidth = sampleBounds.pMax.x - sampleBounds.pMin.x;
+		auto firstPixelSeed = [&](const Bounds2i& bounds) {
+			return nGridTiles + (bounds.pMin.y - sampleBounds.pMin.y) * sampleWidth +
+				(bounds.pMin.x - sampleBounds.pMin.x);
+		};
+
+		std::vector<RenderTile> splitTiles;
+		while (!tiles.empty())
+		{
+			RenderTile tile = tiles.back();
+			tiles.pop_back();
+			Vector2i extent = tile.bounds.Diagonal();
+			if (tile.cost <= maxTileCost || std::max(extent.x, extent.y) < 2 * minTileSize)
+			{
+				splitTiles.push_back(tile);
+				continue;
+			}
 
-	//tileǵڼtile
-	ParallelFor2D([&](Point2i tile) {
-		MemoryArena arena;
-		int seed = tile.y * nTiles.x + tile.x;
-		std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+			//split the longer axis, the cost is assumed to follow the area
+			Point2i pMid = tile.bounds.pMax;
+			if (extent.x >= extent.y)
+				pMid.x = tile.bounds.pMin.x + extent.x / 2;
+			else
+				pMid.y = tile.bounds.pMin.y + extent.y / 2;
+			RenderTile first = tile, second = tile;
+			first.bounds = Bounds2i(tile.bounds.pMin, pMid);
+			second.bounds = Bounds2i(extent.x >= extent.y ? Point2i(pMid.x, tile.bounds.pMin.y) :
+				Point2i(tile.bounds.pMin.x, pMid.y), tile.bounds.pMax);
+			first.seed = firstPixelSeed(first.bounds);
+			second.seed = firstPixelSeed(second.bounds);
+			first.cost = tile.cost * first.bounds.Area() / tile.bounds.Area();
+			second.cost = tile.cost - first.cost;
+			tiles.push_back(first);
+			tiles.push_back(second);
+		}
 
-		//tilesampleBoundܵλ
-		int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-		int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-		int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-		int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-		Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+		//longest first, the cheap tiles fill up the gaps at the end
+		std::stable_sort(splitTiles.begin(), splitTiles.end(),
+			[](const RenderTile& a, const RenderTile& b) { return a.cost > b.cost; });
+		RenderTiles(scene, splitTiles, 1, spp);
+	}
 
-		std::unique_ptr<FilmTile> filmTile =
-			camera->film->GetFilmTile(tileBounds);
+	camera->film->WriteImage();
+	if (!pixelNodesVisited.empty())
+		WriteTraversalCostImages(spp);
+}
 
-		for (Point2i pixel : tileBounds)
+void SamplerIntegrator::RenderTiles(const Scene& scene, std::vector<RenderTile>& tiles,
+	int64_t sampleStart, int64_t sampleEnd)
+{
+	//time each thread spent inside tiles, the rest of the wall time is idle
+	std::vector<double> busyTime(MaxThreadIndex(), 0.0);
+	std::atomic<int> nextTile(0);
+	auto renderStart = std::chrono::steady_clock::now();
+
+	//every thread pulls the next tile from the shared counter, which keeps
+	//the tile order intact no matter which thread is free
+	ParallelFor([&](int) {
+		for (int tileIndex = nextTile++; tileIndex < (int)tiles.size(); tileIndex = nextTile++)
 		{
-			//ɸpixelsamples
-			tileSampler->StartPixel(pixel);
+			auto tileStart = std::chrono::steady_clock::now();
+			RenderTile& tile = tiles[tileIndex];
+			MemoryArena arena;
+			std::unique_ptr<Sampler> tileSampler = sampler->Clone(tile.seed);
+			const Bounds2i& tileBounds = tile.bounds;
 
-			if (!InsideExclusive(pixel, pixelBounds))
-				continue;
+			std::unique_ptr<FilmTile> filmTile =
+				camera->film->GetFilmTile(tileBounds);
 
-			do 
+			if (rayPacketSize > 0)
+				RenderTilePackets(scene, tile, filmTile.get(), arena, sampleStart, sampleEnd);
+			else
 			{
-				//ɵǰpixelcameraSample
-				CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
-				RayDifferential ray;
-				Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
-				ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
-
-
-				Spectrum L(0.f);
-				//·radiance arriving at the film
-				if (rayWeight > 0) 
-					L = Li(ray, scene, *tileSampler, arena);
-
-				if (L.HasNaNs()) {
-					//Error("Not-a-number radiance value returned "
-					//	"for image sample.  Setting to black.");
-					L = Spectrum(0.f);
-				}
-				else if (L.y() < -1e-5) {
-					//Error("Negative luminance value, %f, returned "
-					//	"for image sample.  Setting to black.", L.y());
-					L = Spectrum(0.f);
-				}
-				else if (std::isinf(L.y())) {
-					//Error("Infinite luminance value returned "
-					//	"for image sample.  Setting to black.");
-					L = Spectrum(0.f);
+				for (Point2i pixel : tileBounds)
+				{
+					//ɸpixelsamples
+					if (pixelSequences)
+						tileSampler->SetSequence(PixelSequence(pixel, pixelBounds, true));
+					tileSampler->StartPixel(pixel);
+
+					if (!InsideExclusive(pixel, pixelBounds))
+						continue;
+
+					if (sampleStart > 0 && !tileSampler->SetSampleNumber(sampleStart))
+						continue;
+					if (pixelSequences && sampleStart > 0)
+						tileSampler->SetSequence(PixelSequence(pixel, pixelBounds, false));
+
+					do 
+					{
+						//ɵǰpixelcameraSample
+						CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+						RayDifferential ray;
+						Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+						ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
+
+
+						Spectrum L(0.f);
+						TraversalCounters countersBefore = g_traversalCounters;
+						//·radiance arriving at the film
+						if (rayWeight > 0) 
+							L = Li(ray, scene, *tileSampler, arena);
+						if (!pixelNodesVisited.empty())
+						{
+							int offset = (pixel.x - pixelBounds.pMin.x) +
+								(pixel.y - pixelBounds.pMin.y) * (pixelBounds.pMax.x - pixelBounds.pMin.x);
+							pixelNodesVisited[offset] += g_traversalCounters.nodesVisited - countersBefore.nodesVisited;
+							pixelPrimitivesTested[offset] +=
+								g_traversalCounters.primitivesTested - countersBefore.primitivesTested;
+						}
+
+						L = ValidRadiance(L);
+						filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+						arena.Reset();
+					} while (tileSampler->StartNextSample() &&
+						tileSampler->CurrentSampleNumber() < sampleEnd);
 				}
+			}
 
-				filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-				arena.Reset();
-			} while (tileSampler->StartNextSample());
+			camera->film->MergeFilmTile(std::move(filmTile));
+
+			std::chrono::duration<double> tileTime = std::chrono::steady_clock::now() - tileStart;
+			tile.cost = tileTime.count();
+			busyTime[ThreadIndex] += tile.cost;
 		}
+	}, MaxThreadIndex(), 1);
 
-		camera->film->MergeFilmTile(std::move(filmTile));
-	}, nTiles);
+	std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+	double minIdle = renderTime.count(), maxIdle = 0, sumIdle = 0;
+	for (double busy : busyTime)
+	{
+		double idle = std::max(0.0, renderTime.count() - busy);
+		minIdle = std::min(minIdle, idle);
+		maxIdle = std::max(maxIdle, idle);
+		sumIdle += idle;
+	}
+	Log::Info("Render samples [{},{}) of {} tiles on {} threads in {:.3f}s, "
+		"thread idle min/avg/max {:.3f}/{:.3f}/{:.3f}s", sampleStart, sampleEnd,
+		tiles.size(), busyTime.size(), renderTime.count(), minIdle,
+		sumIdle / busyTime.size(), maxIdle);
+}
 
-	camera->film->WriteImage();
+void SamplerIntegrator::RenderTilePackets(const Scene& scene, const RenderTile& tile,
+	FilmTile* filmTile, MemoryArena& arena, int64_t sampleStart, int64_t sampleEnd)
+{
+	//a 2x2, 4x2 or 4x4 pixel block, each pixel has its own sampler so the
+	//pixels of a block step through their samples together
+	const int packetSize = rayPacketSize;
+	const int blockWidth = packetSize == 4 ? 2 : 4;
+	const int blockHeight = packetSize / blockWidth;
+	std::unique_ptr<Sampler> pixelSamplers[kMaxRayPacketSize];
+	for (int i = 0; i < packetSize; ++i)
+		pixelSamplers[i] = sampler->Clone(tile.seed * kMaxRayPacketSize + i);
+	const Float differentialScale = 1 / std::sqrt((Float)sampler->samplesPerPixel);
+	const Bounds2i& tileBounds = tile.bounds;
+
+	for (int y0 = tileBounds.pMin.y; y0 < tileBounds.pMax.y; y0 += blockHeight)
+	{
+		for (int x0 = tileBounds.pMin.x; x0 < tileBounds.pMax.x; x0 += blockWidth)
+		{
+			Point2i pixels[kMaxRayPacketSize];
+			int nPixels = 0;
+			for (int y = y0; y < std::min(y0 + blockHeight, tileBounds.pMax.y); ++y)
+			{
+				for (int x = x0; x < std::min(x0 + blockWidth, tileBounds.pMax.x); ++x)
+				{
+					Point2i pixel(x, y);
+					if (!InsideExclusive(pixel, pixelBounds))
+						continue;
+					Sampler& pixelSampler = *pixelSamplers[nPixels];
+					if (pixelSequences)
+						pixelSampler.SetSequence(PixelSequence(pixel, pixelBounds, true));
+					pixelSampler.StartPixel(pixel);
+					if (sampleStart > 0 && !pixelSampler.SetSampleNumber(sampleStart))
+						continue;
+					if (pixelSequences && sampleStart > 0)
+						pixelSampler.SetSequence(PixelSequence(pixel, pixelBounds, false));
+					pixels[nPixels++] = pixel;
+				}
+			}
+
+			for (int64_t sampleNum = sampleStart; sampleNum < sampleEnd && nPixels > 0; ++sampleNum)
+			{
+				CameraSample cameraSamples[kMaxRayPacketSize];
+				RayDifferential cameraRays[kMaxRayPacketSize];
+				Float rayWeights[kMaxRayPacketSize];
+				//the camera rays of the pixels with a weight, as plain Rays
+				Ray rays[kMaxRayPacketSize];
+				int packetIndex[kMaxRayPacketSize];
+				int nRays = 0;
+				for (int i = 0; i < nPixels; ++i)
+				{
+					cameraSamples[i] = pixelSamplers[i]->GetCameraSample(pixels[i]);
+					rayWeights[i] = camera->GenerateRayDifferential(cameraSamples[i], &cameraRays[i]);
+					cameraRays[i].ScaleDifferentials(differentialScale);
+					packetIndex[i] = -1;
+					if (rayWeights[i] > 0)
+					{
+						packetIndex[i] = nRays;
+						rays[nRays++] = cameraRays[i];
+					}
+				}
+
+				SurfaceInteraction isects[kMaxRayPacketSize];
+				bool hits[kMaxRayPacketSize];
+				if (interleaveTraversal)
+					scene.IntersectInterleaved(rays, nRays, isects, hits);
+				else
+					scene.IntersectStream(rays, nRays, isects, hits);
+
+				for (int i = 0; i < nPixels; ++i)
+				{
+					Spectrum L(0.f);
+					if (packetIndex[i] >= 0)
+					{
+						const int r = packetIndex[i];
+						cameraRays[i].tMax = rays[r].tMax;
+						L = LiPrimary(cameraRays[i], hits[r] ? &isects[r] : nullptr, scene,
+							*pixelSamplers[i], arena);
+					}
+					L = ValidRadiance(L);
+					filmTile->AddSample(cameraSamples[i].pFilm, L, rayWeights[i]);
+					arena.Reset();
+					pixelSamplers[i]->StartNextSample();
+				}
+			}
+		}
+	}
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(const RayDifferential& ray, const SurfaceInteraction& isect, const Scene& scene,
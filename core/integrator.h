@@ -8,8 +8,11 @@ namespace AIR
 {
 	class Scene;
 	struct Distribution1D;
+	class LightDistribution;
 	class Light;
 	class Interaction;
+	class SurfaceInteraction;
+	class FilmTile;
 
 	//ڴһpixelsamplerʱ(һpixelsamplerж)
 	//light,Ⱦ̼lightĻ
@@ -37,6 +40,12 @@ namespace AIR
 		bool handleMedia = false,
 		const Distribution1D* lightDistrib = nullptr);
 
+	//same, the light is picked by lightDistribution for the point and
+	//normal of it, e.g. by a light BVH
+	Spectrum UniformSampleOneLight(const Interaction& it, const Scene& scene,
+		MemoryArena& arena, Sampler& sampler, bool handleMedia,
+		const LightDistribution& lightDistribution);
+
 	//һԴԵit乱
 	//it Ľ
 	//uShading bsdf
@@ -53,6 +62,27 @@ namespace AIR
 	std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
 		const Scene& scene);
 
+	//black for NaN, negative or infinite radiance, before it reaches the film
+	Spectrum ValidRadiance(Spectrum L);
+
+	//a block of pixels rendered as one task by SamplerIntegrator::Render
+	struct RenderTile
+	{
+		Bounds2i bounds;
+		//seed of the tile sampler, the halves of a split tile get seeds of
+		//their own from their first pixel
+		int seed;
+		//measured wall time in seconds, used by the "cost" tile order
+		double cost;
+	};
+
+	//Splits the sample bounds into tileSize x tileSize tiles in the given order:
+	//"scanline"  row by row
+	//"hilbert"   along a Hilbert curve, neighbouring tiles run close in time
+	//"spiral"    center-out, the middle of the image shows up first
+	std::vector<RenderTile> GenerateRenderTiles(const Bounds2i& sampleBounds,
+		int tileSize, const std::string& order);
+
 	//
 	//pbrtУradianceͨbsdf
 	//bsdfɵĳradianceҲͨ
@@ -89,6 +119,15 @@ namespace AIR
 			Sampler& sampler, MemoryArena& arena,
 			int depth = 0) const = 0;
 
+		//Li of a camera ray already traced as part of a packet, hit is its
+		//first intersection, which Li may modify, or null when it escaped.
+		//The default traces the ray again through Li.
+		virtual Spectrum LiPrimary(const RayDifferential& ray, SurfaceInteraction* hit,
+			const Scene& scene, Sampler& sampler, MemoryArena& arena) const
+		{
+			return Li(ray, scene, sampler, arena);
+		}
+
 		Spectrum SpecularReflect(const RayDifferential& ray, const SurfaceInteraction& isect,
 			const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const;
 
@@ -104,5 +143,31 @@ namespace AIR
 		std::shared_ptr<Sampler> sampler;
 		const Bounds2i pixelBounds;
 
+		//render samples [sampleStart, sampleEnd) of every pixel of the tiles,
+		//tiles are handed out in vector order. The wall time of each tile is
+		//stored in RenderTile::cost.
+		void RenderTiles(const Scene& scene, std::vector<RenderTile>& tiles,
+			int64_t sampleStart, int64_t sampleEnd);
+		//renders a tile in pixel blocks of rayPacketSize pixels, the camera
+		//rays of a block are traced together as one packet
+		void RenderTilePackets(const Scene& scene, const RenderTile& tile,
+			FilmTile* filmTile, MemoryArena& arena, int64_t sampleStart, int64_t sampleEnd);
+		//0 traces the camera rays one by one
+		int rayPacketSize = 0;
+		//the rays of a pixel block are traced as independent rays whose
+		//traversals are interleaved instead of as a packet
+		bool interleaveTraversal = false;
+		//every pixel restarts the sampler on a sequence of its own, so its
+		//samples don't depend on the tile it is rendered in. Set for the
+		//two passes of the "cost" tile order.
+		bool pixelSequences = false;
+
+		//writes the mean nodes visited and primitives tested per camera
+		//sample of every pixel as false color images next to the render
+		void WriteTraversalCostImages(int64_t spp) const;
+		//sums over the camera samples of every pixel of pixelBounds, only
+		//kept with GlobalOptions::traversalCostImages
+		std::vector<int64_t> pixelNodesVisited, pixelPrimitivesTested;
+
 	};
 }
@@ -9,6 +9,7 @@ namespace AIR
 {
     class VisibilityTester;
     class Scene;
+    struct LightBounds;
 
     enum class LightFlags : int 
     {
@@ -61,6 +62,19 @@ namespace AIR
         //wi方向是从ref指向光源
         virtual Float Pdf_Li(const Interaction& ref, const Vector3f& wi) const = 0;
 
+        //samples a ray leaving the light, the start of a light subpath
+        //u1 picks the point on the light, u2 the direction
+        //nLight the surface normal at the origin, the direction itself for
+        //point and distant lights
+        //pdfPos the area density of the origin, pdfDir the solid angle
+        //density of the direction
+        virtual Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+            Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const = 0;
+
+        //the densities Sample_Le would have sampled ray with
+        virtual void Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+            Float* pdfDir) const = 0;
+
         //表示发射的光线escapes the scene bounds
         //意思是物体表面的出来的一条ray，不和场景任何模型（和光照）有相交的话，
         //就要采样环境光
@@ -80,6 +94,14 @@ namespace AIR
 
         //返回光源的功率
         virtual Spectrum Power() const = 0;
+
+        //where the light is, where it emits toward and its power, for
+        //the light BVH. False for the lights without bounds, which are
+        //sampled beside the tree, e.g. infinite and distant lights.
+        virtual bool Bounds(LightBounds* bounds) const
+        {
+            return false;
+        }
     public:
         const int flags;
 
@@ -89,6 +111,10 @@ namespace AIR
         const int nSamples;
 
         const MediumInterface mediumInterface;
+
+        //index of the light in Scene::lights, set by the Scene, it picks
+        //the occluder cache slot of the shadow rays toward the light
+        int sceneIndex = -1;
     protected:
         Transform LightToWorld;
 
@@ -105,6 +131,9 @@ namespace AIR
         const Interaction& P1() const { return p1; }
         //判断p0到p1是否被遮挡
         bool Unoccluded(const Scene& scene) const;
+        //same for a shadow ray toward light, through the occluder cache of
+        //Scene::IntersectP
+        bool Unoccluded(const Scene& scene, const Light& light) const;
         //computes the beam transmittance, Equation (11.1), 
         //the fraction of radiance transmitted along the segment between the two points. 
         //光线和medium也会有相交，当和medium相交时，发生折射后的计算函数
@@ -0,0 +1,373 @@
+#include "lightbvh.h"
+#include "integrator.h"
+#include "interaction.h"
+#include "light.h"
+#include "log.h"
+#include "rng.h"
+#include "scene.h"
+#include <algorithm>
+
+namespace AIR
+{
+	static Float SafeSqrt(Float x)
+	{
+		return std::sqrt(std::max((Float)0, x));
+	}
+
+	static Float SafeACos(Float x)
+	{
+		return std::acos(Clamp(x, -1, 1));
+	}
+
+	//cos(theta_a - theta_b), 1 when theta_a is already inside theta_b
+	static Float CosSubClamped(Float sinTheta_a, Float cosTheta_a,
+		Float sinTheta_b, Float cosTheta_b)
+	{
+		if (cosTheta_a > cosTheta_b)
+			return 1;
+		return cosTheta_a * cosTheta_b + sinTheta_a * sinTheta_b;
+	}
+
+	//sin(theta_a - theta_b), 0 when theta_a is already inside theta_b
+	static Float SinSubClamped(Float sinTheta_a, Float cosTheta_a,
+		Float sinTheta_b, Float cosTheta_b)
+	{
+		if (cosTheta_a > cosTheta_b)
+			return 0;
+		return sinTheta_a * cosTheta_b - cosTheta_a * sinTheta_b;
+	}
+
+	//cosine of the half angle of the cone of directions from p that hits b
+	static Float CosBoundSubtended(const Bounds3f& b, const Point3f& p)
+	{
+		Point3f center;
+		Float radius;
+		b.BoundingSphere(&center, &radius);
+		Float distanceSquared = Vector3f::DistanceSquare(p, center);
+		if (distanceSquared < radius * radius)
+			return -1;
+		Float sin2ThetaMax = radius * radius / distanceSquared;
+		return SafeSqrt(1 - sin2ThetaMax);
+	}
+
+	//v rotated by theta around the unit axis
+	static Vector3f RotateAround(const Vector3f& v, const Vector3f& axis, Float theta)
+	{
+		Float cosTheta = std::cos(theta), sinTheta = std::sin(theta);
+		return v * cosTheta + Vector3f::Cross(axis, v) * sinTheta +
+			axis * (Vector3f::Dot(axis, v) * (1 - cosTheta));
+	}
+
+	//smallest cone holding the cones (wa, cosTheta_a) and (wb, cosTheta_b)
+	static void UnionCones(const Vector3f& wa, Float cosTheta_a,
+		const Vector3f& wb, Float cosTheta_b, Vector3f* w, Float* cosTheta)
+	{
+		Float theta_a = SafeACos(cosTheta_a), theta_b = SafeACos(cosTheta_b);
+		Float theta_d = SafeACos(Vector3f::Dot(wa, wb));
+		if (std::min(theta_d + theta_b, Pi) <= theta_a)
+		{
+			*w = wa;
+			*cosTheta = cosTheta_a;
+			return;
+		}
+		if (std::min(theta_d + theta_a, Pi) <= theta_b)
+		{
+			*w = wb;
+			*cosTheta = cosTheta_b;
+			return;
+		}
+
+		Float theta_o = (theta_a + theta_d + theta_b) / 2;
+		Vector3f wr = Vector3f::Cross(wa, wb);
+		if (theta_o >= Pi || wr.LengthSquared() == 0)
+		{
+			*w = wa;
+			*cosTheta = -1;
+			return;
+		}
+		//turn wa toward wb until the cone reaches both
+		*w = Vector3f::Normalize(RotateAround(wa, Vector3f::Normalize(wr), theta_o - theta_a));
+		*cosTheta = std::cos(theta_o);
+	}
+
+	Float LightBounds::Importance(const Point3f& p, const Vector3f& n) const
+	{
+		Point3f pc = (bounds.pMin + bounds.pMax) * 0.5f;
+		//clamped so points inside the bounds don't get an unbounded weight
+		Float d2 = Vector3f::DistanceSquare(p, pc);
+		d2 = std::max(d2, bounds.Diagonal().Length() / 2);
+		if (d2 == 0)
+			return phi;
+
+		//angle between the emitted direction toward p and the cone axis,
+		//less the spread of the cone and of the bounds seen from p
+		Vector3f wi = p - pc;
+		wi = wi.LengthSquared() > 0 ? Vector3f::Normalize(wi) : w;
+		Float cosTheta_w = Vector3f::Dot(w, wi);
+		if (twoSided)
+			cosTheta_w = std::abs(cosTheta_w);
+		Float sinTheta_w = SafeSqrt(1 - cosTheta_w * cosTheta_w);
+
+		Float cosTheta_b = CosBoundSubtended(bounds, p);
+		Float sinTheta_b = SafeSqrt(1 - cosTheta_b * cosTheta_b);
+
+		Float sinTheta_o = SafeSqrt(1 - cosTheta_o * cosTheta_o);
+		Float cosTheta_x = CosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+		Float sinTheta_x = SinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+		Float cosTheta_p = CosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+		if (cosTheta_p <= cosTheta_e)
+			return 0;
+
+		Float importance = phi * cosTheta_p / d2;
+
+		//the best incident cosine at p, both sides since the BSDF may transmit
+		if (n != Vector3f::zero)
+		{
+			Float cosTheta_i = Vector3f::AbsDot(wi, n);
+			Float sinTheta_i = SafeSqrt(1 - cosTheta_i * cosTheta_i);
+			importance *= CosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+		}
+		return std::max(importance, (Float)0);
+	}
+
+	LightBounds LightBounds::Union(const LightBounds& a, const LightBounds& b)
+	{
+		if (a.phi == 0)
+			return b;
+		if (b.phi == 0)
+			return a;
+
+		LightBounds u;
+		u.bounds = Bounds3f::Union(a.bounds, b.bounds);
+		UnionCones(a.w, a.cosTheta_o, b.w, b.cosTheta_o, &u.w, &u.cosTheta_o);
+		u.phi = a.phi + b.phi;
+		u.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+		u.twoSided = a.twoSided || b.twoSided;
+		return u;
+	}
+
+	struct LightBVH::LightBVHPrimitive
+	{
+		int lightIndex;
+		LightBounds lightBounds;
+		Point3f centroid;
+	};
+
+	LightBVH::LightBVH(const Scene& scene)
+		: lightToLeaf(scene.lights.size(), -1),
+		powerDistrib(ComputeLightPowerDistribution(scene))
+	{
+		std::vector<LightBVHPrimitive> bvhLights;
+		for (size_t i = 0; i < scene.lights.size(); ++i)
+		{
+			LightBVHPrimitive light;
+			light.lightIndex = (int)i;
+			if (!scene.lights[i]->Bounds(&light.lightBounds))
+				infiniteLights.push_back((int)i);
+			else if (light.lightBounds.phi > 0)
+			{
+				const Bounds3f& b = light.lightBounds.bounds;
+				light.centroid = (b.pMin + b.pMax) * 0.5f;
+				bvhLights.push_back(light);
+			}
+		}
+
+		if (!bvhLights.empty())
+		{
+			nodes.reserve(2 * bvhLights.size() - 1);
+			buildTree(bvhLights, 0, (int)bvhLights.size(), -1);
+		}
+		Log::Info("Light BVH: {} lights in {} nodes, {} infinite lights",
+			bvhLights.size(), nodes.size(), infiniteLights.size());
+	}
+
+	Float LightBVH::EvaluateCost(const LightBounds& b, const Bounds3f& bounds, int dim) const
+	{
+		if (b.phi == 0)
+			return 0;
+		//solid angle measure of the emitted directions
+		Float theta_o = SafeACos(b.cosTheta_o), theta_e = SafeACos(b.cosTheta_e);
+		Float theta_w = std::min(theta_o + theta_e, Pi);
+		Float sinTheta_o = SafeSqrt(1 - b.cosTheta_o * b.cosTheta_o);
+		Float M_omega = 2 * Pi * (1 - b.cosTheta_o) +
+			Pi / 2 * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+				2 * theta_o * sinTheta_o + b.cosTheta_o);
+		//thin slabs along dim are penalized, the children should stay compact
+		Vector3f d = bounds.Diagonal();
+		Float Kr = Vector3f::MaxComponent(d) / d[dim];
+		return b.phi * M_omega * Kr * b.bounds.SurfaceArea();
+	}
+
+	int LightBVH::buildTree(std::vector<LightBVHPrimitive>& lights, int start, int end,
+		int parent)
+	{
+		int nodeIndex = (int)nodes.size();
+		if (end - start == 1)
+		{
+			LightBVHNode leaf;
+			leaf.lightBounds = lights[start].lightBounds;
+			leaf.childOrLightIndex = lights[start].lightIndex;
+			leaf.parent = parent;
+			leaf.isLeaf = true;
+			nodes.push_back(leaf);
+			lightToLeaf[lights[start].lightIndex] = nodeIndex;
+			return nodeIndex;
+		}
+
+		Bounds3f bounds, centroidBounds;
+		for (int i = start; i < end; ++i)
+		{
+			bounds = Bounds3f::Union(bounds, lights[i].lightBounds.bounds);
+			centroidBounds = Bounds3f::Union(centroidBounds, lights[i].centroid);
+		}
+
+		//bucketed split of least cost over the three axes
+		const int nBuckets = 12;
+		Float minCost = Infinity;
+		int minBucket = -1, minDim = -1;
+		for (int dim = 0; dim < 3; ++dim)
+		{
+			if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+				continue;
+			LightBounds bucketBounds[nBuckets];
+			for (int i = start; i < end; ++i)
+			{
+				int b = (int)(nBuckets * centroidBounds.Offset(lights[i].centroid)[dim]);
+				b = Clamp(b, 0, nBuckets - 1);
+				bucketBounds[b] = LightBounds::Union(bucketBounds[b], lights[i].lightBounds);
+			}
+
+			for (int split = 0; split < nBuckets - 1; ++split)
+			{
+				LightBounds b0, b1;
+				for (int i = 0; i <= split; ++i)
+					b0 = LightBounds::Union(b0, bucketBounds[i]);
+				for (int i = split + 1; i < nBuckets; ++i)
+					b1 = LightBounds::Union(b1, bucketBounds[i]);
+				Float cost = EvaluateCost(b0, bounds, dim) + EvaluateCost(b1, bounds, dim);
+				if (cost > 0 && cost < minCost)
+				{
+					minCost = cost;
+					minBucket = split;
+					minDim = dim;
+				}
+			}
+		}
+
+		int mid;
+		if (minBucket == -1)
+			mid = (start + end) / 2;
+		else
+		{
+			auto pmid = std::partition(lights.begin() + start, lights.begin() + end,
+				[&](const LightBVHPrimitive& l) {
+					int b = (int)(nBuckets * centroidBounds.Offset(l.centroid)[minDim]);
+					return Clamp(b, 0, nBuckets - 1) <= minBucket;
+				});
+			mid = (int)(pmid - lights.begin());
+			if (mid == start || mid == end)
+				mid = (start + end) / 2;
+		}
+
+		nodes.push_back(LightBVHNode());
+		int child0 = buildTree(lights, start, mid, nodeIndex);
+		int child1 = buildTree(lights, mid, end, nodeIndex);
+		LightBVHNode& node = nodes[nodeIndex];
+		node.lightBounds = LightBounds::Union(nodes[child0].lightBounds, nodes[child1].lightBounds);
+		node.childOrLightIndex = child1;
+		node.parent = parent;
+		node.isLeaf = false;
+		return nodeIndex;
+	}
+
+	int LightBVH::Sample(const Interaction& it, Float u, Float* pdf) const
+	{
+		*pdf = 0;
+		int nInfinite = (int)infiniteLights.size();
+		if (nInfinite == 0 && nodes.empty())
+			return -1;
+
+		//the infinite lights count as much as the whole tree
+		Float pInfinite = Float(nInfinite) / Float(nInfinite + (nodes.empty() ? 0 : 1));
+		if (u < pInfinite)
+		{
+			int index = std::min((int)(u / pInfinite * nInfinite), nInfinite - 1);
+			*pdf = pInfinite / nInfinite;
+			return infiniteLights[index];
+		}
+		u = std::min((u - pInfinite) / (1 - pInfinite), OneMinusEpsilon);
+
+		const Point3f& p = it.interactPoint;
+		const Vector3f& n = it.normal;
+		int nodeIndex = 0;
+		Float pmf = 1 - pInfinite;
+		while (!nodes[nodeIndex].isLeaf)
+		{
+			int child1 = nodes[nodeIndex].childOrLightIndex;
+			Float ci0 = nodes[nodeIndex + 1].lightBounds.Importance(p, n);
+			Float ci1 = nodes[child1].lightBounds.Importance(p, n);
+			if (ci0 == 0 && ci1 == 0)
+				return -1;
+
+			//u is reused for the choice of every level
+			Float nodePMF = ci0 / (ci0 + ci1);
+			if (u < nodePMF)
+			{
+				u = std::min(u / nodePMF, OneMinusEpsilon);
+				pmf *= nodePMF;
+				nodeIndex = nodeIndex + 1;
+			}
+			else
+			{
+				u = std::min((u - nodePMF) / (1 - nodePMF), OneMinusEpsilon);
+				pmf *= 1 - nodePMF;
+				nodeIndex = child1;
+			}
+		}
+
+		//a tree of a single light never compared it to anything
+		if (nodeIndex == 0 && nodes[0].lightBounds.Importance(p, n) == 0)
+			return -1;
+		*pdf = pmf;
+		return nodes[nodeIndex].childOrLightIndex;
+	}
+
+	Float LightBVH::Pdf(const Interaction& it, int lightIndex) const
+	{
+		int nInfinite = (int)infiniteLights.size();
+		Float pInfinite = Float(nInfinite) / Float(nInfinite + (nodes.empty() ? 0 : 1));
+		int nodeIndex = lightToLeaf[lightIndex];
+		if (nodeIndex == -1)
+		{
+			if (std::find(infiniteLights.begin(), infiniteLights.end(), lightIndex) !=
+				infiniteLights.end())
+				return pInfinite / nInfinite;
+			return 0;
+		}
+
+		//the choices of Sample, from the leaf up
+		const Point3f& p = it.interactPoint;
+		const Vector3f& n = it.normal;
+		Float pmf = 1 - pInfinite;
+		if (nodeIndex == 0)
+			return nodes[0].lightBounds.Importance(p, n) > 0 ? pmf : 0;
+		while (nodes[nodeIndex].parent != -1)
+		{
+			int parent = nodes[nodeIndex].parent;
+			int child1 = nodes[parent].childOrLightIndex;
+			Float ci0 = nodes[parent + 1].lightBounds.Importance(p, n);
+			Float ci1 = nodes[child1].lightBounds.Importance(p, n);
+			if (ci0 == 0 && ci1 == 0)
+				return 0;
+			Float nodePMF = ci0 / (ci0 + ci1);
+			pmf *= nodeIndex == child1 ? 1 - nodePMF : nodePMF;
+			nodeIndex = parent;
+		}
+		return pmf;
+	}
+
+	const Distribution1D* LightBVH::Lookup(const Point3f& p) const
+	{
+		return powerDistrib.get();
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "lightdistribution.h"
+#include <memory>
+#include <vector>
+
+namespace AIR
+{
+	class Light;
+
+	//what a light sampler needs to know of a light, or of a group of lights:
+	//where they are, where they emit toward and how much. The emitted
+	//directions are a cone around w of half angle theta_o, widened by
+	//theta_e, the angle past the cone that still receives light (pi/2 for
+	//diffuse emitters).
+	struct LightBounds
+	{
+		LightBounds() {}
+		LightBounds(const Bounds3f& bounds, const Vector3f& w, Float phi,
+			Float cosTheta_o, Float cosTheta_e, bool twoSided)
+			: bounds(bounds), w(w), phi(phi), cosTheta_o(cosTheta_o),
+			cosTheta_e(cosTheta_e), twoSided(twoSided) {}
+
+		//conservative estimate of the light arriving at p from the bounded
+		//lights, n is the surface normal at p or zero inside a medium
+		Float Importance(const Point3f& p, const Vector3f& n) const;
+
+		static LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+		Bounds3f bounds;
+		Vector3f w;
+		//emitted power
+		Float phi = 0;
+		Float cosTheta_o = 1, cosTheta_e = 1;
+		bool twoSided = false;
+	};
+
+	//Picks one of many lights in proportion to how much each can
+	//contribute to a shading point. The lights with bounds are the leaves
+	//of a binary tree built with a surface area and orientation heuristic,
+	//every node holds the LightBounds of its lights. Sampling walks down
+	//the tree choosing each child by its importance to the point, so one
+	//light is drawn in O(log n) and its probability is the product of the
+	//choices on the way. Lights without bounds (infinite and distant) are
+	//drawn uniformly beside the tree.
+	class LightBVH : public LightDistribution
+	{
+	public:
+		LightBVH(const Scene& scene);
+
+		int Sample(const Interaction& it, Float u, Float* pdf) const;
+		Float Pdf(const Interaction& it, int lightIndex) const;
+		//the power distribution, for callers without a shading point
+		const Distribution1D* Lookup(const Point3f& p) const;
+
+	private:
+		struct LightBVHNode
+		{
+			LightBounds lightBounds;
+			//leaves: index of the light in Scene::lights
+			//interior nodes: the first child follows the node, this is the
+			//second one
+			int childOrLightIndex;
+			int parent;
+			bool isLeaf;
+		};
+		struct LightBVHPrimitive;
+
+		//appends the subtree of lights [start, end) and returns its root
+		int buildTree(std::vector<LightBVHPrimitive>& lights, int start, int end,
+			int parent);
+		//cost of putting b in a child, the lights are split along dim
+		Float EvaluateCost(const LightBounds& b, const Bounds3f& bounds, int dim) const;
+
+		std::vector<LightBVHNode> nodes;
+		//leaf of every light in the tree, -1 for the ones outside it
+		std::vector<int> lightToLeaf;
+		std::vector<int> infiniteLights;
+		std::unique_ptr<Distribution1D> powerDistrib;
+	};
+}
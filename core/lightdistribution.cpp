@@ -1,11 +1,28 @@
 #include "lightdistribution.h"
+#include "lightbvh.h"
 #include "integrator.h"
+#include "interaction.h"
+#include "light.h"
+#include "log.h"
+#include "lowdiscrepancy.h"
 #include "scene.h"
+#include <numeric>
+#include <thread>
 
 namespace AIR
 {
 	LightDistribution::~LightDistribution() {}
 
+	int LightDistribution::Sample(const Interaction& it, Float u, Float* pdf) const
+	{
+		return Lookup(it.interactPoint)->SampleDiscrete(u, pdf);
+	}
+
+	Float LightDistribution::Pdf(const Interaction& it, int lightIndex) const
+	{
+		return Lookup(it.interactPoint)->DiscretePDF(lightIndex);
+	}
+
 	std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
 		const std::string& name, const Scene& scene) 
 	{
@@ -19,9 +36,15 @@ namespace AIR
 		{
 			new PowerLightDistribution(scene)
 		};
+		else if (name == "bvh")
+			return std::unique_ptr<LightDistribution>
+		{
+			new LightBVH(scene)
+		};
 		else if (name == "spatial")
-			return std::unique_ptr<LightDistribution>{
-			nullptr
+			return std::unique_ptr<LightDistribution>
+		{
+			new SpatialLightDistribution(scene)
 		};
 		else 
 		{
@@ -49,5 +72,132 @@ namespace AIR
 		return distrib.get();
 	}
 
+	SpatialLightDistribution::SpatialLightDistribution(const Scene& scene,
+		int maxVoxels) : scene(scene)
+	{
+		// Cubic voxels, at least one along each axis
+		Bounds3f b = scene.WorldBound();
+		Vector3f diag = b.Diagonal();
+		Float bmax = diag[b.MaximumExtent()];
+		for (int i = 0; i < 3; ++i)
+			nVoxels[i] = std::max(1, int(std::round(diag[i] / bmax * maxVoxels)));
+
+		// Four times as many slots as voxels keeps the probe sequences short
+		hashTableSize = 4 * nVoxels[0] * nVoxels[1] * nVoxels[2];
+		hashTable.reset(new HashEntry[hashTableSize]);
+		for (size_t i = 0; i < hashTableSize; ++i) {
+			hashTable[i].packedPos.store(invalidPackedPos);
+			hashTable[i].distribution.store(nullptr);
+		}
+
+		Log::Info("SpatialLightDistribution: voxel res ({}, {}, {})",
+			nVoxels[0], nVoxels[1], nVoxels[2]);
+	}
+
+	SpatialLightDistribution::~SpatialLightDistribution()
+	{
+		size_t nEntries = 0;
+		for (size_t i = 0; i < hashTableSize; ++i) {
+			HashEntry& entry = hashTable[i];
+			if (entry.distribution.load()) {
+				delete entry.distribution.load();
+				++nEntries;
+			}
+		}
+		Log::Info("SpatialLightDistribution: computed {} of {} voxel distributions",
+			nEntries, nVoxels[0] * nVoxels[1] * nVoxels[2]);
+	}
+
+	const Distribution1D* SpatialLightDistribution::Lookup(const Point3f& p) const
+	{
+		// Voxel of p, points outside the scene bounds use the nearest one
+		Vector3f offset = scene.WorldBound().Offset(p);
+		Point3i pi;
+		for (int i = 0; i < 3; ++i)
+			pi[i] = Clamp(int(offset[i] * nVoxels[i]), 0, nVoxels[i] - 1);
+
+		uint64_t packedPos = (uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2];
+
+		// Mix the bits of the key so neighbouring voxels spread over the table
+		uint64_t hash = packedPos;
+		hash ^= (hash >> 31);
+		hash *= 0x7fb5d329728ea185;
+		hash ^= (hash >> 27);
+		hash *= 0x81dadef4bc2dd44d;
+		hash ^= (hash >> 33);
+		hash %= hashTableSize;
+
+		// Quadratic probing until the voxel or a free slot is found
+		int step = 1;
+		while (true) {
+			HashEntry& entry = hashTable[hash];
+			uint64_t entryPackedPos = entry.packedPos.load(std::memory_order_acquire);
+			if (entryPackedPos == packedPos) {
+				// Another thread may still be computing the distribution
+				Distribution1D* dist = entry.distribution.load(std::memory_order_acquire);
+				while (!dist) {
+					std::this_thread::yield();
+					dist = entry.distribution.load(std::memory_order_acquire);
+				}
+				return dist;
+			}
+			else if (entryPackedPos != invalidPackedPos) {
+				hash += step * step;
+				if (hash >= hashTableSize)
+					hash %= hashTableSize;
+				++step;
+			}
+			else {
+				// Claim the free slot, if another thread took it first look
+				// at it again since it may be the same voxel
+				uint64_t invalid = invalidPackedPos;
+				if (entry.packedPos.compare_exchange_weak(invalid, packedPos)) {
+					Distribution1D* dist = ComputeDistribution(pi);
+					entry.distribution.store(dist, std::memory_order_release);
+					return dist;
+				}
+			}
+		}
+	}
+
+	Distribution1D* SpatialLightDistribution::ComputeDistribution(const Point3i& pi) const
+	{
+		Point3f p0(Float(pi[0]) / Float(nVoxels[0]), Float(pi[1]) / Float(nVoxels[1]),
+			Float(pi[2]) / Float(nVoxels[2]));
+		Point3f p1(Float(pi[0] + 1) / Float(nVoxels[0]), Float(pi[1] + 1) / Float(nVoxels[1]),
+			Float(pi[2] + 1) / Float(nVoxels[2]));
+		Bounds3f voxelBounds(scene.WorldBound().Lerp(p0), scene.WorldBound().Lerp(p1));
+
+		// Estimate the light each source delivers to the voxel from
+		// Halton points inside it, ignoring visibility and the BSDF
+		const int nSamples = 128;
+		std::vector<Float> lightContrib(scene.lights.size(), Float(0));
+		for (int i = 0; i < nSamples; ++i) {
+			Point3f po = voxelBounds.Lerp(Point3f(RadicalInverse(0, i),
+				RadicalInverse(1, i), RadicalInverse(2, i)));
+			Interaction intr(po, Vector3f::zero, Vector3f::zero, Vector3f(1, 0, 0),
+				0, MediumInterface());
+			Point2f u(RadicalInverse(3, i), RadicalInverse(4, i));
+			for (size_t j = 0; j < scene.lights.size(); ++j) {
+				Float pdf;
+				Vector3f wi;
+				VisibilityTester vis;
+				Spectrum Li = scene.lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
+				if (pdf > 0)
+					lightContrib[j] += Li.y() / pdf;
+			}
+		}
+
+		// A light that missed every sample point may still reach parts of
+		// the voxel, so no light gets a zero probability
+		Float sumContrib = std::accumulate(lightContrib.begin(), lightContrib.end(), Float(0));
+		Float avgContrib = sumContrib / (nSamples * lightContrib.size());
+		Float minContrib = (avgContrib > 0) ? .001f * avgContrib : 1;
+		for (size_t i = 0; i < lightContrib.size(); ++i)
+			lightContrib[i] = std::max(lightContrib[i], minContrib);
+
+		return new Distribution1D(&lightContrib[0], int(lightContrib.size()));
+	}
+
 	
 }
@@ -10,6 +10,7 @@
 namespace AIR
 {
 	class Scene;
+	struct Interaction;
 	class LightDistribution 
 	{
 	public:
@@ -18,6 +19,13 @@ namespace AIR
 		// Given a point |p| in space, this method returns a (hopefully
 		// effective) sampling distribution for light sources at that point.
 		virtual const Distribution1D* Lookup(const Point3f& p) const = 0;
+
+		//picks the index of a light in Scene::lights for the shading point
+		//it, pdf is the probability of the pick. Samples Lookup(p) unless a
+		//distribution also looks at the surface normal.
+		virtual int Sample(const Interaction& it, Float u, Float* pdf) const;
+		//probability that Sample picks lightIndex at it
+		virtual Float Pdf(const Interaction& it, int lightIndex) const;
 	};
 
 	std::unique_ptr<LightDistribution> CreateLightSampleDistribution(
@@ -56,4 +64,37 @@ namespace AIR
 	private:
 		std::unique_ptr<Distribution1D> distrib;
 	};
+
+	// SpatialLightDistribution splits the scene bounds into a grid of
+	// voxels and gives each voxel its own distribution, proportional to
+	// the light each source delivers to sample points inside it. The
+	// distributions are computed the first time a voxel is looked up and
+	// stored in a lock-free hash table, so rendering threads fill it in
+	// concurrently without waiting on each other except for a voxel that
+	// another thread is already computing.
+	class SpatialLightDistribution : public LightDistribution {
+	public:
+		// maxVoxels is the number of voxels along the longest axis of the
+		// scene bounds, the other axes get cubic voxels of the same size.
+		SpatialLightDistribution(const Scene& scene, int maxVoxels = 64);
+		~SpatialLightDistribution();
+		const Distribution1D* Lookup(const Point3f& p) const;
+
+	private:
+		Distribution1D* ComputeDistribution(const Point3i& pi) const;
+
+		const Scene& scene;
+		int nVoxels[3];
+
+		// A voxel is keyed by its coordinates packed into 64 bits, the
+		// distribution is published once computed. A key of
+		// invalidPackedPos marks a free slot.
+		struct HashEntry {
+			std::atomic<uint64_t> packedPos;
+			std::atomic<Distribution1D*> distribution;
+		};
+		mutable std::unique_ptr<HashEntry[]> hashTable;
+		size_t hashTableSize;
+		static const uint64_t invalidPackedPos = 0xffffffffffffffff;
+	};
 }
@@ -2,28 +2,57 @@
 #include "parallelism.h"
 #include "stat.h"
 #include <thread>
+#include <chrono>
 #include <vector>
+#include <deque>
 #include "log.h"
 
 namespace AIR
 {
 	static std::vector<std::thread> threads;
 
-	static bool shutdownThreads = false;
-	class ParallelForLoop;
+	static std::atomic<bool> shutdownThreads{false};
 
-	//
+	//A range of iterations of one ParallelFor loop.
+	struct LoopChunk
+	{
+		ParallelForLoop* loop;
+		int64_t indexStart, indexEnd;
+	};
+
+	//Every thread of the pool (the main thread included) owns one queue.
+	//The owner pushes and pops at the back, so it keeps working on the
+	//small chunks it has just split, thieves take the big ones from the front.
+	//Each queue has its own lock, the only contention left is between the
+	//owner and a thief of the same queue.
+	struct alignas(64) WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<LoopChunk> chunks;
+	};
+	static std::vector<std::unique_ptr<WorkQueue>> workQueues;
+
+	//-scheduler worklist: the loops are linked into one list instead, the
+	//newest first, and every thread takes chunkSize iterations of the head
+	//loop under workListMutex. It is the dispatch ParallelFor had before
+	//the queues, kept so the two can be compared on the same tree.
+	static std::atomic<bool> useWorkList{false};
 	static ParallelForLoop* workList = nullptr;
-	//е
 	static std::mutex workListMutex;
-    //
-    static std::condition_variable workListCondition;
 
-    static std::atomic<bool> reportWorkerStats{false};
-// Number of workers that still need to report their stats.
-static std::atomic<int> reporterCount;
-static std::condition_variable reportDoneCondition;
-static std::mutex reportDoneMutex;
+	//number of chunks sitting in all queues, idle workers sleep while it is 0
+	static std::atomic<int64_t> queuedChunks{0};
+	static std::atomic<int> sleepingWorkers{0};
+	static std::mutex sleepMutex;
+	static constexpr int kIdleSpinsBeforeSleep = 64;
+	static std::condition_variable sleepCondition;
+
+	// Workers report their stats each time reportGeneration changes.
+	static std::atomic<int> reportGeneration{0};
+	// Number of workers that still need to report their stats.
+	static std::atomic<int> reporterCount;
+	static std::condition_variable reportDoneCondition;
+	static std::mutex reportDoneMutex;
 
     thread_local int ThreadIndex;
 
@@ -36,17 +65,29 @@ static std::mutex reportDoneMutex;
 
     int MaxThreadIndex() 
     {
-        //return g_globalOptions.nThreads == 0 ? NumSystemCores() : g_globalOptions.nThreads;
-        //pbrtиʹ̵߳ʹϵͳcpu
-        return 1;   //1̲߳
-        return NumSystemCores();
+        //use the thread count given by --nthreads, 0 means all cores
+        return g_globalOptions.nThreads <= 0 ? NumSystemCores() : g_globalOptions.nThreads;
     }
 
+	bool HaveWorkerThreads()
+	{
+		return !threads.empty();
+	}
+
     void ParallelInit() {
         //CHECK_EQ(threads.size(), 0);
         int nThreads = MaxThreadIndex();
         ThreadIndex = 0;
 
+        useWorkList = g_globalOptions.parallelScheduler == "worklist";
+        if (!useWorkList && g_globalOptions.parallelScheduler != "stealing")
+            Log::Warn("ParallelFor scheduler \"{}\" unknown, using stealing",
+                g_globalOptions.parallelScheduler);
+
+        workQueues.clear();
+        for (int i = 0; i < nThreads; ++i)
+            workQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+
         // Create a barrier so that we can be sure all worker threads get past
         // their call to ProfilerWorkerThreadInit() before we return from this
         // function.  In turn, we can be sure that the profiling system isn't
@@ -66,13 +107,14 @@ static std::mutex reportDoneMutex;
         if (threads.empty()) return;
 
         {
-            std::lock_guard<std::mutex> lock(workListMutex);
+            std::lock_guard<std::mutex> lock(sleepMutex);
             shutdownThreads = true;
-            workListCondition.notify_all();
+            sleepCondition.notify_all();
         }
 
         for (std::thread& thread : threads) thread.join();
         threads.erase(threads.begin(), threads.end());
+        workQueues.clear();
         shutdownThreads = false;
     }
 
@@ -90,228 +132,294 @@ static std::mutex reportDoneMutex;
             cv.wait(lock, [this] { return count == 0; });
     }
 
+	static WorkQueue& LocalQueue()
+	{
+		// Threads outside of the pool share the main thread's queue, which
+		// is still correct since every queue is locked.
+		return *workQueues[ThreadIndex < (int)workQueues.size() ? ThreadIndex : 0];
+	}
+
+	static void PushChunk(const LoopChunk& chunk)
+	{
+		WorkQueue& queue = LocalQueue();
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.chunks.push_back(chunk);
+		}
+		// Both counters are sequentially consistent: either the sleeping
+		// worker sees the new chunk before it waits, or we see it sleeping
+		// and wake it up.
+		++queuedChunks;
+		if (sleepingWorkers > 0)
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			sleepCondition.notify_one();
+		}
+	}
+
+	static bool PopChunk(LoopChunk* chunk)
+	{
+		WorkQueue& queue = LocalQueue();
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.chunks.empty())
+			return false;
+		*chunk = queue.chunks.back();
+		queue.chunks.pop_back();
+		--queuedChunks;
+		return true;
+	}
+
+	static bool StealChunk(LoopChunk* chunk)
+	{
+		// Start at a different victim on every thread so that thieves don't
+		// all line up on the same queue.
+		static thread_local uint32_t victimSeed = 0x9e3779b9u * (ThreadIndex + 1);
+		victimSeed ^= victimSeed << 13;
+		victimSeed ^= victimSeed >> 17;
+		victimSeed ^= victimSeed << 5;
+
+		int nQueues = (int)workQueues.size();
+		int start = victimSeed % nQueues;
+		for (int i = 0; i < nQueues; ++i)
+		{
+			WorkQueue& queue = *workQueues[(start + i) % nQueues];
+			if (&queue == &LocalQueue())
+				continue;
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.chunks.empty())
+				continue;
+			*chunk = queue.chunks.front();
+			queue.chunks.pop_front();
+			--queuedChunks;
+			return true;
+		}
+		return false;
+	}
+
+	//the next chunkSize iterations of loop, or of the head of the work
+	//list when loop is null. A loop leaves the list with its last chunk.
+	static bool TakeWorkListChunk(LoopChunk* chunk, ParallelForLoop* loop = nullptr)
+	{
+		std::lock_guard<std::mutex> lock(workListMutex);
+		if (loop == nullptr)
+			loop = workList;
+		if (loop == nullptr || loop->nextIndex >= loop->maxIndex)
+			return false;
+		int64_t indexStart = loop->nextIndex;
+		loop->nextIndex = std::min(indexStart + loop->chunkSize, loop->maxIndex);
+		if (loop->nextIndex == loop->maxIndex)
+		{
+			//a nested loop may have been pushed in front of it
+			ParallelForLoop** link = &workList;
+			while (*link != loop)
+				link = &(*link)->next;
+			*link = loop->next;
+			--queuedChunks;
+		}
+		*chunk = LoopChunk{ loop, indexStart, loop->nextIndex };
+		return true;
+	}
+
+	static bool GetChunk(LoopChunk* chunk)
+	{
+		if (queuedChunks == 0)
+			return false;
+		if (useWorkList)
+			return TakeWorkListChunk(chunk);
+		return PopChunk(chunk) || StealChunk(chunk);
+	}
+
+	//Runs the chunk chunkSize iterations at a time. Before each step the
+	//rest of the range is split in halves when no chunk is queued, and the
+	//upper half goes to the local queue where idle threads can steal it.
+	//Splitting only when the queues have run dry keeps the pushes to a few
+	//per thread instead of one per chunkSize iterations, which is what a
+	//loop of single iteration chunks (the tiles) used to pay for.
+	static void RunChunk(LoopChunk chunk)
+	{
+		ParallelForLoop& loop = *chunk.loop;
+		int64_t index = chunk.indexStart;
+		while (index < chunk.indexEnd)
+		{
+			if (chunk.indexEnd - index > loop.chunkSize && queuedChunks == 0)
+			{
+				int64_t nChunks = (chunk.indexEnd - index + loop.chunkSize - 1) / loop.chunkSize;
+				int64_t indexMid = index + (nChunks / 2) * loop.chunkSize;
+				PushChunk(LoopChunk{ chunk.loop, indexMid, chunk.indexEnd });
+				chunk.indexEnd = indexMid;
+			}
+			int64_t indexEnd = std::min(index + loop.chunkSize, chunk.indexEnd);
+			loop.runChunk(loop.func, index, indexEnd);
+			index = indexEnd;
+		}
+
+		// This must be the last access to _loop_, the thread waiting on it
+		// may return as soon as remaining reaches 0.
+		loop.remaining.fetch_sub(chunk.indexEnd - chunk.indexStart, std::memory_order_acq_rel);
+	}
+
+	void RunParallelForLoop(ParallelForLoop& loop)
+	{
+		if (loop.maxIndex <= 0)
+			return;
+
+		if (useWorkList)
+		{
+			{
+				//a listed loop counts as one queued chunk for the sleepers
+				std::lock_guard<std::mutex> lock(workListMutex);
+				loop.next = workList;
+				workList = &loop;
+				++queuedChunks;
+			}
+			if (sleepingWorkers > 0)
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+				sleepCondition.notify_all();
+			}
+			//the calling thread only takes iterations of its own loop
+			while (!loop.Finished())
+			{
+				LoopChunk chunk;
+				if (TakeWorkListChunk(&chunk, &loop))
+					RunChunk(chunk);
+				else
+					std::this_thread::yield();
+			}
+			return;
+		}
+
+		RunChunk(LoopChunk{ &loop, 0, loop.maxIndex });
+
+		// Help out with whatever is queued until the other threads have
+		// finished the chunks of _loop_ they took.
+		while (!loop.Finished())
+		{
+			LoopChunk chunk;
+			if (GetChunk(&chunk))
+				RunChunk(chunk);
+			else
+				std::this_thread::yield();
+		}
+	}
+
     static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) 
     {
-        //LOG << "Started execution in worker thread " << tIndex << std::endl;
         ThreadIndex = tIndex;
 
-        // Give the profiler a chance to do per-thread initialization for
-        // the worker thread before the profiling system actually stops running.
-        //ProfilerWorkerThreadInit();
-
         // The main thread sets up a barrier so that it can be sure that all
-        // workers have called ProfilerWorkerThreadInit() before it continues
-        // (and actually starts the profiling system).
+        // workers have started before it continues.
         barrier->Wait();
 
         // Release our reference to the Barrier so that it's freed once all of
         // the threads have cleared it.
         barrier.reset();
 
-        std::unique_lock<std::mutex> lock(workListMutex);
+        int reportedGeneration = reportGeneration;
+        int idleSpins = 0;
         while (!shutdownThreads) 
         {
-            if (reportWorkerStats) 
+            if (reportedGeneration != reportGeneration) 
             {
+                reportedGeneration = reportGeneration;
                 ReportThreadStats();
+                std::lock_guard<std::mutex> lock(reportDoneMutex);
                 if (--reporterCount == 0)
                     // Once all worker threads have merged their stats, wake up
                     // the main thread.
                     reportDoneCondition.notify_one();
-                // Now sleep again.
-                workListCondition.wait(lock);
-            }
-            else if (!workList) {
-                // Sleep until there are more tasks to run
-                workListCondition.wait(lock);
+                continue;
             }
-            else {
-                // Get work from _workList_ and run loop iterations
-                ParallelForLoop& loop = *workList;
-
-                // Run a chunk of loop iterations for _loop_
-
-                // Find the set of loop iterations to run next
-                int64_t indexStart = loop.nextIndex;
-                int64_t indexEnd =
-                    std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-                // Update _loop_ to reflect iterations this thread will run
-                loop.nextIndex = indexEnd;
-                if (loop.nextIndex == loop.maxIndex) workList = loop.next;
-                loop.activeWorkers++;
-
-                // Run loop indices in _[indexStart, indexEnd)_
-                lock.unlock();
-                for (int64_t index = indexStart; index < indexEnd; ++index) {
-                    //uint64_t oldState = ProfilerState;
-                    //ProfilerState = loop.profilerState;
-                    if (loop.func1D) 
-                    {
-                        loop.func1D(index);
-                    }
-                    // Handle other types of loops
-                    else 
-                    {
-                        //CHECK(loop.func2D);
-                        loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                    }
-                    //ProfilerState = oldState;
-                }
-                lock.lock();
-
-                // Update _loop_ to reflect completion of iterations
-                loop.activeWorkers--;
-                if (loop.Finished()) 
-                    workListCondition.notify_all();
-            }
-        }
-        //LOG << "Exiting worker thread " << tIndex<<std::endl;
-    }
-
-    
-	void ParallelFor(const std::function<void(int)>& func, int count, int chunkSize)
-	{
-		//٣Ҫֱ߳Ӵ
-		if (threads.empty() || count < chunkSize) 
-		{
-			for (int64_t i = 0; i < count; ++i) 
-				func(i);
-			return;
-		}
 
-        ParallelForLoop loop(std::move(func), count, chunkSize, 0/*CurrentProfilerState()*/);
-        workListMutex.lock();
-
-        //ŵеͷ
-        loop.next = workList;
-        workList = &loop;
-        workListMutex.unlock();
-
-        // Notify worker threads of work to be done
-        std::unique_lock<std::mutex> lock(workListMutex);
-        workListCondition.notify_all();
-
-        // Help out with parallel loop iterations in the current thread
-        while (!loop.Finished()) {
-            // Run a chunk of loop iterations for _loop_
-
-            // Find the set of loop iterations to run next
-            //ѭ
-            //ѭʼ
-            int64_t indexStart = loop.nextIndex;
-            //ѭ
-            int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-            // Update _loop_ to reflect iterations this thread will run
-            loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) 
-                workList = loop.next;
-            loop.activeWorkers++;
-
-            // Run loop indices in _[indexStart, indexEnd)_
-            lock.unlock();
-            
-            //ִ߳ĺlockindexStartᷢ±仯
-            //߳һloopchunkSize = 32Ļ
-            //indexStartܵ320
-            //ΪindexStart = 0һ̶߳ȡִ
-            for (int64_t index = indexStart; index < indexEnd; ++index) 
+            LoopChunk chunk;
+            if (GetChunk(&chunk))
             {
-                //uint64_t oldState = ProfilerState;
-                //ProfilerState = loop.profilerState;
-                if (loop.func1D) {
-                    loop.func1D(index);
-                }
-                // Handle other types of loops
-                else 
-                {
-                    //CHECK(loop.func2D);
-                    loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-                }
-                //ProfilerState = oldState;
+                RunChunk(chunk);
+                idleSpins = 0;
+                continue;
             }
-            lock.lock();
 
-            // Update _loop_ to reflect completion of iterations
-            //ִ߳꣬Ҫ--
-            loop.activeWorkers--;
+            // Spin for a little while before going to sleep, loops are often
+            // issued back to back and waking a thread is expensive.
+            if (++idleSpins < kIdleSpinsBeforeSleep)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            idleSpins = 0;
+
+            // Sleep until there are more chunks to run
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            ++sleepingWorkers;
+            sleepCondition.wait(lock, [&]() {
+                return queuedChunks > 0 || shutdownThreads ||
+                    reportedGeneration != reportGeneration;
+            });
+            --sleepingWorkers;
         }
-	}
-
-    void ParallelFor2D(const std::function<void(Point2i)>& func, const Point2i& count)
-    {
-		if (threads.empty() || count.x * count.y <= 1) 
-        {
-			for (int y = 0; y < count.y; ++y)
-				for (int x = 0; x < count.x; ++x) 
-                    func(Point2i(x, y));
-			return;
-		}
+    }
 
-		ParallelForLoop loop(std::move(func), count, 0/*, CurrentProfilerState()*/);
+	void BenchmarkParallelFor()
+	{
+		std::atomic<int64_t> checksum{0};
+		const bool useWorkListBefore = useWorkList;
+		//no loop is in flight between the runs, so the scheduler can be
+		//switched under the idle workers
+		for (bool workList : { false, true })
 		{
-			std::lock_guard<std::mutex> lock(workListMutex);
-			loop.next = workList;
-			workList = &loop;
-		}
-
-		std::unique_lock<std::mutex> lock(workListMutex);
-		workListCondition.notify_all();
-
-        //ִ߳
-		// Help out with parallel loop iterations in the current thread
-		while (!loop.Finished()) {
-			// Run a chunk of loop iterations for _loop_
-
-			// Find the set of loop iterations to run next
-			int64_t indexStart = loop.nextIndex;
-			int64_t indexEnd = std::min(indexStart + loop.chunkSize, loop.maxIndex);
-
-			// Update _loop_ to reflect iterations this thread will run
-			loop.nextIndex = indexEnd;
-			if (loop.nextIndex == loop.maxIndex) 
-                workList = loop.next;
-			loop.activeWorkers++;
-
-			// Run loop indices in _[indexStart, indexEnd)_
-			lock.unlock();
-			for (int64_t index = indexStart; index < indexEnd; ++index) {
-				//uint64_t oldState = ProfilerState;
-				//ProfilerState = loop.profilerState;
-				if (loop.func1D) {
-					loop.func1D(index);
-				}
-				// Handle other types of loops
-				else {
-					//CHECK(loop.func2D);
-					loop.func2D(Point2i(index % loop.nX, index / loop.nX));
-				}
-				//ProfilerState = oldState;
+			useWorkList = workList;
+			const char* scheduler = workList ? "worklist" : "stealing";
+			const int64_t nIndices = 1 << 22;
+			for (int chunkSize : { 1, 16, 256 })
+			{
+				auto start = std::chrono::steady_clock::now();
+				ParallelFor([&](int64_t index)
+				{
+					if ((index & 1023) == 0)
+						checksum += index;
+				}, nIndices, chunkSize);
+				std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+				Log::Info("ParallelFor {} on {} threads, chunk {}: {:.1f} ns/index",
+					scheduler, MaxThreadIndex(), chunkSize, time.count() * 1e9 / nIndices);
 			}
-			lock.lock();
 
-			// Update _loop_ to reflect completion of iterations
-			loop.activeWorkers--;
+			//a tile does about as much work as a few cheap samples
+			const int nPasses = 200;
+			const Point2i nTiles(32, 32);
+			auto start = std::chrono::steady_clock::now();
+			for (int pass = 0; pass < nPasses; ++pass)
+			{
+				ParallelFor2D([&](Point2i tile)
+				{
+					Float x = 0;
+					for (int i = 0; i < 2000; ++i)
+						x += i * 0.5f;
+					checksum += (int64_t)x & (tile.x + 1);
+				}, nTiles);
+			}
+			std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+			Log::Info("ParallelFor2D {} on {} threads, {}x{} tiles: {:.0f} tiles/ms (checksum {})",
+				scheduler, MaxThreadIndex(), nTiles.x, nTiles.y,
+				nPasses * nTiles.x * nTiles.y / (time.count() * 1e3), checksum.load());
 		}
-        
-    }
+		useWorkList = useWorkListBefore;
+	}
 
     void MergeWorkerThreadStats() 
     {
-        std::unique_lock<std::mutex> lock(workListMutex);
-        std::unique_lock<std::mutex> doneLock(reportDoneMutex);
-        // Set up state so that the worker threads will know that we would like
-        // them to report their thread-specific stats when they wake up.
-        reportWorkerStats = true;
-        reporterCount = threads.size();
+        if (threads.empty()) return;
 
-        // Wake up the worker threads.
-        workListCondition.notify_all();
+        std::unique_lock<std::mutex> doneLock(reportDoneMutex);
+        reporterCount = (int)threads.size();
+        {
+            // Wake up the worker threads so they report their
+            // thread-specific stats.
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            ++reportGeneration;
+            sleepCondition.notify_all();
+        }
 
         // Wait for all of them to merge their stats.
-        reportDoneCondition.wait(lock, []() { return reporterCount == 0; });
-
-        reportWorkerStats = false;
+        reportDoneCondition.wait(doneLock, []() { return reporterCount == 0; });
     }
 }
@@ -38,57 +38,52 @@ namespace AIR
 		int count;
 	};
 
-	//ѭķװÿִһParallelForһParallelForLoop
-	//һParallelForLoopParallelForindexStartindexEndĴfunc
-	//֧1D2Dĺ
-	//
+	//ParallelFor splits [0, maxIndex) into chunks that are pushed onto the
+	//work queue of the calling thread, idle threads steal chunks from the
+	//front of the other queues. The loop body is reached through one function
+	//pointer call per chunk instead of a std::function call per index.
 	class ParallelForLoop
 	{
 	public:
-		ParallelForLoop(std::function<void(int)> func1D,
-			int64_t maxIndex, int chunkSize, int profilerState)
-			: func1D(std::move(func1D)), maxIndex(maxIndex),
-			chunkSize(chunkSize), profilerState(profilerState) { }
-
-		ParallelForLoop(const std::function<void(Point2i)>& f, const Point2i& count,
-			uint64_t profilerState)
-			: func2D(f),
-			maxIndex((int)count.x * count.y),
-			chunkSize(1),
-			profilerState(profilerState) 
-		{
-			nX = count.x;
-		}
+		typedef void (*ChunkFunc)(const void* func, int64_t indexStart, int64_t indexEnd);
+
+		ParallelForLoop(ChunkFunc runChunk, const void* func,
+			int64_t maxIndex, int chunkSize)
+			: runChunk(runChunk), func(func), maxIndex(maxIndex),
+			chunkSize(chunkSize), remaining(maxIndex) { }
 
 		bool Finished() const 
 		{
-			return nextIndex >= maxIndex &&
-				activeWorkers == 0;
+			return remaining.load(std::memory_order_acquire) == 0;
 		}
 	public:
-		//1Dѭ
-		std::function<void(int)> func1D;
-		std::function<void(Point2i)> func2D;
-		//ѭindex
+		//runs the loop body for [indexStart, indexEnd)
+		ChunkFunc runChunk;
+		//the loop body, only runChunk knows its real type
+		const void* func;
 		const int64_t maxIndex;
 
-		//chunkSizeҪִеĴ
-		const int chunkSize, profilerState;
+		//a chunk is never split below chunkSize iterations
+		const int chunkSize;
 
-		//tracks the next loop index to be executed.
-		//Ϊһִеѭ
-		//һѭ1024ΣmaxIndex = 1024chunkSize = 32
-		//ʼindex64
-		//ônextIndex64 + chunkSize = 96
-		int64_t nextIndex = 0;
+		//iterations that have not finished yet, the loop is done at 0
+		std::atomic<int64_t> remaining;
 
-		//activeWorkers records how many worker threads are currently running iterations of the loop. 
-		int activeWorkers = 0;
+		//the work list scheduler hands out the iterations from nextIndex
+		//on, the loops waiting for threads are linked through next
+		int64_t nextIndex = 0;
 		ParallelForLoop* next = nullptr;
-
-		int nX = -1;
 	};
 
+	//Runs the loop on the thread pool. The calling thread keeps executing
+	//queued chunks (of this loop or of any other one) until every iteration
+	//of the loop is done, so a loop body may start a nested ParallelFor
+	//without blocking a worker.
+	void RunParallelForLoop(ParallelForLoop& loop);
+
+	//false before ParallelInit() or when the pool only has the main thread
+	bool HaveWorkerThreads();
+
 	extern thread_local int ThreadIndex;
 
 	//ִһѭ庯
@@ -97,8 +92,25 @@ namespace AIR
 	//chunkSize һ̴߳ġࡿѭ
 	//ѭ1024Σÿ̴߳ࡿ32Σô
 	//count = 1024, chunkSize = 32
-	//ע⣺úִе
-	void ParallelFor(const std::function<void(int)>& func, int count, int chunkSize);
+	//can be called from any thread, including from inside another loop body
+	template <typename F>
+	void ParallelFor(const F& func, int64_t count, int chunkSize)
+	{
+		if (!HaveWorkerThreads() || count < chunkSize) 
+		{
+			for (int64_t i = 0; i < count; ++i) 
+				func(i);
+			return;
+		}
+
+		ParallelForLoop loop([](const void* f, int64_t indexStart, int64_t indexEnd)
+		{
+			const F& body = *static_cast<const F*>(f);
+			for (int64_t index = indexStart; index < indexEnd; ++index)
+				body(index);
+		}, &func, count, chunkSize);
+		RunParallelForLoop(loop);
+	}
 
 	//ִ2Dѭ
 	//func ѭĺ
@@ -107,7 +119,15 @@ namespace AIR
 	//count.x = (700 + 16 - 1) / 16
 	//count.y = (700 + 16 - 1) / 16
 	//ûchunkSizeںоִһtileSize * tileSize2Dѭ
-	void ParallelFor2D(const std::function<void(Point2i)>& func, const Point2i& count);
+	template <typename F>
+	void ParallelFor2D(const F& func, const Point2i& count)
+	{
+		const int64_t nX = count.x;
+		ParallelFor([&](int64_t index) 
+		{
+			func(Point2i(int(index % nX), int(index / nX)));
+		}, nX * count.y, 1);
+	}
 
 	int MaxThreadIndex();
 	//cpucore
@@ -116,4 +136,10 @@ namespace AIR
 	void ParallelCleanup();
 
 	void MergeWorkerThreadStats();
+
+	//times ParallelFor over empty loop bodies with chunks of 1, 16 and 256
+	//iterations and ParallelFor2D over 32x32 small tiles, once with the
+	//work stealing and once with the work list scheduler, and logs ns per
+	//index and tiles per ms
+	void BenchmarkParallelFor();
 }
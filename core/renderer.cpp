@@ -4,6 +4,7 @@
 #include "scene.h"
 #include "camera.h"
 #include "bvhaccel.h"
+#include "kdtreeaccel.h"
 #include "pathintegrator.h"
 #include "film.h"
 #include "boxfilter.h"
@@ -14,8 +15,15 @@
 #include "stat.h"
 #include "log.h"
 #include "volpathintegrator.h"
+#include "wavefrontpathintegrator.h"
+#include "bdptintegrator.h"
 #include "randomsampler.h"
 #include "haltonsampler.h"
+#include "interaction.h"
+#include "sampling.h"
+#include "rng.h"
+#include "light.h"
+#include <chrono>
 
 namespace AIR
 {
@@ -25,6 +33,7 @@ namespace AIR
 	static size_t transformCacheBytes = 0;
 	Transform* TransformCache::Lookup(const Transform& t)
 	{
+		std::lock_guard<std::mutex> lock(mutex);
 		++nTransformCacheLookups;
 
 		int offset = Hash(t) & (hashTable.size() - 1);
@@ -54,6 +63,7 @@ namespace AIR
 
 	void TransformCache::Clear()
 	{
+		std::lock_guard<std::mutex> lock(mutex);
 		transformCacheBytes += arena.TotalAllocated() + hashTable.size() * sizeof(Transform*);
 		hashTable.clear();
 		hashTable.resize(512);
@@ -122,14 +132,41 @@ namespace AIR
 		) 
 	{
 		std::shared_ptr<Primitive> accel;
+		auto makeBVH = [&prims](int maxPrimsInNode, const char* splitName, int nodeWidth,
+			bool quantizeNodes) {
+			return BVHAccel::CreateBVHAccelerator(std::move(prims), maxPrimsInNode, splitName,
+				nodeWidth, g_globalOptions.bakeTriangles, g_globalOptions.bvhCacheDir,
+				g_globalOptions.spatialSplitBudget, quantizeNodes,
+				g_globalOptions.triangleGroupWidth, g_globalOptions.triangleTest);
+		};
 		if (name == "bvh")
-			accel = BVHAccel::CreateBVHAccelerator(std::move(prims));
+			accel = makeBVH(4, "bvh", 2, false);
+		else if (name == "hlbvh")
+		{
+			//HLBVH leaves are not chosen by cost, and a triangle test is much
+			//more expensive than a node test here, so keep single primitive leaves
+			accel = makeBVH(1, "hlbvh", 2, false);
+		}
+		else if (name == "bvh4")
+			accel = makeBVH(4, "bvh", 4, false);
+		else if (name == "bvh8")
+			accel = makeBVH(4, "bvh", 8, false);
+		else if (name == "bvh4q")
+			accel = makeBVH(4, "bvh", 4, true);
+		else if (name == "bvh8q")
+			accel = makeBVH(4, "bvh", 8, true);
+		else if (name == "sbvh")
+			accel = makeBVH(4, "sbvh", 2, false);
 		else if (name == "kdtree")
-			accel = nullptr;
+			accel = std::make_shared<KdTreeAccel>(std::move(prims));
 		else
 		{
-			//Warning("Accelerator \"%s\" unknown.", name.c_str());
+			Log::Warn("Accelerator \"{}\" unknown, using bvh", name);
 		}
+
+		//prims is only moved from by a successful branch above
+		if (!accel)
+			accel = makeBVH(4, "bvh", 2, false);
 			
 		//paramSet.ReportUnused();
 		return accel;
@@ -141,8 +178,6 @@ namespace AIR
 	{
 		std::shared_ptr<Primitive> accelerator =
 			MakeAccelerator(AcceleratorName, std::move(primitives));
-		if (!accelerator) 
-			accelerator = std::make_shared<BVHAccel>(primitives);
 		Scene* scene = new Scene(accelerator, lights);
 		// Erase primitives and lights from _RenderOptions_
 		primitives.clear();
@@ -161,11 +196,30 @@ namespace AIR
 		
 		if (IntegratorName == "path")
 		{
-			integrator = new PathIntegrator(maxDepth, camera, sampler, pixelBounds);
+			integrator = new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
+				g_globalOptions.lightSampleStrategy);
 		}
 		else if (IntegratorName == "volpath")
 		{
-			integrator = new VolPathIntegrator(maxDepth, camera, sampler, pixelBounds);
+			integrator = new VolPathIntegrator(maxDepth, camera, sampler, pixelBounds, 1,
+				g_globalOptions.lightSampleStrategy);
+		}
+		else if (IntegratorName == "wavefront")
+		{
+			integrator = new WavefrontPathIntegrator(maxDepth, camera, sampler, pixelBounds);
+		}
+		else if (IntegratorName == "bdpt")
+		{
+			//the light subpaths reach the film through the perspective
+			//projection only
+			if (cameraParams.orthogonal)
+			{
+				Log::Warn("bdpt needs a perspective camera, using path");
+				integrator = new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
+					g_globalOptions.lightSampleStrategy);
+			}
+			else
+				integrator = new BDPTIntegrator(maxDepth, camera, sampler, pixelBounds);
 		}
 		return integrator;
 	}
@@ -289,8 +343,219 @@ namespace AIR
 		ParallelCleanup();
 	}
 
+	//traces one primary ray through every pixel center, then from the
+	//primary hits a shadow ray to a random point of the scene bounds and a
+	//cosine distributed bounce ray, and reports the Mrays/s of each kind.
+	//With lights, every hit also traces a shadow ray to a sample on one of
+	//them, once plain and once through the last occluder cache.
+	//Only the traversal is timed, the rays are generated beforehand. The
+	//hardware cache misses per ray are logged where perf counters can be
+	//opened.
+	static void BenchmarkTraversal(const Scene& scene, const Camera& camera)
+	{
+		Point2i resolution = camera.film->fullResolution;
+		std::vector<Ray> primaryRays;
+		primaryRays.reserve(resolution.x * resolution.y);
+		for (int y = 0; y < resolution.y; ++y)
+		{
+			for (int x = 0; x < resolution.x; ++x)
+			{
+				CameraSample cameraSample;
+				cameraSample.pFilm = Point2f(x + 0.5f, y + 0.5f);
+				cameraSample.pLens = Point2f(0.5f, 0.5f);
+				cameraSample.time = 0;
+				Ray ray;
+				camera.GenerateRay(cameraSample, &ray);
+				primaryRays.push_back(ray);
+			}
+		}
+
+		std::vector<Interaction> hits(primaryRays.size());
+		std::vector<char> hitFlags(primaryRays.size());
+		bool missesReported = false;
+		auto logCacheMisses = [&](const char* name, const CacheMissCounter& misses, size_t nRays) {
+			if (misses.Supported())
+				Log::Info("{} rays: {:.2f} cache misses per ray", name,
+					nRays ? double(misses.Read()) / nRays : 0.0);
+			else if (!missesReported)
+				Log::Info("cache misses: perf counters can't be opened here");
+			missesReported = true;
+		};
+		//rayLights, when given, are the lights of shadow rays for the cache
+		auto runPass = [&](const char* name, const std::vector<Ray>& rays, bool shadow, bool keepHits,
+			const std::vector<const Light*>* rayLights = nullptr) {
+			std::atomic<int64_t> nHits(0);
+			CacheMissCounter misses;
+			auto start = std::chrono::steady_clock::now();
+			ParallelFor([&](int64_t i) {
+				misses.Attach();
+				Ray ray = rays[i];
+				bool hit;
+				if (shadow && rayLights)
+					hit = scene.IntersectP(ray, *(*rayLights)[i]);
+				else if (shadow)
+					hit = scene.IntersectP(ray);
+				else
+				{
+					SurfaceInteraction isect;
+					hit = scene.Intersect(ray, &isect);
+					if (keepHits)
+					{
+						hits[i] = isect;
+						hitFlags[i] = hit;
+					}
+				}
+				if (hit)
+					++nHits;
+			}, rays.size(), 256);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			Log::Info("{} rays: {} in {:.3f}s, {:.2f} Mrays/s, {:.1f}% hit", name, rays.size(),
+				elapsed.count(), rays.size() / elapsed.count() * 1e-6,
+				rays.empty() ? 0.0 : 100.0 * nHits / rays.size());
+			logCacheMisses(name, misses, rays.size());
+		};
+
+		//batches of kMaxRayPacketSize rays whose traversals are interleaved
+		auto runInterleavedPass = [&](const char* name, const std::vector<Ray>& rays) {
+			std::atomic<int64_t> nHits(0);
+			const int64_t nBatches = (rays.size() + kMaxRayPacketSize - 1) / kMaxRayPacketSize;
+			CacheMissCounter misses;
+			auto start = std::chrono::steady_clock::now();
+			ParallelFor([&](int64_t batch) {
+				misses.Attach();
+				const int64_t first = batch * kMaxRayPacketSize;
+				const int n = (int)std::min<int64_t>(kMaxRayPacketSize, rays.size() - first);
+				Ray batchRays[kMaxRayPacketSize];
+				SurfaceInteraction isects[kMaxRayPacketSize];
+				bool batchHits[kMaxRayPacketSize];
+				for (int i = 0; i < n; ++i)
+					batchRays[i] = rays[first + i];
+				scene.IntersectInterleaved(batchRays, n, isects, batchHits);
+				for (int i = 0; i < n; ++i)
+				{
+					if (batchHits[i])
+						++nHits;
+				}
+			}, nBatches, 16);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			Log::Info("{} rays: {} in {:.3f}s, {:.2f} Mrays/s, {:.1f}% hit", name, rays.size(),
+				elapsed.count(), rays.size() / elapsed.count() * 1e-6,
+				rays.empty() ? 0.0 : 100.0 * nHits / rays.size());
+			logCacheMisses(name, misses, rays.size());
+		};
+
+		runPass("primary", primaryRays, false, true);
+		runInterleavedPass("primary, interleaved", primaryRays);
+
+		RNG rng;
+		const Bounds3f& worldBound = scene.WorldBound();
+		std::vector<Ray> shadowRays, bounceRays;
+		for (size_t i = 0; i < hits.size(); ++i)
+		{
+			if (!hitFlags[i])
+				continue;
+			const Interaction& it = hits[i];
+			Point3f target = worldBound.Lerp(Point3f(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat()));
+			shadowRays.push_back(it.SpawnRayTo(target));
+
+			Vector3f n = Vector3f::Dot(it.normal, it.wo) < 0 ? -it.normal : it.normal;
+			Vector3f s, t;
+			CoordinateSystem(n, &s, &t);
+			Vector3f w = CosineSampleHemisphere(Point2f(rng.UniformFloat(), rng.UniformFloat()));
+			bounceRays.push_back(it.SpawnRay(s * w.x + t * w.y + n * w.z));
+		}
+
+		runPass("shadow", shadowRays, true, false);
+		runPass("diffuse bounce", bounceRays, false, false);
+		runInterleavedPass("diffuse bounce, interleaved", bounceRays);
+
+		if (scene.lights.empty())
+			return;
+		std::vector<Ray> lightRays;
+		std::vector<const Light*> rayLights;
+		for (size_t i = 0; i < hits.size(); ++i)
+		{
+			if (!hitFlags[i])
+				continue;
+			//neighbouring pixels sample different lights, like a light
+			//picked at random per sample
+			const Light* light = scene.lights[i % scene.lights.size()].get();
+			Vector3f wi;
+			Float pdf;
+			VisibilityTester visibility;
+			light->Sample_Li(hits[i], Point2f(rng.UniformFloat(), rng.UniformFloat()), &wi, &pdf,
+				&visibility);
+			if (pdf == 0)
+				continue;
+			lightRays.push_back(hits[i].SpawnRayTo(visibility.P1()));
+			rayLights.push_back(light);
+		}
+		Log::Info("{} lights", scene.lights.size());
+		runPass("light shadow", lightRays, true, false);
+		runPass("light shadow, last occluder first", lightRays, true, false, &rayLights);
+	}
+
+	//builds each accelerator of the comma separated names over the same
+	//primitives and reports its build time and memory, then the traversal
+	//rates of BenchmarkTraversal
+	static void BenchmarkAccelerators(const std::string& names, const Camera& camera)
+	{
+		size_t start = 0;
+		while (start <= names.size())
+		{
+			size_t end = names.find(',', start);
+			if (end == std::string::npos)
+				end = names.size();
+			std::string name = names.substr(start, end - start);
+			start = end + 1;
+			if (name.empty())
+				continue;
+
+			auto buildStart = std::chrono::steady_clock::now();
+			std::shared_ptr<Primitive> accel = MakeAccelerator(name, g_renderOptions.primitives);
+			std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - buildStart;
+			Log::Info("accelerator {}: build {:.3f}s, {:.1f} MB", name, buildTime.count(),
+				accel->AcceleratorBytes() / (1024.0 * 1024.0));
+			Scene scene(accel, g_renderOptions.lights);
+			BenchmarkTraversal(scene, camera);
+		}
+	}
+
 	void Renderer::Run()
 	{
+		if (!g_globalOptions.benchmarkAccelerators.empty())
+		{
+			std::unique_ptr<Camera> camera(g_renderOptions.MakeCamera());
+			BenchmarkAccelerators(g_globalOptions.benchmarkAccelerators, *camera);
+			return;
+		}
+
+		if (g_globalOptions.benchmarkTriangles)
+		{
+			BenchmarkTriangleKernels();
+			return;
+		}
+
+		if (g_globalOptions.benchmarkSampling)
+		{
+			BenchmarkDistributionSampling();
+			return;
+		}
+
+		if (g_globalOptions.benchmarkParallel)
+		{
+			BenchmarkParallelFor();
+			return;
+		}
+
+		if (g_globalOptions.benchmarkTraversal)
+		{
+			std::unique_ptr<Camera> camera(g_renderOptions.MakeCamera());
+			std::unique_ptr<Scene> scene(g_renderOptions.MakeScene());
+			BenchmarkTraversal(*scene, *camera);
+			return;
+		}
+
 		std::unique_ptr<Integrator> integrator(g_renderOptions.MakeIntegrator());
 		std::unique_ptr<Scene> scene(g_renderOptions.MakeScene());
 
@@ -301,5 +566,6 @@ namespace AIR
 
 		MergeWorkerThreadStats();
         ReportThreadStats();
+		PrintStats(stdout);
 	}
 }
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <mutex>
 #include "memory.h"
 #include "geometry.h"
 #include "quaternion.h"
@@ -47,6 +48,8 @@ namespace AIR
 		std::vector<Transform*> hashTable;
 		int hashTableOccupancy;
 		MemoryArena arena;
+		//Lookup may be called by several threads at the same time
+		std::mutex mutex;
 	};
 
 	struct CameraParam
@@ -107,7 +110,8 @@ namespace AIR
 
 	struct GlobalOptions
 	{
-		int nThreads = 1;
+		//0 means use all cores of the machine
+		int nThreads = 0;
 		int filmWidth = 512;
 		int filmHeight = 512;
 		int samplePerPixel = 16;
@@ -124,6 +128,56 @@ namespace AIR
 		std::string AcceleratorName = "bvh";
 		//ParamSet AcceleratorParams;
 		std::string IntegratorName = "path";
+		//order the image tiles are rendered in: scanline, hilbert, spiral,
+		//or cost (a 1spp pass measures the tiles, the rest of the samples
+		//are rendered most expensive tile first)
+		std::string TileOrder = "scanline";
+		//trace primary, shadow and diffuse bounce rays through the
+		//accelerator and report Mrays/s instead of rendering
+		bool benchmarkTraversal = false;
+		//comma separated accelerators, e.g. "bvh,kdtree", each is built
+		//over the scene and benchmarked like benchmarkTraversal
+		std::string benchmarkAccelerators;
+		//bake mesh triangles into a flat world space array next to the bvh
+		//primitives, trading 40 bytes per triangle for fewer indirections
+		bool bakeTriangles = false;
+		//4 or 8: the baked triangles of each bvh leaf are also stored in
+		//SoA groups of that many and tested by one SIMD kernel per group,
+		//0 tests them one by one. Implies bakeTriangles.
+		int triangleGroupWidth = 0;
+		//"watertight" or "moller", the test of the baked triangles
+		std::string triangleTest = "watertight";
+		//time the scalar and grouped triangle kernels instead of rendering
+		bool benchmarkTriangles = false;
+		//time the alias table sampling of environment map and light
+		//distributions instead of rendering
+		bool benchmarkSampling = false;
+		//time the ParallelFor dispatch and tile throughput of the thread
+		//pool instead of rendering
+		bool benchmarkParallel = false;
+		//"stealing": ParallelFor splits its loops over per thread work
+		//queues, "worklist": the former single list of loops that every
+		//thread takes chunkSize iterations from under one lock
+		std::string parallelScheduler = "stealing";
+		//directory of the bvh cache files, empty turns the cache off
+		std::string bvhCacheDir;
+		//references the sbvh spatial splits may add, as a fraction of the
+		//primitive count
+		Float spatialSplitBudget = 0.3f;
+		//4, 8 or 16: the camera rays of pixel blocks of that size are
+		//traced together as packets, 0 traces them one by one
+		int rayPacketSize = 0;
+		//the rays of a pixel block take turns in the bvh traversal instead
+		//of being traced as a packet, hides node loads on large scenes
+		bool interleaveTraversal = false;
+		//also writes the nodes visited and primitives tested per camera
+		//sample as false color images next to the render
+		bool traversalCostImages = false;
+		//how the path and volpath integrators pick the light of next event
+		//estimation: uniform, power, spatial (a distribution per voxel of
+		//the scene, computed on first use) or bvh (a light BVH weighs the
+		//lights by their distance and orientation to each shading point)
+		std::string lightSampleStrategy = "uniform";
 	};
 
 	struct RenderOptions 
@@ -169,6 +223,11 @@ namespace AIR
 		std::string sceneFile;
 	};
 
+	//builds the accelerator called name over prims, an unknown or missing
+	//one falls back to the bvh. Also builds the prototypes of instances.
+	std::shared_ptr<Primitive> MakeAccelerator(const std::string& name,
+		std::vector<std::shared_ptr<Primitive>> prims);
+
 	class Renderer
 	{
 	public:
@@ -1,5 +1,6 @@
 #include "robject.h"
 #include "sphere.h"
+#include "triangle.h"
 #include "material.h"
 
 namespace AIR
@@ -47,6 +48,37 @@ namespace AIR
 			return false;
 		}
 		r.tMax = tHit;
+		SetHitInteraction(r, pInteract);
+		return true;
+	}
+
+	void Primitive::IntersectPacket(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		for (int i = 0; i < n; ++i)
+			hits[i] = Intersect(rays[i], &isects[i]);
+	}
+
+	void Primitive::IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		for (int i = 0; i < n; ++i)
+			hits[i] = Intersect(rays[i], &isects[i]);
+	}
+
+	void Primitive::IntersectPPacket(const Ray* rays, int n, bool* occluded) const
+	{
+		for (int i = 0; i < n; ++i)
+			occluded[i] = IntersectP(rays[i]);
+	}
+
+	bool Primitive::IntersectPOccluder(const Ray& r, int* lastOccluder) const
+	{
+		return IntersectP(r);
+	}
+
+	void Primitive::SetHitInteraction(const Ray& r, SurfaceInteraction* pInteract) const
+	{
 		pInteract->primitive = this;
 
 		//ýвͬɵģôprimtivemediumInterface
@@ -54,8 +86,6 @@ namespace AIR
 			pInteract->mediumInterface = mediumInterface;
 		else   //rayЯmedium
 			pInteract->mediumInterface = MediumInterface(r.medium);
-
-		return true;
 	}
 
 	bool Primitive::IntersectP(const Ray &r) const
@@ -63,6 +93,22 @@ namespace AIR
 		return shape->IntersectP(r);
 	}
 
+	bool Primitive::SubTriangleVertices(int sub, Point3f p[3]) const
+	{
+		const Triangle* triangle = dynamic_cast<const Triangle*>(shape.get());
+		if (triangle == nullptr)
+			return false;
+		triangle->WorldVertices(p);
+		return true;
+	}
+
+	void Primitive::SubTriangleInteraction(int sub, const Ray& r, const Float b[3],
+		SurfaceInteraction* pInteract) const
+	{
+		static_cast<const Triangle*>(shape.get())->InteractionFromBarycentrics(r, b, pInteract);
+		SetHitInteraction(r, pInteract);
+	}
+
 	void Primitive::ComputeScatteringFunctions(
 		SurfaceInteraction* isect, MemoryArena& arena, TransportMode mode,
 		bool allowMultipleLobes) const {
@@ -11,6 +11,10 @@ namespace AIR
 	class MemoryArena;
 	class Material;
 	class AreaLight;
+
+	//most rays Primitive::IntersectPacket traces together
+	constexpr int kMaxRayPacketSize = 16;
+
 	class Primitive
 	{
 	public:
@@ -33,6 +37,24 @@ namespace AIR
 		virtual Bounds3f WorldBound() const;
 		virtual bool Intersect(const Ray &r, SurfaceInteraction *) const;
 		virtual bool IntersectP(const Ray &r) const;
+		//traces n <= kMaxRayPacketSize rays the caller grouped as coherent,
+		//e.g. the camera rays of a pixel block. hits[i] and isects[i] are
+		//what Intersect(rays[i], &isects[i]) returns. The default traces
+		//the rays one by one, BVHAccel traverses them together.
+		virtual void IntersectPacket(const Ray* rays, int n, SurfaceInteraction* isects,
+			bool* hits) const;
+		virtual void IntersectPPacket(const Ray* rays, int n, bool* occluded) const;
+		//like IntersectPacket for n <= kMaxRayPacketSize independent rays,
+		//e.g. the samples of a pixel or the bounce rays of a pixel block.
+		//BVHAccel advances them in turns to overlap their node loads.
+		virtual void IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+			bool* hits) const;
+		//IntersectP for shadow rays. *lastOccluder is an id of the
+		//primitive that occluded an earlier, similar ray, or -1; it is
+		//tested first and replaced by the occluder found. The id is only
+		//a hint and stays meaningful to the aggregate that returned it.
+		//The default ignores it.
+		virtual bool IntersectPOccluder(const Ray& r, int* lastOccluder) const;
 		
 		//initializes representations of the light-scattering properties of the 
 		//material at the intersection point on the surface.
@@ -56,6 +78,51 @@ namespace AIR
 		{
 			return mTransform;
 		}
+
+		const Shape* GetShape() const
+		{
+			return shape.get();
+		}
+
+		//sets the primitive and medium of pInteract after its shape was hit
+		void SetHitInteraction(const Ray& r, SurfaceInteraction* pInteract) const;
+
+		//recomputes what the primitive caches from its Transform, call it
+		//after the Transform was moved
+		virtual void Refit() {}
+
+		//bytes of the acceleration structure an aggregate owns, not
+		//counting the primitives it was built over
+		virtual size_t AcceleratorBytes() const
+		{
+			return 0;
+		}
+
+		//an aggregate such as MeshPrimitive is split by the accelerator into
+		//sub primitives, which are referenced as (primitive, sub) pairs.
+		//A plain primitive is its only sub primitive 0.
+		virtual int SubPrimitiveCount() const
+		{
+			return 1;
+		}
+		virtual Bounds3f SubPrimitiveBound(int sub) const
+		{
+			return WorldBound();
+		}
+		virtual bool IntersectSub(int sub, const Ray& r, SurfaceInteraction* pInteract) const
+		{
+			return Intersect(r, pInteract);
+		}
+		virtual bool IntersectPSub(int sub, const Ray& r) const
+		{
+			return IntersectP(r);
+		}
+
+		//world space vertices of sub, false if it isn't a triangle
+		virtual bool SubTriangleVertices(int sub, Point3f p[3]) const;
+		//fills pInteract for a hit at barycentrics b on the triangle sub
+		virtual void SubTriangleInteraction(int sub, const Ray& r, const Float b[3],
+			SurfaceInteraction* pInteract) const;
 	private:
 		
 		std::shared_ptr<Shape> shape;
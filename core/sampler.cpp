@@ -92,6 +92,11 @@ namespace AIR
 		return Sampler::SetSampleNumber(sampleNum);
 	}
 
+	void PixelSampler::SetSequence(uint64_t sequence)
+	{
+		rng.SetSequence(sequence);
+	}
+
 	Float PixelSampler::Get1D() 
 	{
 		//ProfilePhase _(Prof::GetSample);
@@ -41,6 +41,10 @@ namespace AIR
 		//ͬһµһsample
 		virtual bool StartNextSample();
 		virtual std::unique_ptr<Sampler> Clone(int seed) = 0;
+		//restarts the random stream at sequence, what StartPixel and the
+		//samples draw afterwards only depends on it. Samplers without a
+		//random stream ignore it.
+		virtual void SetSequence(uint64_t sequence) {}
 		virtual bool SetSampleNumber(int64_t sampleNum);
 
 		int64_t CurrentSampleNumber() const 
@@ -74,6 +78,7 @@ namespace AIR
 		bool SetSampleNumber(int64_t);
 		Float Get1D();
 		Point2f Get2D();
+		void SetSequence(uint64_t sequence);
 
 	protected:
 		// PixelSampler Protected Data
@@ -1,72 +1,186 @@
 #include "sampling.h"
 #include "mathdef.h"
+#include "log.h"
+#include <chrono>
 
 namespace AIR
 {
+	void BuildAliasTable(const Float* f, int n, AliasBin* bins)
+	{
+		double sum = 0;
+		for (int i = 0; i < n; ++i)
+			sum += f[i];
+
+		//p(i) * n, the bins below 1 are filled up from the ones above.
+		//Doubles, the rounding of the subtractions adds up over large n.
+		//One worklist: the small bins stack up from the front, the large
+		//ones from the back.
+		std::vector<double> scaled(n);
+		std::vector<int> work(n);
+		int nSmall = 0, firstLarge = n;
+		double scale = sum > 0 ? n / sum : 0;
+		for (int i = 0; i < n; ++i)
+		{
+			scaled[i] = sum > 0 ? f[i] * scale : 1;
+			if (scaled[i] < 1)
+				work[nSmall++] = i;
+			else
+				work[--firstLarge] = i;
+		}
+
+		while (nSmall > 0 && firstLarge < n)
+		{
+			int s = work[--nSmall], l = work[firstLarge];
+			bins[s].q = (Float)scaled[s];
+			bins[s].alias = l;
+			//l gave 1 - scaled[s] of its probability to bin s
+			scaled[l] = (scaled[l] + scaled[s]) - 1;
+			if (scaled[l] < 1)
+			{
+				++firstLarge;
+				work[nSmall++] = l;
+			}
+		}
+
+		//what is left is 1 up to rounding
+		for (int k = 0; k < nSmall; ++k)
+			bins[work[k]] = { 1, work[k] };
+		for (int k = firstLarge; k < n; ++k)
+			bins[work[k]] = { 1, work[k] };
+	}
+
 	Float Distribution1D::SampleContinuous(Float u, Float* pdf, int* off) const
 	{
-		//binary search ҵuĸcdf
-		int offset = FindInterval(cdf.size(), [&](int index) { return cdf[index] <= u; });
+		Float du;
+		int offset = SampleAliasTable(bins.data(), Count(), u, &du);
 		if (off != nullptr)
 			*off = offset;
 
-		//һcdfֵ
-		Float du = u - cdf[offset];
-		if ((cdf[offset + 1] - cdf[offset]) > 0)
-			du /= (cdf[offset + 1] - cdf[offset]);
-
 		if (pdf != nullptr)
 		{
 			*pdf = funcInt != 0 ? func[offset] / funcInt : 0;
 		}
 
-		//ע⣬ﲻǷcdfcdfӦpdfķֵ
-		//cdfindexӦpdfindexһ򵥵Բֵ
-		return (offset + du) / Count();
-		//return Lerp(du, cdf[offset], cdf[offset + 1]);
+		//segment offset, at du along it. Rounding of offset + du can land
+		//on the start of the next segment, whose pdf may differ.
+		return std::min((offset + du) / Count(), NextFloatDown(Float(offset + 1) / Count()));
 	}
 
 	int Distribution1D::SampleDiscrete(Float u, Float* pdf, Float* uRemapped) const
 	{
-		int offset = FindInterval(cdf.size(), [&](int index) { return cdf[index] <= u; });
+		Float du;
+		int offset = SampleAliasTable(bins.data(), Count(), u, &du);
 
 		if (pdf != nullptr)
-		{
-			*pdf = funcInt != 0 ? func[offset] / funcInt : 0;
-		}
+			*pdf = DiscretePDF(offset);
 
 		if (uRemapped)
+			*uRemapped = du;
+
+		return offset;
+	}
+
+	Distribution2D::Distribution2D(const Float* f, int nu, int nv)
+		: nu(nu), nv(nv), func(f, f + (size_t)nu * nv), rowBins((size_t)nu * nv), rowInt(nv)
+	{
+		for (int v = 0; v < nv; ++v)
 		{
-			*uRemapped = u - cdf[offset];
-			if ((cdf[offset + 1] - cdf[offset]) > 0)
-				*uRemapped /= (cdf[offset + 1] - cdf[offset]);
+			const Float* row = &func[(size_t)v * nu];
+			Float c = 0;
+			for (int u = 0; u < nu; ++u)
+				c += row[u] / nu;
+			rowInt[v] = c;
+			BuildAliasTable(row, nu, &rowBins[(size_t)v * nu]);
 		}
 
-		return offset;
+		//պp(u|v)Ļ
+		//p(v)ҲֻnvԲp(v)һdistribution1dͿ
+		pdfMarginV.reset(new Distribution1D(rowInt.data(), nv));
 	}
 
 	Point2f Distribution2D::SampleContinuous(const Point2f& uv, Float* pdf) const
 	{
-		Float pdfs[2];
 		int vi = 0;
 		//Ȳv
-		//p(v) = f(ui, v~)v~ = floor(u.y * nv);
 		//vȷӦı߼
-		Float v = pdfMarginV->SampleContinuous(uv.y, &pdfs[1], &vi);
+		Float pdfV;
+		Float v = pdfMarginV->SampleContinuous(uv.y, &pdfV, &vi);
 
 		//p(u|v) = p(u,v)/p(v)
-		Float u = pdfUinV[vi]->SampleContinuous(uv.x, &pdfs[0]);
+		Float du;
+		size_t row = (size_t)vi * nu;
+		int ui = SampleAliasTable(&rowBins[row], nu, uv.x, &du);
+		Float pdfU = rowInt[vi] != 0 ? func[row + ui] / rowInt[vi] : 0;
 
-		*pdf = pdfs[0] * pdfs[1];
-		return Point2f(u, v);
+		*pdf = pdfU * pdfV;
+		return Point2f(std::min((ui + du) / nu, NextFloatDown(Float(ui + 1) / nu)), v);
 	}
 
 	Float Distribution2D::Pdf(const Point2f& u) const
 	{
-		int ui = Clamp(int(u.x * pdfUinV[0]->Count()), 0, pdfUinV[0]->Count() - 1);
-		int vi = Clamp(int(u.y * pdfMarginV->Count()), 0, pdfMarginV->Count() - 1);
+		int ui = Clamp(int(u.x * nu), 0, nu - 1);
+		int vi = Clamp(int(u.y * nv), 0, nv - 1);
 
 		//pdfMarginV->funcInt ൱Ļ
-		return pdfUinV[vi]->func[ui] / pdfMarginV->funcInt;
+		return pdfMarginV->funcInt != 0 ? func[(size_t)vi * nu + ui] / pdfMarginV->funcInt : 0;
+	}
+
+	void BenchmarkDistributionSampling()
+	{
+		const int nSamples = 1 << 22;
+		RNG rng;
+		std::vector<Point2f> us(nSamples);
+		for (Point2f& u : us)
+			u = Point2f(rng.UniformFloat(), rng.UniformFloat());
+
+		for (int width = 1024; width <= 16384; width *= 2)
+		{
+			//sky, darker ground, noise and a small sun, weighted by
+			//sin(theta) like the map of InfiniteAreaLight
+			int height = width / 2;
+			std::vector<Float> img((size_t)width * height);
+			for (int v = 0; v < height; ++v)
+			{
+				Float theta = Pi * (v + .5f) / height, sinTheta = std::sin(theta);
+				for (int u = 0; u < width; ++u)
+				{
+					Float du = Float(u) / width - 0.3f, dv = Float(v) / height - 0.25f;
+					Float sun = 5000 * std::exp(-(du * du + dv * dv) * 20000);
+					Float sky = v < height / 2 ? 1.2f : 0.3f;
+					img[(size_t)v * width + u] = (sky + 0.3f * rng.UniformFloat() + sun) * sinTheta;
+				}
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			Distribution2D distrib(img.data(), width, height);
+			std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+
+			double sum = 0;
+			start = std::chrono::steady_clock::now();
+			for (const Point2f& u : us)
+			{
+				Float pdf;
+				Point2f p = distrib.SampleContinuous(u, &pdf);
+				sum += p.x + pdf;
+			}
+			std::chrono::duration<double> sampleTime = std::chrono::steady_clock::now() - start;
+			Log::Info("Distribution2D {}x{}: built in {:.3f}s, {:.1f} M samples/s (checksum {:.3g})",
+				width, height, buildTime.count(), nSamples / sampleTime.count() * 1e-6, sum);
+		}
+
+		std::vector<Float> power(4096);
+		for (Float& p : power)
+			p = rng.UniformFloat() * rng.UniformFloat();
+		Distribution1D lights(power.data(), (int)power.size());
+		int64_t indexSum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const Point2f& u : us)
+		{
+			Float pdf;
+			indexSum += lights.SampleDiscrete(u.x, &pdf);
+		}
+		std::chrono::duration<double> sampleTime = std::chrono::steady_clock::now() - start;
+		Log::Info("Distribution1D of {} lights: {:.1f} M samples/s (checksum {})",
+			power.size(), nSamples / sampleTime.count() * 1e-6, indexSum);
 	}
 }
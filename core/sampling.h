@@ -7,13 +7,42 @@
 
 namespace AIR
 {
+	//one bin of an alias table: u lands in a bin with probability 1/n,
+	//the bin keeps its own index with probability q and gives alias
+	//otherwise (Vose's method)
+	struct AliasBin
+	{
+		Float q;
+		int alias;
+	};
+
+	//fills the n bins for the values f, which need not be normalized.
+	//An all zero f is sampled uniformly.
+	void BuildAliasTable(const Float* f, int n, AliasBin* bins);
+
+	//O(1) pick of a bin index, uRemapped is u rescaled to [0, 1) within
+	//the share of the picked index
+	inline int SampleAliasTable(const AliasBin* bins, int n, Float u, Float* uRemapped)
+	{
+		Float un = u * n;
+		int i = std::min((int)un, n - 1);
+		Float up = std::min(un - i, OneMinusEpsilon);
+		if (up < bins[i].q)
+		{
+			*uRemapped = std::min(up / bins[i].q, OneMinusEpsilon);
+			return i;
+		}
+		*uRemapped = std::min((up - bins[i].q) / (1 - bins[i].q), OneMinusEpsilon);
+		return bins[i].alias;
+	}
+
 	struct Distribution1D
 	{
 		//f 分段函数每段的值
 		//n 分段函数的长度，即有多少段
 		//每段的长度相等
 		Distribution1D(const Float* f, int n) : func(f, f + n)
-			, cdf(n + 1)
+			, bins(n)
 		{
 			//计算func的积分
 			//c = ∫f(x)dx = ∑[0,N-1]f(xi)Δ
@@ -24,23 +53,16 @@ namespace AIR
 			{
 				c += func[i] / n;
 			}
+			funcInt = c;
 
-			//计算cdf
 			//pdf p(x)的积分是1，所以p(x) = f(x)/c
-			cdf[0] = 0;
-			Float inverseC = 1.0f / c;
-			for (int i = 1; i < n + 1; ++i)
-			{
-				cdf[i] = cdf[i - 1] + func[i] * inverseC / n;
-			}
-			funcInt = cdf[n];
+			BuildAliasTable(f, n, bins.data());
 		}
 
 		//采样对应的随机变量
-		//先求u落在哪个cdf上
-		//然后根据该cdf的斜率求出对应的值
-		//off 第几个cdf
-		//return u在cdf中的反函数对应的随机变量
+		//the segment is picked by the alias table, the position inside it
+		//is the remapped u
+		//off 第几段
 		Float SampleContinuous(Float u, Float* pdf, int* off = nullptr) const;
 
 		//采样离散的随机
@@ -58,9 +80,8 @@ namespace AIR
 
 		//分段函数，每一段的函数值是一个常数
 		std::vector<Float> func;
-		//分段函数对应的概率累积函数
-		//从0开始，到最后是1，所以cdf的长度是func.size + 1
-		std::vector<Float> cdf;
+		//alias table over the segments
+		std::vector<AliasBin> bins;
 
 		//分段函数的积分
 		Float funcInt;
@@ -69,28 +90,13 @@ namespace AIR
 	//把这个Distribution2D理解成一个函数f(x,y)
 	//那么他的概率密度函数是p(x,y)服从均匀分布
 	//f(x,y)的积分是If
+	//The rows are not separate Distribution1Ds: their values and alias
+	//tables are stored back to back, row v at v * nu.
 	struct Distribution2D
 	{
 		//func 2D函数
 		//nu nv 长度
-		Distribution2D(const Float* func, int nu, int nv)
-		{
-
-			for (int v = 0; v < nv; ++v)
-			{
-				pdfUinV.emplace_back(new Distribution1D(&func[v * nu], nu));
-			}
-
-			//p(v) = ∫[0, v]p(u, v)du = 1 / nu * ∑[0, nu - 1]f(ui, v) / If
-			//刚好是p(u|v)的积分
-			//由于p(v)也是只有nv个，所以采样p(v)用一个distribution1d就可以了
-			std::vector<Float> marginalFunc;
-			for (int v = 0; v < nv; ++v)
-			{
-				marginalFunc.push_back(pdfUinV[v]->funcInt);
-			}
-			pdfMarginV.reset(new Distribution1D(&marginalFunc[0], nv));
-		}
+		Distribution2D(const Float* func, int nu, int nv);
 
 		//返回均匀随机变量u对应的真正的随机变量
 		//均匀随机变量的pdf转成distribution的pdf
@@ -99,15 +105,24 @@ namespace AIR
 		//返回随机变量u的pdf
 		Float Pdf(const Point2f& u) const;
 
-		//可以理解成nv个关于v的分段函数
-		//严格来说并不是pdf函数，后面要改命名
-		//每个分段函数有nu个变量，那么pdfUinV包含了f[ui, vi]的所有数值
-		std::vector<std::unique_ptr<Distribution1D>> pdfUinV;
+		const int nu, nv;
+		//f[ui, vi] of all rows
+		std::vector<Float> func;
+		//the alias tables of p(u|v), one per row
+		std::vector<AliasBin> rowBins;
+		//∫f(u, v)du of every row
+		std::vector<Float> rowInt;
 
+		//p(v) = ∫[0, v]p(u, v)du = 1 / nu * ∑[0, nu - 1]f(ui, v) / If
 		//v的边际函数，注意不是概率密度，而是v确定下，每个u的积分
 		std::unique_ptr<Distribution1D> pdfMarginV;
 	};
 
+	//builds Distribution2Ds of synthetic environment maps from 1K to 16K
+	//wide and a Distribution1D over 4096 lights, and logs their build
+	//time and samples per second
+	void BenchmarkDistributionSampling();
+
 	//均匀采样单位半球上的立体角
 	//u 0-1的随机变量
 	inline Vector3f UniformSampleHemisphere(const Point2f& u)
@@ -257,6 +272,11 @@ namespace AIR
 		return Vector3f(rphi.x, rphi.y, z);
 	}
 
+	inline Float CosineHemispherePdf(Float cosTheta)
+	{
+		return cosTheta * InvPi;
+	}
+
 	//采样三角形上的一点
 	//u 0-1的均匀随机变量
 	//三角形的重心坐标是u,v,w，由于w = 1 - u -v
@@ -283,6 +303,15 @@ namespace AIR
 	//单位球条带面积：2πsinθdθ
 	//cone的面积：∫[0,θmax]2πsinθdθ = 2π(1 - cosθmax)
 	//所以cone上的p(ω) = 1 / (2π(1 - cosθmax))
+	//a direction in the cone around +z, uniform over its solid angle
+	inline Vector3f UniformSampleCone(const Point2f& u, Float cosThetaMax)
+	{
+		Float cosTheta = (1.0f - u.x) + u.x * cosThetaMax;
+		Float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		Float phi = u.y * 2.0f * Pi;
+		return Vector3f(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+	}
+
 	inline Float UniformConePdf(Float cosThetaMax)
 	{
 		return 1.0f / (Pi * 2.0f * (1.0f - cosThetaMax));
@@ -1,5 +1,7 @@
 #include "scene.h"
 #include "robject.h"
+#include "interaction.h"
+#include "light.h"
 
 namespace AIR
 {
@@ -7,6 +9,14 @@ namespace AIR
 		: aggregate(accel), lights(lights)
 	{
 		worldBound = aggregate->WorldBound();
+		for (size_t i = 0; i < lights.size(); ++i)
+			lights[i]->sceneIndex = (int)i;
+	}
+
+	void Scene::Refit()
+	{
+		aggregate->Refit();
+		worldBound = aggregate->WorldBound();
 	}
 
 	bool Scene::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
@@ -21,6 +31,102 @@ namespace AIR
 		return aggregate->IntersectP(ray);
 	}
 
+	//last occluder of every light of occluderScene on this thread
+	static thread_local const Scene* occluderScene = nullptr;
+	static thread_local std::vector<int> lastOccluders;
+
+	bool Scene::IntersectP(const Ray& ray, const Light& light) const {
+		//a light shared with a scene that listed it elsewhere has no slot here
+		const int slot = light.sceneIndex;
+		if (slot < 0 || slot >= (int)lights.size() || lights[slot].get() != &light)
+			return aggregate->IntersectP(ray);
+		//the ids belong to one aggregate, a stale one only costs a test
+		if (occluderScene != this || lastOccluders.size() != lights.size())
+		{
+			occluderScene = this;
+			lastOccluders.assign(lights.size(), -1);
+		}
+		return aggregate->IntersectPOccluder(ray, &lastOccluders[slot]);
+	}
+
+	//indices of the rays sorted by the octant of their direction, rays of
+	//one octant share the near and far planes of every node
+	static std::vector<int> SortByOctant(const Ray* rays, int n)
+	{
+		auto octant = [&](int i) {
+			return (rays[i].d.x < 0) | ((rays[i].d.y < 0) << 1) | ((rays[i].d.z < 0) << 2);
+		};
+		int start[9] = { 0 };
+		for (int i = 0; i < n; ++i)
+			++start[octant(i) + 1];
+		for (int o = 0; o < 8; ++o)
+			start[o + 1] += start[o];
+		std::vector<int> order(n);
+		for (int i = 0; i < n; ++i)
+			order[start[octant(i)]++] = i;
+		return order;
+	}
+
+	void Scene::IntersectStream(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		if (n <= kMaxRayPacketSize)
+		{
+			aggregate->IntersectPacket(rays, n, isects, hits);
+			return;
+		}
+		std::vector<int> order = SortByOctant(rays, n);
+		for (int first = 0; first < n; first += kMaxRayPacketSize)
+		{
+			int count = std::min(kMaxRayPacketSize, n - first);
+			Ray packet[kMaxRayPacketSize];
+			SurfaceInteraction packetIsects[kMaxRayPacketSize];
+			bool packetHits[kMaxRayPacketSize];
+			for (int i = 0; i < count; ++i)
+				packet[i] = rays[order[first + i]];
+			aggregate->IntersectPacket(packet, count, packetIsects, packetHits);
+			for (int i = 0; i < count; ++i)
+			{
+				const int r = order[first + i];
+				rays[r].tMax = packet[i].tMax;
+				hits[r] = packetHits[i];
+				if (packetHits[i])
+					isects[r] = packetIsects[i];
+			}
+		}
+	}
+
+	void Scene::IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		for (int first = 0; first < n; first += kMaxRayPacketSize)
+		{
+			aggregate->IntersectInterleaved(rays + first, std::min(kMaxRayPacketSize, n - first),
+				isects + first, hits + first);
+		}
+	}
+
+	void Scene::IntersectPStream(const Ray* rays, int n, bool* occluded) const
+	{
+		if (n <= kMaxRayPacketSize)
+		{
+			aggregate->IntersectPPacket(rays, n, occluded);
+			return;
+		}
+		std::vector<int> order = SortByOctant(rays, n);
+		for (int first = 0; first < n; first += kMaxRayPacketSize)
+		{
+			int count = std::min(kMaxRayPacketSize, n - first);
+			Ray packet[kMaxRayPacketSize];
+			bool packetOccluded[kMaxRayPacketSize];
+			for (int i = 0; i < count; ++i)
+				packet[i] = rays[order[first + i]];
+			aggregate->IntersectPPacket(packet, count, packetOccluded);
+			for (int i = 0; i < count; ++i)
+				occluded[order[first + i]] = packetOccluded[i];
+		}
+	}
+
 	bool Scene::IntersectTr(Ray ray, Sampler& sampler, SurfaceInteraction* isect,
 		Spectrum* Tr) const {
 		*Tr = Spectrum(1.f);
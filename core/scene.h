@@ -21,9 +21,50 @@ namespace AIR
 
 		bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
 		bool IntersectP(const Ray& ray) const;
+		//shadow ray toward light: the primitive that last occluded a ray
+		//toward the same light on this thread is tested first
+		bool IntersectP(const Ray& ray, const Light& light) const;
 		bool IntersectTr(Ray ray, Sampler& sampler, SurfaceInteraction* isect,
 			Spectrum* transmittance) const;
 
+		//coherent packets, e.g. the camera rays of a pixel block or the
+		//shadow rays toward one point light
+		void Intersect4(const Ray rays[4], SurfaceInteraction isects[4], bool hits[4]) const
+		{
+			IntersectStream(rays, 4, isects, hits);
+		}
+		void Intersect8(const Ray rays[8], SurfaceInteraction isects[8], bool hits[8]) const
+		{
+			IntersectStream(rays, 8, isects, hits);
+		}
+		void Intersect16(const Ray rays[16], SurfaceInteraction isects[16], bool hits[16]) const
+		{
+			IntersectStream(rays, 16, isects, hits);
+		}
+		void IntersectP4(const Ray rays[4], bool occluded[4]) const
+		{
+			IntersectPStream(rays, 4, occluded);
+		}
+		void IntersectP8(const Ray rays[8], bool occluded[8]) const
+		{
+			IntersectPStream(rays, 8, occluded);
+		}
+		void IntersectP16(const Ray rays[16], bool occluded[16]) const
+		{
+			IntersectPStream(rays, 16, occluded);
+		}
+		//any number of rays, longer streams are grouped by direction octant
+		//and traced in packets of kMaxRayPacketSize
+		void IntersectStream(const Ray* rays, int n, SurfaceInteraction* isects, bool* hits) const;
+		void IntersectPStream(const Ray* rays, int n, bool* occluded) const;
+		//any number of incoherent rays, traced in batches of
+		//kMaxRayPacketSize whose traversals are interleaved
+		void IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+			bool* hits) const;
+		//call after moving transforms between frames, the aggregate is
+		//refit instead of built again
+		void Refit();
+
 		std::vector<std::shared_ptr<Light>> lights;
 	private:
 		std::shared_ptr<Primitive> aggregate;
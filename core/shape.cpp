@@ -1,7 +1,13 @@
 ﻿#include "shape.h"
+#include "transform.h"
 
 namespace AIR
 {
+    Bounds3f Shape::WorldBound() const
+    {
+        return mTransform->ObjectToWorldBound(ObjectBound());
+    }
+
     Interaction Shape::Sample(const Interaction& ref, const Point2f& u,
 		Float* pdf) const
 	{
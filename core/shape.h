@@ -26,6 +26,16 @@ namespace AIR
 
 		virtual Bounds3f ObjectBound() const = 0;
 
+		virtual Bounds3f WorldBound() const;
+
+		//cone around w, of half angle acos(cosTheta), that holds the
+		//normals of the points Sample returns. Any direction by default.
+		virtual void NormalBounds(Vector3f* w, Float* cosTheta) const
+		{
+			*w = Vector3f(0, 0, 1);
+			*cosTheta = -1;
+		}
+
 		//ظshape
 		virtual Float Area() const = 0;
 
@@ -1,9 +1,18 @@
 #include "stat.h"
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
 
 namespace AIR
 {
 
     thread_local uint64_t ProfilerState;
+    thread_local TraversalCounters g_traversalCounters;
+    bool g_countTraversal = false;
 std::vector<std::function<void(StatsAccumulator&)>>* StatRegisterer::funcs;
 static StatsAccumulator statsAccumulator;
 
@@ -20,4 +29,174 @@ void StatRegisterer::CallCallbacks(StatsAccumulator& accum)
         func(accum);
 }
 
+void PrintStats(FILE* dest)
+{
+    statsAccumulator.Print(dest);
+}
+
+static void GetCategoryAndTitle(const std::string& name, std::string* category,
+    std::string* title)
+{
+    size_t slash = name.find('/');
+    if (slash == std::string::npos)
+        *title = name;
+    else
+    {
+        *category = name.substr(0, slash);
+        *title = name.substr(slash + 1);
+    }
+}
+
+void StatsAccumulator::Print(FILE* dest)
+{
+    std::map<std::string, std::vector<std::string>> toPrint;
+    char line[256];
+    std::string category, title;
+    for (auto& counter : counters)
+    {
+        if (counter.second == 0)
+            continue;
+        GetCategoryAndTitle(counter.first, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12lld", title.c_str(), (long long)counter.second);
+        toPrint[category].push_back(line);
+    }
+    for (auto& counter : memoryCounters)
+    {
+        if (counter.second == 0)
+            continue;
+        GetCategoryAndTitle(counter.first, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12.2f MiB", title.c_str(),
+            counter.second / (1024.0 * 1024.0));
+        toPrint[category].push_back(line);
+    }
+    for (auto& distribution : intDistributionSums)
+    {
+        const std::string& name = distribution.first;
+        int64_t count = intDistributionCounts[name];
+        if (count == 0)
+            continue;
+        GetCategoryAndTitle(name, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12.3f avg [range %lld - %lld]", title.c_str(),
+            (double)distribution.second / count, (long long)intDistributionMins[name],
+            (long long)intDistributionMaxs[name]);
+        toPrint[category].push_back(line);
+    }
+    for (auto& distribution : floatDistributionSums)
+    {
+        const std::string& name = distribution.first;
+        int64_t count = floatDistributionCounts[name];
+        if (count == 0)
+            continue;
+        GetCategoryAndTitle(name, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12.3f avg [range %f - %f]", title.c_str(),
+            distribution.second / count, floatDistributionMins[name],
+            floatDistributionMaxs[name]);
+        toPrint[category].push_back(line);
+    }
+    for (auto& percentage : percentages)
+    {
+        if (percentage.second.second == 0)
+            continue;
+        GetCategoryAndTitle(percentage.first, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12lld / %12lld (%.2f%%)", title.c_str(),
+            (long long)percentage.second.first, (long long)percentage.second.second,
+            100.0 * percentage.second.first / percentage.second.second);
+        toPrint[category].push_back(line);
+    }
+    for (auto& ratio : ratios)
+    {
+        if (ratio.second.second == 0)
+            continue;
+        GetCategoryAndTitle(ratio.first, &category, &title);
+        snprintf(line, sizeof(line), "%-42s %12lld / %12lld (%.2fx)", title.c_str(),
+            (long long)ratio.second.first, (long long)ratio.second.second,
+            (double)ratio.second.first / ratio.second.second);
+        toPrint[category].push_back(line);
+    }
+
+    fprintf(dest, "Statistics:\n");
+    for (auto& categoryLines : toPrint)
+    {
+        fprintf(dest, "  %s\n", categoryLines.first.c_str());
+        for (const std::string& categoryLine : categoryLines.second)
+            fprintf(dest, "    %s\n", categoryLine.c_str());
+    }
+}
+
+//ids instead of addresses, a counter may reuse the address of a
+//destroyed one
+static std::atomic<int> nextCacheMissCounterId(1);
+static thread_local int attachedCacheMissCounterId = 0;
+
+CacheMissCounter::CacheMissCounter()
+    : id(nextCacheMissCounterId++), failed(false)
+{
+}
+
+CacheMissCounter::~CacheMissCounter()
+{
+#if defined(__linux__)
+    for (int fd : fds)
+        close(fd);
+#endif
+}
+
+void CacheMissCounter::Attach()
+{
+    if (attachedCacheMissCounterId == id)
+        return;
+    attachedCacheMissCounterId = id;
+#if defined(__linux__)
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    //this thread on any cpu
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+    {
+        failed = true;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    fds.push_back(fd);
+#else
+    failed = true;
+#endif
+}
+
+int64_t CacheMissCounter::Read() const
+{
+    int64_t sum = 0;
+#if defined(__linux__)
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int fd : fds)
+    {
+        int64_t count;
+        if (read(fd, &count, sizeof(count)) == sizeof(count))
+            sum += count;
+    }
+#endif
+    return sum;
+}
+
+void StatsAccumulator::Clear()
+{
+    counters.clear();
+    memoryCounters.clear();
+    intDistributionSums.clear();
+    intDistributionCounts.clear();
+    intDistributionMins.clear();
+    intDistributionMaxs.clear();
+    floatDistributionSums.clear();
+    floatDistributionCounts.clear();
+    floatDistributionMins.clear();
+    floatDistributionMaxs.clear();
+    percentages.clear();
+    ratios.clear();
+}
+
 }
@@ -7,6 +7,8 @@
 #include <functional>
 #include <mutex>
 #include <algorithm>
+#include <cstdio>
+#include <atomic>
 
 namespace AIR
 {
@@ -31,6 +33,47 @@ namespace AIR
 	};
 
 void ReportThreadStats();
+//prints what ReportThreadStats merged, grouped by the category before the
+//'/' of the titles
+void PrintStats(FILE* dest);
+
+	//work of the accelerator traversals on this thread, the integrator
+	//reads it around every camera sample for the traversal cost images
+	struct TraversalCounters
+	{
+		int64_t nodesVisited = 0;
+		int64_t primitivesTested = 0;
+	};
+	extern thread_local TraversalCounters g_traversalCounters;
+	//the counters are only kept while g_countTraversal is set, otherwise
+	//the traversal loops pay a predictable branch on a plain global
+	//instead of a thread local access at every node
+	extern bool g_countTraversal;
+#define COUNT_TRAVERSAL(counter, n)                  \
+    do {                                             \
+        if (g_countTraversal)                        \
+            g_traversalCounters.counter += (n);      \
+    } while (0)
+
+	//hardware cache misses through perf_event_open, linux only. A thread
+	//is counted from its first Attach on, Read sums the attached threads.
+	//Supported is false when a counter could not be opened, e.g. without
+	//perf access or in a VM that hides the counters.
+	class CacheMissCounter
+	{
+	public:
+		CacheMissCounter();
+		~CacheMissCounter();
+		void Attach();
+		bool Supported() const { return !failed; }
+		int64_t Read() const;
+
+	private:
+		int id;
+		mutable std::mutex mutex;
+		std::vector<int> fds;
+		std::atomic<bool> failed;
+	};
 
 	class StatsAccumulator {
 	public:
@@ -7,10 +7,8 @@ namespace AIR
 {
 	void Transform::SetPosition(const Vector3f& position)
 	{
-		mat.SetTranslation(position);
-		matInv = Matrix4x4::Inverse(mat);
 		mPosition = position;
-		mMatrixDirty = true;
+		UpdateMatrix();
 	}
 
 	void Transform::SetScale(const Vector3f& scale)
@@ -29,39 +27,32 @@ namespace AIR
 		//mat._M[2][2] = z.z;
 		//matInv = Matrix4x4::Inverse(mat);
 		mScale = scale;
-		mMatrixDirty = true;
+		UpdateMatrix();
 	}
 
 	void Transform::SetRotation(const Quaternion& rotation)
 	{
 		mRotation = rotation;
-		mMatrixDirty = true;
+		UpdateMatrix();
+	}
+
+	void Transform::UpdateMatrix()
+	{
+		//M = T * R * S, the same order the lazy WorldToLocal used to cache
+		Matrix4x4 scale = Matrix4x4::GetScaleMatrix(mScale);
+		Matrix4x4 rotation = mRotation.ToMatrix();
+		mat = Matrix4x4::Mul(rotation, scale);
+		mat.SetTranslation(mPosition);
+		matInv = Matrix4x4::Inverse(mat);
 	}
 
 	const Matrix4x4& Transform::LocalToWorld() const
 	{
-		if (mMatrixDirty)
-		{
-			Matrix4x4 scale = Matrix4x4::GetScaleMatrix(mScale);
-			Matrix4x4 rotation = mRotation.ToMatrix();
-			mat = Matrix4x4::Mul(scale, rotation);
-			mat.SetTranslation(mPosition);
-			matInv = Matrix4x4::Inverse(mat);
-		}
 		return mat;
 	}
 
 	const Matrix4x4& Transform::WorldToLocal() const
 	{
-		if (mMatrixDirty)
-		{
-			Matrix4x4 scale = Matrix4x4::GetScaleMatrix(mScale);
-			Matrix4x4 rotation = mRotation.ToMatrix();
-			mat = Matrix4x4::Mul(rotation, scale);
-			mat.SetTranslation(mPosition);
-			matInv = Matrix4x4::Inverse(mat);
-			mMatrixDirty = false;
-		}
 		return matInv;
 	}
 
@@ -201,8 +192,9 @@ namespace AIR
 		const Matrix4x4& localToWorld = LocalToWorld();
 		SurfaceInteraction ret;
 		ret.interactPoint = TransformPoint(localToWorld, isect.interactPoint, isect.pError, &ret.pError);
-		ret.normal = ObjectToWorldNormal(isect.normal);
-		ret.wo = TransformVector(localToWorld, isect.wo);
+		//a scale changes the lengths of the normal and wo
+		ret.normal = Vector3f::Normalize(ObjectToWorldNormal(isect.normal));
+		ret.wo = Vector3f::Normalize(TransformVector(localToWorld, isect.wo));
 		ret.time = isect.time;
 		ret.uv = isect.uv;
 		ret.shape = isect.shape;
@@ -225,6 +217,7 @@ namespace AIR
 		ret.shading.dndv = TransformVector(localToWorld, isect.shading.dndv);
 		ret.primitive = isect.primitive;
 		ret.bsdf = isect.bsdf;
+		ret.mediumInterface = isect.mediumInterface;
 
 		return ret;
 	}
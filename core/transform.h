@@ -11,15 +11,16 @@ namespace AIR
 	{
 	public:
 
-		Transform() : mMatrixDirty(true)
+		Transform()
 		{
 			mScale = Vector3f::one;
+			UpdateMatrix();
 		}
 
 		Transform(const Vector3f& position, const Quaternion& rotation, const Vector3f& scale) : 
-			mPosition(position), mRotation(rotation), mScale(scale), mMatrixDirty(true)
+			mPosition(position), mRotation(rotation), mScale(scale)
 		{
-
+			UpdateMatrix();
 		}
 
 		void SetPosition(const Vector3f& position);
@@ -91,14 +92,18 @@ namespace AIR
 		Vector3f TransformPoint(const Matrix4x4& mat, const Vector3f& point, Vector3f* absError = nullptr) const;
 		Vector3f TransformPoint(const Matrix4x4& mat, const Vector3f& point, const Vector3f& ptError, Vector3f* absError = nullptr) const;
 		Vector3f TransformVector(const Matrix4x4& mat, const Vector3f& vec, Vector3f* absError = nullptr) const;
+
+		//matrices are rebuilt eagerly whenever position, rotation or scale changes,
+		//so LocalToWorld/WorldToLocal are plain reads and safe to call from
+		//several render threads at the same time.
+		void UpdateMatrix();
 	private:
 		Vector3f mPosition;
 		Vector3f mScale;
 		Quaternion mRotation;
 
-		mutable Matrix4x4 mat;
-		mutable Matrix4x4 matInv;
-		mutable bool mMatrixDirty;
+		Matrix4x4 mat;
+		Matrix4x4 matInv;
 	};
 };
 
@@ -0,0 +1,778 @@
+#include "bdptintegrator.h"
+#include "scene.h"
+#include "light.h"
+#include "interaction.h"
+#include "bsdf.h"
+#include "film.h"
+#include "robject.h"
+#include "sampling.h"
+#include "parallelism.h"
+#include "log.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
+
+namespace AIR
+{
+	//index of every light of the scene in the light power distribution
+	typedef std::unordered_map<const Light*, size_t> LightIndexMap;
+
+	//the end of a subpath on the camera or on a light. Rays that leave the
+	//scene end on a light vertex without a light, for the infinite lights.
+	struct EndpointInteraction : Interaction
+	{
+		union
+		{
+			const Camera* camera;
+			const Light* light;
+		};
+
+		EndpointInteraction() : Interaction(), light(nullptr) {}
+		EndpointInteraction(const Interaction& it, const Camera* camera)
+			: Interaction(it), camera(camera) {}
+		EndpointInteraction(const Camera* camera, const Ray& ray)
+			: Interaction(ray.o, ray.time, ray.medium), camera(camera) {}
+		EndpointInteraction(const Light* light, const Ray& r, const Vector3f& nl)
+			: Interaction(r.o, r.time, r.medium), light(light)
+		{
+			normal = nl;
+		}
+		EndpointInteraction(const Interaction& it, const Light* light)
+			: Interaction(it), light(light) {}
+		EndpointInteraction(const Ray& ray)
+			: Interaction(ray(1), ray.time, ray.medium), light(nullptr)
+		{
+			normal = -ray.d;
+		}
+	};
+
+	//sets *target to value until it goes out of scope, MISWeight uses it
+	//to evaluate the pdfs of a strategy on the shared subpaths
+	template <typename Type>
+	class ScopedAssignment
+	{
+	public:
+		ScopedAssignment(Type* target = nullptr, Type value = Type())
+			: target(target)
+		{
+			if (target)
+			{
+				backup = *target;
+				*target = value;
+			}
+		}
+		~ScopedAssignment()
+		{
+			if (target)
+				*target = backup;
+		}
+		ScopedAssignment(const ScopedAssignment&) = delete;
+		ScopedAssignment& operator=(const ScopedAssignment&) = delete;
+		ScopedAssignment& operator=(ScopedAssignment&& other)
+		{
+			if (target)
+				*target = backup;
+			target = other.target;
+			backup = other.backup;
+			other.target = nullptr;
+			return *this;
+		}
+
+	private:
+		Type* target;
+		Type backup;
+	};
+
+	//the BSDF is evaluated with shading normals, which breaks the symmetry
+	//of the adjoint BSDF when importance is transported, Veach (5.17)
+	static Float CorrectShadingNormal(const SurfaceInteraction& isect,
+		const Vector3f& wo, const Vector3f& wi, TransportMode mode)
+	{
+		if (mode != TransportMode::Importance)
+			return 1;
+		Float num = Vector3f::AbsDot(wo, isect.shading.n) * Vector3f::AbsDot(wi, isect.normal);
+		Float denom = Vector3f::AbsDot(wo, isect.normal) * Vector3f::AbsDot(wi, isect.shading.n);
+		return denom == 0 ? 0 : num / denom;
+	}
+
+	//solid angle density of the infinite lights toward -w, weighted by
+	//their probability to be picked
+	static Float InfiniteLightDensity(const Scene& scene, const Distribution1D& lightDistr,
+		const LightIndexMap& lightToIndex, const Vector3f& w)
+	{
+		Float pdf = 0;
+		for (const auto& light : scene.lights)
+		{
+			if (!(light->flags & (int)LightFlags::Infinite))
+				continue;
+			size_t index = lightToIndex.find(light.get())->second;
+			pdf += light->Pdf_Li(Interaction(), -w) * lightDistr.func[index];
+		}
+		return pdf / (lightDistr.funcInt * lightDistr.Count());
+	}
+
+	enum class VertexType { Camera, Light, Surface, Medium };
+
+	//a vertex of a subpath. pdfFwd is the area density of the vertex as the
+	//subpath sampled it, pdfRev the one it would have if the path had been
+	//sampled from the other end, the MIS weights are ratios of the two.
+	struct Vertex
+	{
+		VertexType type;
+		//throughput from the start of the subpath up to the vertex
+		Spectrum beta;
+		union
+		{
+			EndpointInteraction ei;
+			MediumInteraction mi;
+			SurfaceInteraction si;
+		};
+		//sampled by a specular BSDF, nothing else can reach it
+		bool delta = false;
+		Float pdfFwd = 0, pdfRev = 0;
+
+		Vertex() : ei() {}
+		Vertex(VertexType type, const EndpointInteraction& ei, const Spectrum& beta)
+			: type(type), beta(beta), ei(ei) {}
+		Vertex(const SurfaceInteraction& si, const Spectrum& beta)
+			: type(VertexType::Surface), beta(beta), si(si) {}
+		Vertex(const MediumInteraction& mi, const Spectrum& beta)
+			: type(VertexType::Medium), beta(beta), mi(mi) {}
+		//the interactions hold no resources, the active union member is
+		//copied as raw bytes
+		Vertex(const Vertex& v)
+		{
+			memcpy((void*)this, &v, sizeof(Vertex));
+		}
+		Vertex& operator=(const Vertex& v)
+		{
+			memcpy((void*)this, &v, sizeof(Vertex));
+			return *this;
+		}
+		~Vertex() {}
+
+		static Vertex CreateCamera(const Camera* camera, const Ray& ray, const Spectrum& beta)
+		{
+			return Vertex(VertexType::Camera, EndpointInteraction(camera, ray), beta);
+		}
+		static Vertex CreateCamera(const Camera* camera, const Interaction& it, const Spectrum& beta)
+		{
+			return Vertex(VertexType::Camera, EndpointInteraction(it, camera), beta);
+		}
+		static Vertex CreateLight(const Light* light, const Ray& ray, const Vector3f& nLight,
+			const Spectrum& Le, Float pdf)
+		{
+			Vertex v(VertexType::Light, EndpointInteraction(light, ray, nLight), Le);
+			v.pdfFwd = pdf;
+			return v;
+		}
+		static Vertex CreateLight(const EndpointInteraction& ei, const Spectrum& beta, Float pdf)
+		{
+			Vertex v(VertexType::Light, ei, beta);
+			v.pdfFwd = pdf;
+			return v;
+		}
+		static Vertex CreateMedium(const MediumInteraction& mi, const Spectrum& beta, Float pdf,
+			const Vertex& prev)
+		{
+			Vertex v(mi, beta);
+			v.pdfFwd = prev.ConvertDensity(pdf, v);
+			return v;
+		}
+		static Vertex CreateSurface(const SurfaceInteraction& si, const Spectrum& beta, Float pdf,
+			const Vertex& prev)
+		{
+			Vertex v(si, beta);
+			v.pdfFwd = prev.ConvertDensity(pdf, v);
+			return v;
+		}
+
+		const Interaction& GetInteraction() const
+		{
+			switch (type)
+			{
+			case VertexType::Medium:
+				return mi;
+			case VertexType::Surface:
+				return si;
+			default:
+				return ei;
+			}
+		}
+		const Point3f& p() const
+		{
+			return GetInteraction().interactPoint;
+		}
+		Float time() const
+		{
+			return GetInteraction().time;
+		}
+		const Vector3f& ng() const
+		{
+			return GetInteraction().normal;
+		}
+		const Vector3f& ns() const
+		{
+			return type == VertexType::Surface ? si.shading.n : GetInteraction().normal;
+		}
+		bool IsOnSurface() const
+		{
+			return GetInteraction().IsSurfaceInteraction();
+		}
+
+		//BSDF or phase function toward next
+		Spectrum f(const Vertex& next, TransportMode mode) const
+		{
+			Vector3f wi = next.p() - p();
+			if (wi.LengthSquared() == 0)
+				return Spectrum(0.f);
+			wi = Vector3f::Normalize(wi);
+			switch (type)
+			{
+			case VertexType::Surface:
+				return si.bsdf->f(si.wo, wi) * CorrectShadingNormal(si, si.wo, wi, mode);
+			case VertexType::Medium:
+				return Spectrum(mi.phase->p(mi.wo, wi));
+			default:
+				return Spectrum(0.f);
+			}
+		}
+
+		//false for vertices a connection can't reach, perfectly specular
+		//surfaces and distant lights
+		bool IsConnectible() const
+		{
+			switch (type)
+			{
+			case VertexType::Medium:
+			case VertexType::Camera:
+				return true;
+			case VertexType::Light:
+				return (ei.light->flags & (int)LightFlags::DeltaDirection) == 0;
+			case VertexType::Surface:
+				return si.bsdf->NumComponents(BxDFType(BSDF_DIFFUSE | BSDF_GLOSSY |
+					BSDF_REFLECTION | BSDF_TRANSMISSION)) > 0;
+			}
+			return false;
+		}
+		bool IsLight() const
+		{
+			return type == VertexType::Light ||
+				(type == VertexType::Surface && si.primitive->GetAreaLight());
+		}
+		bool IsDeltaLight() const
+		{
+			return type == VertexType::Light && ei.light && ei.light->IsDeltaLight();
+		}
+		bool IsInfiniteLight() const
+		{
+			return type == VertexType::Light &&
+				(!ei.light || ei.light->flags & (int)LightFlags::Infinite ||
+					ei.light->flags & (int)LightFlags::DeltaDirection);
+		}
+
+		//radiance the light vertex emits toward v
+		Spectrum Le(const Scene& scene, const Vertex& v) const
+		{
+			if (!IsLight())
+				return Spectrum(0.f);
+			Vector3f w = v.p() - p();
+			if (w.LengthSquared() == 0)
+				return Spectrum(0.f);
+			w = Vector3f::Normalize(w);
+			if (IsInfiniteLight())
+			{
+				Spectrum Le(0.f);
+				for (const auto& light : scene.lights)
+				{
+					if (light->flags & (int)LightFlags::Infinite)
+						Le += light->LiEscape(RayDifferential(p(), -w));
+				}
+				return Le;
+			}
+			return si.primitive->GetAreaLight()->L(si, w);
+		}
+
+		//solid angle density to area density at next
+		Float ConvertDensity(Float pdf, const Vertex& next) const
+		{
+			if (next.IsInfiniteLight())
+				return pdf;
+			Vector3f w = next.p() - p();
+			if (w.LengthSquared() == 0)
+				return 0;
+			Float invDist2 = 1 / w.LengthSquared();
+			if (next.IsOnSurface())
+				pdf *= Vector3f::AbsDot(next.ng(), w * std::sqrt(invDist2));
+			return pdf * invDist2;
+		}
+
+		//area density of sampling next from this vertex, prev is the vertex
+		//the path came from (none for the camera)
+		Float Pdf(const Scene& scene, const Vertex* prev, const Vertex& next) const
+		{
+			if (type == VertexType::Light)
+				return PdfLight(scene, next);
+			Vector3f wn = next.p() - p();
+			if (wn.LengthSquared() == 0)
+				return 0;
+			wn = Vector3f::Normalize(wn);
+			Vector3f wp;
+			if (prev)
+			{
+				wp = prev->p() - p();
+				if (wp.LengthSquared() == 0)
+					return 0;
+				wp = Vector3f::Normalize(wp);
+			}
+
+			Float pdf = 0, unused;
+			if (type == VertexType::Camera)
+				ei.camera->Pdf_We(ei.SpawnRay(wn), &unused, &pdf);
+			else if (type == VertexType::Surface)
+				pdf = si.bsdf->Pdf(wp, wn);
+			else if (type == VertexType::Medium)
+				pdf = mi.phase->p(wp, wn);
+			return ConvertDensity(pdf, next);
+		}
+
+		//area density of a light vertex emitting toward v
+		Float PdfLight(const Scene& scene, const Vertex& v) const
+		{
+			Vector3f w = v.p() - p();
+			Float invDist2 = 1 / w.LengthSquared();
+			w *= std::sqrt(invDist2);
+			Float pdf;
+			if (IsInfiniteLight())
+			{
+				//the origin is uniform on a disk of the scene's bounding sphere
+				Point3f worldCenter;
+				Float worldRadius;
+				scene.WorldBound().BoundingSphere(&worldCenter, &worldRadius);
+				pdf = 1 / (Pi * worldRadius * worldRadius);
+			}
+			else
+			{
+				const Light* light = type == VertexType::Light ? ei.light : si.primitive->GetAreaLight();
+				Float pdfPos, pdfDir;
+				light->Pdf_Le(Ray(p(), w, Infinity, time()), ng(), &pdfPos, &pdfDir);
+				pdf = pdfDir * invDist2;
+			}
+			if (v.IsOnSurface())
+				pdf *= Vector3f::AbsDot(v.ng(), w);
+			return pdf;
+		}
+
+		//area density of the light vertex itself as the start of a light
+		//subpath, the light choice included
+		Float PdfLightOrigin(const Scene& scene, const Vertex& v, const Distribution1D& lightDistr,
+			const LightIndexMap& lightToIndex) const
+		{
+			Vector3f w = v.p() - p();
+			if (w.LengthSquared() == 0)
+				return 0;
+			w = Vector3f::Normalize(w);
+			if (IsInfiniteLight())
+				return InfiniteLightDensity(scene, lightDistr, lightToIndex, w);
+
+			const Light* light = type == VertexType::Light ? ei.light : si.primitive->GetAreaLight();
+			Float pdfChoice = lightDistr.DiscretePDF((int)lightToIndex.find(light)->second);
+			Float pdfPos, pdfDir;
+			light->Pdf_Le(Ray(p(), w, Infinity, time()), ng(), &pdfPos, &pdfDir);
+			return pdfPos * pdfChoice;
+		}
+	};
+
+	//generalized geometry term of the edge v0 v1, visibility included
+	static Spectrum G(const Scene& scene, Sampler& sampler, const Vertex& v0, const Vertex& v1)
+	{
+		Vector3f d = v0.p() - v1.p();
+		Float g = 1 / d.LengthSquared();
+		d *= std::sqrt(g);
+		if (v0.IsOnSurface())
+			g *= Vector3f::AbsDot(v0.ns(), d);
+		if (v1.IsOnSurface())
+			g *= Vector3f::AbsDot(v1.ns(), d);
+		VisibilityTester vis(v0.GetInteraction(), v1.GetInteraction());
+		return g * vis.Tr(scene, sampler);
+	}
+
+	//extends a subpath from ray, path[-1] is the vertex ray leaves from.
+	//pdf is the solid angle density ray was sampled with, mode tells
+	//whether radiance (camera subpaths) or importance (light subpaths)
+	//is carried. Returns the number of vertices added.
+	static int RandomWalk(const Scene& scene, RayDifferential ray, Sampler& sampler,
+		MemoryArena& arena, Spectrum beta, Float pdf, int maxDepth,
+		TransportMode mode, Vertex* path)
+	{
+		if (maxDepth == 0)
+			return 0;
+		int bounces = 0;
+		Float pdfFwd = pdf, pdfRev = 0;
+		while (true)
+		{
+			MediumInteraction mi;
+			SurfaceInteraction isect;
+			bool foundIntersection = scene.Intersect(ray, &isect);
+			if (ray.medium)
+				beta *= ray.medium->Sample(ray, sampler, arena, &mi);
+			if (beta.IsBlack())
+				break;
+			Vertex& vertex = path[bounces];
+			Vertex& prev = path[bounces - 1];
+
+			if (mi.IsValid())
+			{
+				vertex = Vertex::CreateMedium(mi, beta, pdfFwd, prev);
+				if (++bounces >= maxDepth)
+					break;
+				Vector3f wi;
+				pdfFwd = pdfRev = mi.phase->Sample_p(-ray.d, &wi, sampler.Get2D());
+				ray = mi.SpawnRay(wi);
+			}
+			else
+			{
+				if (!foundIntersection)
+				{
+					//an escaped camera ray ends on the infinite lights
+					if (mode == TransportMode::Radiance)
+					{
+						vertex = Vertex::CreateLight(EndpointInteraction(ray), beta, pdfFwd);
+						++bounces;
+					}
+					break;
+				}
+
+				isect.ComputeScatteringFunctions(ray, arena, true, mode);
+				//a medium boundary, go on through it
+				if (!isect.bsdf)
+				{
+					ray = isect.SpawnRay(ray.d);
+					continue;
+				}
+
+				vertex = Vertex::CreateSurface(isect, beta, pdfFwd, prev);
+				if (++bounces >= maxDepth)
+					break;
+
+				Vector3f wi, wo = isect.wo;
+				BxDFType type;
+				Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdfFwd,
+					BSDF_ALL, &type);
+				if (f.IsBlack() || pdfFwd == 0.f)
+					break;
+				beta *= f * Vector3f::AbsDot(wi, isect.shading.n) / pdfFwd;
+				pdfRev = isect.bsdf->Pdf(wi, wo, BSDF_ALL);
+				if (type & BSDF_SPECULAR)
+				{
+					vertex.delta = true;
+					pdfRev = pdfFwd = 0;
+				}
+				beta *= CorrectShadingNormal(isect, wo, wi, mode);
+				ray = isect.SpawnRay(wi);
+			}
+
+			prev.pdfRev = vertex.ConvertDensity(pdfRev, prev);
+		}
+		return bounces;
+	}
+
+	static int GenerateCameraSubpath(const Scene& scene, Sampler& sampler, MemoryArena& arena,
+		int maxDepth, const Camera& camera, const CameraSample& cameraSample, Vertex* path)
+	{
+		if (maxDepth == 0)
+			return 0;
+		RayDifferential ray;
+		Spectrum beta(camera.GenerateRayDifferential(cameraSample, &ray));
+		ray.ScaleDifferentials(1 / std::sqrt((Float)sampler.samplesPerPixel));
+
+		Float pdfPos, pdfDir;
+		path[0] = Vertex::CreateCamera(&camera, ray, beta);
+		camera.Pdf_We(ray, &pdfPos, &pdfDir);
+		return RandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
+			TransportMode::Radiance, path + 1) + 1;
+	}
+
+	static int GenerateLightSubpath(const Scene& scene, Sampler& sampler, MemoryArena& arena,
+		int maxDepth, Float time, const Distribution1D& lightDistr,
+		const LightIndexMap& lightToIndex, Vertex* path)
+	{
+		if (maxDepth == 0)
+			return 0;
+		Float lightPdf;
+		int lightNum = lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+		const std::shared_ptr<Light>& light = scene.lights[lightNum];
+
+		RayDifferential ray;
+		Vector3f nLight;
+		Float pdfPos, pdfDir;
+		Point2f u1 = sampler.Get2D();
+		Point2f u2 = sampler.Get2D();
+		Spectrum Le = light->Sample_Le(u1, u2, time, &ray, &nLight, &pdfPos, &pdfDir);
+		if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack())
+			return 0;
+
+		path[0] = Vertex::CreateLight(light.get(), ray, nLight, Le, pdfPos * lightPdf);
+		Spectrum beta = Le * Vector3f::AbsDot(nLight, ray.d) / (lightPdf * pdfPos * pdfDir);
+		int nVertices = RandomWalk(scene, ray, sampler, arena, beta, pdfDir, maxDepth - 1,
+			TransportMode::Importance, path + 1);
+
+		//the origin of an infinite light is on a disk, its density is the
+		//one of the direction and the next vertex gets the one of the origin
+		if (path[0].IsInfiniteLight())
+		{
+			if (nVertices > 0)
+			{
+				path[1].pdfFwd = pdfPos;
+				if (path[1].IsOnSurface())
+					path[1].pdfFwd *= Vector3f::AbsDot(ray.d, path[1].ng());
+			}
+			path[0].pdfFwd = InfiniteLightDensity(scene, lightDistr, lightToIndex, ray.d);
+		}
+		return nVertices + 1;
+	}
+
+	//balance heuristic weight of the strategy with s light and t camera
+	//vertices. sampled replaces the last vertex of the subpath that was
+	//sampled by the connection itself (s = 1 or t = 1).
+	static Float MISWeight(const Scene& scene, Vertex* lightVertices, Vertex* cameraVertices,
+		Vertex& sampled, int s, int t, const Distribution1D& lightDistr,
+		const LightIndexMap& lightToIndex)
+	{
+		if (s + t == 2)
+			return 1;
+		Float sumRi = 0;
+		//a delta pdf is stored as 0, it cancels in the ratios
+		auto remap0 = [](Float f) -> Float { return f != 0 ? f : 1; };
+
+		Vertex* qs = s > 0 ? &lightVertices[s - 1] : nullptr;
+		Vertex* pt = t > 0 ? &cameraVertices[t - 1] : nullptr;
+		Vertex* qsMinus = s > 1 ? &lightVertices[s - 2] : nullptr;
+		Vertex* ptMinus = t > 1 ? &cameraVertices[t - 2] : nullptr;
+
+		//the connection vertices and their neighbours get the reverse
+		//pdfs of this strategy for the duration of the call
+		ScopedAssignment<Vertex> a1;
+		if (s == 1)
+			a1 = { qs, sampled };
+		else if (t == 1)
+			a1 = { pt, sampled };
+
+		ScopedAssignment<bool> a2, a3;
+		if (pt)
+			a2 = { &pt->delta, false };
+		if (qs)
+			a3 = { &qs->delta, false };
+
+		ScopedAssignment<Float> a4;
+		if (pt)
+			a4 = { &pt->pdfRev, s > 0 ? qs->Pdf(scene, qsMinus, *pt) :
+				pt->PdfLightOrigin(scene, *ptMinus, lightDistr, lightToIndex) };
+		ScopedAssignment<Float> a5;
+		if (ptMinus)
+			a5 = { &ptMinus->pdfRev, s > 0 ? pt->Pdf(scene, qs, *ptMinus) :
+				pt->PdfLight(scene, *ptMinus) };
+		ScopedAssignment<Float> a6;
+		if (qs)
+			a6 = { &qs->pdfRev, pt->Pdf(scene, ptMinus, *qs) };
+		ScopedAssignment<Float> a7;
+		if (qsMinus)
+			a7 = { &qsMinus->pdfRev, qs->Pdf(scene, pt, *qsMinus) };
+
+		//the other strategies as ratios to this one, walking away from the
+		//connection along the camera subpath and then the light subpath
+		Float ri = 1;
+		for (int i = t - 1; i > 0; --i)
+		{
+			ri *= remap0(cameraVertices[i].pdfRev) / remap0(cameraVertices[i].pdfFwd);
+			if (!cameraVertices[i].delta && !cameraVertices[i - 1].delta)
+				sumRi += ri;
+		}
+		ri = 1;
+		for (int i = s - 1; i >= 0; --i)
+		{
+			ri *= remap0(lightVertices[i].pdfRev) / remap0(lightVertices[i].pdfFwd);
+			bool deltaLightVertex = i > 0 ? lightVertices[i - 1].delta :
+				lightVertices[0].IsDeltaLight();
+			if (!lightVertices[i].delta && !deltaLightVertex)
+				sumRi += ri;
+		}
+		return 1 / (1 + sumRi);
+	}
+
+	//contribution of the strategy with s light and t camera vertices,
+	//MIS weighted. pRaster receives the film position of the t = 1
+	//strategies.
+	static Spectrum ConnectBDPT(const Scene& scene, Vertex* lightVertices, Vertex* cameraVertices,
+		int s, int t, const Distribution1D& lightDistr, const LightIndexMap& lightToIndex,
+		const Camera& camera, Sampler& sampler, Point2f* pRaster)
+	{
+		Spectrum L(0.f);
+		//an escaped camera ray only connects as a whole path
+		if (t > 1 && s != 0 && cameraVertices[t - 1].type == VertexType::Light)
+			return Spectrum(0.f);
+
+		Vertex sampled;
+		if (s == 0)
+		{
+			//the camera subpath hit a light by itself
+			const Vertex& pt = cameraVertices[t - 1];
+			if (pt.IsLight())
+				L = pt.Le(scene, cameraVertices[t - 2]) * pt.beta;
+		}
+		else if (t == 1)
+		{
+			//a light vertex seen by the camera
+			const Vertex& qs = lightVertices[s - 1];
+			if (qs.IsConnectible())
+			{
+				VisibilityTester vis;
+				Vector3f wi;
+				Float pdf;
+				Spectrum Wi = camera.Sample_Wi(qs.GetInteraction(), sampler.Get2D(), &wi, &pdf,
+					pRaster, &vis);
+				if (pdf > 0 && !Wi.IsBlack())
+				{
+					sampled = Vertex::CreateCamera(&camera, vis.P1(), Wi / pdf);
+					L = qs.beta * qs.f(sampled, TransportMode::Importance) * sampled.beta;
+					if (qs.IsOnSurface())
+						L *= Vector3f::AbsDot(wi, qs.ns());
+					if (!L.IsBlack())
+						L *= vis.Tr(scene, sampler);
+				}
+			}
+		}
+		else if (s == 1)
+		{
+			//next event estimation, the light point is sampled anew
+			const Vertex& pt = cameraVertices[t - 1];
+			if (pt.IsConnectible())
+			{
+				Float lightPdf;
+				int lightNum = lightDistr.SampleDiscrete(sampler.Get1D(), &lightPdf);
+				const std::shared_ptr<Light>& light = scene.lights[lightNum];
+				VisibilityTester vis;
+				Vector3f wi;
+				Float pdf;
+				Spectrum lightWeight = light->Sample_Li(pt.GetInteraction(), sampler.Get2D(),
+					&wi, &pdf, &vis);
+				if (pdf > 0 && !lightWeight.IsBlack())
+				{
+					EndpointInteraction ei(vis.P1(), light.get());
+					sampled = Vertex::CreateLight(ei, lightWeight / (pdf * lightPdf), 0);
+					sampled.pdfFwd = sampled.PdfLightOrigin(scene, pt, lightDistr, lightToIndex);
+					L = pt.beta * pt.f(sampled, TransportMode::Radiance) * sampled.beta;
+					if (pt.IsOnSurface())
+						L *= Vector3f::AbsDot(wi, pt.ns());
+					if (!L.IsBlack())
+						L *= vis.Tr(scene, sampler);
+				}
+			}
+		}
+		else
+		{
+			const Vertex& qs = lightVertices[s - 1];
+			const Vertex& pt = cameraVertices[t - 1];
+			if (qs.IsConnectible() && pt.IsConnectible())
+			{
+				L = qs.beta * qs.f(pt, TransportMode::Importance) *
+					pt.f(qs, TransportMode::Radiance) * pt.beta;
+				if (!L.IsBlack())
+					L *= G(scene, sampler, qs, pt);
+			}
+		}
+
+		if (L.IsBlack())
+			return L;
+		return L * MISWeight(scene, lightVertices, cameraVertices, sampled, s, t,
+			lightDistr, lightToIndex);
+	}
+
+	void BDPTIntegrator::Render(const Scene& scene)
+	{
+		Film* film = camera->film;
+		if (scene.lights.empty())
+		{
+			Log::Warn("BDPT: the scene has no lights");
+			film->WriteImage();
+			return;
+		}
+
+		//light subpaths start on a light picked by power, there is no
+		//shading point yet to pick one for
+		std::unique_ptr<Distribution1D> lightDistr = ComputeLightPowerDistribution(scene);
+		LightIndexMap lightToIndex;
+		for (size_t i = 0; i < scene.lights.size(); ++i)
+			lightToIndex[scene.lights[i].get()] = i;
+
+		const int tileSize = 16;
+		const int64_t spp = sampler->samplesPerPixel;
+		std::vector<RenderTile> tiles = GenerateRenderTiles(film->GetOutputSampleBounds(),
+			tileSize, g_globalOptions.TileOrder);
+		std::atomic<int> nextTile(0);
+		std::atomic<int64_t> nSplats(0);
+		auto renderStart = std::chrono::steady_clock::now();
+
+		ParallelFor([&](int) {
+			MemoryArena arena;
+			int64_t threadSplats = 0;
+			for (int tileIndex = nextTile++; tileIndex < (int)tiles.size(); tileIndex = nextTile++)
+			{
+				const RenderTile& tile = tiles[tileIndex];
+				std::unique_ptr<Sampler> tileSampler = sampler->Clone(tile.seed);
+				std::unique_ptr<FilmTile> filmTile = film->GetFilmTile(tile.bounds);
+				for (Point2i pixel : tile.bounds)
+				{
+					tileSampler->StartPixel(pixel);
+					if (!InsideExclusive(pixel, pixelBounds))
+						continue;
+					do
+					{
+						CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+						Vertex* cameraVertices = arena.Alloc<Vertex>(maxDepth + 2);
+						Vertex* lightVertices = arena.Alloc<Vertex>(maxDepth + 1);
+						int nCamera = GenerateCameraSubpath(scene, *tileSampler, arena,
+							maxDepth + 2, *camera, cameraSample, cameraVertices);
+						int nLight = GenerateLightSubpath(scene, *tileSampler, arena,
+							maxDepth + 1, cameraVertices[0].time(), *lightDistr, lightToIndex,
+							lightVertices);
+
+						Spectrum L(0.f);
+						for (int t = 1; t <= nCamera; ++t)
+						{
+							for (int s = 0; s <= nLight; ++s)
+							{
+								int depth = t + s - 2;
+								if ((s == 1 && t == 1) || depth < 0 || depth > maxDepth)
+									continue;
+								Point2f pFilmNew = cameraSample.pFilm;
+								Spectrum Lpath = ConnectBDPT(scene, lightVertices, cameraVertices,
+									s, t, *lightDistr, lightToIndex, *camera, *tileSampler, &pFilmNew);
+								if (t != 1)
+									L += Lpath;
+								else if (!Lpath.IsBlack())
+								{
+									film->AddSplat(pFilmNew, Lpath);
+									++threadSplats;
+								}
+							}
+						}
+						filmTile->AddSample(cameraSample.pFilm, ValidRadiance(L));
+						arena.Reset();
+					} while (tileSampler->StartNextSample());
+				}
+				film->MergeFilmTile(std::move(filmTile));
+			}
+			nSplats += threadSplats;
+		}, MaxThreadIndex(), 1);
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+		Log::Info("BDPT rendered {} tiles at {} spp in {:.3f}s, {} light paths splatted",
+			tiles.size(), spp, renderTime.count(), (int64_t)nSplats);
+
+		//every camera sample traced one light subpath, whose splats cover
+		//the whole film
+		film->WriteImage(1.0f / spp);
+	}
+}
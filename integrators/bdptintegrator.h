@@ -0,0 +1,35 @@
+#pragma once
+#include "integrator.h"
+
+namespace AIR
+{
+	//Bidirectional path tracing. Every camera sample traces a subpath from
+	//the camera and one from a light picked by power, then connects every
+	//prefix of the one to every prefix of the other: s light vertices and t
+	//camera vertices make a path of s + t - 2 bounces. The strategies that
+	//build the same path are combined with the balance heuristic, so paths
+	//that are hard to find from the camera, like light through a small
+	//opening or from a small emitter, are taken from the light side.
+	//The t = 1 strategies connect light vertices straight to the camera and
+	//can land on any pixel, they are splatted into the film and scaled by
+	//1/spp when the image is written.
+	//Needs a perspective camera, We is zero for orthogonal ones.
+	class BDPTIntegrator : public Integrator
+	{
+	public:
+		BDPTIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+			std::shared_ptr<Sampler> sampler, const Bounds2i& pixelBounds)
+			: camera(camera), sampler(sampler), pixelBounds(pixelBounds),
+			maxDepth(maxDepth) {}
+
+		void Render(const Scene& scene);
+
+	private:
+		std::shared_ptr<const Camera> camera;
+		std::shared_ptr<Sampler> sampler;
+		const Bounds2i pixelBounds;
+		//longest path in bounces, the camera subpaths have up to maxDepth + 2
+		//vertices and the light subpaths maxDepth + 1
+		const int maxDepth;
+	};
+}
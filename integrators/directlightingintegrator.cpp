@@ -33,10 +33,25 @@ namespace AIR
 	Spectrum DirectLightingIntegrator::Li(const RayDifferential& ray, const Scene& scene,
 		Sampler& sampler, MemoryArena& arena, int depth) const
 	{
-		Spectrum L(0.f);
 		// Find closest ray intersection or return background radiance
 		SurfaceInteraction isect;
-		if (!scene.Intersect(ray, &isect)) 
+		bool foundIntersection = scene.Intersect(ray, &isect);
+		return LiHit(ray, foundIntersection ? &isect : nullptr, scene, sampler, arena, depth);
+	}
+
+	Spectrum DirectLightingIntegrator::LiPrimary(const RayDifferential& ray,
+		SurfaceInteraction* hit, const Scene& scene, Sampler& sampler,
+		MemoryArena& arena) const
+	{
+		return LiHit(ray, hit, scene, sampler, arena, 0);
+	}
+
+	Spectrum DirectLightingIntegrator::LiHit(const RayDifferential& ray,
+		SurfaceInteraction* hit, const Scene& scene, Sampler& sampler,
+		MemoryArena& arena, int depth) const
+	{
+		Spectrum L(0.f);
+		if (hit == nullptr) 
 		{
 			//ûкͳκεgeometryཻ
 			//ÿlight escape the scene bounds
@@ -45,6 +60,7 @@ namespace AIR
 			return L;
 		}
 
+		SurfaceInteraction& isect = *hit;
 		//Ǽinteractionϵmaterialproperties
 		isect.ComputeScatteringFunctions(ray, arena);
 
@@ -23,9 +23,15 @@ namespace AIR
 			maxDepth(maxDepth) { }
 		Spectrum Li(const RayDifferential& ray, const Scene& scene,
 			Sampler& sampler, MemoryArena& arena, int depth) const;
+		Spectrum LiPrimary(const RayDifferential& ray, SurfaceInteraction* hit,
+			const Scene& scene, Sampler& sampler, MemoryArena& arena) const;
 		void Preprocess(const Scene& scene, Sampler& sampler);
 
 	private:
+		//Li after ray was intersected, hit is null when it escaped
+		Spectrum LiHit(const RayDifferential& ray, SurfaceInteraction* hit,
+			const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const;
+
 		const LightStrategy strategy;
 		const int maxDepth;
 		//ÿlightѾԼnSamples
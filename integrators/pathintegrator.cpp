@@ -13,9 +13,23 @@ namespace AIR
 	//                   f(p_j+1 -> p_j -> p_j-1)|cosj|
 	//beta = [j=1, i-2]--------------------------------
 	//                             pw(p_j+1 - p_j)
+	void PathIntegrator::Preprocess(const Scene& scene, Sampler& sampler)
+	{
+		if (!scene.lights.empty())
+			lightDistribution = CreateLightSampleDistribution(lightSampleStrategy, scene);
+	}
+
 	Spectrum PathIntegrator::Li(const RayDifferential& r, const Scene& scene,
 		Sampler& sampler, MemoryArena& arena, int depth) const
 	{
+		SurfaceInteraction isect;
+		bool foundIntersection = scene.Intersect(r, &isect);
+		return LiPrimary(r, foundIntersection ? &isect : nullptr, scene, sampler, arena);
+	}
+
+	Spectrum PathIntegrator::LiPrimary(const RayDifferential& r, SurfaceInteraction* hit,
+		const Scene& scene, Sampler& sampler, MemoryArena& arena) const
+	{
 
 		Spectrum L(0.f);
 		
@@ -23,14 +37,27 @@ namespace AIR
 		
 		RayDifferential ray(r);
 		bool specularBounce = false;
+		//the first intersection was found by the caller
+		bool primary = true;
 
 		//bounces壺
 		//forѭΪûֵbounce > 3ö˹ȥж·ǷҪȥ
 		//һbounceҪѸôbounceradiance׼ӵϴεĹ
 		for (int bounces = 0; ; ++bounces)
 		{
-			SurfaceInteraction isect;
-			bool foundIntersection = scene.Intersect(ray, &isect);
+			SurfaceInteraction tracedIsect;
+			SurfaceInteraction* hitIsect = &tracedIsect;
+			bool foundIntersection;
+			if (primary)
+			{
+				foundIntersection = hit != nullptr;
+				if (foundIntersection)
+					hitIsect = hit;
+				primary = false;
+			}
+			else
+				foundIntersection = scene.Intersect(ray, &tracedIsect);
+			SurfaceInteraction& isect = *hitIsect;
 
 			//bounces == 0ʱ
 			//P(p1) = Le(p1->p0)
@@ -64,7 +91,9 @@ namespace AIR
 
 			//ǰ·ĲԴ
 			//ĹԴҪϴεthroughput
-			L += beta * UniformSampleOneLight(isect, scene, arena, sampler);
+			if (lightDistribution)
+				L += beta * UniformSampleOneLight(isect, scene, arena, sampler,
+					false, *lightDistribution);
 
 			Vector3f wo = -ray.d, wi;
 			Float pdf;
@@ -1,5 +1,6 @@
 #pragma once
 #include "integrator.h"
+#include "lightdistribution.h"
 
 namespace AIR
 {
@@ -9,13 +10,22 @@ namespace AIR
 	public:
 		PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
 			std::shared_ptr<Sampler> sampler,
-			const Bounds2i& pixelBounds)
-			: SamplerIntegrator(camera, sampler, pixelBounds), maxDepth(maxDepth) { }
+			const Bounds2i& pixelBounds,
+			const std::string& lightSampleStrategy = "uniform")
+			: SamplerIntegrator(camera, sampler, pixelBounds), maxDepth(maxDepth),
+			lightSampleStrategy(lightSampleStrategy) { }
+
+		void Preprocess(const Scene& scene, Sampler& sampler);
 
 		virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
 			Sampler& sampler, MemoryArena& arena,
 			int depth = 0) const;
+		virtual Spectrum LiPrimary(const RayDifferential& ray, SurfaceInteraction* hit,
+			const Scene& scene, Sampler& sampler, MemoryArena& arena) const;
 	private:
 		const int maxDepth;
+		//name for CreateLightSampleDistribution: uniform, power, spatial or bvh
+		const std::string lightSampleStrategy;
+		std::unique_ptr<LightDistribution> lightDistribution;
 	};
 }
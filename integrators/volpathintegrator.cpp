@@ -9,7 +9,8 @@ namespace AIR
 {
 	void VolPathIntegrator::Preprocess(const Scene& scene, Sampler& sampler)
 	{
-
+		if (!scene.lights.empty())
+			lightDistribution = CreateLightSampleDistribution(lightSampleStrategy, scene);
 	}
 
 	Spectrum VolPathIntegrator::Li(const RayDifferential& r, const Scene& scene,
@@ -43,8 +44,9 @@ namespace AIR
 				if (bounces >= maxDepth) 
 					break;
 				//ӰMediumInteractionĵƹ
-				L += beta * UniformSampleOneLight(mi, scene, arena, sampler, true,
-					nullptr);
+				if (lightDistribution)
+					L += beta * UniformSampleOneLight(mi, scene, arena, sampler, true,
+						*lightDistribution);
 
 				Vector3f wo = -ray.d, wi;
 				//ͨλ
@@ -82,7 +84,9 @@ namespace AIR
 
 				//ǰ·ĲԴ
 				//ĹԴҪϴεthroughput
-				L += beta * UniformSampleOneLight(isect, scene, arena, sampler, true, nullptr);
+				if (lightDistribution)
+					L += beta * UniformSampleOneLight(isect, scene, arena, sampler, true,
+						*lightDistribution);
 
 				// Sample BSDF to get new path direction
 				Vector3f wo = -ray.d, wi;
@@ -116,7 +120,9 @@ namespace AIR
 						break;
 					beta *= sss / pdf;
 
-					L += beta * UniformSampleOneLight(siIncident, scene, arena, sampler, true, nullptr);
+					if (lightDistribution)
+						L += beta * UniformSampleOneLight(siIncident, scene, arena, sampler, true,
+							*lightDistribution);
 
 					Spectrum f = siIncident.bsdf->Sample_f(siIncident.wo, &wi, sampler.Get2D(),
 						&pdf, BSDF_ALL, &flags);
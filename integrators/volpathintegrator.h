@@ -1,6 +1,7 @@
 #pragma once
 
 #include "integrator.h"
+#include "lightdistribution.h"
 
 
 namespace AIR
@@ -10,10 +11,12 @@ namespace AIR
 	public:
 		VolPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
 			std::shared_ptr<Sampler> sampler,
-			const Bounds2i& pixelBounds, Float rrThreshold = 1)
+			const Bounds2i& pixelBounds, Float rrThreshold = 1,
+			const std::string& lightSampleStrategy = "uniform")
 			: SamplerIntegrator(camera, sampler, pixelBounds),
 			maxDepth(maxDepth),
-			rrThreshold(rrThreshold) { }
+			rrThreshold(rrThreshold),
+			lightSampleStrategy(lightSampleStrategy) { }
 		void Preprocess(const Scene& scene, Sampler& sampler);
 		Spectrum Li(const RayDifferential& ray, const Scene& scene,
 			Sampler& sampler, MemoryArena& arena, int depth) const;
@@ -21,8 +24,9 @@ namespace AIR
 		const int maxDepth;
 		//ʹrussian routineֵ
 		const Float rrThreshold;
-		//const std::string lightSampleStrategy;
-		//std::unique_ptr<LightDistribution> lightDistribution;
+		//name for CreateLightSampleDistribution: uniform, power, spatial or bvh
+		const std::string lightSampleStrategy;
+		std::unique_ptr<LightDistribution> lightDistribution;
 	};
 
 }
@@ -0,0 +1,408 @@
+#include "wavefrontpathintegrator.h"
+#include "scene.h"
+#include "light.h"
+#include "interaction.h"
+#include "bsdf.h"
+#include "film.h"
+#include "robject.h"
+#include "sampling.h"
+#include "parallelism.h"
+#include "rng.h"
+#include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace AIR
+{
+	//the paths of a wave in structure of arrays layout, a stage only
+	//loads the arrays it needs
+	struct PathStates
+	{
+		std::vector<Point2f> pFilm;
+		std::vector<Float> rayWeight;
+		std::vector<RayDifferential> ray;
+		std::vector<SurfaceInteraction> isect;
+		std::vector<Spectrum> beta, L;
+		std::vector<int> bounces;
+		std::vector<char> specularBounce;
+		std::vector<RNG> rng;
+
+		void Resize(int n)
+		{
+			pFilm.resize(n);
+			rayWeight.resize(n);
+			ray.resize(n);
+			isect.resize(n);
+			beta.resize(n);
+			L.resize(n);
+			bounces.resize(n);
+			specularBounce.resize(n);
+			rng.resize(n);
+		}
+	};
+
+	//a fixed capacity queue the threads of a stage append to
+	template <typename T>
+	struct WorkQueue
+	{
+		std::vector<T> items;
+		std::atomic<int> size{ 0 };
+
+		void Reset(int capacity)
+		{
+			items.resize(capacity);
+			size = 0;
+		}
+		void Push(const T& item)
+		{
+			items[size++] = item;
+		}
+	};
+
+	//shadow ray of next event estimation, contribution is added to the
+	//path when it is unoccluded
+	struct ShadowRayItem
+	{
+		int path;
+		const Light* light;
+		Ray ray;
+		Spectrum contribution;
+	};
+
+	//BSDF sampled ray of the light's MIS, contribution times the radiance
+	//of light is added to the path when the ray reaches light
+	struct LightRayItem
+	{
+		int path;
+		const Light* light;
+		Ray ray;
+		Spectrum contribution;
+	};
+
+	//rays traced by the stages of a render
+	struct WavefrontRayCounts
+	{
+		std::atomic<int64_t> camera{ 0 }, bounce{ 0 }, shadow{ 0 }, light{ 0 };
+	};
+
+	static Point2f Get2D(RNG& rng)
+	{
+		Float u0 = rng.UniformFloat();
+		return Point2f(u0, rng.UniformFloat());
+	}
+
+	//traces the rays of the paths in queue, adds the radiance of escaped
+	//rays and emitters the path is allowed to see and queues the paths
+	//to shade. Camera rays are traced as packets, the bounces as
+	//interleaved independent rays.
+	static void IntersectStage(const Scene& scene, int maxDepth, PathStates& paths,
+		const std::vector<int>& queue, bool cameraRays, WorkQueue<int>& shadeQueue)
+	{
+		const int nChunks = ((int)queue.size() + kMaxRayPacketSize - 1) / kMaxRayPacketSize;
+		ParallelFor([&](int64_t chunk) {
+			const int first = (int)chunk * kMaxRayPacketSize;
+			const int n = std::min(kMaxRayPacketSize, (int)queue.size() - first);
+			Ray rays[kMaxRayPacketSize];
+			SurfaceInteraction isects[kMaxRayPacketSize];
+			bool hits[kMaxRayPacketSize];
+			for (int i = 0; i < n; ++i)
+				rays[i] = paths.ray[queue[first + i]];
+			if (cameraRays)
+				scene.IntersectStream(rays, n, isects, hits);
+			else
+				scene.IntersectInterleaved(rays, n, isects, hits);
+
+			for (int i = 0; i < n; ++i)
+			{
+				const int p = queue[first + i];
+				const RayDifferential& ray = paths.ray[p];
+				//only the first hit and specular bounces see emitters,
+				//next event estimation covers the others
+				if (paths.bounces[p] == 0 || paths.specularBounce[p])
+				{
+					if (!hits[i])
+					{
+						for (const auto& light : scene.lights)
+							paths.L[p] += paths.beta[p] * light->LiEscape(ray);
+						continue;
+					}
+					paths.L[p] += paths.beta[p] * isects[i].Le(-ray.d);
+				}
+				if (!hits[i] || paths.bounces[p] >= maxDepth)
+					continue;
+				paths.isect[p] = isects[i];
+				shadeQueue.Push(p);
+			}
+		}, nChunks, 4);
+	}
+
+	//the light sampling half of EstimateDirect queues a shadow ray, the
+	//BSDF sampling half a light ray. Lights are picked uniformly, like
+	//UniformSampleOneLight without a distribution.
+	static void SampleOneLight(const Scene& scene, PathStates& paths, int p,
+		WorkQueue<ShadowRayItem>& shadowQueue, WorkQueue<LightRayItem>& lightQueue)
+	{
+		const SurfaceInteraction& isect = paths.isect[p];
+		RNG& rng = paths.rng[p];
+		const int nLights = (int)scene.lights.size();
+		const int lightIndex = std::min((int)(rng.UniformFloat() * nLights), nLights - 1);
+		const Float lightSelectPdf = Float(1) / nLights;
+		const Light& light = *scene.lights[lightIndex];
+		Point2f uLight = Get2D(rng);
+		Point2f uScattering = Get2D(rng);
+		const BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+
+		Vector3f wi;
+		Float lightPdf = 0, scatteringPdf = 0;
+		VisibilityTester visibility;
+		Spectrum Li = light.Sample_Li(isect, uLight, &wi, &lightPdf, &visibility);
+		if (lightPdf > 0 && !Li.IsBlack())
+		{
+			Spectrum f = isect.bsdf->f(isect.wo, wi, bsdfFlags) * Vector3f::AbsDot(wi, isect.shading.n);
+			scatteringPdf = isect.bsdf->Pdf(isect.wo, wi, bsdfFlags);
+			if (!f.IsBlack())
+			{
+				Float weight = light.IsDeltaLight() ? 1 :
+					PowerHeuristic(1, lightPdf, 1, scatteringPdf);
+				shadowQueue.Push({ p, &light, visibility.P0().SpawnRayTo(visibility.P1()),
+					paths.beta[p] * f * Li * weight / (lightPdf * lightSelectPdf) });
+			}
+		}
+
+		if (light.IsDeltaLight())
+			return;
+		BxDFType sampledType;
+		Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, uScattering, &scatteringPdf,
+			bsdfFlags, &sampledType);
+		f *= Vector3f::AbsDot(wi, isect.shading.n);
+		if (f.IsBlack() || scatteringPdf == 0)
+			return;
+		Float weight = 1;
+		if (!(sampledType & BSDF_SPECULAR))
+		{
+			lightPdf = light.Pdf_Li(isect, wi);
+			if (lightPdf == 0)
+				return;
+			weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+		}
+		lightQueue.Push({ p, &light, isect.SpawnRay(wi),
+			paths.beta[p] * f * weight / (scatteringPdf * lightSelectPdf) });
+	}
+
+	//computes the BSDFs of the queued hits grouped by material, samples a
+	//light and the next bounce of each path
+	static void ShadeStage(const Scene& scene, PathStates& paths, WorkQueue<int>& shadeQueue,
+		std::vector<std::unique_ptr<MemoryArena>>& arenas, WorkQueue<int>& nextQueue,
+		WorkQueue<ShadowRayItem>& shadowQueue, WorkQueue<LightRayItem>& lightQueue)
+	{
+		const int nShade = shadeQueue.size;
+		std::vector<int>& queue = shadeQueue.items;
+		std::sort(queue.begin(), queue.begin() + nShade, [&](int a, int b) {
+			const Material* ma = paths.isect[a].primitive->GetMaterial();
+			const Material* mb = paths.isect[b].primitive->GetMaterial();
+			return ma < mb || (ma == mb && a < b);
+		});
+
+		ParallelFor([&](int64_t i) {
+			const int p = queue[i];
+			SurfaceInteraction& isect = paths.isect[p];
+			RayDifferential& ray = paths.ray[p];
+			isect.ComputeScatteringFunctions(ray, *arenas[ThreadIndex], true);
+			//medium boundaries don't count as a bounce
+			if (!isect.bsdf)
+			{
+				ray = isect.SpawnRay(ray.d);
+				nextQueue.Push(p);
+				return;
+			}
+
+			if (!scene.lights.empty())
+				SampleOneLight(scene, paths, p, shadowQueue, lightQueue);
+
+			RNG& rng = paths.rng[p];
+			Vector3f wo = -ray.d, wi;
+			Float pdf;
+			BxDFType flags;
+			Spectrum f = isect.bsdf->Sample_f(wo, &wi, Get2D(rng), &pdf, BSDF_ALL, &flags);
+			if (f.IsBlack() || pdf == 0.f)
+				return;
+			Spectrum& beta = paths.beta[p];
+			beta *= f * Vector3f::AbsDot(wi, isect.shading.n) / pdf;
+			paths.specularBounce[p] = (flags & BSDF_SPECULAR) != 0;
+			ray = isect.SpawnRay(wi);
+
+			if (paths.bounces[p] > 3)
+			{
+				Float q = std::max((Float).05, 1 - beta.y());
+				if (rng.UniformFloat() < q)
+					return;
+				beta /= 1 - q;
+			}
+			++paths.bounces[p];
+			nextQueue.Push(p);
+		}, nShade, 64);
+	}
+
+	static void ShadowRayStage(const Scene& scene, PathStates& paths,
+		const WorkQueue<ShadowRayItem>& shadowQueue)
+	{
+		ParallelFor([&](int64_t i) {
+			const ShadowRayItem& item = shadowQueue.items[i];
+			if (!scene.IntersectP(item.ray, *item.light))
+				paths.L[item.path] += item.contribution;
+		}, shadowQueue.size, 64);
+	}
+
+	static void LightRayStage(const Scene& scene, PathStates& paths,
+		const WorkQueue<LightRayItem>& lightQueue)
+	{
+		const int nRays = lightQueue.size;
+		const int nChunks = (nRays + kMaxRayPacketSize - 1) / kMaxRayPacketSize;
+		ParallelFor([&](int64_t chunk) {
+			const int first = (int)chunk * kMaxRayPacketSize;
+			const int n = std::min(kMaxRayPacketSize, nRays - first);
+			Ray rays[kMaxRayPacketSize];
+			SurfaceInteraction isects[kMaxRayPacketSize];
+			bool hits[kMaxRayPacketSize];
+			for (int i = 0; i < n; ++i)
+				rays[i] = lightQueue.items[first + i].ray;
+			scene.IntersectInterleaved(rays, n, isects, hits);
+			for (int i = 0; i < n; ++i)
+			{
+				const LightRayItem& item = lightQueue.items[first + i];
+				Spectrum Li(0.f);
+				if (hits[i])
+				{
+					if (isects[i].primitive->GetAreaLight() == item.light)
+						Li = isects[i].Le(-item.ray.d);
+				}
+				else
+					Li = item.light->LiEscape(item.ray);
+				if (!Li.IsBlack())
+					paths.L[item.path] += item.contribution * Li;
+			}
+		}, nChunks, 4);
+	}
+
+	void WavefrontPathIntegrator::Render(const Scene& scene)
+	{
+		const int tileSize = 16;
+		const int64_t spp = sampler->samplesPerPixel;
+		std::vector<RenderTile> tiles = GenerateRenderTiles(
+			camera->film->GetOutputSampleBounds(), tileSize, "scanline");
+
+		//a wave is a group of tiles times a range of samples
+		const int64_t samplesPerWave = Clamp(maxPathsInFlight / (tileSize * tileSize), 1, spp);
+		const int tilesPerWave = std::max(1, (int)(maxPathsInFlight / (tileSize * tileSize * samplesPerWave)));
+		const int pathsPerTile = (int)(tileSize * tileSize * samplesPerWave);
+		const int maxPaths = tilesPerWave * pathsPerTile;
+
+		PathStates paths;
+		paths.Resize(maxPaths);
+		std::vector<int> tilePathCount(tilesPerWave);
+		std::vector<std::unique_ptr<MemoryArena>> arenas(MaxThreadIndex());
+		for (auto& arena : arenas)
+			arena.reset(new MemoryArena);
+		std::vector<int> queue;
+		WorkQueue<int> shadeQueue, nextQueue;
+		WorkQueue<ShadowRayItem> shadowQueue;
+		WorkQueue<LightRayItem> lightQueue;
+		WavefrontRayCounts rayCounts;
+
+		auto renderStart = std::chrono::steady_clock::now();
+		for (int64_t sampleStart = 0; sampleStart < spp; sampleStart += samplesPerWave)
+		{
+			const int64_t sampleEnd = std::min(spp, sampleStart + samplesPerWave);
+			for (size_t firstTile = 0; firstTile < tiles.size(); firstTile += tilesPerWave)
+			{
+				const int nTiles = (int)std::min<size_t>(tilesPerWave, tiles.size() - firstTile);
+
+				//camera rays, the tile samplers are seeded like the ones of
+				//SamplerIntegrator
+				ParallelFor([&](int64_t t) {
+					const RenderTile& tile = tiles[firstTile + t];
+					std::unique_ptr<Sampler> tileSampler = sampler->Clone(tile.seed);
+					int p = (int)t * pathsPerTile;
+					for (Point2i pixel : tile.bounds)
+					{
+						tileSampler->StartPixel(pixel);
+						if (!InsideExclusive(pixel, pixelBounds))
+							continue;
+						if (sampleStart > 0 && !tileSampler->SetSampleNumber(sampleStart))
+							continue;
+						do
+						{
+							CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+							paths.pFilm[p] = cameraSample.pFilm;
+							paths.rayWeight[p] = camera->GenerateRayDifferential(cameraSample, &paths.ray[p]);
+							paths.ray[p].ScaleDifferentials(1 / std::sqrt((Float)spp));
+							paths.beta[p] = Spectrum(1.f);
+							paths.L[p] = Spectrum(0.f);
+							paths.bounces[p] = 0;
+							paths.specularBounce[p] = false;
+							const int64_t pixelIndex = (int64_t)(pixel.y - pixelBounds.pMin.y) *
+								(pixelBounds.pMax.x - pixelBounds.pMin.x) + (pixel.x - pixelBounds.pMin.x);
+							paths.rng[p].SetSequence(pixelIndex * spp + tileSampler->CurrentSampleNumber());
+							++p;
+						} while (tileSampler->StartNextSample() &&
+							tileSampler->CurrentSampleNumber() < sampleEnd);
+					}
+					tilePathCount[t] = p - (int)t * pathsPerTile;
+				}, nTiles, 1);
+
+				queue.clear();
+				for (int t = 0; t < nTiles; ++t)
+				{
+					for (int p = t * pathsPerTile; p < t * pathsPerTile + tilePathCount[t]; ++p)
+					{
+						if (paths.rayWeight[p] > 0)
+							queue.push_back(p);
+					}
+				}
+				rayCounts.camera += queue.size();
+
+				for (bool cameraRays = true; !queue.empty(); cameraRays = false)
+				{
+					shadeQueue.Reset(queue.size());
+					nextQueue.Reset(queue.size());
+					shadowQueue.Reset(queue.size());
+					lightQueue.Reset(queue.size());
+
+					IntersectStage(scene, maxDepth, paths, queue, cameraRays, shadeQueue);
+					ShadeStage(scene, paths, shadeQueue, arenas, nextQueue, shadowQueue, lightQueue);
+					ShadowRayStage(scene, paths, shadowQueue);
+					LightRayStage(scene, paths, lightQueue);
+					rayCounts.shadow += shadowQueue.size;
+					rayCounts.light += lightQueue.size;
+					for (auto& arena : arenas)
+						arena->Reset();
+
+					//path order keeps neighbouring pixels together in the
+					//intersect batches
+					queue.assign(nextQueue.items.begin(), nextQueue.items.begin() + nextQueue.size);
+					std::sort(queue.begin(), queue.end());
+					rayCounts.bounce += queue.size();
+				}
+
+				ParallelFor([&](int64_t t) {
+					const RenderTile& tile = tiles[firstTile + t];
+					std::unique_ptr<FilmTile> filmTile = camera->film->GetFilmTile(tile.bounds);
+					for (int p = (int)t * pathsPerTile; p < (int)t * pathsPerTile + tilePathCount[t]; ++p)
+						filmTile->AddSample(paths.pFilm[p], ValidRadiance(paths.L[p]), paths.rayWeight[p]);
+					camera->film->MergeFilmTile(std::move(filmTile));
+				}, nTiles, 1);
+			}
+		}
+
+		std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+		const int64_t totalRays = rayCounts.camera + rayCounts.bounce + rayCounts.shadow + rayCounts.light;
+		Log::Info("Wavefront render of {} samples in waves of {} paths in {:.3f}s, "
+			"{} rays ({} camera, {} bounce, {} shadow, {} light), {:.2f} Mrays/s",
+			spp, maxPaths, renderTime.count(), totalRays, rayCounts.camera.load(),
+			rayCounts.bounce.load(), rayCounts.shadow.load(), rayCounts.light.load(),
+			totalRays / renderTime.count() * 1e-6);
+
+		camera->film->WriteImage();
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "integrator.h"
+
+namespace AIR
+{
+	//the estimator of PathIntegrator, but run stage by stage over queues of
+	//paths instead of one path at a time. A wave holds the paths of a group
+	//of tiles, at most maxPathsInFlight, and every bounce of the wave goes
+	//through the stages
+	//  camera rays   generated tile by tile from the tile samplers
+	//  intersect     the rays of all live paths, in interleaved batches
+	//  shade         sorted by material, computes the BSDFs and samples the
+	//                light and the next bounce
+	//  shadow rays   of next event estimation, any hit
+	//  light rays    the BSDF half of the light's MIS, closest hit
+	//and the finished wave is added to the film. Every stage runs over its
+	//whole queue with ParallelFor, so a stage only touches one kind of code
+	//and data.
+	//The camera samples come from the sampler, the other dimensions of a
+	//path from an RNG seeded by its pixel and sample index: the pixel
+	//samplers can't be interleaved between paths. The image converges to
+	//the one of PathIntegrator, the noise differs.
+	class WavefrontPathIntegrator : public Integrator
+	{
+	public:
+		WavefrontPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+			std::shared_ptr<Sampler> sampler, const Bounds2i& pixelBounds,
+			int maxPathsInFlight = 1 << 16)
+			: camera(camera), sampler(sampler), pixelBounds(pixelBounds),
+			maxDepth(maxDepth), maxPathsInFlight(maxPathsInFlight) {}
+
+		void Render(const Scene& scene);
+
+	private:
+		std::shared_ptr<const Camera> camera;
+		std::shared_ptr<Sampler> sampler;
+		const Bounds2i pixelBounds;
+		const int maxDepth;
+		const int maxPathsInFlight;
+	};
+}
@@ -1,6 +1,8 @@
 ﻿#include "diffusearealight.h"
 #include "transform.h"
 #include "shape.h"
+#include "lightbvh.h"
+#include "sampling.h"
 
 namespace AIR
 {
@@ -31,11 +33,71 @@ namespace AIR
         return L(pShape, -*wi);
     }
 
+	Spectrum DiffuseAreaLight::Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+		Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const
+	{
+		//uniform over the area, cosine weighted around the normal
+		Interaction pShape = shape->Sample(u1, pdfPos);
+		pShape.time = time;
+		pShape.mediumInterface = mediumInterface;
+		*nLight = pShape.normal;
+
+		//a two sided emitter picks its side with the first half of u2.x
+		Vector3f w;
+		if (twoSided)
+		{
+			Point2f u = u2;
+			if (u.x < 0.5f)
+			{
+				u.x = std::min(u.x * 2, OneMinusEpsilon);
+				w = CosineSampleHemisphere(u);
+			}
+			else
+			{
+				u.x = std::min((u.x - 0.5f) * 2, OneMinusEpsilon);
+				w = CosineSampleHemisphere(u);
+				w.z *= -1;
+			}
+			*pdfDir = 0.5f * CosineHemispherePdf(std::abs(w.z));
+		}
+		else
+		{
+			w = CosineSampleHemisphere(u2);
+			*pdfDir = CosineHemispherePdf(w.z);
+		}
+
+		Vector3f v1, v2;
+		CoordinateSystem(pShape.normal, &v1, &v2);
+		w = w.x * v1 + w.y * v2 + w.z * pShape.normal;
+		*ray = pShape.SpawnRay(w);
+		return L(pShape, w);
+	}
+
+	void DiffuseAreaLight::Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+		Float* pdfDir) const
+	{
+		Interaction it(ray.o, nLight, Vector3f::zero, nLight, ray.time, mediumInterface);
+		*pdfPos = shape->Pdf(it);
+		*pdfDir = twoSided ? (0.5f * CosineHemispherePdf(Vector3f::AbsDot(nLight, ray.d))) :
+			CosineHemispherePdf(Vector3f::Dot(nLight, ray.d));
+	}
+
 	Spectrum DiffuseAreaLight::Power() const 
     {
 		return (twoSided ? 2 : 1) * Lemit * area * Pi;
 	}
 
+    bool DiffuseAreaLight::Bounds(LightBounds* bounds) const
+    {
+        //a diffuse emitter lights the half space in front of each normal
+        Vector3f w;
+        Float cosTheta_o;
+        shape->NormalBounds(&w, &cosTheta_o);
+        *bounds = LightBounds(shape->WorldBound(), w, Power().MaxComponentValue(),
+            cosTheta_o, 0, twoSided);
+        return true;
+    }
+
     Float DiffuseAreaLight::Pdf_Li(const Interaction& isect, const Vector3f& wi) const
     {
         //dw = dAcosθ/r²
@@ -18,6 +18,14 @@ namespace AIR
 		Spectrum Power() const;
 
 		Float Pdf_Li(const Interaction&, const Vector3f&) const;
+
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+			Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const;
+
+		void Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+			Float* pdfDir) const;
+
+		bool Bounds(LightBounds* bounds) const;
 		//evaluate the area light’s emitted radiance
 		Spectrum L(const Interaction& intr, const Vector3f& w) const {
 			return (twoSided || Vector3f::Dot(intr.normal, w) > 0) ? Lemit : Spectrum(0.f);
@@ -1,5 +1,6 @@
 #include "distantlight.h"
 #include "scene.h"
+#include "sampling.h"
 
 namespace AIR
 {
@@ -16,6 +17,29 @@ namespace AIR
 		return L;
 	}
 
+	Spectrum DistantLight::Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+		Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const
+	{
+		//a parallel beam, the origins are spread over a disk of the scene's
+		//bounding sphere that faces the light
+		Vector3f v1, v2;
+		CoordinateSystem(wLight, &v1, &v2);
+		Point2f cd = ConcentricSampleDisk(u1);
+		Point3f pDisk = worldCenter + worldRadius * (cd.x * v1 + cd.y * v2);
+		*ray = Ray(pDisk + worldRadius * wLight, -wLight, Infinity, time);
+		*nLight = ray->d;
+		*pdfPos = 1 / (Pi * worldRadius * worldRadius);
+		*pdfDir = 1;
+		return L;
+	}
+
+	void DistantLight::Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+		Float* pdfDir) const
+	{
+		*pdfPos = 1 / (Pi * worldRadius * worldRadius);
+		*pdfDir = 0;
+	}
+
 	Spectrum DistantLight::Power() const
 	{
 		return 2 * Pi * worldRadius * worldRadius * L;
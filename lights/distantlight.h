@@ -26,6 +26,12 @@ namespace AIR
 		}
 
 		Spectrum Power() const;
+
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+			Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const;
+
+		void Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+			Float* pdfDir) const;
 	private:
 		const Spectrum L;
 		const Vector3f wLight;
@@ -108,6 +108,44 @@ namespace AIR
             (2 * Pi * Pi * sinTheta);
     }
 
+    Spectrum InfiniteAreaLight::Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+        Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const
+    {
+        //the direction follows the environment map like Sample_Li, the
+        //origin is on the disk of the scene's bounding sphere facing it
+        Float mapPdf;
+        Point2f uv = distribution->SampleContinuous(u1, &mapPdf);
+        if (mapPdf == 0)
+            return Spectrum(0.0f);
+        Float theta = uv[1] * Pi, phi = uv[0] * 2 * Pi;
+        Float cosTheta = std::cos(theta), sinTheta = std::sin(theta);
+        Float sinPhi = std::sin(phi), cosPhi = std::cos(phi);
+        Vector3f d = -LightToWorld.ObjectToWorldVector(Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta));
+        *nLight = d;
+
+        Vector3f v1, v2;
+        CoordinateSystem(-d, &v1, &v2);
+        Point2f cd = ConcentricSampleDisk(u2);
+        Point3f pDisk = worldCenter + worldRadius * (cd.x * v1 + cd.y * v2);
+        *ray = Ray(pDisk + worldRadius * -d, d, Infinity, time);
+
+        //same Jacobian as Pdf_Li
+        *pdfDir = sinTheta == 0 ? 0 : mapPdf / (2 * Pi * Pi * sinTheta);
+        *pdfPos = 1 / (Pi * worldRadius * worldRadius);
+        return Spectrum(Lmap->Lookup(uv), SpectrumType::Illuminant);
+    }
+
+    void InfiniteAreaLight::Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+        Float* pdfDir) const
+    {
+        Vector3f d = -LightToWorld.WorldToObjectVector(ray.d);
+        Float theta = SphericalTheta(d), phi = SphericalPhi(d);
+        Float sinTheta = std::sin(theta);
+        Point2f uv(phi * Inv2Pi, theta * InvPi);
+        *pdfDir = sinTheta == 0 ? 0 : distribution->Pdf(uv) / (2 * Pi * Pi * sinTheta);
+        *pdfPos = 1 / (Pi * worldRadius * worldRadius);
+    }
+
     Spectrum InfiniteAreaLight::Power() const
     {
         return Spectrum(worldRadius * worldRadius * Pi * Lmap->Lookup(Point2f(.5f, .5f), .5f),
@@ -17,6 +17,12 @@ namespace AIR
 
 		Float Pdf_Li(const Interaction&, const Vector3f&) const;
 
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+			Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const;
+
+		void Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+			Float* pdfDir) const;
+
 		//virtual Spectrum LiEscape(const RayDifferential& r) const;
 
 		void Preprocess(const Scene& scene);
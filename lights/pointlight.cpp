@@ -1,4 +1,6 @@
 #include "pointlight.h"
+#include "lightbvh.h"
+#include "sampling.h"
 
 namespace AIR
 {
@@ -12,9 +14,35 @@ namespace AIR
 		return intensity / Vector3f::DistanceSquare(position, ref.interactPoint);
 	}
 
+	Spectrum PointLight::Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+		Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const
+	{
+		*ray = Ray(position, UniformSampleSphere(u1), Infinity, time, mediumInterface.inside);
+		*nLight = ray->d;
+		*pdfPos = 1;
+		*pdfDir = UniformSpherePdf();
+		return intensity;
+	}
+
+	void PointLight::Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+		Float* pdfDir) const
+	{
+		//the position is a delta, no other path can sample it
+		*pdfPos = 0;
+		*pdfDir = UniformSpherePdf();
+	}
+
 	Spectrum PointLight::Power() const
 	{
 		return 4 * Pi * intensity;
 	}
+
+	bool PointLight::Bounds(LightBounds* bounds) const
+	{
+		//emits in every direction
+		*bounds = LightBounds(Bounds3f(position), Vector3f(0, 0, 1),
+			Power().MaxComponentValue(), -1, 0, false);
+		return true;
+	}
 }
 
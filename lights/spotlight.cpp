@@ -1,4 +1,6 @@
 ﻿#include "spotlight.h"
+#include "lightbvh.h"
+#include "sampling.h"
 
 
 namespace AIR
@@ -13,6 +15,26 @@ namespace AIR
 		return intensity * Falloff(-*wi) / Vector3f::DistanceSquare(position, ref.interactPoint);
 	}
 
+	Spectrum SpotLight::Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+		Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const
+	{
+		Vector3f w = UniformSampleCone(u1, cosTotalWidth);
+		*ray = Ray(position, Vector3f::Normalize(LightToWorld.ObjectToWorldVector(w)), Infinity,
+			time, mediumInterface.inside);
+		*nLight = ray->d;
+		*pdfPos = 1;
+		*pdfDir = UniformConePdf(cosTotalWidth);
+		return intensity * Falloff(ray->d);
+	}
+
+	void SpotLight::Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+		Float* pdfDir) const
+	{
+		*pdfPos = 0;
+		Float cosTheta = Vector3f::Normalize(LightToWorld.WorldToObjectVector(ray.d)).z;
+		*pdfDir = cosTheta >= cosTotalWidth ? UniformConePdf(cosTotalWidth) : 0;
+	}
+
 	Float SpotLight::Falloff(const Vector3f& w) const
 	{
 		Vector3f wInLight = Vector3f::Normalize(LightToWorld.WorldToObjectVector(w));
@@ -58,4 +80,14 @@ namespace AIR
 		//由于从FalloffStart开始衰减，所以从中间值近似
 		return 2.0f * Pi * (1.0f - 0.5f * (cosTotalWidth + cosFalloffStart)) * intensity;
 	}
+
+	bool SpotLight::Bounds(LightBounds* bounds) const
+	{
+		//full intensity inside the falloff start, nothing past the total width
+		Vector3f w = Vector3f::Normalize(LightToWorld.ObjectToWorldVector(Vector3f(0, 0, 1)));
+		Float cosTheta_e = std::cos(std::acos(cosTotalWidth) - std::acos(cosFalloffStart));
+		*bounds = LightBounds(Bounds3f(position), w, Power().MaxComponentValue(),
+			cosFalloffStart, cosTheta_e, false);
+		return true;
+	}
 }
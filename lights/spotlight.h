@@ -22,7 +22,15 @@ namespace AIR
 
 		Spectrum Power() const;
 
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, Float time,
+			Ray* ray, Vector3f* nLight, Float* pdfPos, Float* pdfDir) const;
+
+		void Pdf_Le(const Ray& ray, const Vector3f& nLight, Float* pdfPos,
+			Float* pdfDir) const;
+
 		Float Falloff(const Vector3f& w) const;
+
+		bool Bounds(LightBounds* bounds) const;
 	private:
 		const Point3f position;
 		const Spectrum intensity;
@@ -129,7 +129,7 @@ namespace AIR
 		return Vector3<T>(
 			mat._M[0][0] * vec.x + mat._M[0][1] * vec.y + mat._M[0][2] * vec.z,
 			mat._M[1][0] * vec.x + mat._M[1][1] * vec.y + mat._M[1][2] * vec.z,
-			mat._M[2][0] * vec.x + mat._M[2][0] * vec.y + mat._M[2][0] * vec.z);
+			mat._M[2][0] * vec.x + mat._M[2][1] * vec.y + mat._M[2][2] * vec.z);
 	}
 	
 
@@ -709,7 +709,7 @@ namespace AIR
 		return Vector3<T>(
 			mat._M[0][0] * vec.x + mat._M[0][1] * vec.y + mat._M[0][2] * vec.z,
 			mat._M[1][0] * vec.x + mat._M[1][1] * vec.y + mat._M[1][2] * vec.z,
-			mat._M[2][0] * vec.x + mat._M[2][0] * vec.y + mat._M[2][2] * vec.z);
+			mat._M[2][0] * vec.x + mat._M[2][1] * vec.y + mat._M[2][2] * vec.z);
 	}
 
 };
@@ -1,4 +1,5 @@
 #include "haltonsampler.h"
+#include <mutex>
 
 namespace AIR
 {
@@ -24,16 +25,19 @@ namespace AIR
 	}
 
 	std::vector<uint16_t> HaltonSampler::radicalInversePermutations;
+	static std::once_flag radicalInversePermutationsInit;
 
 	HaltonSampler::HaltonSampler(int samplesPerPixel, 
 		const Bounds2i& sampleBounds) : GlobalSampler(samplesPerPixel),
 		offsetForCurrentPixel(0)
 	{
-		if (radicalInversePermutations.size() == 0) 
+		//samplers may be created from several threads, the permutation table
+		//is shared by all of them and must only be built once
+		std::call_once(radicalInversePermutationsInit, []()
 		{
 			RNG rng;
 			radicalInversePermutations = ComputeRadicalInversePermutations(rng);
-		}
+		});
 
 
 		// Find radical inverse base scales and exponents that cover sampling area
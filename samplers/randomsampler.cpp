@@ -22,6 +22,10 @@ namespace AIR
 		return std::unique_ptr<Sampler>(rs);
 	}
 
+	void RandomSampler::SetSequence(uint64_t sequence) {
+		rng.SetSequence(sequence);
+	}
+
 	void RandomSampler::StartPixel(const Point2i& p) {
 		//ProfilePhase _(Prof::StartPixel);
 		for (size_t i = 0; i < sampleArray1D.size(); ++i)
@@ -12,6 +12,7 @@ namespace AIR
 		Float Get1D();
 		Point2f Get2D();
 		std::unique_ptr<Sampler> Clone(int seed);
+		void SetSequence(uint64_t sequence);
 
 	private:
 		RNG rng;
@@ -1,9 +1,43 @@
 #include "bvhaccel.h"
 #include "memory.h"
 #include "stat.h"
+#include "parallelism.h"
+#include "log.h"
+#include "triangle.h"
+#include "meshprimitive.h"
+#include "interaction.h"
+#include "fileutil.h"
+#include "rng.h"
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BVH_HAVE_SSE
+#include <xmmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 namespace AIR
 {
+	//subtrees with more primitives than this are built as parallel tasks
+	static constexpr int kParallelBuildPrimitives = 4096;
+	//bounds and partitions of ranges larger than this are computed in
+	//parallel blocks of kParallelBlockSize primitives. The block size is
+	//fixed, so the tree is the same for any number of threads.
+	static constexpr int kParallelScanPrimitives = 64 * 1024;
+	static constexpr int kParallelBlockSize = 16 * 1024;
+
 	STAT_COUNTER("BVH/Interior nodes", interiorNodes);
 	STAT_COUNTER("BVH/Leaf nodes", leafNodes);
 	struct BVHPrimitiveInfo 
@@ -13,7 +47,7 @@ namespace AIR
 			: primitiveNumber(primitiveNumber),
 			bounds(bounds),
 			centroid(.5f * bounds.pMin + .5f * bounds.pMax) {}
-		//primitivesе
+		//primRefsе
 		size_t primitiveNumber;
 		//Ӧprimitiveworldbound
 		Bounds3f bounds;
@@ -51,6 +85,8 @@ namespace AIR
 		int firstPrimOffset;
 		//leafй˶ٸprimitive
 		int nPrimitives;
+		//SBVH leaf: indices into primRefs until GatherSBVHLeaves orders them
+		const uint32_t* leafRefs;
 	};
 
 	struct LinearBVHNode {
@@ -59,16 +95,152 @@ namespace AIR
 			//primtivesе
 			int primitivesOffset;    // leaf
 
-			int secondChildOffset;   // interior
+			//the two children are stored side by side from here
+			int childrenOffset;      // interior
 		};
 		//Ҷӽڵ㣬ӵеprimitves
 		//Ϊbuild tree nodeʱprimitiveѾݷõnode
 		//primitveǺnodeյģͬһҶprimitve˳primitivesµ
 		uint16_t nPrimitives;  // 0 -> interior node
 		uint8_t axis;          // interior node: xyz
-		uint8_t pad[1];        // ensure 32 byte total size
+		//interior node: children[1] is stored at childrenOffset and
+		//children[0] after it
+		uint8_t swapped;       // ensure 32 byte total size
+	};
+
+	//N-wide node collapsed from the binary tree. The child bounds are stored
+	//as structure of arrays so one SIMD slab test covers 4 (SSE) or 8 (AVX)
+	//children. Leaf children are stored in the slot of their parent.
+	template <int N>
+	struct alignas(64) WideBVHNode
+	{
+		//bounds[0] = pMin, bounds[1] = pMax, then [axis][child]
+		//unused slots are empty bounds and never hit
+		float bounds[2][3][N];
+		//leaf child: first primitive, interior child: index of its wide node
+		int32_t offset[N];
+		//primitives of a leaf child, 0 for an interior child
+		uint16_t nPrimitives[N];
+		uint8_t nChildren;
+		//split axis of the binary node the children were collapsed from,
+		//the children are stored in order along it
+		uint8_t axis;
+
+		static constexpr int width = N;
+	};
+
+	//WideBVHNode with the child bounds quantized to 8 bits on a grid over
+	//the union of the children, 80 bytes for 4 children and 128 for 8
+	//instead of 128 and 256. The grid step is a power of two, so
+	//origin + q * scale is rounded once however it is evaluated, and the
+	//bounds are rounded outwards so a decoded box contains its child.
+	template <int N>
+	struct alignas(4 * N) QuantizedBVHNode
+	{
+		float origin[3];
+		float scale[3];
+		//qBounds[0] = pMin, qBounds[1] = pMax, then [axis][child]
+		uint8_t qBounds[2][3][N];
+		int32_t offset[N];
+		uint16_t nPrimitives[N];
+		uint8_t nChildren;
+		uint8_t axis;
+
+		static constexpr int width = N;
+	};
+
+	static_assert(sizeof(WideBVHNode<4>) == 128 && sizeof(WideBVHNode<8>) == 256,
+		"wide node sizes changed");
+	static_assert(sizeof(QuantizedBVHNode<4>) == 80 && sizeof(QuantizedBVHNode<8>) == 128,
+		"quantized node sizes changed");
+
+	//world space triangle copied out of a Triangle shape at build time
+	struct BakedTriangle
+	{
+		Point3f p0, p1, p2;
+		//0 when primRefs[i] isn't a triangle and is tested through the
+		//Primitive interface
+		uint32_t isTriangle;
+	};
+
+	struct BakedHit
+	{
+		//primitive of the closest baked triangle hit, -1 when the closest
+		//hit so far already filled the SurfaceInteraction
+		int index = -1;
+		Float b[3];
+	};
+
+	//the baked triangles of a leaf, W lanes in SoA order so a kernel loads
+	//one coordinate of all lanes at once. A leaf of n primitives has
+	//(n + W - 1) / W groups, the lanes past n are empty.
+	template <int W>
+	struct alignas(16) TriangleGroup
+	{
+		//p[vertex][axis][lane]
+		float p[3][3][W];
+		//primRefs index of each lane
+		int32_t index[W];
+		//lanes holding a baked triangle and lanes of the other primitives,
+		//which are tested through the Primitive interface
+		uint32_t triangleMask;
+		uint32_t otherMask;
 	};
 
+	//the per ray part of the watertight test: the axis permutation and the
+	//shear of IntersectTriangle, computed once per leaf
+	struct WatertightRay
+	{
+		int kx, ky, kz;
+		Float Sx, Sy, Sz;
+	};
+
+	static inline WatertightRay SetupWatertightRay(const Ray& ray)
+	{
+		WatertightRay wr;
+		wr.kz = Vector3f::MaxDimension(Vector3f::Abs(ray.d));
+		wr.kx = wr.kz + 1;
+		if (wr.kx == 3) wr.kx = 0;
+		wr.ky = wr.kx + 1;
+		if (wr.ky == 3) wr.ky = 0;
+		Vector3f d = Vector3f::Permute(ray.d, wr.kx, wr.ky, wr.kz);
+		wr.Sx = -d.x / d.z;
+		wr.Sy = -d.y / d.z;
+		wr.Sz = 1.f / d.z;
+		return wr;
+	}
+
+	//Moller-Trumbore test of a baked triangle, b are the barycentrics of
+	//p0, p1 and p2 like IntersectTriangle. The SIMD kernel below does the
+	//same operations in the same order, so both agree on every hit.
+	static inline bool IntersectTriangleMoller(const Ray& ray, const Point3f& p0,
+		const Point3f& p1, const Point3f& p2, Float* tHit, Float b[3])
+	{
+		Vector3f e1 = p1 - p0, e2 = p2 - p0;
+		Vector3f pv(ray.d.y * e2.z - ray.d.z * e2.y,
+			ray.d.z * e2.x - ray.d.x * e2.z,
+			ray.d.x * e2.y - ray.d.y * e2.x);
+		Float det = e1.x * pv.x + e1.y * pv.y + e1.z * pv.z;
+		//the ray is parallel to the triangle
+		if (std::abs(det) <= 1e-8f)
+			return false;
+		Float invDet = 1 / det;
+		Vector3f tv = ray.o - p0;
+		Float u = (tv.x * pv.x + tv.y * pv.y + tv.z * pv.z) * invDet;
+		Vector3f qv(tv.y * e1.z - tv.z * e1.y,
+			tv.z * e1.x - tv.x * e1.z,
+			tv.x * e1.y - tv.y * e1.x);
+		Float v = (ray.d.x * qv.x + ray.d.y * qv.y + ray.d.z * qv.z) * invDet;
+		Float t = (e2.x * qv.x + e2.y * qv.y + e2.z * qv.z) * invDet;
+		if (!(u >= 0 && v >= 0 && u + v <= 1 && t > 0 && t < ray.tMax))
+			return false;
+		b[0] = 1 - u - v;
+		b[1] = u;
+		b[2] = v;
+		*tHit = t;
+		return true;
+	}
+
 	struct BucketInfo 
 	{
 		//ӵеprimitive
@@ -77,7 +249,191 @@ namespace AIR
 		Bounds3f bounds;
 	};
 
-	std::shared_ptr<Primitive> BVHAccel::CreateBVHAccelerator(std::vector<std::shared_ptr<Primitive>> prims, int maxPrimsInNode, const std::string& splitName)
+	//SBVH references may be split into both children, so every node owns
+	//its reference list instead of a range of primitiveInfo
+	struct SBVHState
+	{
+		//spatial splits are only tried where the best object split
+		//overlaps by more than this area
+		Float minOverlapArea;
+		//references the spatial splits may still add
+		std::atomic<int64_t> budget;
+	};
+
+	struct MortonPrimitive
+	{
+		//index into primitiveInfo before the Morton sort
+		int primitiveIndex;
+		uint32_t mortonCode;
+	};
+
+	struct LBVHTreelet
+	{
+		//range of the Morton sorted primitives
+		int startIndex, nPrimitives;
+		BVHBuildNode* buildNodes;
+	};
+
+	//spreads the low 10 bits of x so that there are two zero bits between
+	//each of them
+	inline uint32_t LeftShift3(uint32_t x)
+	{
+		if (x == (1 << 10))
+			--x;
+		x = (x | (x << 16)) & 0x030000ff;	// x = ---- --98 ---- ---- ---- ---- 7654 3210
+		x = (x | (x << 8)) & 0x0300f00f;	// x = ---- --98 ---- ---- 7654 ---- ---- 3210
+		x = (x | (x << 4)) & 0x030c30c3;	// x = ---- --98 ---- 76-- --54 ---- 32-- --10
+		x = (x | (x << 2)) & 0x09249249;	// x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+		return x;
+	}
+
+	//30 bit Morton code of a point in [0, 1024]^3, bit i belongs to axis i % 3
+	inline uint32_t EncodeMorton3(const Vector3f& v)
+	{
+		return (LeftShift3((uint32_t)v.z) << 2) | (LeftShift3((uint32_t)v.y) << 1) |
+			LeftShift3((uint32_t)v.x);
+	}
+
+	//LSD radix sort on the Morton codes. Each pass counts the digits of fixed
+	//size blocks in parallel and scatters the blocks in parallel, the sort is
+	//stable so equal codes keep their primitive order.
+	static void RadixSort(std::vector<MortonPrimitive>* v)
+	{
+		std::vector<MortonPrimitive> tempVector(v->size());
+		constexpr int bitsPerPass = 6;
+		constexpr int nBits = 30;
+		constexpr int nPasses = nBits / bitsPerPass;
+		constexpr int nBuckets = 1 << bitsPerPass;
+		constexpr int bitMask = nBuckets - 1;
+		int n = (int)v->size();
+		int nBlocks = (n + kParallelBlockSize - 1) / kParallelBlockSize;
+		std::vector<int> blockOffsets(nBlocks * nBuckets);
+
+		for (int pass = 0; pass < nPasses; ++pass)
+		{
+			int lowBit = pass * bitsPerPass;
+			std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+			std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+			ParallelFor([&](int64_t b) {
+				int* count = &blockOffsets[b * nBuckets];
+				std::fill(count, count + nBuckets, 0);
+				int blockEnd = std::min((int)(b + 1) * kParallelBlockSize, n);
+				for (int i = (int)b * kParallelBlockSize; i < blockEnd; ++i)
+					count[(in[i].mortonCode >> lowBit) & bitMask]++;
+			}, nBlocks, 1);
+
+			//bucket by bucket, block by block, so every block writes its
+			//part of a bucket after the parts of the blocks before it
+			int offset = 0;
+			for (int bucket = 0; bucket < nBuckets; ++bucket)
+			{
+				for (int b = 0; b < nBlocks; ++b)
+				{
+					int count = blockOffsets[b * nBuckets + bucket];
+					blockOffsets[b * nBuckets + bucket] = offset;
+					offset += count;
+				}
+			}
+
+			ParallelFor([&](int64_t b) {
+				int* outIndex = &blockOffsets[b * nBuckets];
+				int blockEnd = std::min((int)(b + 1) * kParallelBlockSize, n);
+				for (int i = (int)b * kParallelBlockSize; i < blockEnd; ++i)
+					out[outIndex[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+			}, nBlocks, 1);
+		}
+
+		if (nPasses & 1)
+			std::swap(*v, tempVector);
+	}
+
+	//bounds of the primitives and of their centroids in [start, end)
+	static void ComputeRangeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		int start, int end, Bounds3f* bounds, Bounds3f* centroidBounds)
+	{
+		auto scan = [&](int s, int e, Bounds3f* b, Bounds3f* cb) {
+			for (int i = s; i < e; ++i)
+			{
+				*b = Bounds3f::Union(*b, primitiveInfo[i].bounds);
+				*cb = Union(*cb, primitiveInfo[i].centroid);
+			}
+		};
+
+		if (end - start < kParallelScanPrimitives)
+		{
+			scan(start, end, bounds, centroidBounds);
+			return;
+		}
+
+		int nBlocks = (end - start + kParallelBlockSize - 1) / kParallelBlockSize;
+		std::vector<Bounds3f> blockBounds(nBlocks), blockCentroidBounds(nBlocks);
+		ParallelFor([&](int64_t b) {
+			int s = start + (int)b * kParallelBlockSize;
+			scan(s, std::min(s + kParallelBlockSize, end), &blockBounds[b], &blockCentroidBounds[b]);
+		}, nBlocks, 1);
+		for (int b = 0; b < nBlocks; ++b)
+		{
+			*bounds = Bounds3f::Union(*bounds, blockBounds[b]);
+			*centroidBounds = Bounds3f::Union(*centroidBounds, blockCentroidBounds[b]);
+		}
+	}
+
+	//std::partition of [start, end), returns the index of the first element
+	//for which pred is false. Large ranges are partitioned block by block in
+	//parallel, then the blocks are scattered to their final place.
+	template <typename Predicate>
+	static int PartitionPrimitiveInfo(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		int start, int end, const Predicate& pred)
+	{
+		if (end - start < kParallelScanPrimitives)
+		{
+			BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start],
+				&primitiveInfo[end - 1] + 1, pred);
+			return pmid - &primitiveInfo[0];
+		}
+
+		int nBlocks = (end - start + kParallelBlockSize - 1) / kParallelBlockSize;
+		auto blockStart = [=](int b) { return start + b * kParallelBlockSize; };
+		auto blockEnd = [=](int b) { return std::min(start + (b + 1) * kParallelBlockSize, end); };
+		std::vector<int> nLeft(nBlocks);
+		ParallelFor([&](int64_t b) {
+			BVHPrimitiveInfo* first = &primitiveInfo[blockStart(b)];
+			nLeft[b] = std::partition(first, &primitiveInfo[blockEnd(b) - 1] + 1, pred) - first;
+		}, nBlocks, 1);
+
+		std::vector<int> leftOffset(nBlocks), rightOffset(nBlocks);
+		int totalLeft = 0;
+		for (int b = 0; b < nBlocks; ++b)
+		{
+			leftOffset[b] = totalLeft;
+			totalLeft += nLeft[b];
+		}
+		int rightOffsetSum = totalLeft;
+		for (int b = 0; b < nBlocks; ++b)
+		{
+			rightOffset[b] = rightOffsetSum;
+			rightOffsetSum += blockEnd(b) - blockStart(b) - nLeft[b];
+		}
+
+		std::vector<BVHPrimitiveInfo> partitioned(end - start);
+		ParallelFor([&](int64_t b) {
+			const BVHPrimitiveInfo* first = &primitiveInfo[blockStart(b)];
+			const BVHPrimitiveInfo* last = &primitiveInfo[blockEnd(b) - 1] + 1;
+			std::copy(first, first + nLeft[b], &partitioned[leftOffset[b]]);
+			std::copy(first + nLeft[b], last, &partitioned[rightOffset[b]]);
+		}, nBlocks, 1);
+		ParallelFor([&](int64_t b) {
+			std::copy(&partitioned[blockStart(b) - start], &partitioned[blockEnd(b) - start - 1] + 1,
+				&primitiveInfo[blockStart(b)]);
+		}, nBlocks, 1);
+
+		return start + totalLeft;
+	}
+
+	std::shared_ptr<Primitive> BVHAccel::CreateBVHAccelerator(std::vector<std::shared_ptr<Primitive>> prims, int maxPrimsInNode, const std::string& splitName,
+		int nodeWidth, bool bakeTriangles, const std::string& cacheDir, Float spatialSplitBudget,
+		bool quantizeNodes, int triangleGroupWidth, const std::string& triangleTestName)
 	{
 		SplitMethod method = SplitMethod::SAH;
 		if (splitName == "middle")
@@ -88,369 +444,3380 @@ namespace AIR
 		{
 			method = SplitMethod::EqualCounts;
 		}
+		else if (splitName == "hlbvh")
+		{
+			method = SplitMethod::HLBVH;
+		}
+		else if (splitName == "sbvh")
+		{
+			method = SplitMethod::SBVH;
+		}
+
+		TriangleTest triangleTest = TriangleTest::Watertight;
+		if (triangleTestName == "moller")
+		{
+			triangleTest = TriangleTest::Moller;
+		}
+		else if (triangleTestName != "watertight")
+		{
+			Log::Warn("Triangle test \"{}\" unknown, using watertight", triangleTestName);
+		}
 
-		return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, method);
+		return std::make_shared<BVHAccel>(std::move(prims), maxPrimsInNode, method, nodeWidth,
+			bakeTriangles, cacheDir, spatialSplitBudget, quantizeNodes, triangleGroupWidth,
+			triangleTest);
 	}
 
 	BVHAccel::BVHAccel(std::vector<std::shared_ptr<Primitive>> p, int maxPrimsInNode,
-		SplitMethod splitMethod)
-		: maxPrimsInNode(std::min(255, maxPrimsInNode)),
+		SplitMethod splitMethod, int nodeWidth, bool bakeTriangles, const std::string& cacheDir,
+		Float spatialSplitBudget, bool quantizeNodes, int triangleGroupWidth,
+		TriangleTest triangleTest)
+		: maxPrimsInNode(std::min(255, triangleGroupWidth == 4 || triangleGroupWidth == 8 ?
+			std::max(triangleGroupWidth, maxPrimsInNode) : maxPrimsInNode)),
+		spatialSplitBudget(std::max(Float(0), spatialSplitBudget)),
 		primitives(std::move(p)),
-		splitMethod(splitMethod)
+		splitMethod(splitMethod),
+		nodeWidth(nodeWidth == 4 || nodeWidth == 8 ? nodeWidth : 2),
+		triangleGroupWidth(triangleGroupWidth == 4 || triangleGroupWidth == 8 ? triangleGroupWidth : 0),
+		triangleTest(triangleTest)
 	{
-		std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+		if (primitives.empty())
+			return;
+		if (triangleGroupWidth != 0 && this->triangleGroupWidth == 0)
+			Log::Warn("BVH triangle groups of {} unsupported, use 4 or 8", triangleGroupWidth);
+		//the groups are filled from the baked triangles
+		if (this->triangleGroupWidth)
+			bakeTriangles = true;
+		if (quantizeNodes && this->nodeWidth == 2)
+		{
+			Log::Warn("BVH node quantization needs 4 or 8 wide nodes, keeping the binary nodes");
+			quantizeNodes = false;
+		}
+
+		auto buildStart = std::chrono::steady_clock::now();
+		//a MeshPrimitive gets a reference per triangle
+		std::vector<uint32_t> firstRef(primitives.size() + 1, 0);
 		for (size_t i = 0; i < primitives.size(); ++i)
-			primitiveInfo[i] = { i, primitives[i]->WorldBound() };
+			firstRef[i + 1] = firstRef[i] + primitives[i]->SubPrimitiveCount();
+		primRefs.resize(firstRef.back());
+		ParallelFor([&](int64_t i) {
+			for (uint32_t j = firstRef[i]; j < firstRef[i + 1]; ++j)
+				primRefs[j] = { (uint32_t)i, j - firstRef[i] };
+		}, primitives.size(), 1);
+		if (primRefs.empty())
+			return;
+
+		std::vector<BVHPrimitiveInfo> primitiveInfo(primRefs.size());
+		ParallelFor([&](int64_t i) {
+			const BVHPrimitiveRef& ref = primRefs[i];
+			primitiveInfo[i] = { (size_t)i, primitives[ref.primitive]->SubPrimitiveBound(ref.sub) };
+		}, primRefs.size(), 1024);
+		Bounds3f centroidBounds;
+		ComputeRangeBounds(primitiveInfo, 0, primitiveInfo.size(), &worldBound, &centroidBounds);
+
+		uint64_t cacheKey = 0;
+		std::string cachePath;
+		if (!cacheDir.empty())
+		{
+			cacheKey = CacheKey(primitiveInfo);
+			char fileName[32];
+			snprintf(fileName, sizeof(fileName), "bvh_%016llx.bvh", (unsigned long long)cacheKey);
+			cachePath = cacheDir + "/" + fileName;
+			if (LoadCache(cachePath, cacheKey, &nNodes))
+			{
+				if (bakeTriangles)
+					BakeTriangles();
+				if (this->triangleGroupWidth)
+					GroupTriangles();
+				ReportPrimitiveMemory();
+				std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - buildStart;
+				Log::Info("BVH{} loaded {} primitives, {} nodes from {} in {:.3f}s",
+					this->nodeWidth, primRefs.size(), nNodes, cachePath, loadTime.count());
+				if (quantizeNodes)
+					QuantizeNodes(true);
+				return;
+			}
+		}
 
-		MemoryArena arena(1024 * 1024);
-		int totalNodes = 0;
-		std::vector<std::shared_ptr<Primitive>> orderedPrims;
+		//one arena per thread, the build nodes live until the tree is flattened
+		std::vector<std::unique_ptr<MemoryArena>> arenas;
+		for (int i = 0; i < MaxThreadIndex(); ++i)
+			arenas.emplace_back(new MemoryArena(1024 * 1024));
+		std::atomic<int> totalNodes(0);
 		BVHBuildNode* root;
 
-		root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
-				&totalNodes, orderedPrims);
+		if (splitMethod == SplitMethod::SBVH)
+		{
+			SBVHState state;
+			state.minOverlapArea = 1e-5f * worldBound.SurfaceArea();
+			state.budget = (int64_t)(spatialSplitBudget * primRefs.size());
+			root = SBVHBuild(arenas, primitiveInfo, 0, state, &totalNodes);
+
+			std::vector<BVHPrimitiveRef> orderedRefs;
+			orderedRefs.reserve(primRefs.size() + (int64_t)(spatialSplitBudget * primRefs.size()) - state.budget);
+			GatherSBVHLeaves(root, orderedRefs);
+			Log::Info("SBVH spatial splits added {} references to {}",
+				orderedRefs.size() - primRefs.size(), primRefs.size());
+			primRefs.swap(orderedRefs);
+		}
+		else
+		{
+			if (splitMethod == SplitMethod::HLBVH)
+				root = HLBVHBuild(arenas, primitiveInfo, &totalNodes);
+			else
+				root = recursiveBuild(arenas, primitiveInfo, 0, primRefs.size(),
+					&totalNodes);
 
-		//primitives is replaced with the orderedPrims
-		primitives.swap(orderedPrims);
+			//primRefs is replaced with the orderedRefs, the leaves of the
+			//tree reference ranges of primitiveInfo
+			std::vector<BVHPrimitiveRef> orderedRefs(primRefs.size());
+			ParallelFor([&](int64_t i) {
+				orderedRefs[i] = primRefs[primitiveInfo[i].primitiveNumber];
+			}, primRefs.size(), 1024);
+			primRefs.swap(orderedRefs);
+		}
 		primitiveInfo.resize(0);
+		ReportTreeQuality(root);
+		if (bakeTriangles)
+			BakeTriangles();
+		ReportPrimitiveMemory();
+
+		nNodes = totalNodes;
+		if (nodeWidth == 4)
+		{
+			std::vector<WideBVHNode<4>> wideNodes;
+			CollapseBVHTree(root, wideNodes);
+			nNodes = wideNodes.size();
+			wideNodes4 = AllocAligned<WideBVHNode<4>>(nNodes);
+			memcpy(wideNodes4, wideNodes.data(), nNodes * sizeof(WideBVHNode<4>));
+			ReorderWideNodes(wideNodes4);
+		}
+		else if (nodeWidth == 8)
+		{
+			std::vector<WideBVHNode<8>> wideNodes;
+			CollapseBVHTree(root, wideNodes);
+			nNodes = wideNodes.size();
+			wideNodes8 = AllocAligned<WideBVHNode<8>>(nNodes);
+			memcpy(wideNodes8, wideNodes.data(), nNodes * sizeof(WideBVHNode<8>));
+			ReorderWideNodes(wideNodes8);
+		}
+		else
+		{
+			//the root is alone at index 0 and index 1 is left empty, so the
+			//sibling pairs from index 2 on fill whole cache lines
+			nNodes = totalNodes + 1;
+			linearNodes = AllocAligned<LinearBVHNode>(nNodes);
+			linearNodes[1] = LinearBVHNode();
+			int offset = 2;
+			FlattenBVHTree(root, 0, &offset);
+			ReorderLinearNodes();
+		}
+
+		std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - buildStart;
+		Log::Info("BVH{} build {} primitives, {} nodes on {} threads in {:.3f}s",
+			nodeWidth, primRefs.size(), nNodes, MaxThreadIndex(), buildTime.count());
+		if (this->triangleGroupWidth)
+			GroupTriangles();
 
-		linearNodes = AllocAligned<LinearBVHNode>(totalNodes);
-		int offset = 0;
-		FlattenBVHTree(root, &offset);
+		//the cache always holds the float nodes
+		if (!cachePath.empty())
+			WriteCache(cachePath, cacheKey, nNodes);
+		if (quantizeNodes)
+			QuantizeNodes(true);
 	}
 
-	BVHAccel::~BVHAccel()
+	Bounds3f BVHAccel::WorldBound() const
 	{
-		FreeAligned(linearNodes);
+		return worldBound;
 	}
 
-	BVHBuildNode* BVHAccel::recursiveBuild(
-		MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo,
-		int start, int end, int* totalNodes,
-		std::vector<std::shared_ptr<Primitive>>& orderedPrims)
+	size_t BVHAccel::AcceleratorBytes() const
 	{
-		BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
-		(*totalNodes)++;
+		size_t nodeSize = quantizedNodes4 ? sizeof(QuantizedBVHNode<4>) :
+			quantizedNodes8 ? sizeof(QuantizedBVHNode<8>) :
+			nodeWidth == 4 ? sizeof(WideBVHNode<4>) :
+			nodeWidth == 8 ? sizeof(WideBVHNode<8>) : sizeof(LinearBVHNode);
+		return nNodes * nodeSize + primRefs.size() * sizeof(BVHPrimitiveRef) +
+			(bakedTriangles ? primRefs.size() * sizeof(BakedTriangle) : 0) +
+			nTriangleGroups * (triangleGroups4 ? sizeof(TriangleGroup<4>) : sizeof(TriangleGroup<8>)) +
+			leafGroups.size() * sizeof(uint32_t);
+	}
 
-		Bounds3f bounds;
-		for (int i = start; i < end; ++i)
+	BVHAccel::~BVHAccel()
+	{
+		//mapped nodes are released with cacheFile
+		if (!cacheFile)
 		{
-			bounds = Bounds3f::Union(bounds, primitiveInfo[i].bounds);
+			FreeAligned(linearNodes);
+			FreeAligned(wideNodes4);
+			FreeAligned(wideNodes8);
 		}
-		node->bounds = bounds;
+		FreeAligned(quantizedNodes4);
+		FreeAligned(quantizedNodes8);
+		FreeAligned(bakedTriangles);
+		FreeAligned(triangleGroups4);
+		FreeAligned(triangleGroups8);
+	}
 
-		//ж鳤
-		int nPrimitives = end - start;
-		if (nPrimitives == 1)
+	template <int N>
+	static void QuantizeNode(const WideBVHNode<N>& node, QuantizedBVHNode<N>* q)
+	{
+		q->nChildren = node.nChildren;
+		q->axis = node.axis;
+		for (int i = 0; i < N; ++i)
 		{
-			//1ʱ»֣leaf
-			int firstPrimOffset = orderedPrims.size();
-			int primIndex = primitiveInfo[start].primitiveNumber;
-			orderedPrims.push_back(primitives[primIndex]);
-			node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-			return node;
+			q->offset[i] = node.offset[i];
+			q->nPrimitives[i] = node.nPrimitives[i];
 		}
-
-		//ʼӽڵ
-		//ȼprimitiveĵ㹹ɵBounds
-		Bounds3f centroidBounds;
-		for (int i = start; i < end; ++i)
+		for (int a = 0; a < 3; ++a)
 		{
-			centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+			float lo = std::numeric_limits<float>::max();
+			float hi = std::numeric_limits<float>::lowest();
+			for (int i = 0; i < node.nChildren; ++i)
+			{
+				lo = std::min(lo, node.bounds[0][a][i]);
+				hi = std::max(hi, node.bounds[1][a][i]);
+			}
+			//the smallest power of two step covering the extent in 255 steps
+			int exponent;
+			std::frexp((hi - lo) * (1 + 1e-6f) / 255, &exponent);
+			float scale = std::ldexp(1.0f, std::max(exponent, -126));
+			q->origin[a] = lo;
+			q->scale[a] = scale;
+			for (int i = 0; i < N; ++i)
+			{
+				//unused slots decode to empty boxes, they are masked anyway
+				if (i >= node.nChildren)
+				{
+					q->qBounds[0][a][i] = 255;
+					q->qBounds[1][a][i] = 0;
+					continue;
+				}
+				const float childLo = node.bounds[0][a][i], childHi = node.bounds[1][a][i];
+				int qLo = Clamp((int)std::floor((childLo - lo) / scale), 0, 255);
+				int qHi = Clamp((int)std::ceil((childHi - lo) / scale), 0, 255);
+				while (qLo > 0 && lo + qLo * scale > childLo)
+					--qLo;
+				while (qHi < 255 && lo + qHi * scale < childHi)
+					++qHi;
+				q->qBounds[0][a][i] = qLo;
+				q->qBounds[1][a][i] = qHi;
+			}
 		}
-		int dim = centroidBounds.MaximumExtent();
+	}
 
-		//centroidBoundsһ
-		//primitiveInfoĵͬһλ
-		int mid = (start + end) / 2;
-		if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+	template <int N>
+	static inline void DecodeChildBounds(const QuantizedBVHNode<N>& node, float bounds[2][3][N])
+	{
+#if defined(BVH_HAVE_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		for (int s = 0; s < 2; ++s)
 		{
-			//build the leaf BVHBuildNode
-			int firstPrimOffset = orderedPrims.size();
-			for (int i = start; i < end; ++i) 
+			for (int a = 0; a < 3; ++a)
 			{
-				int primNum = primitiveInfo[i].primitiveNumber;
-				orderedPrims.push_back(primitives[primNum]);
+				__m128 origin = _mm_set1_ps(node.origin[a]);
+				__m128 scale = _mm_set1_ps(node.scale[a]);
+				for (int g = 0; g < N; g += 4)
+				{
+					int32_t packed;
+					memcpy(&packed, &node.qBounds[s][a][g], sizeof(packed));
+					__m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+					_mm_store_ps(&bounds[s][a][g], _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), scale), origin));
+				}
 			}
-			node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-			return node;
 		}
-		else
+#else
+		for (int s = 0; s < 2; ++s)
 		{
-			//еĻ־mid
-			//ȻprimitiveInfo
-			//ԭŻֵᣬ< centroidmidǰ棬mid
-			switch (splitMethod)
-			{
-				//centroidBoundĵ㻮
-			case SplitMethod::Middle:
+			for (int a = 0; a < 3; ++a)
 			{
-				Float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
-				BVHPrimitiveInfo* midPtr =
-					std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
-						[dim, pmid](const BVHPrimitiveInfo& pi) {
-					return pi.centroid[dim] < pmid;
-				});
-				mid = midPtr - &primitiveInfo[0];
-				if (mid != start && mid != end)
-					break;
-				break;
+				for (int i = 0; i < N; ++i)
+					bounds[s][a][i] = node.origin[a] + node.qBounds[s][a][i] * node.scale[a];
 			}
-				//primitiveInfo
-			case SplitMethod::EqualCounts:
-				mid = (start + end) / 2;
-				std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
-					&primitiveInfo[end - 1] + 1,
-					[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
-					return a.centroid[dim] < b.centroid[dim];
-				});
-				break;
-			case SplitMethod::SAH:
-			default:
+		}
+#endif
+	}
+
+	template <int N>
+	static void DequantizeNode(const QuantizedBVHNode<N>& q, WideBVHNode<N>* node)
+	{
+		DecodeChildBounds(q, node->bounds);
+		for (int i = 0; i < N; ++i)
+		{
+			node->offset[i] = q.offset[i];
+			node->nPrimitives[i] = q.nPrimitives[i];
+			if (i >= q.nChildren)
 			{
-				if (nPrimitives <= 2) {
-					// Partition primitives into equally-sized subsets
-					mid = (start + end) / 2;
-					std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
-						&primitiveInfo[end - 1] + 1,
-						[dim](const BVHPrimitiveInfo& a,
-							const BVHPrimitiveInfo& b) {
-						return a.centroid[dim] <
-							b.centroid[dim];
-					});
-				}
-				else
+				for (int a = 0; a < 3; ++a)
 				{
-					constexpr int nBuckets = 12;
-					BucketInfo buckets[nBuckets];
+					node->bounds[0][a][i] = std::numeric_limits<float>::max();
+					node->bounds[1][a][i] = std::numeric_limits<float>::lowest();
+				}
+			}
+		}
+		node->nChildren = q.nChildren;
+		node->axis = q.axis;
+	}
 
-					// Initialize _BucketInfo_ for SAH partition buckets
-					for (int i = start; i < end; ++i) 
-					{
-						//㵱ǰPrimitiveĸbucket
-						int b = nBuckets *
-							centroidBounds.Offset(
-								primitiveInfo[i].centroid)[dim];
-						if (b == nBuckets) 
-							b = nBuckets - 1;
-						//CHECK_GE(b, 0);
-						//CHECK_LT(b, nBuckets);
-						buckets[b].count++;
-						//bucketbounds
-						buckets[b].bounds =
-							Union(buckets[b].bounds, primitiveInfo[i].bounds);
-					}
+	void BVHAccel::QuantizeNodes(bool report)
+	{
+		auto quantize = [&](auto*& nodes, auto*& quantized) {
+			using QNode = typename std::remove_reference<decltype(*quantized)>::type;
+			quantized = AllocAligned<QNode>(nNodes);
+			ParallelFor([&](int64_t i) {
+				QuantizeNode(nodes[i], &quantized[i]);
+			}, nNodes, 4096);
+			if (!cacheFile)
+				FreeAligned(nodes);
+			nodes = nullptr;
+			if (report)
+				Log::Info("BVH{} quantized {} nodes, {:.1f} MB instead of {:.1f} MB", nodeWidth, nNodes,
+					nNodes * sizeof(QNode) / (1024.0 * 1024.0),
+					nNodes * sizeof(*nodes) / (1024.0 * 1024.0));
+		};
+		if (nodeWidth == 4)
+			quantize(wideNodes4, quantizedNodes4);
+		else if (nodeWidth == 8)
+			quantize(wideNodes8, quantizedNodes8);
+		//mapped cache nodes aren't referenced anymore
+		cacheFile.reset();
+	}
 
-					//飬ÿcost
-					//cost(A,B) = t_trav + pAt_isect(ai) + pBt_isect(ai)
-					//t_trav = 0.125; t_isect = 1
-					Float cost[nBuckets - 1];
-					for (int i = 0; i < nBuckets - 1; ++i) 
-					{
-						Bounds3f bA, bB;
-						int count0 = 0, count1 = 0;
-						for (int j = 0; j <= i; ++j) 
-						{
-							bA = Union(bA, buckets[j].bounds);
-							count0 += buckets[j].count; 
-						}
-						for (int j = i + 1; j < nBuckets; ++j) 
-						{
-							bB = Union(bB, buckets[j].bounds);
-							count1 += buckets[j].count;
-						}
-						//t_trav = 0.125f
-						cost[i] = 0.125f +
-							(count0 * bA.SurfaceArea() +
-								count1 * bB.SurfaceArea()) /
-							bounds.SurfaceArea();
-					}
+	void BVHAccel::DequantizeNodes()
+	{
+		auto dequantize = [&](auto*& quantized, auto*& nodes) {
+			using Node = typename std::remove_reference<decltype(*nodes)>::type;
+			nodes = AllocAligned<Node>(nNodes);
+			ParallelFor([&](int64_t i) {
+				DequantizeNode(quantized[i], &nodes[i]);
+			}, nNodes, 4096);
+			FreeAligned(quantized);
+			quantized = nullptr;
+		};
+		if (quantizedNodes4)
+			dequantize(quantizedNodes4, wideNodes4);
+		else if (quantizedNodes8)
+			dequantize(quantizedNodes8, wideNodes8);
+	}
 
-					// Find bucket to split at that minimizes SAH metric
-					Float minCost = cost[0];
-					int minCostSplitBucket = 0;
-					for (int i = 1; i < nBuckets - 1; ++i) 
-					{
-						if (cost[i] < minCost) 
-						{
+	//bump when the layout of the nodes, the refs or the build changes
+	static constexpr uint32_t kBVHCacheVersion = 3;
+	static constexpr size_t kHashBlockBytes = 1024 * 1024;
+
+	struct BVHCacheHeader
+	{
+		char magic[8];
+		uint32_t version;
+		//sizeof the node type, catches a cache written by another build
+		uint32_t nodeSize;
+		uint64_t key;
+		//hash of the file after the header
+		uint64_t checksum;
+		uint64_t nRefs;
+		uint64_t nNodes;
+		uint64_t refsOffset;
+		uint64_t nodesOffset;
+		uint64_t fileSize;
+	};
+	static const char kBVHCacheMagic[8] = { 'A', 'I', 'R', 'B', 'V', 'H', 0, 0 };
+
+	//FNV-1a over 8 byte words, the bytes past the last whole word one by one
+	static uint64_t HashBytes(const void* data, size_t size, uint64_t h = 14695981039346656037ull)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, bytes + i, 8);
+			h = (h ^ word) * 1099511628211ull;
+			h ^= h >> 32;
+		}
+		for (; i < size; ++i)
+			h = (h ^ bytes[i]) * 1099511628211ull;
+		//finalizer of MurmurHash3, spreads the last words over all bits
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	//hashes fixed size blocks in parallel, then the block hashes
+	static uint64_t HashBlocks(const uint8_t* data, size_t size)
+	{
+		size_t nBlocks = (size + kHashBlockBytes - 1) / kHashBlockBytes;
+		std::vector<uint64_t> blockHash(nBlocks);
+		ParallelFor([&](int64_t b) {
+			size_t start = b * kHashBlockBytes;
+			blockHash[b] = HashBytes(data + start, std::min(kHashBlockBytes, size - start));
+		}, nBlocks, 1);
+		return HashBytes(blockHash.data(), nBlocks * sizeof(uint64_t), size);
+	}
+
+	static size_t NodeSize(int nodeWidth)
+	{
+		if (nodeWidth == 4)
+			return sizeof(WideBVHNode<4>);
+		if (nodeWidth == 8)
+			return sizeof(WideBVHNode<8>);
+		return sizeof(LinearBVHNode);
+	}
+
+	static uint64_t AlignCacheOffset(uint64_t offset)
+	{
+		return (offset + 63) & ~uint64_t(63);
+	}
+
+	uint64_t BVHAccel::CacheKey(const std::vector<BVHPrimitiveInfo>& primitiveInfo) const
+	{
+		//the build only sees the bounds, so they identify the scene content
+		size_t nBlocks = (primitiveInfo.size() + kParallelBlockSize - 1) / kParallelBlockSize;
+		std::vector<uint64_t> blockHash(nBlocks);
+		ParallelFor([&](int64_t b) {
+			uint64_t h = 14695981039346656037ull;
+			size_t end = std::min(primitiveInfo.size(), size_t(b + 1) * kParallelBlockSize);
+			for (size_t i = b * kParallelBlockSize; i < end; ++i)
+				h = HashBytes(&primitiveInfo[i].bounds, sizeof(Bounds3f), h);
+			blockHash[b] = h;
+		}, nBlocks, 1);
+
+		uint64_t key = HashBytes(blockHash.data(), nBlocks * sizeof(uint64_t));
+		key = HashBlocks((const uint8_t*)primRefs.data(), primRefs.size() * sizeof(BVHPrimitiveRef)) ^ key;
+		const int32_t params[] = { (int32_t)kBVHCacheVersion, maxPrimsInNode,
+			(int32_t)splitMethod, nodeWidth, (int32_t)(spatialSplitBudget * 1000),
+			triangleGroupWidth };
+		return HashBytes(params, sizeof(params), key);
+	}
+
+	bool BVHAccel::LoadCache(const std::string& path, uint64_t key, int* nNodes)
+	{
+		std::unique_ptr<MappedFile> file(new MappedFile());
+		if (!file->Open(path))
+			return false;
+
+		const uint8_t* data = file->Data();
+		const BVHCacheHeader* header = (const BVHCacheHeader*)data;
+		const size_t nodeSize = NodeSize(nodeWidth);
+		if (file->Size() < sizeof(BVHCacheHeader) ||
+			memcmp(header->magic, kBVHCacheMagic, sizeof(kBVHCacheMagic)) != 0 ||
+			header->version != kBVHCacheVersion || header->nodeSize != nodeSize ||
+			header->key != key ||
+			(splitMethod == SplitMethod::SBVH ? header->nRefs < primRefs.size() : header->nRefs != primRefs.size()) ||
+			header->fileSize != file->Size() ||
+			header->refsOffset + header->nRefs * sizeof(BVHPrimitiveRef) > header->nodesOffset ||
+			header->nodesOffset % 64 != 0 ||
+			header->nodesOffset + header->nNodes * nodeSize != header->fileSize)
+		{
+			Log::Warn("BVH cache {} doesn't match the scene, rebuilding", path);
+			return false;
+		}
+		if (HashBlocks(data + header->refsOffset, header->fileSize - header->refsOffset) != header->checksum)
+		{
+			Log::Warn("BVH cache {} is corrupt, rebuilding", path);
+			return false;
+		}
+
+		primRefs.resize(header->nRefs);
+		memcpy(primRefs.data(), data + header->refsOffset, header->nRefs * sizeof(BVHPrimitiveRef));
+		uint8_t* nodes = file->Data() + header->nodesOffset;
+		if (nodeWidth == 4)
+			wideNodes4 = (WideBVHNode<4>*)nodes;
+		else if (nodeWidth == 8)
+			wideNodes8 = (WideBVHNode<8>*)nodes;
+		else
+			linearNodes = (LinearBVHNode*)nodes;
+		*nNodes = (int)header->nNodes;
+		cacheFile = std::move(file);
+		return true;
+	}
+
+	void BVHAccel::WriteCache(const std::string& path, uint64_t key, int nNodes) const
+	{
+		const size_t nodeSize = NodeSize(nodeWidth);
+		BVHCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, kBVHCacheMagic, sizeof(kBVHCacheMagic));
+		header.version = kBVHCacheVersion;
+		header.nodeSize = nodeSize;
+		header.key = key;
+		header.nRefs = primRefs.size();
+		header.nNodes = nNodes;
+		header.refsOffset = AlignCacheOffset(sizeof(BVHCacheHeader));
+		header.nodesOffset = AlignCacheOffset(header.refsOffset + primRefs.size() * sizeof(BVHPrimitiveRef));
+		header.fileSize = header.nodesOffset + nNodes * nodeSize;
+
+		std::vector<uint8_t> buffer(header.fileSize, 0);
+		memcpy(&buffer[header.refsOffset], primRefs.data(), primRefs.size() * sizeof(BVHPrimitiveRef));
+		const void* nodes = nodeWidth == 4 ? (const void*)wideNodes4 :
+			nodeWidth == 8 ? (const void*)wideNodes8 : (const void*)linearNodes;
+		memcpy(&buffer[header.nodesOffset], nodes, nNodes * nodeSize);
+		header.checksum = HashBlocks(&buffer[header.refsOffset], header.fileSize - header.refsOffset);
+		memcpy(&buffer[0], &header, sizeof(header));
+
+		//written next to the final name and renamed, so a render that is
+		//killed halfway never leaves a truncated cache behind
+		std::string tmpPath = path + ".tmp";
+		std::ofstream fs(tmpPath, std::ios::binary);
+		fs.write((const char*)buffer.data(), buffer.size());
+		fs.close();
+		if (!fs)
+		{
+			Log::Warn("BVH cache {} can't be written", tmpPath);
+			std::remove(tmpPath.c_str());
+			return;
+		}
+		std::remove(path.c_str());
+		if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+		{
+			Log::Warn("BVH cache {} can't be written", path);
+			std::remove(tmpPath.c_str());
+			return;
+		}
+		Log::Info("BVH cache saved to {}, {:.1f} MB", path, buffer.size() / (1024.0 * 1024.0));
+	}
+
+	void BVHAccel::BakeTriangles()
+	{
+		//baked again after every refit
+		FreeAligned(bakedTriangles);
+		bakedTriangles = AllocAligned<BakedTriangle>(primRefs.size());
+		std::atomic<int> nBaked(0);
+		ParallelFor([&](int64_t i) {
+			BakedTriangle& baked = bakedTriangles[i];
+			baked.isTriangle = 0;
+			const BVHPrimitiveRef& ref = primRefs[i];
+			Point3f p[3];
+			if (!primitives[ref.primitive]->SubTriangleVertices(ref.sub, p))
+				return;
+			//degenerate triangles keep the full path which rejects them
+			if (Vector3f::Cross(p[2] - p[0], p[1] - p[0]).LengthSquared() == 0)
+				return;
+			baked.p0 = p[0];
+			baked.p1 = p[1];
+			baked.p2 = p[2];
+			baked.isTriangle = 1;
+			++nBaked;
+		}, primRefs.size(), 1024);
+
+		Log::Info("BVH baked {} of {} primitives as triangles, {} bytes per primitive, {:.1f} MB",
+			nBaked.load(), primRefs.size(), sizeof(BakedTriangle),
+			primRefs.size() * sizeof(BakedTriangle) / (1024.0 * 1024.0));
+	}
+
+	//fills group with the n <= W baked triangles from baked[first], the
+	//primitives that aren't triangles go to otherMask
+	template <int W>
+	static void FillTriangleGroup(TriangleGroup<W>& group, const BakedTriangle* baked,
+		int first, int n)
+	{
+		memset(&group, 0, sizeof(group));
+		for (int lane = 0; lane < n; ++lane)
+		{
+			const BakedTriangle& triangle = baked[first + lane];
+			group.index[lane] = first + lane;
+			if (!triangle.isTriangle)
+			{
+				group.otherMask |= 1u << lane;
+				continue;
+			}
+			const Point3f* p[3] = { &triangle.p0, &triangle.p1, &triangle.p2 };
+			for (int v = 0; v < 3; ++v)
+			{
+				for (int axis = 0; axis < 3; ++axis)
+					group.p[v][axis][lane] = (*p[v])[axis];
+			}
+			group.triangleMask |= 1u << lane;
+		}
+	}
+
+	template <int W>
+	static TriangleGroup<W>* GroupLeafTriangles(const BakedTriangle* baked,
+		const std::vector<std::pair<int, int>>& leaves, std::vector<uint32_t>& leafGroups,
+		int* nGroups)
+	{
+		std::vector<int> firstGroup(leaves.size() + 1, 0);
+		for (size_t i = 0; i < leaves.size(); ++i)
+			firstGroup[i + 1] = firstGroup[i] + (leaves[i].second + W - 1) / W;
+		*nGroups = firstGroup.back();
+		TriangleGroup<W>* groups = AllocAligned<TriangleGroup<W>>(*nGroups);
+		ParallelFor([&](int64_t i) {
+			int offset = leaves[i].first, n = leaves[i].second;
+			leafGroups[offset] = firstGroup[i];
+			for (int g = 0; g * W < n; ++g)
+				FillTriangleGroup(groups[firstGroup[i] + g], baked, offset + g * W,
+					std::min(W, n - g * W));
+		}, leaves.size(), 1024);
+		return groups;
+	}
+
+	void BVHAccel::GroupTriangles()
+	{
+		FreeAligned(triangleGroups4);
+		FreeAligned(triangleGroups8);
+		triangleGroups4 = nullptr;
+		triangleGroups8 = nullptr;
+
+		//(first primRef, count) of every leaf in primRefs order
+		std::vector<std::pair<int, int>> leaves;
+		if (wideNodes4 || wideNodes8)
+		{
+			for (int i = 0; i < nNodes; ++i)
+			{
+				int nChildren = wideNodes4 ? wideNodes4[i].nChildren : wideNodes8[i].nChildren;
+				for (int c = 0; c < nChildren; ++c)
+				{
+					int n = wideNodes4 ? wideNodes4[i].nPrimitives[c] : wideNodes8[i].nPrimitives[c];
+					if (n > 0)
+						leaves.emplace_back(wideNodes4 ? wideNodes4[i].offset[c] : wideNodes8[i].offset[c], n);
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < nNodes; ++i)
+			{
+				if (linearNodes[i].nPrimitives > 0)
+					leaves.emplace_back(linearNodes[i].primitivesOffset, linearNodes[i].nPrimitives);
+			}
+		}
+		std::sort(leaves.begin(), leaves.end());
+
+		leafGroups.assign(primRefs.size(), 0);
+		if (triangleGroupWidth == 4)
+			triangleGroups4 = GroupLeafTriangles<4>(bakedTriangles, leaves, leafGroups, &nTriangleGroups);
+		else
+			triangleGroups8 = GroupLeafTriangles<8>(bakedTriangles, leaves, leafGroups, &nTriangleGroups);
+
+		size_t groupBytes = nTriangleGroups *
+			(triangleGroups4 ? sizeof(TriangleGroup<4>) : sizeof(TriangleGroup<8>));
+		Log::Info("BVH grouped the primitives of {} leaves into {} groups of {}, {:.1f} lanes used, "
+			"{:.1f} MB", leaves.size(), nTriangleGroups, triangleGroupWidth,
+			nTriangleGroups ? double(primRefs.size()) / nTriangleGroups : 0.0,
+			groupBytes / (1024.0 * 1024.0));
+	}
+
+	void BVHAccel::ReportPrimitiveMemory() const
+	{
+		size_t nMeshes = 0, nMeshTriangles = 0;
+		for (const auto& primitive : primitives)
+		{
+			if (dynamic_cast<const MeshPrimitive*>(primitive.get()))
+			{
+				++nMeshes;
+				nMeshTriangles += primitive->SubPrimitiveCount();
+			}
+		}
+		if (nMeshTriangles == 0)
+			return;
+
+		//make_shared puts the object behind a control block holding a vtable
+		//pointer and the use and weak counts
+		const size_t controlBlock = sizeof(void*) + 2 * sizeof(int);
+		//a Primitive and a Triangle per triangle, both made with make_shared,
+		//and the shared_ptr of the Primitive in the primitive list
+		const size_t perTriangle = sizeof(std::shared_ptr<Primitive>) +
+			sizeof(Primitive) + sizeof(Triangle) + 2 * controlBlock;
+		//the reference in the BVH, the MeshPrimitive is shared by the mesh
+		const double perMeshTriangle = sizeof(BVHPrimitiveRef) +
+			double(nMeshes * (sizeof(std::shared_ptr<Primitive>) + sizeof(MeshPrimitive) +
+				controlBlock)) / nMeshTriangles;
+		Log::Info("BVH {} triangles in {} mesh primitives take {:.1f} bytes per triangle, "
+			"{} bytes with a Primitive and Triangle per triangle, {:.1f} MB saved",
+			nMeshTriangles, nMeshes, perMeshTriangle, perTriangle,
+			nMeshTriangles * (perTriangle - perMeshTriangle) / (1024.0 * 1024.0));
+	}
+
+	inline bool BVHAccel::IntersectPrimitive(int index, const Ray& ray,
+		SurfaceInteraction* isect, BakedHit* bakedHit) const
+	{
+		if (bakedTriangles && bakedTriangles[index].isTriangle)
+		{
+			const BakedTriangle& baked = bakedTriangles[index];
+			Float tHit;
+			bool triangleHit = triangleTest == TriangleTest::Moller ?
+				IntersectTriangleMoller(ray, baked.p0, baked.p1, baked.p2, &tHit, bakedHit->b) :
+				IntersectTriangle(ray, baked.p0, baked.p1, baked.p2, &tHit, bakedHit->b);
+			if (!triangleHit)
+				return false;
+			ray.tMax = tHit;
+			bakedHit->index = index;
+			return true;
+		}
+
+		const BVHPrimitiveRef& ref = primRefs[index];
+		if (!primitives[ref.primitive]->IntersectSub(ref.sub, ray, isect))
+			return false;
+		bakedHit->index = -1;
+		return true;
+	}
+
+	inline bool BVHAccel::IntersectPrimitiveP(int index, const Ray& ray) const
+	{
+		if (bakedTriangles && bakedTriangles[index].isTriangle)
+		{
+			const BakedTriangle& baked = bakedTriangles[index];
+			Float tHit, b[3];
+			if (triangleTest == TriangleTest::Moller)
+				return IntersectTriangleMoller(ray, baked.p0, baked.p1, baked.p2, &tHit, b);
+			return IntersectTriangle(ray, baked.p0, baked.p1, baked.p2, &tHit, b);
+		}
+		const BVHPrimitiveRef& ref = primRefs[index];
+		return primitives[ref.primitive]->IntersectPSub(ref.sub, ray);
+	}
+
+	void BVHAccel::FinishIntersect(const Ray& ray, const BakedHit& bakedHit,
+		SurfaceInteraction* isect) const
+	{
+		if (bakedHit.index < 0)
+			return;
+		const BVHPrimitiveRef& ref = primRefs[bakedHit.index];
+		primitives[ref.primitive]->SubTriangleInteraction(ref.sub, ray, bakedHit.b, isect);
+	}
+
+	BVHBuildNode* BVHAccel::recursiveBuild(
+		std::vector<std::unique_ptr<MemoryArena>>& arenas,
+		std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		int start, int end, std::atomic<int>* totalNodes)
+	{
+		BVHBuildNode* node = arenas[ThreadIndex]->Alloc<BVHBuildNode>();
+		(*totalNodes)++;
+
+		//bounds and centroid bounds are gathered in one pass
+		Bounds3f bounds, centroidBounds;
+		ComputeRangeBounds(primitiveInfo, start, end, &bounds, &centroidBounds);
+		node->bounds = bounds;
+
+		//ж鳤
+		int nPrimitives = end - start;
+		if (nPrimitives == 1)
+		{
+			//1ʱ»֣leaf
+			node->InitLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+
+		//ʼӽڵ
+		//ȼprimitiveĵ㹹ɵBounds
+		int dim = centroidBounds.MaximumExtent();
+
+		//centroidBoundsһ
+		//primitiveInfoĵͬһλ
+		int mid = (start + end) / 2;
+		if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+		{
+			//build the leaf BVHBuildNode
+			node->InitLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+		else
+		{
+			//еĻ־mid
+			//ȻprimitiveInfo
+			//ԭŻֵᣬ< centroidmidǰ棬mid
+			switch (splitMethod)
+			{
+				//centroidBoundĵ㻮
+			case SplitMethod::Middle:
+			{
+				Float pmid = (centroidBounds.pMin[dim] + centroidBounds.pMax[dim]) / 2;
+				mid = PartitionPrimitiveInfo(primitiveInfo, start, end,
+					[dim, pmid](const BVHPrimitiveInfo& pi) {
+					return pi.centroid[dim] < pmid;
+				});
+				if (mid != start && mid != end)
+					break;
+				break;
+			}
+				//primitiveInfo
+			case SplitMethod::EqualCounts:
+				mid = (start + end) / 2;
+				std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+					&primitiveInfo[end - 1] + 1,
+					[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+					return a.centroid[dim] < b.centroid[dim];
+				});
+				break;
+			case SplitMethod::SAH:
+			default:
+			{
+				if (nPrimitives <= 2) {
+					// Partition primitives into equally-sized subsets
+					mid = (start + end) / 2;
+					std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+						&primitiveInfo[end - 1] + 1,
+						[dim](const BVHPrimitiveInfo& a,
+							const BVHPrimitiveInfo& b) {
+						return a.centroid[dim] <
+							b.centroid[dim];
+					});
+				}
+				else
+				{
+					constexpr int nBuckets = 12;
+					BucketInfo buckets[nBuckets];
+
+					// Initialize _BucketInfo_ for SAH partition buckets
+					for (int i = start; i < end; ++i) 
+					{
+						//㵱ǰPrimitiveĸbucket
+						int b = nBuckets *
+							centroidBounds.Offset(
+								primitiveInfo[i].centroid)[dim];
+						if (b == nBuckets) 
+							b = nBuckets - 1;
+						//CHECK_GE(b, 0);
+						//CHECK_LT(b, nBuckets);
+						buckets[b].count++;
+						//bucketbounds
+						buckets[b].bounds =
+							Union(buckets[b].bounds, primitiveInfo[i].bounds);
+					}
+
+					//飬ÿcost
+					//cost(A,B) = t_trav + pAt_isect(ai) + pBt_isect(ai)
+					//t_trav = 0.125; t_isect = 1
+					Float cost[nBuckets - 1];
+					for (int i = 0; i < nBuckets - 1; ++i) 
+					{
+						Bounds3f bA, bB;
+						int count0 = 0, count1 = 0;
+						for (int j = 0; j <= i; ++j) 
+						{
+							bA = Union(bA, buckets[j].bounds);
+							count0 += buckets[j].count; 
+						}
+						for (int j = i + 1; j < nBuckets; ++j) 
+						{
+							bB = Union(bB, buckets[j].bounds);
+							count1 += buckets[j].count;
+						}
+						//t_trav = 0.125f
+						cost[i] = 0.125f +
+							(LeafIntersectCost(count0) * bA.SurfaceArea() +
+								LeafIntersectCost(count1) * bB.SurfaceArea()) /
+							bounds.SurfaceArea();
+					}
+
+					// Find bucket to split at that minimizes SAH metric
+					Float minCost = cost[0];
+					int minCostSplitBucket = 0;
+					for (int i = 1; i < nBuckets - 1; ++i) 
+					{
+						if (cost[i] < minCost) 
+						{
 							minCost = cost[i];
 							minCostSplitBucket = i;
 						}
 					}
 
 					//Ҷӽڵ
-					Float leafCost = nPrimitives;
+					Float leafCost = LeafIntersectCost(nPrimitives);
 					if (nPrimitives > maxPrimsInNode || minCost < leafCost)
 					{
-						BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start],
-							&primitiveInfo[end - 1] + 1,
+						mid = PartitionPrimitiveInfo(primitiveInfo, start, end,
 							[=](const BVHPrimitiveInfo& pi) {
 							int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
 							if (b == nBuckets) b = nBuckets - 1;
 							return b <= minCostSplitBucket;
 						});
-						mid = pmid - &primitiveInfo[0];
 					}
 					else
 					{
-						int firstPrimOffset = orderedPrims.size();
-						for (int i = start; i < end; ++i) {
-							int primNum = primitiveInfo[i].primitiveNumber;
-							orderedPrims.push_back(primitives[primNum]);
-						}
-						node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+						node->InitLeaf(start, nPrimitives, bounds);
 						return node;
 					}
 				}
 			}
-				break;
+				break;
+			}
+
+			//the two halves touch disjoint ranges of primitiveInfo, so large
+			//subtrees are built as independent tasks on the thread pool
+			BVHBuildNode* children[2];
+			if (nPrimitives > kParallelBuildPrimitives)
+			{
+				ParallelFor([&](int64_t i) {
+					children[i] = i == 0 ? recursiveBuild(arenas, primitiveInfo, start, mid, totalNodes) :
+						recursiveBuild(arenas, primitiveInfo, mid, end, totalNodes);
+				}, 2, 1);
+			}
+			else
+			{
+				children[0] = recursiveBuild(arenas, primitiveInfo, start, mid, totalNodes);
+				children[1] = recursiveBuild(arenas, primitiveInfo, mid, end, totalNodes);
+			}
+			node->InitInterior(dim, children[0], children[1]);
+		}
+
+		
+
+		return node;
+	}
+
+	//SBVH nodes deeper than this only use object splits
+	static constexpr int kSBVHMaxSpatialDepth = 48;
+
+	//object buckets and spatial bins of an SBVH node, 12 like the SAH
+	//build for small nodes and up to 64 for large ones
+	static int SBVHBucketCount(int nRefs)
+	{
+		return std::min(64, std::max(12, nRefs / 256));
+	}
+
+	static bool IsValidBounds(const Bounds3f& b)
+	{
+		return b.pMin.x <= b.pMax.x && b.pMin.y <= b.pMax.y && b.pMin.z <= b.pMax.z;
+	}
+
+	Bounds3f BVHAccel::ClipReference(const BVHPrimitiveInfo& ref, int axis, Float lo, Float hi) const
+	{
+		Bounds3f clipped;
+		Point3f p[3];
+		const BVHPrimitiveRef& primRef = primRefs[ref.primitiveNumber];
+		if (primitives[primRef.primitive]->SubTriangleVertices(primRef.sub, p))
+		{
+			//the vertices inside the slab and the points where the edges
+			//cross its planes
+			for (int i = 0; i < 3; ++i)
+			{
+				const Point3f& v0 = p[i];
+				const Point3f& v1 = p[(i + 1) % 3];
+				if (v0[axis] >= lo && v0[axis] <= hi)
+					clipped = Union(clipped, v0);
+				for (Float plane : { lo, hi })
+				{
+					if ((v0[axis] < plane && v1[axis] > plane) || (v0[axis] > plane && v1[axis] < plane))
+					{
+						Float t = (plane - v0[axis]) / (v1[axis] - v0[axis]);
+						Point3f q = v0 + (v1 - v0) * t;
+						q[axis] = plane;
+						clipped = Union(clipped, q);
+					}
+				}
+			}
+		}
+		else
+			clipped = ref.bounds;
+		clipped.pMin[axis] = std::max(clipped.pMin[axis], lo);
+		clipped.pMax[axis] = std::min(clipped.pMax[axis], hi);
+		//the reference may already be clipped by an earlier split
+		return Bounds3f::Intersect(clipped, ref.bounds);
+	}
+
+	BVHBuildNode* BVHAccel::SBVHBuild(
+		std::vector<std::unique_ptr<MemoryArena>>& arenas,
+		std::vector<BVHPrimitiveInfo>& refs, int depth,
+		SBVHState& state, std::atomic<int>* totalNodes) const
+	{
+		BVHBuildNode* node = arenas[ThreadIndex]->Alloc<BVHBuildNode>();
+		(*totalNodes)++;
+
+		const int nRefs = refs.size();
+		Bounds3f bounds, centroidBounds;
+		ComputeRangeBounds(refs, 0, nRefs, &bounds, &centroidBounds);
+		auto makeLeaf = [&]() {
+			uint32_t* leafRefs = arenas[ThreadIndex]->Alloc<uint32_t>(nRefs, false);
+			for (int i = 0; i < nRefs; ++i)
+				leafRefs[i] = refs[i].primitiveNumber;
+			node->InitLeaf(0, nRefs, bounds);
+			node->leafRefs = leafRefs;
+			return node;
+		};
+		if (nRefs == 1)
+			return makeLeaf();
+
+		//the costs below are SAH costs times the node area
+		const int nBuckets = SBVHBucketCount(nRefs);
+		std::vector<BucketInfo> buckets(nBuckets);
+		std::vector<Bounds3f> rightBounds(nBuckets);
+		std::vector<int> rightCount(nBuckets);
+
+		//object split over the buckets of all three axes
+		Float objectCost = Infinity;
+		int objectAxis = -1, objectBucket = -1;
+		Bounds3f objectLeft, objectRight;
+		auto bucketOf = [&](const BVHPrimitiveInfo& ref, int axis) {
+			int b = nBuckets * centroidBounds.Offset(ref.centroid)[axis];
+			return std::min(b, nBuckets - 1);
+		};
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (centroidBounds.pMax[axis] == centroidBounds.pMin[axis])
+				continue;
+			std::fill(buckets.begin(), buckets.end(), BucketInfo());
+			for (const BVHPrimitiveInfo& ref : refs)
+			{
+				BucketInfo& bucket = buckets[bucketOf(ref, axis)];
+				bucket.count++;
+				bucket.bounds = Union(bucket.bounds, ref.bounds);
+			}
+			Bounds3f right;
+			int nRight = 0;
+			for (int i = nBuckets - 1; i > 0; --i)
+			{
+				right = Union(right, buckets[i].bounds);
+				nRight += buckets[i].count;
+				rightBounds[i] = right;
+				rightCount[i] = nRight;
+			}
+			Bounds3f left;
+			int nLeft = 0;
+			for (int i = 0; i < nBuckets - 1; ++i)
+			{
+				left = Union(left, buckets[i].bounds);
+				nLeft += buckets[i].count;
+				if (nLeft == 0 || rightCount[i + 1] == 0)
+					continue;
+				Float cost = LeafIntersectCost(nLeft) * left.SurfaceArea() +
+					LeafIntersectCost(rightCount[i + 1]) * rightBounds[i + 1].SurfaceArea();
+				if (cost < objectCost)
+				{
+					objectCost = cost;
+					objectAxis = axis;
+					objectBucket = i;
+					objectLeft = left;
+					objectRight = rightBounds[i + 1];
+				}
+			}
+		}
+
+		//spatial split over bins of the node bounds, a reference is clipped
+		//to every bin it spans
+		Float spatialCost = Infinity;
+		int spatialAxis = -1;
+		Float spatialPlane = 0;
+		Bounds3f spatialLeft, spatialRight;
+		int spatialNLeft = 0, spatialNRight = 0;
+		Bounds3f objectOverlap = Bounds3f::Intersect(objectLeft, objectRight);
+		if (depth < kSBVHMaxSpatialDepth && state.budget > 0 &&
+			(objectAxis == -1 || (IsValidBounds(objectOverlap) &&
+				objectOverlap.SurfaceArea() > state.minOverlapArea)))
+		{
+			const int nBins = nBuckets;
+			std::vector<Bounds3f> binBounds(nBins);
+			std::vector<int> entry(nBins), exit(nBins);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const Float origin = bounds.pMin[axis];
+				const Float width = (bounds.pMax[axis] - origin) / nBins;
+				if (!(width > 0))
+					continue;
+				std::fill(binBounds.begin(), binBounds.end(), Bounds3f());
+				std::fill(entry.begin(), entry.end(), 0);
+				std::fill(exit.begin(), exit.end(), 0);
+				for (const BVHPrimitiveInfo& ref : refs)
+				{
+					int first = Clamp(int((ref.bounds.pMin[axis] - origin) / width), 0, nBins - 1);
+					int last = Clamp(int((ref.bounds.pMax[axis] - origin) / width), first, nBins - 1);
+					++entry[first];
+					++exit[last];
+					if (first == last)
+					{
+						binBounds[first] = Union(binBounds[first], ref.bounds);
+						continue;
+					}
+					for (int b = first; b <= last; ++b)
+					{
+						Float lo = origin + b * width;
+						Float hi = b == nBins - 1 ? bounds.pMax[axis] : origin + (b + 1) * width;
+						Bounds3f part = ClipReference(ref, axis, lo, hi);
+						if (IsValidBounds(part))
+							binBounds[b] = Union(binBounds[b], part);
+					}
+				}
+
+				Bounds3f right;
+				int nRight = 0;
+				for (int i = nBins - 1; i > 0; --i)
+				{
+					right = Union(right, binBounds[i]);
+					nRight += exit[i];
+					rightBounds[i] = right;
+					rightCount[i] = nRight;
+				}
+				Bounds3f left;
+				int nLeft = 0;
+				for (int i = 0; i < nBins - 1; ++i)
+				{
+					left = Union(left, binBounds[i]);
+					nLeft += entry[i];
+					if (nLeft == 0 || rightCount[i + 1] == 0)
+						continue;
+					Float cost = LeafIntersectCost(nLeft) * left.SurfaceArea() +
+						LeafIntersectCost(rightCount[i + 1]) * rightBounds[i + 1].SurfaceArea();
+					if (cost < spatialCost)
+					{
+						spatialCost = cost;
+						spatialAxis = axis;
+						spatialPlane = origin + (i + 1) * width;
+						spatialLeft = left;
+						spatialRight = rightBounds[i + 1];
+						spatialNLeft = nLeft;
+						spatialNRight = rightCount[i + 1];
+					}
+				}
+			}
+		}
+
+		Float splitCost = 0.125f * bounds.SurfaceArea() + std::min(objectCost, spatialCost);
+		Float leafCost = LeafIntersectCost(nRefs) * bounds.SurfaceArea();
+		if ((objectAxis == -1 && spatialAxis == -1) ||
+			(nRefs <= maxPrimsInNode && splitCost >= leafCost))
+			return makeLeaf();
+
+		std::vector<BVHPrimitiveInfo> childRefs[2];
+		int axis = objectAxis;
+		if (spatialAxis != -1 && spatialCost < objectCost)
+		{
+			//the budget of splitting every straddling reference is taken up
+			//front, what the unsplitting saves is given back
+			int nStraddling = 0;
+			for (const BVHPrimitiveInfo& ref : refs)
+			{
+				if (ref.bounds.pMin[spatialAxis] < spatialPlane && ref.bounds.pMax[spatialAxis] > spatialPlane)
+					++nStraddling;
+			}
+			int nSplit = 0;
+			if (state.budget.fetch_sub(nStraddling) >= nStraddling)
+			{
+				const Float leftArea = spatialLeft.SurfaceArea(), rightArea = spatialRight.SurfaceArea();
+				for (const BVHPrimitiveInfo& ref : refs)
+				{
+					if (ref.bounds.pMax[spatialAxis] <= spatialPlane)
+					{
+						childRefs[0].push_back(ref);
+						continue;
+					}
+					if (ref.bounds.pMin[spatialAxis] >= spatialPlane)
+					{
+						childRefs[1].push_back(ref);
+						continue;
+					}
+					Bounds3f leftPart = ClipReference(ref, spatialAxis, bounds.pMin[spatialAxis], spatialPlane);
+					Bounds3f rightPart = ClipReference(ref, spatialAxis, spatialPlane, bounds.pMax[spatialAxis]);
+					if (!IsValidBounds(leftPart) || !IsValidBounds(rightPart))
+					{
+						childRefs[IsValidBounds(leftPart) ? 0 : 1].push_back(ref);
+						continue;
+					}
+					//unsplitting: the whole reference stays on one side when
+					//that costs less than having it in both
+					Float costSplit = leftArea * LeafIntersectCost(spatialNLeft) +
+						rightArea * LeafIntersectCost(spatialNRight);
+					Float costLeft = Union(spatialLeft, ref.bounds).SurfaceArea() * LeafIntersectCost(spatialNLeft) +
+						rightArea * LeafIntersectCost(spatialNRight - 1);
+					Float costRight = leftArea * LeafIntersectCost(spatialNLeft - 1) +
+						Union(spatialRight, ref.bounds).SurfaceArea() * LeafIntersectCost(spatialNRight);
+					if (costSplit <= costLeft && costSplit <= costRight)
+					{
+						childRefs[0].push_back({ ref.primitiveNumber, leftPart });
+						childRefs[1].push_back({ ref.primitiveNumber, rightPart });
+						++nSplit;
+					}
+					else
+						childRefs[costLeft < costRight ? 0 : 1].push_back(ref);
+				}
+				axis = spatialAxis;
+				//everything ended on one side, use the object split
+				if (childRefs[0].empty() || childRefs[1].empty())
+				{
+					nSplit = 0;
+					childRefs[0].clear();
+					childRefs[1].clear();
+					axis = objectAxis;
+				}
+			}
+			state.budget += nStraddling - nSplit;
+		}
+
+		if (childRefs[0].empty())
+		{
+			if (axis == -1)
+				return makeLeaf();
+			for (const BVHPrimitiveInfo& ref : refs)
+				childRefs[bucketOf(ref, axis) > objectBucket].push_back(ref);
+		}
+		std::vector<BVHPrimitiveInfo>().swap(refs);
+
+		BVHBuildNode* children[2];
+		if (nRefs > kParallelBuildPrimitives)
+		{
+			ParallelFor([&](int64_t i) {
+				children[i] = SBVHBuild(arenas, childRefs[i], depth + 1, state, totalNodes);
+			}, 2, 1);
+		}
+		else
+		{
+			children[0] = SBVHBuild(arenas, childRefs[0], depth + 1, state, totalNodes);
+			children[1] = SBVHBuild(arenas, childRefs[1], depth + 1, state, totalNodes);
+		}
+		node->InitInterior(axis, children[0], children[1]);
+		return node;
+	}
+
+	void BVHAccel::GatherSBVHLeaves(BVHBuildNode* node, std::vector<BVHPrimitiveRef>& orderedRefs) const
+	{
+		if (node->nPrimitives > 0)
+		{
+			node->firstPrimOffset = orderedRefs.size();
+			for (int i = 0; i < node->nPrimitives; ++i)
+				orderedRefs.push_back(primRefs[node->leafRefs[i]]);
+			return;
+		}
+		GatherSBVHLeaves(node->children[0], orderedRefs);
+		GatherSBVHLeaves(node->children[1], orderedRefs);
+	}
+
+	//shape of the build tree, gathered by ReportTreeQuality
+	struct BVHTreeStats
+	{
+		int64_t interiorNodes = 0, leafNodes = 0;
+		int64_t leafDepthSum = 0;
+		Float sahCost = 0, overlap = 0;
+		//number of leaves by depth and by primitive count
+		std::vector<int64_t> leafDepths, leafSizes;
+	};
+
+	static void CollectTreeStats(const BVHBuildNode* node, int depth, BVHTreeStats* stats)
+	{
+		Float area = node->bounds.SurfaceArea();
+		if (node->nPrimitives > 0)
+		{
+			stats->sahCost += node->nPrimitives * area;
+			++stats->leafNodes;
+			stats->leafDepthSum += depth;
+			if ((int)stats->leafDepths.size() <= depth)
+				stats->leafDepths.resize(depth + 1);
+			++stats->leafDepths[depth];
+			if ((int)stats->leafSizes.size() <= node->nPrimitives)
+				stats->leafSizes.resize(node->nPrimitives + 1);
+			++stats->leafSizes[node->nPrimitives];
+			return;
+		}
+		++stats->interiorNodes;
+		stats->sahCost += 0.125f * area;
+		Bounds3f childOverlap = Bounds3f::Intersect(node->children[0]->bounds, node->children[1]->bounds);
+		if (IsValidBounds(childOverlap))
+			stats->overlap += childOverlap.SurfaceArea();
+		CollectTreeStats(node->children[0], depth + 1, stats);
+		CollectTreeStats(node->children[1], depth + 1, stats);
+	}
+
+	//"lo-hi:count" for every non empty bucket of bucketWidth entries
+	static std::string FormatHistogram(const std::vector<int64_t>& counts, int bucketWidth)
+	{
+		std::string text;
+		for (size_t lo = 0; lo < counts.size(); lo += bucketWidth)
+		{
+			size_t hi = std::min(lo + bucketWidth, counts.size());
+			int64_t count = 0;
+			for (size_t i = lo; i < hi; ++i)
+				count += counts[i];
+			if (count == 0)
+				continue;
+			if (!text.empty())
+				text += ' ';
+			text += bucketWidth == 1 ? std::to_string(lo) :
+				std::to_string(lo) + '-' + std::to_string(hi - 1);
+			text += ':' + std::to_string(count);
+		}
+		return text;
+	}
+
+	void BVHAccel::ReportTreeQuality(const BVHBuildNode* root) const
+	{
+		BVHTreeStats stats;
+		CollectTreeStats(root, 0, &stats);
+		interiorNodes += stats.interiorNodes;
+		leafNodes += stats.leafNodes;
+		Float rootArea = root->bounds.SurfaceArea();
+		Log::Info("BVH {} interior nodes, {} leaves, leaf depth avg {:.1f} max {}",
+			stats.interiorNodes, stats.leafNodes, (double)stats.leafDepthSum / stats.leafNodes,
+			stats.leafDepths.size() - 1);
+		Log::Info("BVH SAH cost {:.2f}, sibling overlap {:.2f} root areas",
+			stats.sahCost / rootArea, stats.overlap / rootArea);
+		Log::Info("BVH leaves by depth {}", FormatHistogram(stats.leafDepths, 4));
+		Log::Info("BVH leaves by primitive count {}", FormatHistogram(stats.leafSizes, 1));
+	}
+
+	BVHBuildNode* BVHAccel::HLBVHBuild(
+		std::vector<std::unique_ptr<MemoryArena>>& arenas,
+		std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		std::atomic<int>* totalNodes) const
+	{
+		int nPrimitives = (int)primitiveInfo.size();
+		Bounds3f bounds, centroidBounds;
+		ComputeRangeBounds(primitiveInfo, 0, nPrimitives, &bounds, &centroidBounds);
+
+		//Morton codes of the centroids quantized to a 1024^3 grid
+		std::vector<MortonPrimitive> mortonPrims(nPrimitives);
+		ParallelFor([&](int64_t i) {
+			constexpr int mortonBits = 10;
+			constexpr int mortonScale = 1 << mortonBits;
+			mortonPrims[i].primitiveIndex = (int)i;
+			Vector3f centroidOffset = centroidBounds.Offset(primitiveInfo[i].centroid);
+			mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * (Float)mortonScale);
+		}, nPrimitives, 512);
+
+		RadixSort(&mortonPrims);
+
+		//put primitiveInfo in Morton order, leaves then reference its ranges
+		//the same way the recursive build does
+		std::vector<BVHPrimitiveInfo> sortedInfo(nPrimitives);
+		ParallelFor([&](int64_t i) {
+			sortedInfo[i] = primitiveInfo[mortonPrims[i].primitiveIndex];
+		}, nPrimitives, 1024);
+		primitiveInfo.swap(sortedInfo);
+
+		//a treelet is a run of primitives with the same top 12 Morton bits
+		std::vector<LBVHTreelet> treeletsToBuild;
+		for (int start = 0, end = 1; end <= nPrimitives; ++end)
+		{
+			uint32_t mask = 0x3ffc0000;
+			if (end == nPrimitives ||
+				((mortonPrims[start].mortonCode & mask) !=
+					(mortonPrims[end].mortonCode & mask)))
+			{
+				treeletsToBuild.push_back({ start, end - start, nullptr });
+				start = end;
+			}
+		}
+
+		//the treelets are independent, each one gets its nodes in one
+		//allocation from the arena of the thread that emits it
+		ParallelFor([&](int64_t i) {
+			int nodesCreated = 0;
+			const int firstBitIndex = 29 - 12;
+			LBVHTreelet& tr = treeletsToBuild[i];
+			int maxBVHNodes = 2 * tr.nPrimitives - 1;
+			tr.buildNodes = arenas[ThreadIndex]->Alloc<BVHBuildNode>(maxBVHNodes, false);
+			BVHBuildNode* buildNodes = tr.buildNodes;
+			tr.buildNodes = emitLBVH(buildNodes, primitiveInfo, &mortonPrims[0],
+				tr.startIndex, tr.nPrimitives, &nodesCreated, firstBitIndex);
+			*totalNodes += nodesCreated;
+		}, treeletsToBuild.size(), 1);
+
+		std::vector<BVHBuildNode*> finishedTreelets;
+		finishedTreelets.reserve(treeletsToBuild.size());
+		for (LBVHTreelet& treelet : treeletsToBuild)
+			finishedTreelets.push_back(treelet.buildNodes);
+		return buildUpperSAH(*arenas[ThreadIndex], finishedTreelets, 0,
+			finishedTreelets.size(), totalNodes);
+	}
+
+	BVHBuildNode* BVHAccel::emitLBVH(
+		BVHBuildNode*& buildNodes,
+		const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+		const MortonPrimitive* mortonPrims, int start, int nPrimitives,
+		int* totalNodes, int bitIndex) const
+	{
+		if (bitIndex == -1 || nPrimitives < maxPrimsInNode)
+		{
+			(*totalNodes)++;
+			BVHBuildNode* node = buildNodes++;
+			Bounds3f bounds;
+			for (int i = start; i < start + nPrimitives; ++i)
+				bounds = Bounds3f::Union(bounds, primitiveInfo[i].bounds);
+			node->InitLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+		else
+		{
+			int mask = 1 << bitIndex;
+			//all the primitives are on the same side of this plane
+			if ((mortonPrims[start].mortonCode & mask) ==
+				(mortonPrims[start + nPrimitives - 1].mortonCode & mask))
+				return emitLBVH(buildNodes, primitiveInfo, mortonPrims, start, nPrimitives,
+					totalNodes, bitIndex - 1);
+
+			//binary search the first primitive with the bit set
+			int searchStart = 0, searchEnd = nPrimitives - 1;
+			while (searchStart + 1 != searchEnd)
+			{
+				int mid = (searchStart + searchEnd) / 2;
+				if ((mortonPrims[start + searchStart].mortonCode & mask) ==
+					(mortonPrims[start + mid].mortonCode & mask))
+					searchStart = mid;
+				else
+					searchEnd = mid;
+			}
+			int splitOffset = searchEnd;
+
+			(*totalNodes)++;
+			BVHBuildNode* node = buildNodes++;
+			BVHBuildNode* lbvh[2] = {
+				emitLBVH(buildNodes, primitiveInfo, mortonPrims, start, splitOffset,
+					totalNodes, bitIndex - 1),
+				emitLBVH(buildNodes, primitiveInfo, mortonPrims, start + splitOffset,
+					nPrimitives - splitOffset, totalNodes, bitIndex - 1) };
+			int axis = bitIndex % 3;
+			node->InitInterior(axis, lbvh[0], lbvh[1]);
+			return node;
+		}
+	}
+
+	BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena,
+		std::vector<BVHBuildNode*>& treeletRoots,
+		int start, int end, std::atomic<int>* totalNodes) const
+	{
+		int nNodes = end - start;
+		if (nNodes == 1)
+			return treeletRoots[start];
+		(*totalNodes)++;
+		BVHBuildNode* node = arena.Alloc<BVHBuildNode>();
+
+		Bounds3f bounds, centroidBounds;
+		for (int i = start; i < end; ++i)
+		{
+			bounds = Union(bounds, treeletRoots[i]->bounds);
+			Point3f centroid = (treeletRoots[i]->bounds.pMin + treeletRoots[i]->bounds.pMax) * 0.5f;
+			centroidBounds = Union(centroidBounds, centroid);
+		}
+		int dim = centroidBounds.MaximumExtent();
+
+		int mid = (start + end) / 2;
+		auto centroidLess = [dim](const BVHBuildNode* a, const BVHBuildNode* b) {
+			return a->bounds.pMin[dim] + a->bounds.pMax[dim] <
+				b->bounds.pMin[dim] + b->bounds.pMax[dim];
+		};
+		if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+		{
+			std::nth_element(&treeletRoots[start], &treeletRoots[mid],
+				&treeletRoots[end - 1] + 1, centroidLess);
+		}
+		else
+		{
+			constexpr int nBuckets = 12;
+			BucketInfo buckets[nBuckets];
+			auto bucketOf = [&](const BVHBuildNode* n) {
+				Float centroid = (n->bounds.pMin[dim] + n->bounds.pMax[dim]) * 0.5f;
+				int b = nBuckets * ((centroid - centroidBounds.pMin[dim]) /
+					(centroidBounds.pMax[dim] - centroidBounds.pMin[dim]));
+				if (b == nBuckets)
+					b = nBuckets - 1;
+				return b;
+			};
+
+			for (int i = start; i < end; ++i)
+			{
+				int b = bucketOf(treeletRoots[i]);
+				buckets[b].count++;
+				buckets[b].bounds = Union(buckets[b].bounds, treeletRoots[i]->bounds);
+			}
+
+			//same cost model as the recursive SAH build
+			Float cost[nBuckets - 1];
+			for (int i = 0; i < nBuckets - 1; ++i)
+			{
+				Bounds3f bA, bB;
+				int count0 = 0, count1 = 0;
+				for (int j = 0; j <= i; ++j)
+				{
+					bA = Union(bA, buckets[j].bounds);
+					count0 += buckets[j].count;
+				}
+				for (int j = i + 1; j < nBuckets; ++j)
+				{
+					bB = Union(bB, buckets[j].bounds);
+					count1 += buckets[j].count;
+				}
+				cost[i] = .125f +
+					(count0 * bA.SurfaceArea() + count1 * bB.SurfaceArea()) /
+					bounds.SurfaceArea();
+			}
+
+			Float minCost = cost[0];
+			int minCostSplitBucket = 0;
+			for (int i = 1; i < nBuckets - 1; ++i)
+			{
+				if (cost[i] < minCost)
+				{
+					minCost = cost[i];
+					minCostSplitBucket = i;
+				}
+			}
+
+			BVHBuildNode** pmid = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+				[&](const BVHBuildNode* n) { return bucketOf(n) <= minCostSplitBucket; });
+			mid = pmid - &treeletRoots[0];
+			if (mid == start || mid == end)
+			{
+				mid = (start + end) / 2;
+				std::nth_element(&treeletRoots[start], &treeletRoots[mid],
+					&treeletRoots[end - 1] + 1, centroidLess);
+			}
+		}
+
+		node->InitInterior(dim,
+			buildUpperSAH(arena, treeletRoots, start, mid, totalNodes),
+			buildUpperSAH(arena, treeletRoots, mid, end, totalNodes));
+		return node;
+	}
+
+	//brings a node pushed on the traversal stack into the cache while the
+	//current one is tested
+	template <typename Node>
+	static inline void PrefetchNode(const Node* node)
+	{
+#if defined(BVH_HAVE_SSE)
+		for (size_t line = 0; line < sizeof(Node); line += 64)
+			_mm_prefetch((const char*)node + line, _MM_HINT_T0);
+#endif
+	}
+
+	static inline int CountTrailingZeros(uint32_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, v);
+		return index;
+#else
+		return __builtin_ctz(v);
+#endif
+	}
+
+	//lanes of group that can be hit: the edge and t range tests of
+	//IntersectTriangle on 4 lanes at once with the same float operations,
+	//so no lane it would accept is rejected. Lanes with an edge function of
+	//exactly 0 are kept for its double precision fallback. The candidates
+	//are confirmed by IntersectTriangle, which is rarely reached for more
+	//than one lane.
+	template <int W>
+	static inline uint32_t WatertightCandidates(const TriangleGroup<W>& group, const Ray& ray,
+		const WatertightRay& wr)
+	{
+#if defined(BVH_HAVE_SSE)
+		const __m128 ox = _mm_set1_ps(ray.o[wr.kx]);
+		const __m128 oy = _mm_set1_ps(ray.o[wr.ky]);
+		const __m128 oz = _mm_set1_ps(ray.o[wr.kz]);
+		const __m128 sx = _mm_set1_ps(wr.Sx);
+		const __m128 sy = _mm_set1_ps(wr.Sy);
+		const __m128 sz = _mm_set1_ps(wr.Sz);
+		const __m128 tMax = _mm_set1_ps(ray.tMax);
+		const __m128 zero = _mm_setzero_ps();
+		uint32_t mask = 0;
+		for (int c = 0; c < W; c += 4)
+		{
+			__m128 x[3], y[3], z[3];
+			for (int v = 0; v < 3; ++v)
+			{
+				z[v] = _mm_sub_ps(_mm_load_ps(&group.p[v][wr.kz][c]), oz);
+				x[v] = _mm_add_ps(_mm_sub_ps(_mm_load_ps(&group.p[v][wr.kx][c]), ox),
+					_mm_mul_ps(sx, z[v]));
+				y[v] = _mm_add_ps(_mm_sub_ps(_mm_load_ps(&group.p[v][wr.ky][c]), oy),
+					_mm_mul_ps(sy, z[v]));
+			}
+			__m128 e0 = _mm_sub_ps(_mm_mul_ps(x[1], y[2]), _mm_mul_ps(y[1], x[2]));
+			__m128 e1 = _mm_sub_ps(_mm_mul_ps(x[2], y[0]), _mm_mul_ps(y[2], x[0]));
+			__m128 e2 = _mm_sub_ps(_mm_mul_ps(x[0], y[1]), _mm_mul_ps(y[0], x[1]));
+			__m128 anyZero = _mm_or_ps(_mm_cmpeq_ps(e0, zero),
+				_mm_or_ps(_mm_cmpeq_ps(e1, zero), _mm_cmpeq_ps(e2, zero)));
+			__m128 anyNeg = _mm_or_ps(_mm_cmplt_ps(e0, zero),
+				_mm_or_ps(_mm_cmplt_ps(e1, zero), _mm_cmplt_ps(e2, zero)));
+			__m128 anyPos = _mm_or_ps(_mm_cmpgt_ps(e0, zero),
+				_mm_or_ps(_mm_cmpgt_ps(e1, zero), _mm_cmpgt_ps(e2, zero)));
+			__m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+			__m128 tScaled = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(e0, _mm_mul_ps(z[0], sz)), _mm_mul_ps(e1, _mm_mul_ps(z[1], sz))),
+				_mm_mul_ps(e2, _mm_mul_ps(z[2], sz)));
+			__m128 tMaxDet = _mm_mul_ps(tMax, det);
+			__m128 rejectNeg = _mm_and_ps(_mm_cmplt_ps(det, zero),
+				_mm_or_ps(_mm_cmpge_ps(tScaled, zero), _mm_cmplt_ps(tScaled, tMaxDet)));
+			__m128 rejectPos = _mm_and_ps(_mm_cmpgt_ps(det, zero),
+				_mm_or_ps(_mm_cmple_ps(tScaled, zero), _mm_cmpgt_ps(tScaled, tMaxDet)));
+			__m128 reject = _mm_or_ps(_mm_or_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpeq_ps(det, zero)),
+				_mm_or_ps(rejectNeg, rejectPos));
+			uint32_t keep = (~_mm_movemask_ps(reject) & 0xf) | _mm_movemask_ps(anyZero);
+			mask |= keep << c;
+		}
+		return mask & group.triangleMask;
+#else
+		return group.triangleMask;
+#endif
+	}
+
+	//Moller-Trumbore on the triangle lanes of group, writes t and the
+	//barycentrics u, v of p1 and p2 of the lanes hit closer than ray.tMax
+	template <int W>
+	static inline uint32_t MollerHits(const TriangleGroup<W>& group, const Ray& ray,
+		float t[W], float u[W], float v[W])
+	{
+#if defined(BVH_HAVE_SSE)
+		const __m128 dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z);
+		const __m128 ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z);
+		const __m128 tMax = _mm_set1_ps(ray.tMax);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 epsilon = _mm_set1_ps(1e-8f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		uint32_t mask = 0;
+		for (int c = 0; c < W; c += 4)
+		{
+			__m128 p0x = _mm_load_ps(&group.p[0][0][c]);
+			__m128 p0y = _mm_load_ps(&group.p[0][1][c]);
+			__m128 p0z = _mm_load_ps(&group.p[0][2][c]);
+			__m128 e1x = _mm_sub_ps(_mm_load_ps(&group.p[1][0][c]), p0x);
+			__m128 e1y = _mm_sub_ps(_mm_load_ps(&group.p[1][1][c]), p0y);
+			__m128 e1z = _mm_sub_ps(_mm_load_ps(&group.p[1][2][c]), p0z);
+			__m128 e2x = _mm_sub_ps(_mm_load_ps(&group.p[2][0][c]), p0x);
+			__m128 e2y = _mm_sub_ps(_mm_load_ps(&group.p[2][1][c]), p0y);
+			__m128 e2z = _mm_sub_ps(_mm_load_ps(&group.p[2][2][c]), p0z);
+			__m128 pvx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 pvy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 pvz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, pvx), _mm_mul_ps(e1y, pvy)),
+				_mm_mul_ps(e1z, pvz));
+			__m128 valid = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+			__m128 invDet = _mm_div_ps(one, det);
+			__m128 tvx = _mm_sub_ps(ox, p0x), tvy = _mm_sub_ps(oy, p0y), tvz = _mm_sub_ps(oz, p0z);
+			__m128 uc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx), _mm_mul_ps(tvy, pvy)),
+				_mm_mul_ps(tvz, pvz)), invDet);
+			__m128 qvx = _mm_sub_ps(_mm_mul_ps(tvy, e1z), _mm_mul_ps(tvz, e1y));
+			__m128 qvy = _mm_sub_ps(_mm_mul_ps(tvz, e1x), _mm_mul_ps(tvx, e1z));
+			__m128 qvz = _mm_sub_ps(_mm_mul_ps(tvx, e1y), _mm_mul_ps(tvy, e1x));
+			__m128 vc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)),
+				_mm_mul_ps(dz, qvz)), invDet);
+			__m128 tc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qvx), _mm_mul_ps(e2y, qvy)),
+				_mm_mul_ps(e2z, qvz)), invDet);
+			__m128 hit = _mm_and_ps(_mm_and_ps(valid, _mm_cmpge_ps(uc, zero)),
+				_mm_and_ps(_mm_cmpge_ps(vc, zero), _mm_cmple_ps(_mm_add_ps(uc, vc), one)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tc, zero), _mm_cmplt_ps(tc, tMax)));
+			_mm_storeu_ps(&t[c], tc);
+			_mm_storeu_ps(&u[c], uc);
+			_mm_storeu_ps(&v[c], vc);
+			mask |= _mm_movemask_ps(hit) << c;
+		}
+		return mask & group.triangleMask;
+#else
+		uint32_t mask = 0;
+		for (uint32_t lanes = group.triangleMask; lanes; lanes &= lanes - 1)
+		{
+			int lane = CountTrailingZeros(lanes);
+			Point3f p[3];
+			for (int i = 0; i < 3; ++i)
+				p[i] = Point3f(group.p[i][0][lane], group.p[i][1][lane], group.p[i][2][lane]);
+			Float b[3];
+			if (IntersectTriangleMoller(ray, p[0], p[1], p[2], &t[lane], b))
+			{
+				u[lane] = b[1];
+				v[lane] = b[2];
+				mask |= 1u << lane;
+			}
+		}
+		return mask;
+#endif
+	}
+
+	//closest hit among the triangle lanes of group, updates ray.tMax and
+	//bakedHit like IntersectPrimitive
+	template <int W>
+	static inline bool IntersectGroupTriangles(const TriangleGroup<W>& group,
+		const BakedTriangle* baked, BVHAccel::TriangleTest test, const Ray& ray,
+		const WatertightRay& wr, BakedHit* bakedHit)
+	{
+		bool hit = false;
+		if (test == BVHAccel::TriangleTest::Moller)
+		{
+			alignas(16) float t[W], u[W], v[W];
+			uint32_t mask = MollerHits(group, ray, t, u, v);
+			int closest = -1;
+			for (; mask; mask &= mask - 1)
+			{
+				int lane = CountTrailingZeros(mask);
+				if (closest < 0 || t[lane] < t[closest])
+					closest = lane;
+			}
+			if (closest < 0)
+				return false;
+			ray.tMax = t[closest];
+			bakedHit->index = group.index[closest];
+			bakedHit->b[0] = 1 - u[closest] - v[closest];
+			bakedHit->b[1] = u[closest];
+			bakedHit->b[2] = v[closest];
+			return true;
+		}
+
+		for (uint32_t mask = WatertightCandidates(group, ray, wr); mask; mask &= mask - 1)
+		{
+			int index = group.index[CountTrailingZeros(mask)];
+			const BakedTriangle& triangle = baked[index];
+			Float tHit;
+			if (IntersectTriangle(ray, triangle.p0, triangle.p1, triangle.p2, &tHit, bakedHit->b))
+			{
+				ray.tMax = tHit;
+				bakedHit->index = index;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+
+	//primRefs index of a triangle lane of group hit by ray, -1 for none
+	template <int W>
+	static inline int IntersectGroupTrianglesP(const TriangleGroup<W>& group,
+		const BakedTriangle* baked, BVHAccel::TriangleTest test, const Ray& ray,
+		const WatertightRay& wr)
+	{
+		if (test == BVHAccel::TriangleTest::Moller)
+		{
+			alignas(16) float t[W], u[W], v[W];
+			uint32_t mask = MollerHits(group, ray, t, u, v);
+			return mask ? group.index[CountTrailingZeros(mask)] : -1;
+		}
+		for (uint32_t mask = WatertightCandidates(group, ray, wr); mask; mask &= mask - 1)
+		{
+			int index = group.index[CountTrailingZeros(mask)];
+			const BakedTriangle& triangle = baked[index];
+			Float tHit, b[3];
+			if (IntersectTriangle(ray, triangle.p0, triangle.p1, triangle.p2, &tHit, b))
+				return index;
+		}
+		return -1;
+	}
+
+	inline bool BVHAccel::IntersectLeaf(int offset, int n, const Ray& ray,
+		SurfaceInteraction* isect, BakedHit* bakedHit) const
+	{
+		COUNT_TRAVERSAL(primitivesTested, n);
+		if (triangleGroups4)
+			return IntersectLeafGroups(triangleGroups4 + leafGroups[offset], n, ray, isect, bakedHit);
+		if (triangleGroups8)
+			return IntersectLeafGroups(triangleGroups8 + leafGroups[offset], n, ray, isect, bakedHit);
+		bool hit = false;
+		for (int i = 0; i < n; ++i)
+		{
+			if (IntersectPrimitive(offset + i, ray, isect, bakedHit))
+				hit = true;
+		}
+		return hit;
+	}
+
+	inline bool BVHAccel::IntersectLeafP(int offset, int n, const Ray& ray,
+		int* occluder) const
+	{
+		COUNT_TRAVERSAL(primitivesTested, n);
+		if (triangleGroups4)
+			return IntersectLeafGroupsP(triangleGroups4 + leafGroups[offset], n, ray, occluder);
+		if (triangleGroups8)
+			return IntersectLeafGroupsP(triangleGroups8 + leafGroups[offset], n, ray, occluder);
+		for (int i = 0; i < n; ++i)
+		{
+			if (IntersectPrimitiveP(offset + i, ray))
+			{
+				*occluder = offset + i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template <int W>
+	bool BVHAccel::IntersectLeafGroups(const TriangleGroup<W>* groups, int n, const Ray& ray,
+		SurfaceInteraction* isect, BakedHit* bakedHit) const
+	{
+		//the shear needs divisions, Moller-Trumbore doesn't use it
+		WatertightRay wr = {};
+		if (triangleTest == TriangleTest::Watertight)
+			wr = SetupWatertightRay(ray);
+		bool hit = false;
+		for (int g = 0; g * W < n; ++g)
+		{
+			const TriangleGroup<W>& group = groups[g];
+			if (group.triangleMask &&
+				IntersectGroupTriangles(group, bakedTriangles, triangleTest, ray, wr, bakedHit))
+				hit = true;
+			for (uint32_t other = group.otherMask; other; other &= other - 1)
+			{
+				if (IntersectPrimitive(group.index[CountTrailingZeros(other)], ray, isect, bakedHit))
+					hit = true;
+			}
+		}
+		return hit;
+	}
+
+	template <int W>
+	bool BVHAccel::IntersectLeafGroupsP(const TriangleGroup<W>* groups, int n,
+		const Ray& ray, int* occluder) const
+	{
+		WatertightRay wr = {};
+		if (triangleTest == TriangleTest::Watertight)
+			wr = SetupWatertightRay(ray);
+		for (int g = 0; g * W < n; ++g)
+		{
+			const TriangleGroup<W>& group = groups[g];
+			if (group.triangleMask)
+			{
+				*occluder = IntersectGroupTrianglesP(group, bakedTriangles, triangleTest, ray, wr);
+				if (*occluder >= 0)
+					return true;
+			}
+			for (uint32_t other = group.otherMask; other; other &= other - 1)
+			{
+				*occluder = group.index[CountTrailingZeros(other)];
+				if (IntersectPrimitiveP(*occluder, ray))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	//every ray is tested against every triangle of a block of W, the
+	//grouped kernels against the block as one TriangleGroup<W>
+	template <int W>
+	static void BenchmarkGroupKernels(const std::vector<BakedTriangle>& triangles,
+		const std::vector<Ray>& rays)
+	{
+		const int nGroups = (int)triangles.size() / W;
+		TriangleGroup<W>* groups = AllocAligned<TriangleGroup<W>>(nGroups);
+		for (int g = 0; g < nGroups; ++g)
+			FillTriangleGroup(groups[g], triangles.data(), g * W, W);
+
+		const BVHAccel::TriangleTest tests[2] = {
+			BVHAccel::TriangleTest::Watertight, BVHAccel::TriangleTest::Moller };
+		const char* testNames[2] = { "watertight", "moller" };
+		for (int k = 0; k < 2; ++k)
+		{
+			for (int grouped = 0; grouped < 2; ++grouped)
+			{
+				int64_t nHits = 0;
+				auto start = std::chrono::steady_clock::now();
+				for (const Ray& r : rays)
+				{
+					for (int g = 0; g < nGroups; ++g)
+					{
+						Ray ray = r;
+						BakedHit bakedHit;
+						bool hit = false;
+						if (grouped)
+						{
+							WatertightRay wr = {};
+							if (tests[k] == BVHAccel::TriangleTest::Watertight)
+								wr = SetupWatertightRay(ray);
+							hit = IntersectGroupTriangles(groups[g], triangles.data(), tests[k],
+								ray, wr, &bakedHit);
+						}
+						else
+						{
+							for (int i = g * W; i < (g + 1) * W; ++i)
+							{
+								const BakedTriangle& t = triangles[i];
+								Float tHit;
+								bool triangleHit = tests[k] == BVHAccel::TriangleTest::Moller ?
+									IntersectTriangleMoller(ray, t.p0, t.p1, t.p2, &tHit, bakedHit.b) :
+									IntersectTriangle(ray, t.p0, t.p1, t.p2, &tHit, bakedHit.b);
+								if (triangleHit)
+								{
+									ray.tMax = tHit;
+									hit = true;
+								}
+							}
+						}
+						nHits += hit;
+					}
+				}
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				double nTests = double(rays.size()) * nGroups * W;
+				Log::Info("triangle kernel {} {}{}: {:.1f} M triangle tests/s, {} block hits",
+					testNames[k], grouped ? "group of " : "scalar, blocks of ", W,
+					nTests / elapsed.count() * 1e-6, nHits);
+			}
+		}
+		FreeAligned(groups);
+	}
+
+	void BenchmarkTriangleKernels()
+	{
+		//triangles of about a tenth of the unit cube, rays through it, so
+		//a few percent of the tests hit like in the leaves of a real scene
+		RNG rng;
+		auto randomPoint = [&rng]() {
+			return Point3f(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+		};
+		std::vector<BakedTriangle> triangles(4096);
+		for (BakedTriangle& t : triangles)
+		{
+			t.p0 = randomPoint();
+			t.p1 = t.p0 + (randomPoint() - Point3f(.5f, .5f, .5f)) * 0.2f;
+			t.p2 = t.p0 + (randomPoint() - Point3f(.5f, .5f, .5f)) * 0.2f;
+			t.isTriangle = 1;
+		}
+		std::vector<Ray> rays(2048);
+		for (Ray& ray : rays)
+		{
+			Point3f o = randomPoint() * 3.f - Point3f(1, 1, 1);
+			ray = Ray(o, Vector3f::Normalize(randomPoint() - o));
+		}
+		BenchmarkGroupKernels<4>(triangles, rays);
+		BenchmarkGroupKernels<8>(triangles, rays);
+	}
+
+	//traversal of one ray through the binary nodes, StepLinear visits one
+	//node. Intersect runs it to the end, IntersectInterleaved switches
+	//between the traversals of several rays.
+	struct LinearTraversal
+	{
+		Vector3f invDir;
+		int dirIsNeg[3];
+		int currentNodeIndex = 0; //ǰڷʵnode
+		//һҪʵnodenodesToVisitindex
+		int toVisitOffset = 0;
+		//nodesToVisitһҪʵnodestack
+		int nodesToVisit[64];
+		BakedHit bakedHit;
+		bool hit = false;
+
+		LinearTraversal() = default;
+		explicit LinearTraversal(const Ray& ray)
+			: invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z)
+		{
+			dirIsNeg[0] = invDir.x < 0;
+			dirIsNeg[1] = invDir.y < 0;
+			dirIsNeg[2] = invDir.z < 0;
+		}
+	};
+
+	//traversal of one ray through wide or quantized nodes
+	template <typename Node>
+	struct WideTraversal
+	{
+		//stack of wide nodes to visit with the distance the ray enters them,
+		//every level pushes at most N - 1 more nodes than it pops
+		struct NodeToVisit
+		{
+			int nodeIndex;
+			Float tNear;
+		};
+		Vector3f invDir;
+		int dirIsNeg[3];
+		NodeToVisit nodesToVisit[64 * (Node::width - 1)];
+		int toVisitOffset = 1;
+		BakedHit bakedHit;
+		bool hit = false;
+
+		WideTraversal() = default;
+		explicit WideTraversal(const Ray& ray)
+			: invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z)
+		{
+			dirIsNeg[0] = invDir.x < 0;
+			dirIsNeg[1] = invDir.y < 0;
+			dirIsNeg[2] = invDir.z < 0;
+			nodesToVisit[0] = { 0, 0 };
+		}
+	};
+
+	bool BVHAccel::StepLinear(LinearTraversal& t, const Ray& ray, SurfaceInteraction* isect) const
+	{
+		const LinearBVHNode* node = &linearNodes[t.currentNodeIndex];
+		COUNT_TRAVERSAL(nodesVisited, 1);
+		if (node->bounds.IntersectP(ray, t.invDir, t.dirIsNeg))
+		{
+			//Ҷӽڵ
+			if (node->nPrimitives > 0)
+			{
+				if (IntersectLeaf(node->primitivesOffset, node->nPrimitives, ray, isect, &t.bakedHit))
+					t.hit = true;
+			}
+			else
+			{
+				//߷ķǳ90
+				//ȷʵڶӽڵ
+				//߷ķ < 90෴
+				//the far child shares the cache line of the near one
+				int child0 = node->childrenOffset, child1 = node->childrenOffset + 1;
+				if (node->swapped)
+					std::swap(child0, child1);
+				int farChild = t.dirIsNeg[node->axis] ? child0 : child1;
+				t.currentNodeIndex = t.dirIsNeg[node->axis] ? child1 : child0;
+				t.nodesToVisit[t.toVisitOffset++] = farChild;
+				return true;
+			}
+		}
+		if (t.toVisitOffset == 0)
+			return false;
+		t.currentNodeIndex = t.nodesToVisit[--t.toVisitOffset];
+		return true;
+	}
+
+	bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const
+	{
+		if (quantizedNodes4)
+			return IntersectWide(quantizedNodes4, ray, isect);
+		if (quantizedNodes8)
+			return IntersectWide(quantizedNodes8, ray, isect);
+		if (wideNodes4)
+			return IntersectWide(wideNodes4, ray, isect);
+		if (wideNodes8)
+			return IntersectWide(wideNodes8, ray, isect);
+		if (linearNodes == nullptr)
+			return false;
+		LinearTraversal traversal(ray);
+		while (StepLinear(traversal, ray, isect))
+			;
+		FinishIntersect(ray, traversal.bakedHit, isect);
+		return traversal.hit;
+	}
+
+	bool BVHAccel::IntersectP(const Ray& ray) const
+	{
+		int occluder;
+		return IntersectPAnyHit(ray, &occluder);
+	}
+
+	bool BVHAccel::IntersectPOccluder(const Ray& ray, int* lastOccluder) const
+	{
+		//rays toward one light from nearby points are mostly blocked by
+		//the same primitive, testing it first skips the traversal
+		if (*lastOccluder >= 0 && *lastOccluder < (int)primRefs.size())
+		{
+			COUNT_TRAVERSAL(primitivesTested, 1);
+			if (IntersectPrimitiveP(*lastOccluder, ray))
+				return true;
+		}
+		int occluder;
+		if (!IntersectPAnyHit(ray, &occluder))
+			return false;
+		*lastOccluder = occluder;
+		return true;
+	}
+
+	bool BVHAccel::IntersectPAnyHit(const Ray& ray, int* occluder) const
+	{
+		if (quantizedNodes4)
+			return IntersectPWide(quantizedNodes4, ray, occluder);
+		if (quantizedNodes8)
+			return IntersectPWide(quantizedNodes8, ray, occluder);
+		if (wideNodes4)
+			return IntersectPWide(wideNodes4, ray, occluder);
+		if (wideNodes8)
+			return IntersectPWide(wideNodes8, ray, occluder);
+		if (linearNodes == nullptr)
+		    return false;
+		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+		int currentNodeIndex = 0;
+		int toVisitOffset = 0;
+		int nodesToVisit[64];
+		while (true)
+		{
+			const LinearBVHNode* node = &linearNodes[currentNodeIndex];
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			if (node->bounds.IntersectP(ray, invDir, dirIsNeg))
+			{
+				if (node->nPrimitives > 0)
+				{
+					if (IntersectLeafP(node->primitivesOffset, node->nPrimitives, ray, occluder))
+						return true;
+					if (toVisitOffset == 0)
+						break;
+					currentNodeIndex = nodesToVisit[--toVisitOffset];
+				}
+				else
+				{
+					//any hit ends the traversal, so the order is not front to
+					//back: the child with the larger surface area, which the
+					//ray is more likely to hit something in, is visited first.
+					//FlattenBVHTree stores it first in the pair.
+					nodesToVisit[toVisitOffset++] = node->childrenOffset + 1;
+					currentNodeIndex = node->childrenOffset;
+				}
+			}
+			else
+			{
+				if (toVisitOffset == 0)
+					break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+		}
+		return false;
+	}
+
+	//the rays of a packet in structure of arrays layout, lanes past n are
+	//never in a mask
+	struct RayPacket
+	{
+		alignas(16) float org[3][kMaxRayPacketSize];
+		alignas(16) float dir[3][kMaxRayPacketSize];
+		alignas(16) float invDir[3][kMaxRayPacketSize];
+		alignas(16) float tMax[kMaxRayPacketSize];
+		int n;
+		//the packet is coherent when the direction signs of all its rays
+		//agree, dirIsNeg is then shared by them
+		bool coherent;
+		int dirIsNeg[3];
+		//bounds of the origins, inverse directions and tMax over the packet
+		Float orgMin[3], orgMax[3], invMin[3], invMax[3];
+		Float maxTMax;
+	};
+
+	static void InitRayPacket(const Ray* rays, int n, RayPacket* packet)
+	{
+		packet->n = n;
+		packet->coherent = true;
+		for (int a = 0; a < 3; ++a)
+		{
+			packet->orgMin[a] = packet->invMin[a] = std::numeric_limits<Float>::max();
+			packet->orgMax[a] = packet->invMax[a] = std::numeric_limits<Float>::lowest();
+			for (int i = 0; i < kMaxRayPacketSize; ++i)
+			{
+				packet->org[a][i] = i < n ? rays[i].o[a] : 0;
+				packet->dir[a][i] = i < n ? rays[i].d[a] : 0;
+				packet->invDir[a][i] = i < n ? 1 / rays[i].d[a] : 0;
+			}
+			packet->dirIsNeg[a] = packet->invDir[a][0] < 0;
+			for (int i = 0; i < n; ++i)
+			{
+				packet->orgMin[a] = std::min(packet->orgMin[a], packet->org[a][i]);
+				packet->orgMax[a] = std::max(packet->orgMax[a], packet->org[a][i]);
+				packet->invMin[a] = std::min(packet->invMin[a], packet->invDir[a][i]);
+				packet->invMax[a] = std::max(packet->invMax[a], packet->invDir[a][i]);
+				if ((packet->invDir[a][i] < 0) != (packet->dirIsNeg[a] != 0))
+					packet->coherent = false;
+			}
+		}
+		packet->maxTMax = 0;
+		for (int i = 0; i < kMaxRayPacketSize; ++i)
+		{
+			packet->tMax[i] = i < n ? rays[i].tMax : 0;
+			packet->maxTMax = std::max(packet->maxTMax, packet->tMax[i]);
+		}
+	}
+
+	//Moller-Trumbore of the rays of packet in mask against one baked
+	//triangle, four rays at a time. Writes t and the barycentrics u, v of
+	//p1 and p2 of the rays hit closer than their tMax and returns their
+	//mask. The operations are those of IntersectTriangleMoller, so a ray
+	//gets the same hits as when it is traced alone.
+	static inline int MollerPacketHits(const BakedTriangle& triangle, const RayPacket& packet,
+		const Ray* rays, int mask, float t[kMaxRayPacketSize], float u[kMaxRayPacketSize],
+		float v[kMaxRayPacketSize])
+	{
+		int hitMask = 0;
+#if defined(BVH_HAVE_SSE)
+		const Vector3f e1 = triangle.p1 - triangle.p0, e2 = triangle.p2 - triangle.p0;
+		const __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+		const __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+		const __m128 p0x = _mm_set1_ps(triangle.p0.x), p0y = _mm_set1_ps(triangle.p0.y),
+			p0z = _mm_set1_ps(triangle.p0.z);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 epsilon = _mm_set1_ps(1e-8f);
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		for (int g = 0; g < packet.n; g += 4)
+		{
+			if (((mask >> g) & 0xf) == 0)
+				continue;
+			__m128 dx = _mm_load_ps(&packet.dir[0][g]);
+			__m128 dy = _mm_load_ps(&packet.dir[1][g]);
+			__m128 dz = _mm_load_ps(&packet.dir[2][g]);
+			__m128 pvx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 pvy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 pvz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, pvx), _mm_mul_ps(e1y, pvy)),
+				_mm_mul_ps(e1z, pvz));
+			__m128 valid = _mm_cmpgt_ps(_mm_and_ps(det, absMask), epsilon);
+			__m128 invDet = _mm_div_ps(one, det);
+			__m128 tvx = _mm_sub_ps(_mm_load_ps(&packet.org[0][g]), p0x);
+			__m128 tvy = _mm_sub_ps(_mm_load_ps(&packet.org[1][g]), p0y);
+			__m128 tvz = _mm_sub_ps(_mm_load_ps(&packet.org[2][g]), p0z);
+			__m128 uc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx), _mm_mul_ps(tvy, pvy)),
+				_mm_mul_ps(tvz, pvz)), invDet);
+			__m128 qvx = _mm_sub_ps(_mm_mul_ps(tvy, e1z), _mm_mul_ps(tvz, e1y));
+			__m128 qvy = _mm_sub_ps(_mm_mul_ps(tvz, e1x), _mm_mul_ps(tvx, e1z));
+			__m128 qvz = _mm_sub_ps(_mm_mul_ps(tvx, e1y), _mm_mul_ps(tvy, e1x));
+			__m128 vc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)),
+				_mm_mul_ps(dz, qvz)), invDet);
+			__m128 tc = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qvx), _mm_mul_ps(e2y, qvy)),
+				_mm_mul_ps(e2z, qvz)), invDet);
+			__m128 hit = _mm_and_ps(_mm_and_ps(valid, _mm_cmpge_ps(uc, zero)),
+				_mm_and_ps(_mm_cmpge_ps(vc, zero), _mm_cmple_ps(_mm_add_ps(uc, vc), one)));
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tc, zero),
+				_mm_cmplt_ps(tc, _mm_load_ps(&packet.tMax[g]))));
+			_mm_store_ps(&t[g], tc);
+			_mm_store_ps(&u[g], uc);
+			_mm_store_ps(&v[g], vc);
+			hitMask |= _mm_movemask_ps(hit) << g;
+		}
+#else
+		for (int bits = mask; bits != 0; bits &= bits - 1)
+		{
+			int r = CountTrailingZeros(bits);
+			Float b[3];
+			if (IntersectTriangleMoller(rays[r], triangle.p0, triangle.p1, triangle.p2, &t[r], b))
+			{
+				u[r] = b[1];
+				v[r] = b[2];
+				hitMask |= 1 << r;
+			}
+		}
+#endif
+		return hitMask & mask;
+	}
+
+	//true when every ray of a coherent packet misses bounds. The entry and
+	//exit distances are bounded with interval arithmetic over the origins
+	//and inverse directions, one test for the whole packet.
+	static inline bool PacketMissesBounds(const Bounds3f& bounds, const RayPacket& packet)
+	{
+		const Float farScale = 1 + 2 * gamma(3);
+		Float tEntry = 0, tExit = packet.maxTMax;
+		for (int a = 0; a < 3; ++a)
+		{
+			//an axis parallel ray has no finite interval, the axis is left out
+			if (std::isinf(packet.invMin[a]) || std::isinf(packet.invMax[a]))
+				continue;
+			const Float nearPlane = packet.dirIsNeg[a] ? bounds.pMax[a] : bounds.pMin[a];
+			const Float farPlane = packet.dirIsNeg[a] ? bounds.pMin[a] : bounds.pMax[a];
+			Float dLo = nearPlane - packet.orgMax[a], dHi = nearPlane - packet.orgMin[a];
+			tEntry = std::max(tEntry, std::min(std::min(dLo * packet.invMin[a], dLo * packet.invMax[a]),
+				std::min(dHi * packet.invMin[a], dHi * packet.invMax[a])));
+			dLo = farPlane - packet.orgMax[a];
+			dHi = farPlane - packet.orgMin[a];
+			tExit = std::min(tExit, farScale * std::max(std::max(dLo * packet.invMin[a], dLo * packet.invMax[a]),
+				std::max(dHi * packet.invMin[a], dHi * packet.invMax[a])));
+		}
+		return tEntry > tExit;
+	}
+
+	//slab test of the rays in mask against bounds, returns the mask of the
+	//rays that hit it
+	static inline int IntersectPacketBounds(const Bounds3f& bounds, const RayPacket& packet, int mask)
+	{
+		const Float farScale = 1 + 2 * gamma(3);
+		int hitMask = 0;
+		for (int g = 0; g < packet.n; g += 4)
+		{
+			if (((mask >> g) & 0xf) == 0)
+				continue;
+#if defined(BVH_HAVE_SSE)
+			const __m128 zero = _mm_setzero_ps();
+			__m128 t0 = zero;
+			__m128 t1 = _mm_load_ps(&packet.tMax[g]);
+			for (int a = 0; a < 3; ++a)
+			{
+				__m128 o = _mm_load_ps(&packet.org[a][g]);
+				__m128 inv = _mm_load_ps(&packet.invDir[a][g]);
+				//the near plane is pMax for the rays going down the axis
+				__m128 neg = _mm_cmplt_ps(inv, zero);
+				__m128 lo = _mm_set1_ps(bounds.pMin[a]), hi = _mm_set1_ps(bounds.pMax[a]);
+				__m128 nearPlane = _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+				__m128 farPlane = _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+				__m128 tn = _mm_mul_ps(_mm_sub_ps(nearPlane, o), inv);
+				__m128 tf = _mm_mul_ps(_mm_sub_ps(farPlane, o), inv);
+				t0 = _mm_max_ps(tn, t0);
+				t1 = _mm_min_ps(_mm_mul_ps(tf, _mm_set1_ps(farScale)), t1);
+			}
+			hitMask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+#else
+			for (int i = g; i < g + 4; ++i)
+			{
+				Float t0 = 0, t1 = packet.tMax[i];
+				for (int a = 0; a < 3; ++a)
+				{
+					bool neg = packet.invDir[a][i] < 0;
+					Float tn = ((neg ? bounds.pMax[a] : bounds.pMin[a]) - packet.org[a][i]) * packet.invDir[a][i];
+					Float tf = ((neg ? bounds.pMin[a] : bounds.pMax[a]) - packet.org[a][i]) * packet.invDir[a][i] * farScale;
+					t0 = tn > t0 ? tn : t0;
+					t1 = tf < t1 ? tf : t1;
+				}
+				if (t0 <= t1)
+					hitMask |= 1 << i;
+			}
+#endif
+		}
+		return hitMask & mask;
+	}
+
+	int BVHAccel::IntersectLeafPacket(int offset, int n, const Ray* rays, int mask,
+		RayPacket* packet, SurfaceInteraction* isects, BakedHit* bakedHits) const
+	{
+		int hitMask = 0;
+		//the triangle groups test a ray against several triangles at once,
+		//without them the baked triangles are tested against the packet
+		if (triangleGroups4 || triangleGroups8 || bakedTriangles == nullptr ||
+			triangleTest != TriangleTest::Moller)
+		{
+			for (int bits = mask; bits != 0; bits &= bits - 1)
+			{
+				int r = CountTrailingZeros(bits);
+				if (IntersectLeaf(offset, n, rays[r], &isects[r], &bakedHits[r]))
+					hitMask |= 1 << r;
+				packet->tMax[r] = rays[r].tMax;
+			}
+			return hitMask;
+		}
+		if (g_countTraversal)
+			for (int bits = mask; bits != 0; bits &= bits - 1)
+				g_traversalCounters.primitivesTested += n;
+		for (int i = offset; i < offset + n; ++i)
+		{
+			if (!bakedTriangles[i].isTriangle)
+			{
+				for (int bits = mask; bits != 0; bits &= bits - 1)
+				{
+					int r = CountTrailingZeros(bits);
+					if (IntersectPrimitive(i, rays[r], &isects[r], &bakedHits[r]))
+					{
+						hitMask |= 1 << r;
+						packet->tMax[r] = rays[r].tMax;
+					}
+				}
+				continue;
+			}
+			alignas(16) float t[kMaxRayPacketSize], u[kMaxRayPacketSize], v[kMaxRayPacketSize];
+			int triangleHits = MollerPacketHits(bakedTriangles[i], *packet, rays, mask, t, u, v);
+			hitMask |= triangleHits;
+			for (; triangleHits != 0; triangleHits &= triangleHits - 1)
+			{
+				int r = CountTrailingZeros(triangleHits);
+				rays[r].tMax = packet->tMax[r] = t[r];
+				bakedHits[r].index = i;
+				bakedHits[r].b[0] = 1 - u[r] - v[r];
+				bakedHits[r].b[1] = u[r];
+				bakedHits[r].b[2] = v[r];
+			}
+		}
+		return hitMask;
+	}
+
+	int BVHAccel::IntersectLeafPacketP(int offset, int n, const Ray* rays, int mask,
+		const RayPacket& packet) const
+	{
+		int occludedMask = 0;
+		if (triangleGroups4 || triangleGroups8 || bakedTriangles == nullptr ||
+			triangleTest != TriangleTest::Moller)
+		{
+			for (int bits = mask; bits != 0; bits &= bits - 1)
+			{
+				int r = CountTrailingZeros(bits);
+				int occluder;
+				if (IntersectLeafP(offset, n, rays[r], &occluder))
+					occludedMask |= 1 << r;
+			}
+			return occludedMask;
+		}
+		if (g_countTraversal)
+			for (int bits = mask; bits != 0; bits &= bits - 1)
+				g_traversalCounters.primitivesTested += n;
+		alignas(16) float t[kMaxRayPacketSize], u[kMaxRayPacketSize], v[kMaxRayPacketSize];
+		for (int i = offset; i < offset + n && mask != 0; ++i)
+		{
+			int hitMask = 0;
+			if (bakedTriangles[i].isTriangle)
+				hitMask = MollerPacketHits(bakedTriangles[i], packet, rays, mask, t, u, v);
+			else
+			{
+				for (int bits = mask; bits != 0; bits &= bits - 1)
+				{
+					int r = CountTrailingZeros(bits);
+					if (IntersectPrimitiveP(i, rays[r]))
+						hitMask |= 1 << r;
+				}
+			}
+			occludedMask |= hitMask;
+			mask &= ~hitMask;
+		}
+		return occludedMask;
+	}
+
+	void BVHAccel::IntersectPacket(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		//wide nodes already test their children with SIMD, their rays are
+		//traced one by one
+		if (linearNodes == nullptr || n == 1)
+		{
+			Primitive::IntersectPacket(rays, n, isects, hits);
+			return;
+		}
+		RayPacket packet;
+		InitRayPacket(rays, n, &packet);
+		BakedHit bakedHits[kMaxRayPacketSize];
+		for (int i = 0; i < n; ++i)
+			hits[i] = false;
+
+		//nodes to visit with the mask of the rays that entered their parent
+		struct NodeToVisit
+		{
+			int nodeIndex;
+			int mask;
+		};
+		NodeToVisit nodesToVisit[64];
+		int toVisitOffset = 0;
+		int currentNodeIndex = 0;
+		int mask = (1 << n) - 1;
+		while (true)
+		{
+			const LinearBVHNode* node = &linearNodes[currentNodeIndex];
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			if (packet.coherent && PacketMissesBounds(node->bounds, packet))
+				mask = 0;
+			else
+				mask = IntersectPacketBounds(node->bounds, packet, mask);
+			if (mask != 0 && node->nPrimitives == 0)
+			{
+				//the order of the children follows the first ray that entered
+				int first = CountTrailingZeros(mask);
+				int dirIsNeg = packet.invDir[node->axis][first] < 0;
+				int child0 = node->childrenOffset, child1 = node->childrenOffset + 1;
+				if (node->swapped)
+					std::swap(child0, child1);
+				int farChild = dirIsNeg ? child0 : child1;
+				currentNodeIndex = dirIsNeg ? child1 : child0;
+				nodesToVisit[toVisitOffset++] = { farChild, mask };
+				continue;
+			}
+			if (mask != 0)
+			{
+				int hitMask = IntersectLeafPacket(node->primitivesOffset, node->nPrimitives,
+					rays, mask, &packet, isects, bakedHits);
+				for (; hitMask != 0; hitMask &= hitMask - 1)
+					hits[CountTrailingZeros(hitMask)] = true;
+				packet.maxTMax = 0;
+				for (int r = 0; r < n; ++r)
+					packet.maxTMax = std::max(packet.maxTMax, packet.tMax[r]);
+			}
+			if (toVisitOffset == 0)
+				break;
+			--toVisitOffset;
+			currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+			mask = nodesToVisit[toVisitOffset].mask;
+		}
+		for (int r = 0; r < n; ++r)
+			FinishIntersect(rays[r], bakedHits[r], &isects[r]);
+	}
+
+	void BVHAccel::IntersectPPacket(const Ray* rays, int n, bool* occluded) const
+	{
+		if (linearNodes == nullptr || n == 1)
+		{
+			Primitive::IntersectPPacket(rays, n, occluded);
+			return;
+		}
+		RayPacket packet;
+		InitRayPacket(rays, n, &packet);
+		for (int i = 0; i < n; ++i)
+			occluded[i] = false;
+
+		struct NodeToVisit
+		{
+			int nodeIndex;
+			int mask;
+		};
+		NodeToVisit nodesToVisit[64];
+		int toVisitOffset = 0;
+		int currentNodeIndex = 0;
+		//the rays not occluded yet
+		int alive = (1 << n) - 1;
+		int mask = alive;
+		while (true)
+		{
+			const LinearBVHNode* node = &linearNodes[currentNodeIndex];
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			mask &= alive;
+			if (mask != 0 && packet.coherent && PacketMissesBounds(node->bounds, packet))
+				mask = 0;
+			else if (mask != 0)
+				mask = IntersectPacketBounds(node->bounds, packet, mask);
+			if (mask != 0 && node->nPrimitives == 0)
+			{
+				int first = CountTrailingZeros(mask);
+				int dirIsNeg = packet.invDir[node->axis][first] < 0;
+				int child0 = node->childrenOffset, child1 = node->childrenOffset + 1;
+				if (node->swapped)
+					std::swap(child0, child1);
+				int farChild = dirIsNeg ? child0 : child1;
+				currentNodeIndex = dirIsNeg ? child1 : child0;
+				nodesToVisit[toVisitOffset++] = { farChild, mask };
+				continue;
+			}
+			if (mask != 0)
+			{
+				int occludedMask = IntersectLeafPacketP(node->primitivesOffset, node->nPrimitives,
+					rays, mask, packet);
+				for (; occludedMask != 0; occludedMask &= occludedMask - 1)
+				{
+					int r = CountTrailingZeros(occludedMask);
+					occluded[r] = true;
+					alive &= ~(1 << r);
+				}
+			}
+			if (alive == 0 || toVisitOffset == 0)
+				break;
+			--toVisitOffset;
+			currentNodeIndex = nodesToVisit[toVisitOffset].nodeIndex;
+			mask = nodesToVisit[toVisitOffset].mask;
+		}
+	}
+
+	void BVHAccel::FlattenBVHTree(BVHBuildNode* node, int index, int* offset)
+	{
+		LinearBVHNode* linearNode = &linearNodes[index];
+		linearNode->bounds = node->bounds;
+		if (node->nPrimitives > 0)
+		{
+			//һҶӽڵ
+			linearNode->nPrimitives = node->nPrimitives;
+			linearNode->primitivesOffset = node->firstPrimOffset;
+		}
+		else
+		{
+			linearNode->axis = node->splitAxis;
+			linearNode->nPrimitives = 0;
+			//the child with the larger surface area is the more likely one to
+			//be visited, it is stored first
+			int adjacent = node->children[1]->bounds.SurfaceArea() >
+				node->children[0]->bounds.SurfaceArea() ? 1 : 0;
+			linearNode->swapped = adjacent;
+			linearNode->childrenOffset = *offset;
+			*offset += 2;
+			int children = linearNode->childrenOffset;
+			FlattenBVHTree(node->children[adjacent], children, offset);
+			FlattenBVHTree(node->children[1 - adjacent], children + 1, offset);
+		}
+	}
+
+	//slab test of the ray against the first nChildren boxes of bounds,
+	//returns a bit mask of the boxes hit and their entry distances in tNear
+	template <int N>
+	static inline int IntersectChildBounds(const float (&bounds)[2][3][N], int nChildren,
+		const Vector3f& org, const Vector3f& invDir, const int dirIsNeg[3], Float rayTMax,
+		Float* tNear)
+	{
+		//same robustness factor as Bounds3::IntersectP
+		const Float farScale = 1 + 2 * gamma(3);
+		int hitMask = 0;
+		//max/min return their second operand for NaN (0 * inf when the ray
+		//origin lies on a slab plane), which keeps the current interval
+#if defined(__AVX__)
+		if constexpr (N == 8)
+		{
+			__m256 t0 = _mm256_setzero_ps();
+			__m256 t1 = _mm256_set1_ps(rayTMax);
+			for (int a = 0; a < 3; ++a)
+			{
+				__m256 o = _mm256_set1_ps(org[a]);
+				__m256 inv = _mm256_set1_ps(invDir[a]);
+				__m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[dirIsNeg[a]][a]), o), inv);
+				__m256 tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[1 - dirIsNeg[a]][a]), o), inv);
+				t0 = _mm256_max_ps(tn, t0);
+				t1 = _mm256_min_ps(_mm256_mul_ps(tf, _mm256_set1_ps(farScale)), t1);
+			}
+			_mm256_storeu_ps(tNear, t0);
+			hitMask = _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+		}
+		else
+#endif
+		{
+#if defined(BVH_HAVE_SSE)
+			for (int g = 0; g < N; g += 4)
+			{
+				__m128 t0 = _mm_setzero_ps();
+				__m128 t1 = _mm_set1_ps(rayTMax);
+				for (int a = 0; a < 3; ++a)
+				{
+					__m128 o = _mm_set1_ps(org[a]);
+					__m128 inv = _mm_set1_ps(invDir[a]);
+					__m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[dirIsNeg[a]][a][g]), o), inv);
+					__m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(&bounds[1 - dirIsNeg[a]][a][g]), o), inv);
+					t0 = _mm_max_ps(tn, t0);
+					t1 = _mm_min_ps(_mm_mul_ps(tf, _mm_set1_ps(farScale)), t1);
+				}
+				_mm_storeu_ps(&tNear[g], t0);
+				hitMask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+			}
+#else
+			for (int i = 0; i < N; ++i)
+			{
+				Float t0 = 0, t1 = rayTMax;
+				for (int a = 0; a < 3; ++a)
+				{
+					Float tn = (bounds[dirIsNeg[a]][a][i] - org[a]) * invDir[a];
+					Float tf = (bounds[1 - dirIsNeg[a]][a][i] - org[a]) * invDir[a] * farScale;
+					t0 = tn > t0 ? tn : t0;
+					t1 = tf < t1 ? tf : t1;
+				}
+				tNear[i] = t0;
+				if (t0 <= t1)
+					hitMask |= 1 << i;
+			}
+#endif
+		}
+		return hitMask & ((1 << nChildren) - 1);
+	}
+
+	template <int N>
+	static inline int IntersectChildren(const WideBVHNode<N>& node, const Vector3f& org,
+		const Vector3f& invDir, const int dirIsNeg[3], Float rayTMax, Float* tNear)
+	{
+		return IntersectChildBounds<N>(node.bounds, node.nChildren, org, invDir, dirIsNeg,
+			rayTMax, tNear);
+	}
+
+	//decodes the child boxes first, they are conservative so the slab test
+	//can only report extra hits, never miss a child
+	template <int N>
+	static inline int IntersectChildren(const QuantizedBVHNode<N>& node, const Vector3f& org,
+		const Vector3f& invDir, const int dirIsNeg[3], Float rayTMax, Float* tNear)
+	{
+		alignas(32) float bounds[2][3][N];
+		DecodeChildBounds(node, bounds);
+		return IntersectChildBounds<N>(bounds, node.nChildren, org, invDir, dirIsNeg,
+			rayTMax, tNear);
+	}
+
+	template <int N>
+	int BVHAccel::CollapseBVHTree(BVHBuildNode* node, std::vector<WideBVHNode<N>>& wideNodes)
+	{
+		int myOffset = wideNodes.size();
+		wideNodes.emplace_back();
+
+		//start with the two children and keep opening the interior child with
+		//the largest surface area until the node is full. An opened child is
+		//replaced in place by its children, so the order along the split
+		//axes is kept.
+		BVHBuildNode* children[N];
+		int nChildren = 0;
+		if (node->nPrimitives > 0)
+			children[nChildren++] = node;
+		else
+		{
+			children[nChildren++] = node->children[0];
+			children[nChildren++] = node->children[1];
+			while (nChildren < N)
+			{
+				int best = -1;
+				Float bestArea = -1;
+				for (int i = 0; i < nChildren; ++i)
+				{
+					if (children[i]->nPrimitives == 0 && children[i]->bounds.SurfaceArea() > bestArea)
+					{
+						best = i;
+						bestArea = children[i]->bounds.SurfaceArea();
+					}
+				}
+				if (best == -1)
+					break;
+				BVHBuildNode* opened = children[best];
+				for (int i = nChildren; i > best + 1; --i)
+					children[i] = children[i - 1];
+				children[best] = opened->children[0];
+				children[best + 1] = opened->children[1];
+				++nChildren;
+			}
+		}
+
+		WideBVHNode<N> wideNode;
+		for (int a = 0; a < 3; ++a)
+		{
+			for (int i = 0; i < N; ++i)
+			{
+				wideNode.bounds[0][a][i] = Infinity;
+				wideNode.bounds[1][a][i] = -Infinity;
 			}
+		}
+		for (int i = 0; i < N; ++i)
+		{
+			wideNode.offset[i] = -1;
+			wideNode.nPrimitives[i] = 0;
+		}
+		wideNode.nChildren = nChildren;
+		wideNode.axis = node->nPrimitives > 0 ? 0 : node->splitAxis;
 
-			node->InitInterior(dim, recursiveBuild(arena, primitiveInfo, start, mid, totalNodes, orderedPrims),
-				recursiveBuild(arena, primitiveInfo, mid, end, totalNodes, orderedPrims));
+		for (int i = 0; i < nChildren; ++i)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				wideNode.bounds[0][a][i] = children[i]->bounds.pMin[a];
+				wideNode.bounds[1][a][i] = children[i]->bounds.pMax[a];
+			}
+			if (children[i]->nPrimitives > 0)
+			{
+				wideNode.offset[i] = children[i]->firstPrimOffset;
+				wideNode.nPrimitives[i] = children[i]->nPrimitives;
+			}
+			else
+				wideNode.offset[i] = CollapseBVHTree(children[i], wideNodes);
 		}
 
-		
+		//wideNodes may have grown, so the node is written back last
+		wideNodes[myOffset] = wideNode;
+		return myOffset;
+	}
 
-		return node;
+	template <int N>
+	static Bounds3f WideChildBounds(const WideBVHNode<N>& node, int i)
+	{
+		return Bounds3f(Point3f(node.bounds[0][0][i], node.bounds[0][1][i], node.bounds[0][2][i]),
+			Point3f(node.bounds[1][0][i], node.bounds[1][1][i], node.bounds[1][2][i]));
 	}
 
-	bool BVHAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const
+	template <int N>
+	static void SetWideChildBounds(WideBVHNode<N>& node, int i, const Bounds3f& bounds)
 	{
-		bool hit = false;
-		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
-		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-		int currentNodeIndex = 0; //ǰڷʵnode
-		//һҪʵnodenodesToVisitindex
-		int toVisitOffset = 0;
-		//nodesToVisitһҪʵnodestack
-		int nodesToVisit[64]; 
-		while (true)
+		for (int a = 0; a < 3; ++a)
 		{
-			const LinearBVHNode* node = &linearNodes[currentNodeIndex];
-			if (node->bounds.IntersectP(ray, invDir, dirIsNeg))
+			node.bounds[0][a][i] = bounds.pMin[a];
+			node.bounds[1][a][i] = bounds.pMax[a];
+		}
+	}
+
+	template <int N>
+	static Bounds3f WideNodeBounds(const WideBVHNode<N>& node)
+	{
+		Bounds3f bounds;
+		for (int i = 0; i < node.nChildren; ++i)
+			bounds = Union(bounds, WideChildBounds(node, i));
+		return bounds;
+	}
+
+	//depth of the refit roots, about 256 of them for any node width
+	static int RefitRootDepth(int nodeWidth)
+	{
+		int depth = 0;
+		for (int n = 1; n < 256; n *= nodeWidth)
+			++depth;
+		return depth;
+	}
+
+	static void CollectLinearRoots(const LinearBVHNode* nodes, int index, int depth,
+		int rootDepth, std::vector<int>& roots)
+	{
+		if (depth == rootDepth || nodes[index].nPrimitives > 0)
+		{
+			roots.push_back(index);
+			return;
+		}
+		CollectLinearRoots(nodes, nodes[index].childrenOffset, depth + 1, rootDepth, roots);
+		CollectLinearRoots(nodes, nodes[index].childrenOffset + 1, depth + 1, rootDepth, roots);
+	}
+
+	template <int N>
+	static void CollectWideRoots(const WideBVHNode<N>* nodes, int index, int depth,
+		int rootDepth, std::vector<int>& roots)
+	{
+		if (depth == rootDepth)
+		{
+			roots.push_back(index);
+			return;
+		}
+		const WideBVHNode<N>& node = nodes[index];
+		for (int i = 0; i < node.nChildren; ++i)
+		{
+			if (node.nPrimitives[i] == 0)
+				CollectWideRoots(nodes, node.offset[i], depth + 1, rootDepth, roots);
+		}
+	}
+
+	static void LinearRefRange(const LinearBVHNode* nodes, int index, int* first, int* last)
+	{
+		const LinearBVHNode& node = nodes[index];
+		if (node.nPrimitives > 0)
+		{
+			*first = std::min(*first, node.primitivesOffset);
+			*last = std::max(*last, node.primitivesOffset + (int)node.nPrimitives);
+			return;
+		}
+		LinearRefRange(nodes, node.childrenOffset, first, last);
+		LinearRefRange(nodes, node.childrenOffset + 1, first, last);
+	}
+
+	template <int N>
+	static void WideRefRange(const WideBVHNode<N>* nodes, int index, int* first, int* last)
+	{
+		const WideBVHNode<N>& node = nodes[index];
+		for (int i = 0; i < node.nChildren; ++i)
+		{
+			if (node.nPrimitives[i] > 0)
 			{
-				//Ҷӽڵ
-				if (node->nPrimitives > 0)
+				*first = std::min(*first, (int)node.offset[i]);
+				*last = std::max(*last, (int)node.offset[i] + (int)node.nPrimitives[i]);
+			}
+			else
+				WideRefRange(nodes, node.offset[i], first, last);
+		}
+	}
+
+	template <int N>
+	void BVHAccel::ReorderWideNodes(WideBVHNode<N>* nodes)
+	{
+		const int treeletSize = std::max(1, 4096 / (int)sizeof(WideBVHNode<N>));
+		std::vector<int> order;
+		order.reserve(nNodes);
+		std::vector<int> newIndex(nNodes);
+		std::vector<int> treeletRoots(1, 0);
+		//(surface area, node index), a max heap
+		std::vector<std::pair<Float, int>> candidates;
+		while (!treeletRoots.empty())
+		{
+			candidates.assign(1, { 0, treeletRoots.back() });
+			treeletRoots.pop_back();
+			for (int size = 0; size < treeletSize && !candidates.empty(); ++size)
+			{
+				std::pop_heap(candidates.begin(), candidates.end());
+				int index = candidates.back().second;
+				candidates.pop_back();
+				newIndex[index] = order.size();
+				order.push_back(index);
+				const WideBVHNode<N>& node = nodes[index];
+				for (int i = 0; i < node.nChildren; ++i)
 				{
-					for (int i = 0; i < node->nPrimitives; i++)
-					{
-						if (primitives[node->primitivesOffset + i]->Intersect(ray, isect))
-						{
-							hit = true;
-						}
-					}
-					if (toVisitOffset == 0) 
-						break;
-					currentNodeIndex = nodesToVisit[--toVisitOffset];
+					if (node.nPrimitives[i] > 0)
+						continue;
+					candidates.push_back({ WideChildBounds(node, i).SurfaceArea(), node.offset[i] });
+					std::push_heap(candidates.begin(), candidates.end());
 				}
-				else
+			}
+			//the largest of the children left out is laid out next
+			std::sort(candidates.begin(), candidates.end());
+			for (const auto& candidate : candidates)
+				treeletRoots.push_back(candidate.second);
+		}
+
+		std::vector<WideBVHNode<N>> reordered(nNodes);
+		ParallelFor([&](int64_t i) {
+			WideBVHNode<N>& node = reordered[i];
+			node = nodes[order[i]];
+			for (int c = 0; c < node.nChildren; ++c)
+			{
+				if (node.nPrimitives[c] == 0)
+					node.offset[c] = newIndex[node.offset[c]];
+			}
+		}, nNodes, 4096);
+		memcpy(nodes, reordered.data(), nNodes * sizeof(WideBVHNode<N>));
+	}
+
+	void BVHAccel::ReorderLinearNodes()
+	{
+		if (linearNodes[0].nPrimitives > 0)
+			return;
+		const int treeletPairs = std::max(1, 4096 / (2 * (int)sizeof(LinearBVHNode)));
+		//first slot of every pair in the new order
+		std::vector<int> order;
+		order.reserve(nNodes / 2);
+		std::vector<int> newIndex(nNodes);
+		//interior nodes whose children start a treelet
+		std::vector<int> treeletRoots(1, 0);
+		//(surface area, interior node index), a max heap
+		std::vector<std::pair<Float, int>> candidates;
+		while (!treeletRoots.empty())
+		{
+			candidates.assign(1, { 0, treeletRoots.back() });
+			treeletRoots.pop_back();
+			for (int size = 0; size < treeletPairs && !candidates.empty(); ++size)
+			{
+				std::pop_heap(candidates.begin(), candidates.end());
+				int pair = linearNodes[candidates.back().second].childrenOffset;
+				candidates.pop_back();
+				newIndex[pair] = 2 + 2 * (int)order.size();
+				newIndex[pair + 1] = newIndex[pair] + 1;
+				order.push_back(pair);
+				for (int i = pair; i < pair + 2; ++i)
 				{
-					//߷ķǳ90
-					//ȷʵڶӽڵ
-					//һڵǵһӽڵ(currentNodeIndex + 1)
-					//߷ķ < 90෴
-					if (dirIsNeg[node->axis]) 
-					{
-                     	nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                     	currentNodeIndex = node->secondChildOffset;
-                  	} 
-					else 
-					{
-                     	nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                     	currentNodeIndex = currentNodeIndex + 1;
-                  	}
+					if (linearNodes[i].nPrimitives > 0)
+						continue;
+					candidates.push_back({ linearNodes[i].bounds.SurfaceArea(), i });
+					std::push_heap(candidates.begin(), candidates.end());
 				}
 			}
+			//the largest of the nodes left out is laid out next
+			std::sort(candidates.begin(), candidates.end());
+			for (const auto& candidate : candidates)
+				treeletRoots.push_back(candidate.second);
+		}
+
+		std::vector<LinearBVHNode> reordered(nNodes);
+		reordered[0] = linearNodes[0];
+		ParallelFor([&](int64_t i) {
+			reordered[2 + 2 * i] = linearNodes[order[i]];
+			reordered[3 + 2 * i] = linearNodes[order[i] + 1];
+		}, order.size(), 4096);
+		ParallelFor([&](int64_t i) {
+			LinearBVHNode& node = reordered[i];
+			if (i != 1 && node.nPrimitives == 0)
+				node.childrenOffset = newIndex[node.childrenOffset];
+		}, nNodes, 4096);
+		memcpy(linearNodes, reordered.data(), nNodes * sizeof(LinearBVHNode));
+	}
+
+	static int CountLinearNodes(const LinearBVHNode* nodes, int index)
+	{
+		if (nodes[index].nPrimitives > 0)
+			return 1;
+		return 1 + CountLinearNodes(nodes, nodes[index].childrenOffset) +
+			CountLinearNodes(nodes, nodes[index].childrenOffset + 1);
+	}
+
+	Bounds3f BVHAccel::RefBounds(int first, int n) const
+	{
+		Bounds3f bounds;
+		for (int i = first; i < first + n; ++i)
+		{
+			const BVHPrimitiveRef& ref = primRefs[i];
+			bounds = Union(bounds, primitives[ref.primitive]->SubPrimitiveBound(ref.sub));
+		}
+		return bounds;
+	}
+
+	std::vector<int> BVHAccel::CollectRefitRoots() const
+	{
+		std::vector<int> roots;
+		const int rootDepth = RefitRootDepth(nodeWidth);
+		if (nodeWidth == 4)
+			CollectWideRoots(wideNodes4, 0, 0, rootDepth, roots);
+		else if (nodeWidth == 8)
+			CollectWideRoots(wideNodes8, 0, 0, rootDepth, roots);
+		else
+			CollectLinearRoots(linearNodes, 0, 0, rootDepth, roots);
+		return roots;
+	}
+
+	Bounds3f BVHAccel::RefitLinear(int index, bool update, Float* areaSum)
+	{
+		LinearBVHNode& node = linearNodes[index];
+		if (node.nPrimitives > 0)
+		{
+			if (update)
+				node.bounds = RefBounds(node.primitivesOffset, node.nPrimitives);
+		}
+		else
+		{
+			Bounds3f b0 = RefitLinear(node.childrenOffset, update, areaSum);
+			Bounds3f b1 = RefitLinear(node.childrenOffset + 1, update, areaSum);
+			if (update)
+				node.bounds = Union(b0, b1);
+		}
+		*areaSum += node.bounds.SurfaceArea();
+		return node.bounds;
+	}
+
+	template <int N>
+	Bounds3f BVHAccel::RefitWide(WideBVHNode<N>* nodes, int index, bool update, Float* areaSum)
+	{
+		WideBVHNode<N>& node = nodes[index];
+		Bounds3f bounds;
+		for (int i = 0; i < node.nChildren; ++i)
+		{
+			Bounds3f child;
+			if (node.nPrimitives[i] > 0)
+				child = update ? RefBounds(node.offset[i], node.nPrimitives[i]) : WideChildBounds(node, i);
 			else
 			{
-				if (toVisitOffset == 0) 
-					break;
-				currentNodeIndex = nodesToVisit[--toVisitOffset];
+				child = RefitWide(nodes, node.offset[i], update, areaSum);
+				if (!update)
+					child = WideChildBounds(node, i);
 			}
+			if (update)
+				SetWideChildBounds(node, i, child);
+			*areaSum += child.SurfaceArea();
+			bounds = Union(bounds, child);
 		}
-		return hit;
+		return bounds;
 	}
 
-	bool BVHAccel::IntersectP(const Ray& ray) const
+	Bounds3f BVHAccel::RefitLinearTop(int index, int depth, int rootDepth)
 	{
-		if (linearNodes == nullptr)
-		    return false;
-		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
-		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
-		int currentNodeIndex = 0; //ǰڷʵnode
-		//һҪʵnodenodesToVisitindex
-		int toVisitOffset = 0;
-		//nodesToVisitһҪʵnodestack
-		int nodesToVisit[64]; 
-		while (true)
+		LinearBVHNode& node = linearNodes[index];
+		if (depth == rootDepth || node.nPrimitives > 0)
+			return node.bounds;
+		node.bounds = Union(RefitLinearTop(node.childrenOffset, depth + 1, rootDepth),
+			RefitLinearTop(node.childrenOffset + 1, depth + 1, rootDepth));
+		return node.bounds;
+	}
+
+	template <int N>
+	Bounds3f BVHAccel::RefitWideTop(WideBVHNode<N>* nodes, int index, int depth, int rootDepth)
+	{
+		WideBVHNode<N>& node = nodes[index];
+		Bounds3f bounds;
+		for (int i = 0; i < node.nChildren; ++i)
 		{
-			const LinearBVHNode* node = &linearNodes[currentNodeIndex];
-			if (node->bounds.IntersectP(ray, invDir, dirIsNeg))
+			Bounds3f child;
+			if (node.nPrimitives[i] > 0)
+				child = RefBounds(node.offset[i], node.nPrimitives[i]);
+			else if (depth + 1 == rootDepth)
+				child = WideNodeBounds(nodes[node.offset[i]]);
+			else
+				child = RefitWideTop(nodes, node.offset[i], depth + 1, rootDepth);
+			SetWideChildBounds(node, i, child);
+			bounds = Union(bounds, child);
+		}
+		return bounds;
+	}
+
+	std::vector<Float> BVHAccel::RefitSubtrees(const std::vector<int>& roots, bool update)
+	{
+		std::vector<Float> cost(roots.size());
+		ParallelFor([&](int64_t i) {
+			Float areaSum = 0;
+			Bounds3f bounds;
+			if (nodeWidth == 4)
+				bounds = RefitWide(wideNodes4, roots[i], update, &areaSum);
+			else if (nodeWidth == 8)
+				bounds = RefitWide(wideNodes8, roots[i], update, &areaSum);
+			else
+				bounds = RefitLinear(roots[i], update, &areaSum);
+			cost[i] = areaSum / std::max(bounds.SurfaceArea(), MachineEpsilon);
+		}, roots.size(), 1);
+		return cost;
+	}
+
+	void BVHAccel::Refit(Float rebuildThreshold)
+	{
+		if (primRefs.empty())
+			return;
+
+		auto refitStart = std::chrono::steady_clock::now();
+		ParallelFor([&](int64_t i) {
+			primitives[i]->Refit();
+		}, primitives.size(), 16);
+		//the refit works on float bounds, the nodes are quantized again after it
+		const bool quantized = quantizedNodes4 || quantizedNodes8;
+		if (quantized)
+			DequantizeNodes();
+
+		//before the first refit the nodes still have their built bounds
+		if (refitRoots.empty())
+		{
+			refitRoots = CollectRefitRoots();
+			refitBaseCost = RefitSubtrees(refitRoots, false);
+		}
+		std::vector<Float> cost = RefitSubtrees(refitRoots, true);
+		const int rootDepth = RefitRootDepth(nodeWidth);
+		if (nodeWidth == 4)
+			worldBound = RefitWideTop(wideNodes4, 0, 0, rootDepth);
+		else if (nodeWidth == 8)
+			worldBound = RefitWideTop(wideNodes8, 0, 0, rootDepth);
+		else
+			worldBound = RefitLinearTop(0, 0, rootDepth);
+
+		std::vector<int> degraded;
+		if (rebuildThreshold > 1)
+		{
+			for (size_t i = 0; i < refitRoots.size(); ++i)
 			{
-				//Ҷӽڵ
-				if (node->nPrimitives > 0)
-				{
-					for (int i = 0; i < node->nPrimitives; i++)
-					{
-						if (primitives[node->primitivesOffset + i]->IntersectP(ray))
-						{
-							return true;
-						}
-					}
-					if (toVisitOffset == 0) 
-						break;
-					currentNodeIndex = nodesToVisit[--toVisitOffset];
-				}
-				else
+				if (cost[i] > refitBaseCost[i] * rebuildThreshold)
+					degraded.push_back(refitRoots[i]);
+			}
+		}
+		if (!degraded.empty())
+		{
+			RebuildSubtrees(degraded);
+			refitRoots = CollectRefitRoots();
+			refitBaseCost = RefitSubtrees(refitRoots, false);
+		}
+		if (bakedTriangles)
+			BakeTriangles();
+		if (triangleGroupWidth)
+			GroupTriangles();
+		if (quantized)
+			QuantizeNodes(false);
+
+		std::chrono::duration<double> refitTime = std::chrono::steady_clock::now() - refitStart;
+		Log::Info("BVH{} refit {} primitives, {} nodes in {:.3f}s, rebuilt {} of {} subtrees",
+			nodeWidth, primRefs.size(), nNodes, refitTime.count(), degraded.size(), refitRoots.size());
+	}
+
+	void BVHAccel::SubtreeRefRange(int index, int* first, int* last) const
+	{
+		*first = std::numeric_limits<int>::max();
+		*last = 0;
+		if (nodeWidth == 4)
+			WideRefRange(wideNodes4, index, first, last);
+		else if (nodeWidth == 8)
+			WideRefRange(wideNodes8, index, first, last);
+		else
+			LinearRefRange(linearNodes, index, first, last);
+	}
+
+	static BVHBuildNode* FindRebuilt(const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt, int index)
+	{
+		auto it = std::lower_bound(rebuilt.begin(), rebuilt.end(), std::make_pair(index, (BVHBuildNode*)nullptr));
+		return it != rebuilt.end() && it->first == index ? it->second : nullptr;
+	}
+
+	void BVHAccel::ReemitLinear(const LinearBVHNode* oldNodes, int oldIndex, int index,
+		const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt, int* offset)
+	{
+		if (BVHBuildNode* node = FindRebuilt(rebuilt, oldIndex))
+		{
+			FlattenBVHTree(node, index, offset);
+			return;
+		}
+
+		const LinearBVHNode& oldNode = oldNodes[oldIndex];
+		linearNodes[index] = oldNode;
+		if (oldNode.nPrimitives == 0)
+		{
+			int children = *offset;
+			*offset += 2;
+			linearNodes[index].childrenOffset = children;
+			ReemitLinear(oldNodes, oldNode.childrenOffset, children, rebuilt, offset);
+			ReemitLinear(oldNodes, oldNode.childrenOffset + 1, children + 1, rebuilt, offset);
+		}
+	}
+
+	template <int N>
+	int BVHAccel::ReemitWide(const WideBVHNode<N>* oldNodes, int index,
+		const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt,
+		std::vector<WideBVHNode<N>>& wideNodes)
+	{
+		if (BVHBuildNode* node = FindRebuilt(rebuilt, index))
+			return CollapseBVHTree(node, wideNodes);
+
+		int myOffset = wideNodes.size();
+		WideBVHNode<N> wideNode = oldNodes[index];
+		wideNodes.push_back(wideNode);
+		for (int i = 0; i < wideNode.nChildren; ++i)
+		{
+			if (wideNode.nPrimitives[i] == 0)
+				wideNode.offset[i] = ReemitWide(oldNodes, wideNode.offset[i], rebuilt, wideNodes);
+		}
+		wideNodes[myOffset] = wideNode;
+		return myOffset;
+	}
+
+	void BVHAccel::RebuildSubtrees(const std::vector<int>& roots)
+	{
+		std::vector<std::unique_ptr<MemoryArena>> arenas;
+		for (int i = 0; i < MaxThreadIndex(); ++i)
+			arenas.emplace_back(new MemoryArena(1024 * 1024));
+		std::atomic<int> totalNodes(0);
+		std::vector<BVHPrimitiveInfo> primitiveInfo(primRefs.size());
+		std::vector<std::pair<int, BVHBuildNode*>> rebuilt;
+		int nOldNodes = 0;
+
+		//the leaves of a subtree reference a contiguous range of primRefs,
+		//the range is built again and reordered in place
+		for (int root : roots)
+		{
+			int first, last;
+			SubtreeRefRange(root, &first, &last);
+			ParallelFor([&](int64_t i) {
+				const BVHPrimitiveRef& ref = primRefs[first + i];
+				primitiveInfo[first + i] = { (size_t)(first + i),
+					primitives[ref.primitive]->SubPrimitiveBound(ref.sub) };
+			}, last - first, 1024);
+			rebuilt.push_back({ root, recursiveBuild(arenas, primitiveInfo, first, last, &totalNodes) });
+
+			std::vector<BVHPrimitiveRef> orderedRefs(last - first);
+			for (int i = first; i < last; ++i)
+				orderedRefs[i - first] = primRefs[primitiveInfo[i].primitiveNumber];
+			std::copy(orderedRefs.begin(), orderedRefs.end(), primRefs.begin() + first);
+			if (nodeWidth == 2)
+				nOldNodes += CountLinearNodes(linearNodes, root);
+		}
+		std::sort(rebuilt.begin(), rebuilt.end());
+
+		//the untouched subtrees are copied, the rebuilt ones emitted in
+		//their place. Mapped cache nodes are left to cacheFile.
+		if (nodeWidth == 4 || nodeWidth == 8)
+		{
+			auto reemit = [&](auto*& nodes) {
+				using Node = typename std::remove_reference<decltype(*nodes)>::type;
+				std::vector<Node> wideNodes;
+				ReemitWide(nodes, 0, rebuilt, wideNodes);
+				if (!cacheFile)
+					FreeAligned(nodes);
+				nNodes = wideNodes.size();
+				nodes = AllocAligned<Node>(nNodes);
+				memcpy(nodes, wideNodes.data(), nNodes * sizeof(Node));
+				ReorderWideNodes(nodes);
+			};
+			if (nodeWidth == 4)
+				reemit(wideNodes4);
+			else
+				reemit(wideNodes8);
+		}
+		else
+		{
+			const LinearBVHNode* oldNodes = linearNodes;
+			nNodes = nNodes - nOldNodes + totalNodes;
+			linearNodes = AllocAligned<LinearBVHNode>(nNodes);
+			linearNodes[1] = LinearBVHNode();
+			int offset = 2;
+			ReemitLinear(oldNodes, 0, 0, rebuilt, &offset);
+			if (!cacheFile)
+				FreeAligned((void*)oldNodes);
+			ReorderLinearNodes();
+		}
+		cacheFile.reset();
+	}
+
+	template <typename Node>
+	bool BVHAccel::StepWide(const Node* nodes, WideTraversal<Node>& t, const Ray& ray,
+		SurfaceInteraction* isect) const
+	{
+		constexpr int N = Node::width;
+		auto current = t.nodesToVisit[--t.toVisitOffset];
+		//a closer hit was found after the node was pushed
+		if (current.tNear > ray.tMax)
+			return t.toVisitOffset > 0;
+		const Node& node = nodes[current.nodeIndex];
+		COUNT_TRAVERSAL(nodesVisited, 1);
+		Float tNear[N];
+		int hitMask = IntersectChildren(node, ray.o, t.invDir, t.dirIsNeg, ray.tMax, tNear);
+		if (hitMask == 0)
+			return t.toVisitOffset > 0;
+
+		//visit the children front to back along the split axis: leaves
+		//are intersected right away, interior children are pushed in
+		//reverse so the front one is popped first
+		int nChildren = node.nChildren;
+		bool reverse = t.dirIsNeg[node.axis];
+		for (int k = 0; k < nChildren; ++k)
+		{
+			int i = reverse ? nChildren - 1 - k : k;
+			if (!(hitMask & (1 << i)) || node.nPrimitives[i] == 0)
+				continue;
+			if (IntersectLeaf(node.offset[i], node.nPrimitives[i], ray, isect, &t.bakedHit))
+				t.hit = true;
+		}
+		for (int k = nChildren - 1; k >= 0; --k)
+		{
+			int i = reverse ? nChildren - 1 - k : k;
+			if ((hitMask & (1 << i)) && node.nPrimitives[i] == 0 && tNear[i] <= ray.tMax)
+			{
+				PrefetchNode(&nodes[node.offset[i]]);
+				t.nodesToVisit[t.toVisitOffset++] = { node.offset[i], tNear[i] };
+			}
+		}
+		return t.toVisitOffset > 0;
+	}
+
+	template <typename Node>
+	bool BVHAccel::IntersectWide(const Node* nodes, const Ray& ray,
+		SurfaceInteraction* isect) const
+	{
+		WideTraversal<Node> traversal(ray);
+		while (StepWide(nodes, traversal, ray, isect))
+			;
+		FinishIntersect(ray, traversal.bakedHit, isect);
+		return traversal.hit;
+	}
+
+	void BVHAccel::IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+		bool* hits) const
+	{
+		if (quantizedNodes4)
+			IntersectInterleavedWide(quantizedNodes4, rays, n, isects, hits);
+		else if (quantizedNodes8)
+			IntersectInterleavedWide(quantizedNodes8, rays, n, isects, hits);
+		else if (wideNodes4)
+			IntersectInterleavedWide(wideNodes4, rays, n, isects, hits);
+		else if (wideNodes8)
+			IntersectInterleavedWide(wideNodes8, rays, n, isects, hits);
+		else if (linearNodes == nullptr || n == 1)
+			Primitive::IntersectInterleaved(rays, n, isects, hits);
+		else
+		{
+			LinearTraversal traversals[kMaxRayPacketSize];
+			int active[kMaxRayPacketSize];
+			for (int r = 0; r < n; ++r)
+			{
+				traversals[r] = LinearTraversal(rays[r]);
+				active[r] = r;
+			}
+			//round robin over the unfinished rays. A popped far child
+			//shares the cache line of its sibling, so a ray keeps going
+			//while it stays in the line, then its next node is prefetched
+			//and the other rays are advanced while the load is in flight.
+			int nActive = n;
+			while (nActive > 0)
+			{
+				for (int k = 0; k < nActive;)
 				{
-					//߷ķǳ90
-					//ȷʵڶӽڵ
-					//һڵǵһӽڵ(currentNodeIndex + 1)
-					//߷ķ < 90෴
-					if (dirIsNeg[node->axis]) 
+					const int r = active[k];
+					LinearTraversal& t = traversals[r];
+					int from;
+					bool more;
+					do
 					{
-                     	nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
-                     	currentNodeIndex = node->secondChildOffset;
-                  	} 
-					else 
+						from = t.currentNodeIndex;
+						more = StepLinear(t, rays[r], &isects[r]);
+					} while (more && (t.currentNodeIndex >> 1) == (from >> 1));
+					if (more)
 					{
-                     	nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-                     	currentNodeIndex = currentNodeIndex + 1;
-                  	}
+						PrefetchNode(&linearNodes[t.currentNodeIndex]);
+						++k;
+						continue;
+					}
+					FinishIntersect(rays[r], t.bakedHit, &isects[r]);
+					hits[r] = t.hit;
+					active[k] = active[--nActive];
 				}
-				
-			}
-			else 
-			{
-				if (toVisitOffset == 0) 
-					break;
-				currentNodeIndex = nodesToVisit[--toVisitOffset];
 			}
 		}
-		return false;
 	}
 
-	int BVHAccel::FlattenBVHTree(BVHBuildNode* node, int* offset)
+	template <typename Node>
+	void BVHAccel::IntersectInterleavedWide(const Node* nodes, const Ray* rays, int n,
+		SurfaceInteraction* isects, bool* hits) const
 	{
-		LinearBVHNode* linearNode = &linearNodes[*offset];
-		linearNode->bounds = node->bounds;
-		int myOffset = (*offset)++;
-		if (node->nPrimitives > 0)
+		if (n == 1)
 		{
-			//һҶӽڵ
-			linearNode->nPrimitives = node->nPrimitives;
-			linearNode->primitivesOffset = node->firstPrimOffset;
+			hits[0] = IntersectWide(nodes, rays[0], &isects[0]);
+			return;
 		}
-		else
+		//every step pops a wide node, which is a jump, so the rays take
+		//turns after each node. The children pushed were prefetched.
+		WideTraversal<Node> traversals[kMaxRayPacketSize];
+		int active[kMaxRayPacketSize];
+		for (int r = 0; r < n; ++r)
 		{
-			linearNode->axis = node->splitAxis;
-			linearNode->nPrimitives = 0;
-			//ﷵoffset
-			FlattenBVHTree(node->children[0], offset);
-			linearNode->secondChildOffset = FlattenBVHTree(node->children[1], offset);
+			traversals[r] = WideTraversal<Node>(rays[r]);
+			active[r] = r;
+		}
+		int nActive = n;
+		while (nActive > 0)
+		{
+			for (int k = 0; k < nActive;)
+			{
+				const int r = active[k];
+				WideTraversal<Node>& t = traversals[r];
+				if (StepWide(nodes, t, rays[r], &isects[r]))
+				{
+					++k;
+					continue;
+				}
+				FinishIntersect(rays[r], t.bakedHit, &isects[r]);
+				hits[r] = t.hit;
+				active[k] = active[--nActive];
+			}
 		}
+	}
 
-		return myOffset;
+	template <typename Node>
+	bool BVHAccel::IntersectPWide(const Node* nodes, const Ray& ray, int* occluder) const
+	{
+		constexpr int N = Node::width;
+		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+		int dirIsNeg[3] = { invDir.x < 0, invDir.y < 0, invDir.z < 0 };
+		int nodesToVisit[64 * (N - 1)];
+		int toVisitOffset = 0;
+		nodesToVisit[toVisitOffset++] = 0;
+		while (toVisitOffset > 0)
+		{
+			const Node& node = nodes[nodesToVisit[--toVisitOffset]];
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			Float tNear[N];
+			int hitMask = IntersectChildren(node, ray.o, invDir, dirIsNeg, ray.tMax, tNear);
+			int nChildren = node.nChildren;
+			bool reverse = dirIsNeg[node.axis];
+			for (int k = nChildren - 1; k >= 0; --k)
+			{
+				int i = reverse ? nChildren - 1 - k : k;
+				if (!(hitMask & (1 << i)))
+					continue;
+				if (node.nPrimitives[i] == 0)
+				{
+					PrefetchNode(&nodes[node.offset[i]]);
+					nodesToVisit[toVisitOffset++] = node.offset[i];
+					continue;
+				}
+				if (IntersectLeafP(node.offset[i], node.nPrimitives[i], ray, occluder))
+					return true;
+			}
+		}
+		return false;
 	}
 }
\ No newline at end of file
@@ -1,30 +1,119 @@
 #pragma once
 #include "robject.h"
+#include <atomic>
 
 namespace AIR
 {
 	struct BVHBuildNode;
 	struct BVHPrimitiveInfo;
 	struct LinearBVHNode;
+	struct MortonPrimitive;
+	struct SBVHState;
+	template <int N> struct WideBVHNode;
+	template <int N> struct QuantizedBVHNode;
+	struct BakedTriangle;
+	struct BakedHit;
+	struct LinearTraversal;
+	struct RayPacket;
+	template <typename Node> struct WideTraversal;
+	template <int W> struct TriangleGroup;
+	class MappedFile;
 
 	class SurfaceInteraction;
 
+	//the leaves reference (primitive, sub primitive) pairs, sub is the
+	//triangle of a MeshPrimitive and 0 for any other primitive
+	struct BVHPrimitiveRef
+	{
+		uint32_t primitive;
+		uint32_t sub;
+	};
+
 	class BVHAccel : public Primitive
 	{
 	public:
-		enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts };
+		enum class SplitMethod { SAH, HLBVH, Middle, EqualCounts, SBVH };
+		enum class TriangleTest { Watertight, Moller };
+		//nodeWidth 2 keeps the binary LinearBVHNode layout, 4 or 8 collapses
+		//the binary tree into WideBVHNode<4/8> whose children are tested
+		//with SIMD slab tests
+		//
+		//bakeTriangles copies the world space vertices of the triangle
+		//primitives into an array the leaves test directly, without the
+		//Primitive and Shape virtual calls and transforms per test
+		//
+		//with a cacheDir the nodes and the primitive order are saved to
+		//cacheDir/bvh_<key>.bvh, the key hashes the bounds of every primitive
+		//and the build parameters. When that file exists the tree is mapped
+		//from it instead of being built.
+		//
+		//SplitMethod::SBVH also splits references across spatial planes where
+		//the best object split overlaps, adding at most spatialSplitBudget
+		//times the primitive count of references
+		//
+		//quantizeNodes stores the child bounds of the 4 or 8 wide nodes as
+		//8 bit offsets on a grid over the node, QuantizedBVHNode, for a few
+		//more instructions per node visited. A 4 wide node shrinks from 128
+		//to 80 bytes and an 8 wide node from 256 to 128 bytes
+		//
+		//triangleGroupWidth 4 or 8 also stores the baked triangles of every
+		//leaf in SoA groups of that many, TriangleGroup, which the leaves
+		//test with one SIMD kernel per group. It implies bakeTriangles, the
+		//SAH split then costs a leaf by its groups and lets it hold at least
+		//a full group.
+		//triangleTest picks the watertight test of IntersectTriangle or
+		//Moller-Trumbore for the baked triangles.
 		BVHAccel(std::vector<std::shared_ptr<Primitive>> p,
 			int maxPrimsInNode = 1,
-			SplitMethod splitMethod = SplitMethod::SAH);
+			SplitMethod splitMethod = SplitMethod::SAH,
+			int nodeWidth = 2,
+			bool bakeTriangles = false,
+			const std::string& cacheDir = "",
+			Float spatialSplitBudget = 0.3f,
+			bool quantizeNodes = false,
+			int triangleGroupWidth = 0,
+			TriangleTest triangleTest = TriangleTest::Watertight);
 		~BVHAccel();
 
+		Bounds3f WorldBound() const;
 		bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
 		bool IntersectP(const Ray& ray) const;
+		//*lastOccluder is a primRefs index
+		bool IntersectPOccluder(const Ray& ray, int* lastOccluder) const;
+		//the binary nodes are traversed by the whole packet, a node is
+		//culled for a packet of one direction octant with a single interval
+		//test before the rays are tested one by one
+		void IntersectPacket(const Ray* rays, int n, SurfaceInteraction* isects,
+			bool* hits) const;
+		void IntersectPPacket(const Ray* rays, int n, bool* occluded) const;
+		//the rays are traversed one node at a time in turns, a ray yields
+		//after prefetching the node it jumps to
+		void IntersectInterleaved(const Ray* rays, int n, SurfaceInteraction* isects,
+			bool* hits) const;
+
+		//refits the tree after the Transforms of its primitives moved, the
+		//topology is kept and the node bounds are recomputed bottom-up.
+		//With a rebuildThreshold > 1 every top level subtree whose
+		//normalized SAH cost grew by more than that factor since it was
+		//built is rebuilt from its own primitives.
+		void Refit(Float rebuildThreshold);
+		void Refit()
+		{
+			Refit(0);
+		}
+		size_t AcceleratorBytes() const;
 
 		static std::shared_ptr<Primitive> CreateBVHAccelerator(
 			std::vector<std::shared_ptr<Primitive>> prims,
 			int maxPrimsInNode = 4,
-			const std::string& splitName = "bvh");
+			const std::string& splitName = "bvh",
+			int nodeWidth = 2,
+			bool bakeTriangles = false,
+			const std::string& cacheDir = "",
+			Float spatialSplitBudget = 0.3f,
+			bool quantizeNodes = false,
+			int triangleGroupWidth = 0,
+			const std::string& triangleTestName = "watertight");
 
 	private:
 		//ݹ鹹
@@ -33,19 +122,207 @@ namespace AIR
 		//start         ӶprimitiveInfoеʼλ
 		//end           ӶprimitiveInfoеĽλ
 		//totalNodes    tracks the total number of BVH nodes(BVHBuildNode) that have been created
-		//orderedPrims  
+		//
+		//Large subtrees are built as parallel tasks, each thread allocates its
+		//nodes from arenas[ThreadIndex]. A leaf references its own
+		//[start, end) range of primitiveInfo, so the final primitive order
+		//doesn't depend on which thread built what.
 		BVHBuildNode* recursiveBuild(
-			MemoryArena& arena, std::vector<BVHPrimitiveInfo>& primitiveInfo,
-			int start, int end, int* totalNodes,
-			std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+			std::vector<std::unique_ptr<MemoryArena>>& arenas,
+			std::vector<BVHPrimitiveInfo>& primitiveInfo,
+			int start, int end, std::atomic<int>* totalNodes);
+
+		//HLBVH build: primitives are sorted by the Morton code of their
+		//centroid, each run sharing the top 12 bits becomes a treelet that is
+		//emitted in parallel by splitting on the Morton bits, and the treelet
+		//roots are joined with SAH. primitiveInfo is left in Morton order.
+		BVHBuildNode* HLBVHBuild(
+			std::vector<std::unique_ptr<MemoryArena>>& arenas,
+			std::vector<BVHPrimitiveInfo>& primitiveInfo,
+			std::atomic<int>* totalNodes) const;
+
+		//emits the nodes of one treelet from the preallocated buildNodes,
+		//[start, start + nPrimitives) is the treelet's range of primitiveInfo
+		BVHBuildNode* emitLBVH(
+			BVHBuildNode*& buildNodes,
+			const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+			const MortonPrimitive* mortonPrims, int start, int nPrimitives,
+			int* totalNodes, int bitIndex) const;
+
+		//SAH over the treelet roots in [start, end)
+		BVHBuildNode* buildUpperSAH(MemoryArena& arena,
+			std::vector<BVHBuildNode*>& treeletRoots,
+			int start, int end, std::atomic<int>* totalNodes) const;
+		//SBVH build over the references of one node, refs holds their
+		//clipped bounds and is released before the children are built.
+		//The leaves keep their own reference lists until
+		//GatherSBVHLeaves puts them in tree order.
+		BVHBuildNode* SBVHBuild(
+			std::vector<std::unique_ptr<MemoryArena>>& arenas,
+			std::vector<BVHPrimitiveInfo>& refs, int depth,
+			SBVHState& state, std::atomic<int>* totalNodes) const;
+		//bounds of the part of ref between lo and hi along axis
+		Bounds3f ClipReference(const BVHPrimitiveInfo& ref, int axis, Float lo, Float hi) const;
+		void GatherSBVHLeaves(BVHBuildNode* node, std::vector<BVHPrimitiveRef>& orderedRefs) const;
+		//logs the SAH cost of the tree and the overlap of sibling nodes,
+		//both relative to the root area
+		void ReportTreeQuality(const BVHBuildNode* root) const;
 
 		//õױڴṹ
 		//Ҳһݹķ
-		int FlattenBVHTree(BVHBuildNode* node, int* offset);
+		//node goes to linearNodes[index], its children to the pair of slots
+		//at *offset
+		void FlattenBVHTree(BVHBuildNode* node, int index, int* offset);
+		//lays the sibling pairs of linearNodes out in treelets of about a
+		//page, grown from the treelet root by the interior node with the
+		//largest surface area like ReorderWideNodes
+		void ReorderLinearNodes();
+
+		//collapses the binary build tree into N-wide nodes, returns the
+		//index of the wide node created for node
+		template <int N>
+		int CollapseBVHTree(BVHBuildNode* node, std::vector<WideBVHNode<N>>& wideNodes);
+
+		//lays the wide nodes out in treelets of about a page. A treelet
+		//grows from its root by the interior child with the largest surface
+		//area, the one a ray most likely visits, the children left out
+		//start the next treelets, depth first.
+		template <int N>
+		void ReorderWideNodes(WideBVHNode<N>* nodes);
+
+		//Node is WideBVHNode<N> or QuantizedBVHNode<N>
+		template <typename Node>
+		bool IntersectWide(const Node* nodes, const Ray& ray,
+			SurfaceInteraction* isect) const;
+		template <typename Node>
+		void IntersectInterleavedWide(const Node* nodes, const Ray* rays, int n,
+			SurfaceInteraction* isects, bool* hits) const;
+		//visit the next node of a traversal, false once it is done
+		bool StepLinear(LinearTraversal& t, const Ray& ray, SurfaceInteraction* isect) const;
+		template <typename Node>
+		bool StepWide(const Node* nodes, WideTraversal<Node>& t, const Ray& ray,
+			SurfaceInteraction* isect) const;
+		//any hit traversal, occluder is set to the primRefs index hit
+		bool IntersectPAnyHit(const Ray& ray, int* occluder) const;
+		template <typename Node>
+		bool IntersectPWide(const Node* nodes, const Ray& ray, int* occluder) const;
+
+		//replaces the wide nodes by QuantizedBVHNodes, with report the memory
+		//before and after is logged
+		void QuantizeNodes(bool report);
+		//decodes the quantized nodes back into wide nodes, for refitting
+		void DequantizeNodes();
+
+		//SAH cost of intersecting a leaf of n primitives, in triangle tests
+		Float LeafIntersectCost(int n) const
+		{
+			return triangleGroupWidth ?
+				Float((n + triangleGroupWidth - 1) / triangleGroupWidth) : Float(n);
+		}
+
+		//bakes the triangles of the ordered primRefs
+		void BakeTriangles();
+		//packs the baked triangles of every leaf into triangleGroups4/8,
+		//after the nodes are built and after every refit
+		void GroupTriangles();
+
+		//union of the bounds of primRefs[first, first + n)
+		Bounds3f RefBounds(int first, int n) const;
+		//subtrees of the first levels refit as parallel tasks
+		std::vector<int> CollectRefitRoots() const;
+		//refits (or with update false only reads) the subtree of node index,
+		//adds the surface areas of its nodes to areaSum, returns its bounds
+		Bounds3f RefitLinear(int index, bool update, Float* areaSum);
+		template <int N>
+		Bounds3f RefitWide(WideBVHNode<N>* nodes, int index, bool update, Float* areaSum);
+		//refits the nodes above the refit roots
+		Bounds3f RefitLinearTop(int index, int depth, int rootDepth);
+		template <int N>
+		Bounds3f RefitWideTop(WideBVHNode<N>* nodes, int index, int depth, int rootDepth);
+		//sum of the node areas over the root area of each subtree
+		std::vector<Float> RefitSubtrees(const std::vector<int>& roots, bool update);
+		//builds the subtrees of roots again and re-emits the node array
+		void RebuildSubtrees(const std::vector<int>& roots);
+		void SubtreeRefRange(int index, int* first, int* last) const;
+		template <int N>
+		int ReemitWide(const WideBVHNode<N>* oldNodes, int index,
+			const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt,
+			std::vector<WideBVHNode<N>>& wideNodes);
+		void ReemitLinear(const LinearBVHNode* oldNodes, int oldIndex, int index,
+			const std::vector<std::pair<int, BVHBuildNode*>>& rebuilt, int* offset);
+
+		//hash of the primitive bounds and the build parameters
+		uint64_t CacheKey(const std::vector<BVHPrimitiveInfo>& primitiveInfo) const;
+		//maps the nodes of the cache file at path and copies its primitive
+		//order, false if it is missing, stale or corrupt
+		bool LoadCache(const std::string& path, uint64_t key, int* nNodes);
+		void WriteCache(const std::string& path, uint64_t key, int nNodes) const;
+
+		//logs the bytes per triangle of the mesh primitives against a
+		//Primitive and a Triangle per triangle
+		void ReportPrimitiveMemory() const;
+
+		//tests primRefs[index], a baked triangle hit only records its
+		//barycentrics in bakedHit, FinishIntersect computes the interaction
+		//of the closest one after traversal
+		bool IntersectPrimitive(int index, const Ray& ray, SurfaceInteraction* isect,
+			BakedHit* bakedHit) const;
+		bool IntersectPrimitiveP(int index, const Ray& ray) const;
+		//tests the n primitives of the leaf starting at primRefs[offset],
+		//through its triangle groups when there are any
+		bool IntersectLeaf(int offset, int n, const Ray& ray, SurfaceInteraction* isect,
+			BakedHit* bakedHit) const;
+		bool IntersectLeafP(int offset, int n, const Ray& ray, int* occluder) const;
+		//the same for the rays of packet in mask, keeps the tMax of packet
+		//in step with rays. Returns the mask of the rays that hit (occluded
+		//for the P version).
+		int IntersectLeafPacket(int offset, int n, const Ray* rays, int mask,
+			RayPacket* packet, SurfaceInteraction* isects, BakedHit* bakedHits) const;
+		int IntersectLeafPacketP(int offset, int n, const Ray* rays, int mask,
+			const RayPacket& packet) const;
+		template <int W>
+		bool IntersectLeafGroups(const TriangleGroup<W>* groups, int n, const Ray& ray,
+			SurfaceInteraction* isect, BakedHit* bakedHit) const;
+		template <int W>
+		bool IntersectLeafGroupsP(const TriangleGroup<W>* groups, int n, const Ray& ray,
+			int* occluder) const;
+		void FinishIntersect(const Ray& ray, const BakedHit& bakedHit,
+			SurfaceInteraction* isect) const;
 
 		const int maxPrimsInNode;
+		const Float spatialSplitBudget;
 		std::vector<std::shared_ptr<Primitive>> primitives;
+		//in the order of the leaves
+		std::vector<BVHPrimitiveRef> primRefs;
 		const SplitMethod splitMethod;
 		LinearBVHNode* linearNodes = nullptr;
+		const int nodeWidth;
+		Bounds3f worldBound;
+		//only the array matching nodeWidth is allocated
+		WideBVHNode<4>* wideNodes4 = nullptr;
+		WideBVHNode<8>* wideNodes8 = nullptr;
+		//replace wideNodes4/8 when the nodes are quantized
+		QuantizedBVHNode<4>* quantizedNodes4 = nullptr;
+		QuantizedBVHNode<8>* quantizedNodes8 = nullptr;
+		//parallel to primRefs when bakeTriangles is on
+		BakedTriangle* bakedTriangles = nullptr;
+		const int triangleGroupWidth;
+		const TriangleTest triangleTest;
+		//only the array matching triangleGroupWidth is allocated, the groups
+		//of a leaf are consecutive and start at leafGroups[its first primRef]
+		TriangleGroup<4>* triangleGroups4 = nullptr;
+		TriangleGroup<8>* triangleGroups8 = nullptr;
+		std::vector<uint32_t> leafGroups;
+		int nTriangleGroups = 0;
+		//the nodes point into this mapping when they came from the cache
+		std::unique_ptr<MappedFile> cacheFile;
+		int nNodes = 0;
+		//refit roots and their normalized SAH cost when they were built
+		std::vector<int> refitRoots;
+		std::vector<Float> refitBaseCost;
 	};
+
+	//times the scalar and grouped watertight and Moller-Trumbore triangle
+	//kernels on random triangles and rays and logs their tests per second
+	void BenchmarkTriangleKernels();
 }
@@ -0,0 +1,47 @@
+#include "instanceprimitive.h"
+#include "interaction.h"
+
+namespace AIR
+{
+	InstancePrimitive::InstancePrimitive(const std::shared_ptr<Primitive>& prototype,
+		Transform* pInstanceToWorld)
+		: Primitive(nullptr, nullptr, nullptr, pInstanceToWorld, MediumInterface()),
+		prototype(prototype)
+	{
+		Refit();
+	}
+
+	void InstancePrimitive::Refit()
+	{
+		worldBound = mTransform->ObjectToWorldBound(prototype->WorldBound());
+	}
+
+	Bounds3f InstancePrimitive::WorldBound() const
+	{
+		return worldBound;
+	}
+
+	Ray InstancePrimitive::ToPrototype(const Ray& r) const
+	{
+		//WorldToObjectRay moves the origin by its rounding error, which
+		//shifts t. The prototype's tMax has to map back to r as it is, so
+		//the origin isn't offset here, the shapes offset their own hits.
+		return Ray(mTransform->WorldToObjectPoint(r.o), mTransform->WorldToObjectVector(r.d),
+			r.tMax, r.time, r.medium);
+	}
+
+	bool InstancePrimitive::Intersect(const Ray& r, SurfaceInteraction* pInteract) const
+	{
+		Ray ray = ToPrototype(r);
+		if (!prototype->Intersect(ray, pInteract))
+			return false;
+		r.tMax = ray.tMax;
+		*pInteract = mTransform->ObjectToWorldInteraction(*pInteract);
+		return true;
+	}
+
+	bool InstancePrimitive::IntersectP(const Ray& r) const
+	{
+		return prototype->IntersectP(ToPrototype(r));
+	}
+}
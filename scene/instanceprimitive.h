@@ -0,0 +1,37 @@
+#pragma once
+#include "robject.h"
+
+namespace AIR
+{
+	//one placement of a shared prototype, usually a BVHAccel built over a
+	//mesh in object space. The scene BVH only holds the instance, rays are
+	//moved into the prototype's space with the instance transform, so a
+	//mesh placed many times is stored and built once.
+	class InstancePrimitive : public Primitive
+	{
+	public:
+		//pInstanceToWorld should come from the TransformCache, instances
+		//with the same placement share it
+		InstancePrimitive(const std::shared_ptr<Primitive>& prototype,
+			Transform* pInstanceToWorld);
+
+		Bounds3f WorldBound() const;
+		//only follows the instance transform, a prototype whose contents
+		//moved has to be refit on its own first
+		void Refit();
+		bool Intersect(const Ray& r, SurfaceInteraction* pInteract) const;
+		bool IntersectP(const Ray& r) const;
+
+		const Primitive* GetPrototype() const
+		{
+			return prototype.get();
+		}
+
+	private:
+		//the ray in prototype space, with the same t along it as r
+		Ray ToPrototype(const Ray& r) const;
+
+		std::shared_ptr<Primitive> prototype;
+		Bounds3f worldBound;
+	};
+}
@@ -0,0 +1,509 @@
+#include "kdtreeaccel.h"
+#include "memory.h"
+#include "stat.h"
+#include "parallelism.h"
+#include "log.h"
+#include "interaction.h"
+#include <chrono>
+#include <cstring>
+
+namespace AIR
+{
+	//subtrees with more primitives than this are built as parallel tasks
+	static constexpr int kParallelBuildPrimitives = 4096;
+
+	STAT_COUNTER("Kd-Tree/Interior nodes", kdInteriorNodes);
+	STAT_COUNTER("Kd-Tree/Leaf nodes", kdLeafNodes);
+
+	struct KdAccelNode
+	{
+		void InitLeaf(const int* primNums, int np, std::vector<int>* primitiveIndices)
+		{
+			flags = 3;
+			nPrims |= (np << 2);
+			if (np == 0)
+				onePrimitive = 0;
+			else if (np == 1)
+				onePrimitive = primNums[0];
+			else
+			{
+				primitiveIndicesOffset = primitiveIndices->size();
+				primitiveIndices->insert(primitiveIndices->end(), primNums, primNums + np);
+			}
+		}
+
+		void InitInterior(int axis, int ac, Float s)
+		{
+			split = s;
+			flags = axis;
+			aboveChild |= (ac << 2);
+		}
+
+		Float SplitPos() const
+		{
+			return split;
+		}
+
+		int nPrimitives() const
+		{
+			return nPrims >> 2;
+		}
+
+		int SplitAxis() const
+		{
+			return flags & 3;
+		}
+
+		bool IsLeaf() const
+		{
+			return (flags & 3) == 3;
+		}
+
+		int AboveChild() const
+		{
+			return aboveChild >> 2;
+		}
+
+		//moves the node from a task's own arrays into the final ones
+		void Relocate(int nodeOffset, int indexOffset)
+		{
+			if (!IsLeaf())
+				aboveChild += nodeOffset << 2;
+			else if (nPrimitives() > 1)
+				primitiveIndicesOffset += indexOffset;
+		}
+
+		union
+		{
+			//interior
+			Float split;
+			//leaf
+			int onePrimitive;
+			int primitiveIndicesOffset;
+		};
+
+	private:
+		//the low 2 bits are the split axis, 3 for a leaf
+		union
+		{
+			int flags;
+			//leaf
+			int nPrims;
+			//interior
+			int aboveChild;
+		};
+	};
+
+	enum class EdgeType { Start, End };
+
+	struct BoundEdge
+	{
+		BoundEdge() {}
+		BoundEdge(Float t, int primNum, bool starting) : t(t), primNum(primNum)
+		{
+			type = starting ? EdgeType::Start : EdgeType::End;
+		}
+		Float t;
+		int primNum;
+		EdgeType type;
+	};
+
+	struct KdBuildNodes
+	{
+		std::vector<KdAccelNode> nodes;
+		std::vector<int> primitiveIndices;
+	};
+
+	//edge arrays reused by the nodes one task builds
+	struct KdBuildScratch
+	{
+		std::vector<BoundEdge> edges[3];
+	};
+
+	struct KdToDo
+	{
+		const KdAccelNode* node;
+		Float tMin, tMax;
+	};
+
+	KdTreeAccel::KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
+		int isectCost, int traversalCost, Float emptyBonus, int maxPrims, int maxDepth)
+		: isectCost(isectCost),
+		traversalCost(traversalCost),
+		maxPrims(maxPrims),
+		emptyBonus(emptyBonus),
+		maxDepth(maxDepth),
+		primitives(std::move(p))
+	{
+		for (size_t i = 0; i < primitives.size(); ++i)
+		{
+			int nSubs = primitives[i]->SubPrimitiveCount();
+			for (int sub = 0; sub < nSubs; ++sub)
+				primRefs.push_back({ (uint32_t)i, (uint32_t)sub });
+		}
+		Build();
+	}
+
+	KdTreeAccel::~KdTreeAccel()
+	{
+		FreeAligned(nodes);
+	}
+
+	void KdTreeAccel::Build()
+	{
+		FreeAligned(nodes);
+		nodes = nullptr;
+		nNodes = 0;
+		primitiveIndices.clear();
+		bounds = Bounds3f();
+		if (primRefs.empty())
+			return;
+
+		auto buildStart = std::chrono::steady_clock::now();
+		if (maxDepth <= 0)
+			maxDepth = std::round(8 + 1.3f * Log2Int((uint32_t)primRefs.size()));
+
+		std::vector<Bounds3f> primBounds(primRefs.size());
+		ParallelFor([&](int64_t i) {
+			const BVHPrimitiveRef& ref = primRefs[i];
+			primBounds[i] = primitives[ref.primitive]->SubPrimitiveBound(ref.sub);
+		}, primRefs.size(), 1024);
+		for (const Bounds3f& b : primBounds)
+			bounds = Union(bounds, b);
+
+		std::vector<int> primNums(primRefs.size());
+		for (size_t i = 0; i < primRefs.size(); ++i)
+			primNums[i] = i;
+		KdBuildNodes tree;
+		KdBuildScratch scratch;
+		buildTree(tree, bounds, primBounds, primNums, maxDepth, 0, scratch);
+
+		nNodes = tree.nodes.size();
+		nodes = AllocAligned<KdAccelNode>(nNodes);
+		memcpy(nodes, tree.nodes.data(), nNodes * sizeof(KdAccelNode));
+		primitiveIndices = std::move(tree.primitiveIndices);
+
+		std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - buildStart;
+		Log::Info("Kd-tree build {} primitives, {} nodes, max depth {} in {:.3f}s",
+			primRefs.size(), nNodes, maxDepth, buildTime.count());
+	}
+
+	void KdTreeAccel::buildTree(KdBuildNodes& out, const Bounds3f& nodeBounds,
+		const std::vector<Bounds3f>& allPrimBounds, std::vector<int>& primNums,
+		int depth, int badRefines, KdBuildScratch& scratch) const
+	{
+		const int nPrimitives = primNums.size();
+		const int nodeNum = out.nodes.size();
+		out.nodes.emplace_back();
+		if (nPrimitives <= maxPrims || depth == 0)
+		{
+			out.nodes[nodeNum].InitLeaf(primNums.data(), nPrimitives, &out.primitiveIndices);
+			++kdLeafNodes;
+			return;
+		}
+
+		//the split with the lowest SAH cost along the longest axis, the
+		//other axes are only tried when it has no split inside the node
+		int bestAxis = -1, bestOffset = -1;
+		Float bestCost = Infinity;
+		Float oldCost = isectCost * Float(nPrimitives);
+		Float invTotalSA = 1 / nodeBounds.SurfaceArea();
+		Vector3f d = nodeBounds.pMax - nodeBounds.pMin;
+		int axis = nodeBounds.MaximumExtent();
+		for (int retries = 0; retries < 3 && bestAxis == -1; ++retries, axis = (axis + 1) % 3)
+		{
+			std::vector<BoundEdge>& edges = scratch.edges[axis];
+			edges.resize(2 * nPrimitives);
+			for (int i = 0; i < nPrimitives; ++i)
+			{
+				int pn = primNums[i];
+				const Bounds3f& b = allPrimBounds[pn];
+				edges[2 * i] = BoundEdge(b.pMin[axis], pn, true);
+				edges[2 * i + 1] = BoundEdge(b.pMax[axis], pn, false);
+			}
+			std::sort(edges.begin(), edges.end(),
+				[](const BoundEdge& e0, const BoundEdge& e1) -> bool {
+				if (e0.t == e1.t)
+					return (int)e0.type < (int)e1.type;
+				return e0.t < e1.t;
+			});
+
+			int nBelow = 0, nAbove = nPrimitives;
+			int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+			for (int i = 0; i < 2 * nPrimitives; ++i)
+			{
+				if (edges[i].type == EdgeType::End)
+					--nAbove;
+				Float edgeT = edges[i].t;
+				if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis])
+				{
+					Float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] +
+						(edgeT - nodeBounds.pMin[axis]) * (d[otherAxis0] + d[otherAxis1]));
+					Float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] +
+						(nodeBounds.pMax[axis] - edgeT) * (d[otherAxis0] + d[otherAxis1]));
+					Float pBelow = belowSA * invTotalSA;
+					Float pAbove = aboveSA * invTotalSA;
+					Float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
+					Float cost = traversalCost +
+						isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						bestAxis = axis;
+						bestOffset = i;
+					}
+				}
+				if (edges[i].type == EdgeType::Start)
+					++nBelow;
+			}
+		}
+
+		if (bestCost > oldCost)
+			++badRefines;
+		if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 || badRefines == 3)
+		{
+			out.nodes[nodeNum].InitLeaf(primNums.data(), nPrimitives, &out.primitiveIndices);
+			++kdLeafNodes;
+			return;
+		}
+
+		const std::vector<BoundEdge>& edges = scratch.edges[bestAxis];
+		std::vector<int> prims[2];
+		for (int i = 0; i < bestOffset; ++i)
+		{
+			if (edges[i].type == EdgeType::Start)
+				prims[0].push_back(edges[i].primNum);
+		}
+		for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
+		{
+			if (edges[i].type == EdgeType::End)
+				prims[1].push_back(edges[i].primNum);
+		}
+		Float tSplit = edges[bestOffset].t;
+		std::vector<int>().swap(primNums);
+
+		Bounds3f childBounds[2] = { nodeBounds, nodeBounds };
+		childBounds[0].pMax[bestAxis] = childBounds[1].pMin[bestAxis] = tSplit;
+		++kdInteriorNodes;
+		if (nPrimitives > kParallelBuildPrimitives)
+		{
+			//both children are built into their own arrays, then appended
+			//after this node
+			KdBuildNodes children[2];
+			ParallelFor([&](int64_t i) {
+				KdBuildScratch childScratch;
+				buildTree(children[i], childBounds[i], allPrimBounds, prims[i],
+					depth - 1, badRefines, childScratch);
+			}, 2, 1);
+			out.nodes[nodeNum].InitInterior(bestAxis, nodeNum + 1 + children[0].nodes.size(), tSplit);
+			for (KdBuildNodes& child : children)
+			{
+				int nodeOffset = out.nodes.size();
+				int indexOffset = out.primitiveIndices.size();
+				for (KdAccelNode node : child.nodes)
+				{
+					node.Relocate(nodeOffset, indexOffset);
+					out.nodes.push_back(node);
+				}
+				out.primitiveIndices.insert(out.primitiveIndices.end(),
+					child.primitiveIndices.begin(), child.primitiveIndices.end());
+			}
+		}
+		else
+		{
+			buildTree(out, childBounds[0], allPrimBounds, prims[0], depth - 1, badRefines, scratch);
+			out.nodes[nodeNum].InitInterior(bestAxis, out.nodes.size(), tSplit);
+			buildTree(out, childBounds[1], allPrimBounds, prims[1], depth - 1, badRefines, scratch);
+		}
+	}
+
+	Bounds3f KdTreeAccel::WorldBound() const
+	{
+		return bounds;
+	}
+
+	inline bool KdTreeAccel::IntersectRef(int index, const Ray& ray, SurfaceInteraction* isect) const
+	{
+		const BVHPrimitiveRef& ref = primRefs[index];
+		return primitives[ref.primitive]->IntersectSub(ref.sub, ray, isect);
+	}
+
+	inline bool KdTreeAccel::IntersectRefP(int index, const Ray& ray) const
+	{
+		const BVHPrimitiveRef& ref = primRefs[index];
+		return primitives[ref.primitive]->IntersectPSub(ref.sub, ray);
+	}
+
+	bool KdTreeAccel::Intersect(const Ray& ray, SurfaceInteraction* isect) const
+	{
+		Float tMin, tMax;
+		if (nodes == nullptr || !bounds.IntersectP(ray, &tMin, &tMax))
+			return false;
+
+		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+		constexpr int maxTodo = 64;
+		KdToDo todo[maxTodo];
+		int todoPos = 0;
+		bool hit = false;
+		const KdAccelNode* node = &nodes[0];
+		while (node != nullptr)
+		{
+			//a closer hit was already found
+			if (ray.tMax < tMin)
+				break;
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			if (!node->IsLeaf())
+			{
+				int axis = node->SplitAxis();
+				Float tPlane = (node->SplitPos() - ray.o[axis]) * invDir[axis];
+
+				const KdAccelNode* firstChild;
+				const KdAccelNode* secondChild;
+				int belowFirst = (ray.o[axis] < node->SplitPos()) ||
+					(ray.o[axis] == node->SplitPos() && ray.d[axis] <= 0);
+				if (belowFirst)
+				{
+					firstChild = node + 1;
+					secondChild = &nodes[node->AboveChild()];
+				}
+				else
+				{
+					firstChild = &nodes[node->AboveChild()];
+					secondChild = node + 1;
+				}
+
+				if (tPlane > tMax || tPlane <= 0)
+					node = firstChild;
+				else if (tPlane < tMin)
+					node = secondChild;
+				else
+				{
+					todo[todoPos].node = secondChild;
+					todo[todoPos].tMin = tPlane;
+					todo[todoPos].tMax = tMax;
+					++todoPos;
+					node = firstChild;
+					tMax = tPlane;
+				}
+			}
+			else
+			{
+				int nPrimitives = node->nPrimitives();
+				COUNT_TRAVERSAL(primitivesTested, nPrimitives);
+				if (nPrimitives == 1)
+				{
+					if (IntersectRef(node->onePrimitive, ray, isect))
+						hit = true;
+				}
+				else
+				{
+					for (int i = 0; i < nPrimitives; ++i)
+					{
+						if (IntersectRef(primitiveIndices[node->primitiveIndicesOffset + i], ray, isect))
+							hit = true;
+					}
+				}
+
+				if (todoPos == 0)
+					break;
+				--todoPos;
+				node = todo[todoPos].node;
+				tMin = todo[todoPos].tMin;
+				tMax = todo[todoPos].tMax;
+			}
+		}
+		return hit;
+	}
+
+	bool KdTreeAccel::IntersectP(const Ray& ray) const
+	{
+		Float tMin, tMax;
+		if (nodes == nullptr || !bounds.IntersectP(ray, &tMin, &tMax))
+			return false;
+
+		Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+		constexpr int maxTodo = 64;
+		KdToDo todo[maxTodo];
+		int todoPos = 0;
+		const KdAccelNode* node = &nodes[0];
+		while (node != nullptr)
+		{
+			if (ray.tMax < tMin)
+				break;
+			COUNT_TRAVERSAL(nodesVisited, 1);
+			if (node->IsLeaf())
+			{
+				int nPrimitives = node->nPrimitives();
+				COUNT_TRAVERSAL(primitivesTested, nPrimitives);
+				if (nPrimitives == 1)
+				{
+					if (IntersectRefP(node->onePrimitive, ray))
+						return true;
+				}
+				else
+				{
+					for (int i = 0; i < nPrimitives; ++i)
+					{
+						if (IntersectRefP(primitiveIndices[node->primitiveIndicesOffset + i], ray))
+							return true;
+					}
+				}
+
+				if (todoPos == 0)
+					break;
+				--todoPos;
+				node = todo[todoPos].node;
+				tMin = todo[todoPos].tMin;
+				tMax = todo[todoPos].tMax;
+			}
+			else
+			{
+				int axis = node->SplitAxis();
+				Float tPlane = (node->SplitPos() - ray.o[axis]) * invDir[axis];
+				const KdAccelNode* firstChild;
+				const KdAccelNode* secondChild;
+				int belowFirst = (ray.o[axis] < node->SplitPos()) ||
+					(ray.o[axis] == node->SplitPos() && ray.d[axis] <= 0);
+				if (belowFirst)
+				{
+					firstChild = node + 1;
+					secondChild = &nodes[node->AboveChild()];
+				}
+				else
+				{
+					firstChild = &nodes[node->AboveChild()];
+					secondChild = node + 1;
+				}
+
+				if (tPlane > tMax || tPlane <= 0)
+					node = firstChild;
+				else if (tPlane < tMin)
+					node = secondChild;
+				else
+				{
+					todo[todoPos].node = secondChild;
+					todo[todoPos].tMin = tPlane;
+					todo[todoPos].tMax = tMax;
+					++todoPos;
+					node = firstChild;
+					tMax = tPlane;
+				}
+			}
+		}
+		return false;
+	}
+
+	void KdTreeAccel::Refit()
+	{
+		ParallelFor([&](int64_t i) {
+			primitives[i]->Refit();
+		}, primitives.size(), 16);
+		Build();
+	}
+
+	size_t KdTreeAccel::AcceleratorBytes() const
+	{
+		return nNodes * sizeof(KdAccelNode) + primRefs.size() * sizeof(BVHPrimitiveRef) +
+			primitiveIndices.size() * sizeof(int);
+	}
+}
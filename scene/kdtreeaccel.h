@@ -0,0 +1,51 @@
+#pragma once
+#include "bvhaccel.h"
+
+namespace AIR
+{
+	struct KdAccelNode;
+	struct KdBuildNodes;
+	struct KdBuildScratch;
+
+	//SAH kd-tree over the same (primitive, sub primitive) references as the
+	//BVH. A node is 8 bytes, its below child follows it and the index of the
+	//above child is stored in the node. Subtrees with many primitives are
+	//built as parallel tasks.
+	class KdTreeAccel : public Primitive
+	{
+	public:
+		//maxDepth <= 0 picks 8 + 1.3 log2(primitives)
+		KdTreeAccel(std::vector<std::shared_ptr<Primitive>> p,
+			int isectCost = 80, int traversalCost = 1,
+			Float emptyBonus = 0.5f, int maxPrims = 1, int maxDepth = -1);
+		~KdTreeAccel();
+		Bounds3f WorldBound() const;
+		bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
+		//returns at the first hit found
+		bool IntersectP(const Ray& ray) const;
+		//the split planes can't follow the primitives, so the tree is built again
+		void Refit();
+		size_t AcceleratorBytes() const;
+
+	private:
+		void Build();
+		//appends the subtree of primNums to out, primNums is released
+		//before the children are built
+		void buildTree(KdBuildNodes& out, const Bounds3f& nodeBounds,
+			const std::vector<Bounds3f>& allPrimBounds, std::vector<int>& primNums,
+			int depth, int badRefines, KdBuildScratch& scratch) const;
+		bool IntersectRef(int index, const Ray& ray, SurfaceInteraction* isect) const;
+		bool IntersectRefP(int index, const Ray& ray) const;
+
+		const int isectCost, traversalCost, maxPrims;
+		const Float emptyBonus;
+		int maxDepth;
+		std::vector<std::shared_ptr<Primitive>> primitives;
+		std::vector<BVHPrimitiveRef> primRefs;
+		//primRefs of the leaves holding more than one
+		std::vector<int> primitiveIndices;
+		KdAccelNode* nodes = nullptr;
+		int nNodes = 0;
+		Bounds3f bounds;
+	};
+}
@@ -0,0 +1,100 @@
+#include "meshprimitive.h"
+#include "triangle.h"
+#include "interaction.h"
+
+namespace AIR
+{
+	MeshPrimitive::MeshPrimitive(const std::shared_ptr<TriangleMesh>& mesh,
+		const std::shared_ptr<Material>& material,
+		Transform* pTransform,
+		const MediumInterface& mediumInterface)
+		: Primitive(nullptr, material, nullptr, pTransform, mediumInterface),
+		mesh(mesh)
+	{
+		Refit();
+	}
+
+	void MeshPrimitive::Refit()
+	{
+		worldBound = Bounds3f();
+		for (int i = 0; i < mesh->nTriangles; ++i)
+			worldBound = Union(worldBound, SubPrimitiveBound(i));
+	}
+
+	Bounds3f MeshPrimitive::WorldBound() const
+	{
+		return worldBound;
+	}
+
+	bool MeshPrimitive::Intersect(const Ray& r, SurfaceInteraction* pInteract) const
+	{
+		bool hit = false;
+		for (int i = 0; i < mesh->nTriangles; ++i)
+		{
+			if (IntersectSub(i, r, pInteract))
+				hit = true;
+		}
+		return hit;
+	}
+
+	bool MeshPrimitive::IntersectP(const Ray& r) const
+	{
+		for (int i = 0; i < mesh->nTriangles; ++i)
+		{
+			if (IntersectPSub(i, r))
+				return true;
+		}
+		return false;
+	}
+
+	int MeshPrimitive::SubPrimitiveCount() const
+	{
+		return mesh->nTriangles;
+	}
+
+	Bounds3f MeshPrimitive::SubPrimitiveBound(int sub) const
+	{
+		Point3f p[3];
+		SubTriangleVertices(sub, p);
+		return Union(Bounds3f(p[0], p[1]), p[2]);
+	}
+
+	bool MeshPrimitive::IntersectSub(int sub, const Ray& r, SurfaceInteraction* pInteract) const
+	{
+		Point3f p[3];
+		SubTriangleVertices(sub, p);
+		Float tHit, b[3];
+		if (!IntersectTriangle(r, p[0], p[1], p[2], &tHit, b))
+			return false;
+		r.tMax = tHit;
+		SubTriangleInteraction(sub, r, b, pInteract);
+		return true;
+	}
+
+	bool MeshPrimitive::IntersectPSub(int sub, const Ray& r) const
+	{
+		Point3f p[3];
+		SubTriangleVertices(sub, p);
+		Float tHit, b[3];
+		return IntersectTriangle(r, p[0], p[1], p[2], &tHit, b);
+	}
+
+	bool MeshPrimitive::SubTriangleVertices(int sub, Point3f p[3]) const
+	{
+		const int* vIndices = &mesh->vertexIndices[sub * 3];
+		p[0] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[0]]);
+		p[1] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[1]]);
+		p[2] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[2]]);
+		return true;
+	}
+
+	void MeshPrimitive::SubTriangleInteraction(int sub, const Ray& r, const Float b[3],
+		SurfaceInteraction* pInteract) const
+	{
+		//there is no Triangle shape behind a mesh triangle, pInteract->shape
+		//stays null
+		ComputeTriangleInteraction(mesh.get(), &mesh->vertexIndices[sub * 3], mTransform,
+			r, b, nullptr, pInteract);
+		SetHitInteraction(r, pInteract);
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "robject.h"
+
+namespace AIR
+{
+	struct TriangleMesh;
+
+	//all the triangles of a mesh as one primitive. The material, medium
+	//interface and transform are stored once per mesh and a triangle is only
+	//its index, the BVH references the triangles as (mesh, triangle) pairs
+	//through the sub primitive interface.
+	//An emissive mesh still needs a Primitive per triangle, because every
+	//triangle owns its own DiffuseAreaLight.
+	class MeshPrimitive : public Primitive
+	{
+	public:
+		MeshPrimitive(const std::shared_ptr<TriangleMesh>& mesh,
+			const std::shared_ptr<Material>& material,
+			Transform* pTransform,
+			const MediumInterface& mediumInterface);
+
+		Bounds3f WorldBound() const;
+		void Refit();
+		//tests every triangle, only meant for a mesh outside an accelerator
+		bool Intersect(const Ray& r, SurfaceInteraction* pInteract) const;
+		bool IntersectP(const Ray& r) const;
+
+		int SubPrimitiveCount() const;
+		Bounds3f SubPrimitiveBound(int sub) const;
+		bool IntersectSub(int sub, const Ray& r, SurfaceInteraction* pInteract) const;
+		bool IntersectPSub(int sub, const Ray& r) const;
+		bool SubTriangleVertices(int sub, Point3f p[3]) const;
+		void SubTriangleInteraction(int sub, const Ray& r, const Float b[3],
+			SurfaceInteraction* pInteract) const;
+
+		const TriangleMesh* GetMesh() const
+		{
+			return mesh.get();
+		}
+
+	private:
+		std::shared_ptr<TriangleMesh> mesh;
+		Bounds3f worldBound;
+	};
+}
@@ -18,6 +18,10 @@
 #include "imageio.h"
 #include "imagetexture.h"
 #include "robject.h"
+#include "meshprimitive.h"
+#include "instanceprimitive.h"
+#include "parallelism.h"
+#include <chrono>
 #include "homogeneousmedium.h"
 #include "log.h"
 
@@ -41,6 +45,9 @@ namespace AIR
 		ShapeType_Disk,
 		ShapeType_TriangleMesh,
 		ShapeType_Rectangle,
+		//a triangle mesh followed by an int count and that many more
+		//transforms, every transform places the same mesh again
+		ShapeType_MeshInstances,
 	};
 
 	enum MaterialType
@@ -454,7 +461,8 @@ namespace AIR
 				lights.push_back(light);
 			}
 		}
-		else if (shapeType == ShapeType::ShapeType_TriangleMesh || shapeType == ShapeType::ShapeType_Rectangle)
+		else if (shapeType == ShapeType::ShapeType_TriangleMesh || shapeType == ShapeType::ShapeType_Rectangle
+			|| shapeType == ShapeType::ShapeType_MeshInstances)
 		{
 
 			int meshIndex;
@@ -466,19 +474,56 @@ namespace AIR
 
 			std::shared_ptr<TriangleMesh> mesh = triangleMeshes[meshIndex];
 
-  			for (int i = 0; i < mesh->nTriangles; ++i)
+			std::vector<Transform*> placements(1, pTransform);
+			if (shapeType == ShapeType::ShapeType_MeshInstances)
 			{
-				std::shared_ptr<Light> light = nullptr;
-				std::shared_ptr<Shape> shape = std::make_shared<Triangle>(pTransform, mesh, i);
-				if (isAreaLight)
+				int instancesNum = 0;
+				fs.read((char*)&instancesNum, sizeof(instancesNum));
+				for (int i = 0; i < instancesNum; ++i)
+					placements.push_back(ParseTransform(fs));
+			}
+
+			//the triangles of a mesh share one primitive, unless each of
+			//them needs its own area light
+			if (!isAreaLight && placements.size() == 1)
+			{
+				primitives.push_back(std::make_shared<MeshPrimitive>(mesh, material, pTransform, mi));
+				return;
+			}
+
+			//a mesh placed several times is built once in object space and
+			//every placement becomes an instance of it
+			if (!isAreaLight)
+			{
+				auto buildStart = std::chrono::steady_clock::now();
+				std::vector<std::shared_ptr<Primitive>> meshPrimitives(1, std::make_shared<MeshPrimitive>(
+					mesh, material, TransformCache::GetInstance().Lookup(Transform()), mi));
+				std::shared_ptr<Primitive> prototype = MakeAccelerator(g_globalOptions.AcceleratorName,
+					std::move(meshPrimitives));
+				for (Transform* placement : placements)
+					primitives.push_back(std::make_shared<InstancePrimitive>(prototype, placement));
+				std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - buildStart;
+				Log::Info("Mesh {} placed {} times, {} triangles built once in {:.3f}s",
+					meshIndex, placements.size(), mesh->nTriangles, buildTime.count());
+				return;
+			}
+
+			for (Transform* placement : placements)
+			{
+	  			for (int i = 0; i < mesh->nTriangles; ++i)
 				{
-					light = std::make_shared<DiffuseAreaLight>(*pTransform, mi, lightSpectrum * I, 1, shape);
-					lights.push_back(light);
+					std::shared_ptr<Light> light = nullptr;
+					std::shared_ptr<Shape> shape = std::make_shared<Triangle>(placement, mesh, i);
+					if (isAreaLight)
+					{
+						light = std::make_shared<DiffuseAreaLight>(*placement, mi, lightSpectrum * I, 1, shape);
+						lights.push_back(light);
+					}
+					
+					std::shared_ptr<Primitive> primitive = std::make_shared<Primitive>(shape, material, std::dynamic_pointer_cast<AreaLight>(light), placement, mi);
+					primitives.push_back(primitive);
+					
 				}
-				
-				std::shared_ptr<Primitive> primitive = std::make_shared<Primitive>(shape, material, std::dynamic_pointer_cast<AreaLight>(light), pTransform, mi);
-				primitives.push_back(primitive);
-				
 			}
 		}
 
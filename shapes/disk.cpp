@@ -119,4 +119,11 @@ namespace AIR
 		*pdf = 1 / Area();
 		return it;
 	}
+
+	void Disk::NormalBounds(Vector3f* w, Float* cosTheta) const
+	{
+		//every point has the normal of Sample
+		*w = Vector3f::Normalize(mTransform->ObjectToWorldNormal(Vector3f::forward));
+		*cosTheta = 1;
+	}
 }
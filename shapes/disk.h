@@ -23,6 +23,8 @@ namespace AIR
 
 		virtual Interaction Sample(const Point2f& u, Float* pdf) const;
 
+		void NormalBounds(Vector3f* w, Float* cosTheta) const;
+
 		bool IntersectP(const Ray& ray) const;
 
 	private:
@@ -59,19 +59,9 @@ namespace AIR
         return Bounds3f::Union(Bounds3f(mTransform->ObjectToWorldPoint(p0), mTransform->ObjectToWorldPoint(p1)), mTransform->ObjectToWorldPoint(p2));
     }
 
-    bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect) const
+    bool IntersectTriangle(const Ray& ray, const Point3f& p0, const Point3f& p1,
+        const Point3f& p2, Float* tHit, Float b[3])
     {
-		//ProfilePhase p(Prof::TriIntersect);
-		//++nTests;
-		// Get triangle vertices in _p0_, _p1_, and _p2_
-		Point3f p0 = mTransform->ObjectToWorldPoint(mesh->p[vIndices[0]]);
-		Point3f p1 = mTransform->ObjectToWorldPoint(mesh->p[vIndices[1]]);
-		Point3f p2 = mTransform->ObjectToWorldPoint(mesh->p[vIndices[2]]);
-
-		Vector3f n0 = mTransform->ObjectToWorldNormal(mesh->n[vIndices[0]]);
-		Vector3f n1 = mTransform->ObjectToWorldNormal(mesh->n[vIndices[1]]);
-		Vector3f n2 = mTransform->ObjectToWorldNormal(mesh->n[vIndices[2]]);
-
 		// Perform ray--triangle intersection test
 
 		// Transform triangle vertices to ray coordinate space
@@ -171,10 +161,37 @@ namespace AIR
 		if (t <= deltaT) 
 			return false;
 
+		b[0] = b0;
+		b[1] = b1;
+		b[2] = b2;
+		*tHit = t;
+		return true;
+    }
+
+    bool ComputeTriangleInteraction(const TriangleMesh* mesh, const int* vIndices,
+        const Transform* transform, const Ray& ray, const Float b[3], const Shape* shape,
+        SurfaceInteraction* isect)
+    {
+		Point3f p0 = transform->ObjectToWorldPoint(mesh->p[vIndices[0]]);
+		Point3f p1 = transform->ObjectToWorldPoint(mesh->p[vIndices[1]]);
+		Point3f p2 = transform->ObjectToWorldPoint(mesh->p[vIndices[2]]);
+		Float b0 = b[0], b1 = b[1], b2 = b[2];
+
 		// Compute triangle partial derivatives
 		Vector3f dpdu, dpdv;
 		Point2f uv[3];
-		GetUVs(uv);
+		if (mesh->uv)
+		{
+			uv[0] = mesh->uv[vIndices[0]];
+			uv[1] = mesh->uv[vIndices[1]];
+			uv[2] = mesh->uv[vIndices[2]];
+		}
+		else
+		{
+			uv[0] = Point2f(0, 0);
+			uv[1] = Point2f(1, 0);
+			uv[2] = Point2f(1, 1);
+		}
 
 		// Compute deltas for triangle partial derivatives
 		Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
@@ -223,7 +240,7 @@ namespace AIR
 		// Fill in _SurfaceInteraction_ from triangle hit
 		*isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
 			Vector3f(0, 0, 0), Vector3f(0, 0, 0), ray.time,
-			this);
+			shape);
 
 		// Override surface normal in _isect_ for triangle
 		isect->normal = isect->shading.n = Vector3f::Normalize(Vector3f::Cross(dp02, dp12));
@@ -233,11 +250,15 @@ namespace AIR
 		if (mesh->n || mesh->s) 
 		{
 			// Initialize _Triangle_ shading geometry
+			Vector3f n0, n1, n2;
 
 			// Compute shading normal _ns_ for triangle
 			Vector3f ns;
 			if (mesh->n) 
 			{
+				n0 = transform->ObjectToWorldNormal(mesh->n[vIndices[0]]);
+				n1 = transform->ObjectToWorldNormal(mesh->n[vIndices[1]]);
+				n2 = transform->ObjectToWorldNormal(mesh->n[vIndices[2]]);
 				ns = (b0 * n0 + b1 * n1 + b2 * n2);
 				if (ns.LengthSquared() > 0)
 					ns = Vector3f::Normalize(ns);
@@ -251,9 +272,9 @@ namespace AIR
 			Vector3f ss;
 			if (mesh->s) 
 			{
-				Vector3f s0 = mTransform->ObjectToWorldVector(mesh->s[vIndices[0]]);
-				Vector3f s1 = mTransform->ObjectToWorldVector(mesh->s[vIndices[1]]);
-				Vector3f s2 = mTransform->ObjectToWorldVector(mesh->s[vIndices[2]]);
+				Vector3f s0 = transform->ObjectToWorldVector(mesh->s[vIndices[0]]);
+				Vector3f s1 = transform->ObjectToWorldVector(mesh->s[vIndices[1]]);
+				Vector3f s2 = transform->ObjectToWorldVector(mesh->s[vIndices[2]]);
 
 				ss = (b0 * s0 + b1 * s1 + b2 * s2);
 				if (ss.LengthSquared() > 0)
@@ -319,11 +340,38 @@ namespace AIR
 			isect->SetGeometryShading(ss, ts, dndu, dndv, true);
 		}
 
-		*tHit = t;
 		//++nHits;
 		return true;
     }
 
+    bool Triangle::Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect) const
+    {
+		//ProfilePhase p(Prof::TriIntersect);
+		//++nTests;
+		// Get triangle vertices in _p0_, _p1_, and _p2_
+		Point3f p[3];
+		WorldVertices(p);
+
+		// The normals and uvs are only fetched for a hit
+		Float b[3];
+		if (!IntersectTriangle(ray, p[0], p[1], p[2], tHit, b))
+			return false;
+		return InteractionFromBarycentrics(ray, b, isect);
+    }
+
+    bool Triangle::InteractionFromBarycentrics(const Ray& ray, const Float b[3],
+        SurfaceInteraction* isect) const
+    {
+		return ComputeTriangleInteraction(mesh.get(), vIndices, mTransform, ray, b, this, isect);
+    }
+
+    void Triangle::WorldVertices(Point3f p[3]) const
+    {
+        p[0] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[0]]);
+        p[1] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[1]]);
+        p[2] = mTransform->ObjectToWorldPoint(mesh->p[vIndices[2]]);
+    }
+
     bool Triangle::IntersectMoller(const Ray& ray, Float* tHit, SurfaceInteraction* isect) const
     {
 		//这里和pbrt有所不同，用的是Möller-Trumbore algorithm
@@ -588,7 +636,7 @@ namespace AIR
         //  = -|[T E2 E1]| / |[-D E1 E2]|
         //  = (T x E1)·E2 / det
         Float t = Vector3f::Dot(Vector3f::Cross(T, E1), E2) * invDet;
-        if (t < 0)
+        if (t < 0 || t >= ray.tMax)
             return false;
 
         //u = |[-D T E2]| / |[-D E1 E2]|   行列式性质：第一列乘以-1 = -1 乘以 行列式
@@ -600,7 +648,7 @@ namespace AIR
 
         //v = (D x T)·E1 / det
         Float v = Vector3f::Dot(Vector3f::Cross(ray.d, T), E1) * invDet;
-        if (v < 0 || v > 1)
+        if (v < 0 || u + v > 1)
             return false;
 
         return true;
@@ -645,6 +693,36 @@ namespace AIR
         return it;
     }
 
+    void Triangle::NormalBounds(Vector3f* w, Float* cosTheta) const
+    {
+        if (!mesh->n)
+        {
+            Point3f p[3];
+            WorldVertices(p);
+            *w = Vector3f::Normalize(Vector3f::Cross(p[1] - p[0], p[2] - p[0]));
+            *cosTheta = 1;
+            return;
+        }
+
+        Vector3f n[3];
+        for (int i = 0; i < 3; ++i)
+            n[i] = Vector3f::Normalize(mTransform->ObjectToWorldNormal(mesh->n[vIndices[i]]));
+        Vector3f sum = n[0] + n[1] + n[2];
+        if (sum.LengthSquared() == 0)
+        {
+            *w = n[0];
+            *cosTheta = -1;
+            return;
+        }
+        //the interpolated normals stay inside the cone of the vertex normals
+        //as long as it is convex
+        *w = Vector3f::Normalize(sum);
+        *cosTheta = std::min(Vector3f::Dot(*w, n[0]),
+            std::min(Vector3f::Dot(*w, n[1]), Vector3f::Dot(*w, n[2])));
+        if (*cosTheta <= 0)
+            *cosTheta = -1;
+    }
+
     //Area = |Cross(a, b)| * 0.5;
     //|Cross(a, b)| = |a||b|sinθ
     Float Triangle::Area() const
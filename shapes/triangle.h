@@ -18,6 +18,17 @@ namespace AIR
         std::unique_ptr<Point2f[]> uv;    //texture coordinates
     };
 
+    //watertight ray-triangle test against world space vertices, only computes
+    //the hit distance and the barycentric coordinates of the hit
+    bool IntersectTriangle(const Ray& ray, const Point3f& p0, const Point3f& p1,
+        const Point3f& p2, Float* tHit, Float b[3]);
+
+    //surface interaction of the hit at barycentrics b on the triangle
+    //vIndices of mesh, the uvs, normals and tangents are fetched here
+    bool ComputeTriangleInteraction(const TriangleMesh* mesh, const int* vIndices,
+        const Transform* transform, const Ray& ray, const Float b[3], const Shape* shape,
+        SurfaceInteraction* isect);
+
     //ע⣺TriangleָһΣTriangleMeshļ
 	class Triangle : public Shape
 	{
@@ -32,6 +43,14 @@ namespace AIR
         bool Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect) const;
         bool IntersectP(const Ray& ray) const;
 
+        //fills isect for a hit found by IntersectTriangle, b are the
+        //barycentric coordinates of the hit
+        bool InteractionFromBarycentrics(const Ray& ray, const Float b[3],
+            SurfaceInteraction* isect) const;
+
+        //the three vertices in world space
+        void WorldVertices(Point3f p[3]) const;
+
         //ε
         //ϵµ
         Float Area() const;
@@ -39,6 +58,10 @@ namespace AIR
         using Shape::Sample;  // Bring in the other Sample() overload.
         Interaction Sample(const Point2f& u, Float* pdf) const;
 
+        //the face normal, or a cone over the vertex normals when the mesh
+        //has them since Sample interpolates those
+        void NormalBounds(Vector3f* w, Float* cosTheta) const;
+
         // Returns the solid angle subtended by the triangle w.r.t. the given
         // reference point p.
         Float SolidAngle(const Point3f& p, int nSamples = 0) const;
@@ -9,6 +9,9 @@ namespace AIR
 template <typename Tmemory, typename Treturn>
 std::map<TexInfo, std::unique_ptr<Mipmap<Tmemory>>> ImageTexture<Tmemory, Treturn>::s_textures;
 
+template <typename Tmemory, typename Treturn>
+std::mutex ImageTexture<Tmemory, Treturn>::s_texturesMutex;
+
 template <typename Tmemory, typename Treturn> 
 ImageTexture<Tmemory, Treturn>::ImageTexture(std::unique_ptr<TextureMapping2D> m,
                  const std::string &filename, bool doTri, Float maxAniso,
@@ -23,6 +26,9 @@ template <typename Tmemory, typename Treturn>
 Mipmap<Tmemory>* ImageTexture<Tmemory, Treturn>::GetTexture(const std::string& filename, bool doTri, Float maxAniso, ImageWrap wm, Float scale, bool gamma)
 {
     TexInfo texInfo(filename, doTri, maxAniso, wm, scale, gamma);
+    //the whole load is done under the lock so two threads asking for the
+    //same file don't both build a mipmap for it
+    std::lock_guard<std::mutex> lock(s_texturesMutex);
 
     //ȴtable
     if (s_textures.find(texInfo) != s_textures.end())
@@ -3,6 +3,7 @@
 #include "texture.h"
 #include "mipmap.h"
 #include <map>
+#include <mutex>
 
 namespace AIR
 {
@@ -27,6 +28,7 @@ public:
                  ImageWrap wm, Float scale, bool gamma);
 
 	static void ClearCache() {
+        std::lock_guard<std::mutex> lock(s_texturesMutex);
         s_textures.erase(s_textures.begin(), s_textures.end());
 	}
 
@@ -74,6 +76,7 @@ private:
     Mipmap<Tmemory>* mipmap;
 
     static std::map<TexInfo, std::unique_ptr<Mipmap<Tmemory>>> s_textures;
+    static std::mutex s_texturesMutex;
 };
 
 	extern template class ImageTexture<Float, Float>;